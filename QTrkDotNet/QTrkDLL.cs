@@ -21,6 +21,9 @@ namespace QTrkDotNet
 	    ClearFirstFourPixels = 128,
 	    FourierLUT = 256,
 	    LocalizeZWeighted = 512,
+	    ZLUTPCA = 1024,
+	    ImageLUT = 2048,
+	    PixelBinnedProfile = 4096,
     };
 
     public enum QTRK_PixelDataType
@@ -183,9 +186,21 @@ namespace QTrkDotNet
         [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
         public static extern void QTrkFreeInstance(IntPtr qtrk);
 
+        // State snapshots: LUTs, config values, mode profiles and pixel calibration
+        [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
+        public static extern IntPtr QTrkCreateInstanceFromState([MarshalAs(UnmanagedType.LPStr)] string filename);
+        [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool QTrkSaveState(IntPtr qtrk, [MarshalAs(UnmanagedType.LPStr)] string filename);
+        [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool QTrkLoadState(IntPtr qtrk, [MarshalAs(UnmanagedType.LPStr)] string filename);
+
         // C API, mainly intended to allow binding to .NET
         [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
         public static extern void QTrkSetLocalizationMode(IntPtr qtrk, int locType);
+        [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
+        public static extern void QTrkSetLocalizationModeProfile(IntPtr qtrk, int profile, int locType);
 
 	    // These are per-bead! So both gain and offset are sized [width*height*numbeads], similar to ZLUT
 	    // result=gain*(pixel+offset)
@@ -193,6 +208,9 @@ namespace QTrkDotNet
         public static extern void QTrkSetPixelCalibrationImages(IntPtr qtrk, float* offset, float* gain);
         [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
         public static extern void QTrkSetPixelCalibrationFactors(float offsetFactor, float gainFactor);
+        [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool QTrkSetPixelCalibrationMap(IntPtr qtrk, float* offset, float* gain, int sensorWidth, int sensorHeight, Int2* roiPositions, int numBeads);
 
         // Frame and timestamp are ignored by tracking code itself, but usable for the calling code
         // Pitch: Distance in bytes between two successive rows of pixels (e.g. address of (0,0) -  address of (0,1) )
@@ -200,6 +218,8 @@ namespace QTrkDotNet
         [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
         public static extern void QTrkScheduleLocalization(IntPtr qtrk, void* data, int pitch, QTRK_PixelDataType pdt, LocalizationJob* jobInfo);
         [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
+        public static extern void QTrkScheduleLocalizationProfile(IntPtr qtrk, void* data, int pitch, QTRK_PixelDataType pdt, LocalizationJob* jobInfo, int modeProfile);
+        [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
         public static extern void QTrkClearResults(IntPtr qtrk);
         [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
         public static extern void QTrkFlush(IntPtr qtrk); // stop waiting for more jobs to do, and just process the current batch
@@ -207,6 +227,8 @@ namespace QTrkDotNet
         // Schedule an entire frame at once, allowing for further optimizations
         [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
         public static extern int QTrkScheduleFrame(IntPtr qtrk, void* imgptr, int pitch, int width, int height, Int2* positions, int numROI, QTRK_PixelDataType pdt, LocalizationJob* jobInfo);
+        [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int QTrkScheduleFrameProfiles(IntPtr qtrk, void* imgptr, int pitch, int width, int height, Int2* positions, int numROI, QTRK_PixelDataType pdt, LocalizationJob* jobInfo, int* modeProfiles);
 
         [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
         public static extern void QTrkEnableRadialZLUTCompareProfile(bool enabled);
@@ -221,12 +243,25 @@ namespace QTrkDotNet
         [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
         public static extern void QTrkGetRadialZLUTSize(IntPtr qtrk, out int count, out int planes, out int radialsteps);
 
+        // Beads with the same LUT index share one LUT. lutIndex = [numBeads], or null to use LUT i for bead i
+        [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
+        public static extern void QTrkSetBeadLUTMapping(IntPtr qtrk, int[] lutIndex, int numBeads);
+
         // Set radial weights used for comparing LUT profiles, zcmp has to have 'zlut_radialsteps' elements
         [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
         public static extern void QTrkSetRadialWeights(IntPtr qtrk, float* zcmp);
 
+        // LUT library files hold all LUTs, radial weights and the bias correction table
+        [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool QTrkSaveLUTLibrary(IntPtr qtrk, [MarshalAs(UnmanagedType.LPStr)] string filename);
+        [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool QTrkLoadLUTLibrary(IntPtr qtrk, [MarshalAs(UnmanagedType.LPStr)] string filename);
+
 //        #define BUILDLUT_NORMALIZE 4
         //#define BUILDLUT_BIASCORRECT 8
+        //#define BUILDLUT_PIXELBINNED 16
         [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
         public static extern void QTrkBeginLUT(IntPtr qtrk, uint flags);
         [DllImport(DllName, CallingConvention = CallingConvention.Cdecl)]
@@ -20,6 +20,7 @@ namespace TraceViewer
 		int numBeads;
 		string[] infoColNames;
 		int startOffset;
+		const int ResultFileMagic = 0x53455251; // "QRES", see cputrack/ResultFileReader.h
 		int bytesPerFrame;
 		bool haveErrors, haveImageMeans;
 		string filename;
@@ -210,7 +211,19 @@ namespace TraceViewer
 					int c = r.ReadInt32();
 
 					int infoCols;
-					if (oldVersion)
+					int recordSize = 0;
+					if (!oldVersion && a == ResultFileMagic)
+					{
+						// magic, version, numBeads, numFrameInfoColumns, dataOffset, recordSize, firstFrame, headerSize
+						numBeads = c;
+						infoCols = r.ReadInt32();
+						startOffset = r.ReadInt32();
+						recordSize = r.ReadInt32();
+						r.ReadInt32();
+						stream.Seek(r.ReadInt32(), SeekOrigin.Begin);
+						haveImageMeans = true;
+					}
+					else if (oldVersion)
 					{
 						numBeads = a;
 						infoCols = b;
@@ -242,7 +255,7 @@ namespace TraceViewer
 						Console.WriteLine("InfoCol[{0}]={1}", j, infoColNames[j]);
 					}
 					haveErrors = !oldVersion;
-					bytesPerFrame = 4 * 3 * numBeads + infoCols * 4 + 4 + 8 + (haveErrors ? (4 * numBeads) : 0);
+					bytesPerFrame = recordSize > 0 ? recordSize : 4 * 3 * numBeads + infoCols * 4 + 4 + 8 + (haveErrors ? (4 * numBeads) : 0);
 					numFrames = ((int)stream.Length - startOffset) / bytesPerFrame;
 					Console.WriteLine("#Frames: {0}", numFrames);
 
@@ -8,8 +8,13 @@
 #include "../utils/ExtractBeadImages.h"
 #include "../cputrack/BenchmarkLUT.h"
 #include "../cputrack/CubicBSpline.h"
+#include "../cputrack/LUTLibrary.h"
+#include "../cputrack/ResultWriter.h"
+#include "../cputrack/ResultFileReader.h"
+#include "../cputrack/ResultManager.h"
 #include <time.h>
 #include <fstream>
+#include <limits>
 
 
 
@@ -680,6 +685,408 @@ void TestZLUTAlign()
 	dbgprintf("Only QI:   X= %f. stdev: %f\tZ=%f,  stdev: %f\n", resultsQI.meanErr.x, resultsQI.stdev.x, resultsQI.meanErr.z, resultsQI.stdev.z);
 }
 
+// Z precision and speed of the image LUT fit, compared to repeated ZLUTAlign passes
+void TestImageLUT()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 60;
+	QueuedCPUTracker trk(cfg);
+
+	ImageData lut = ReadJPEGFile("lut000.jpg");
+	const int planes = 50, lutSize = 40;
+	int dims[] = { 1, planes, lutSize, lutSize };
+	trk.SetImageZLUT(0, 0, dims);
+
+	ImageData img = ImageData::alloc(cfg.width,cfg.height);
+	vector2f center(cfg.width/2, cfg.height/2);
+	trk.BeginLUT(BUILDLUT_IMAGELUT | BUILDLUT_NORMALIZE);
+	for (int p=0;p<planes;p++) {
+		GenerateImageFromLUT(&img, &lut, trk.cfg.zlut_minradius, trk.cfg.zlut_maxradius, vector3f(center.x, center.y, p/(float)planes * lut.h), true);
+		trk.BuildLUT(img.data, sizeof(float)*img.w, QTrkFloat, p, &center);
+	}
+	trk.FinalizeLUT();
+
+	const int N = 1000;
+	std::vector<vector3f> truePos(N);
+	std::vector<ImageData> imgs(N);
+	srand(0);
+	for (int i=0;i<N;i++) {
+		truePos[i] = vector3f(center.x + rand_uniform<float>()-0.5f, center.y + rand_uniform<float>()-0.5f, planes/2 + 10*(rand_uniform<float>()-0.5f));
+		imgs[i] = ImageData::alloc(cfg.width,cfg.height);
+		GenerateImageFromLUT(&imgs[i], &lut, trk.cfg.zlut_minradius, trk.cfg.zlut_maxradius, vector3f(truePos[i].x, truePos[i].y, truePos[i].z/planes * lut.h), true);
+		ApplyPoissonNoise(imgs[i], 28 * 255, 255);
+	}
+
+	const char* names[] = { "QI+ZLUTAlign", "QI+ImageLUT" };
+	LocMode_t modes[] = { LT_QI | LT_NormalizeProfile | LT_LocalizeZ | LT_ZLUTAlign, LT_QI | LT_NormalizeProfile | LT_LocalizeZ | LT_ImageLUT };
+	for (int m=0;m<2;m++) {
+		trk.SetLocalizationMode(modes[m]);
+		double t0 = GetPreciseTime();
+		for (int i=0;i<N;i++) {
+			LocalizationJob job(i, 0, 0, 0);
+			trk.ScheduleImageData(&imgs[i], &job);
+		}
+		WaitForFinish(&trk, N);
+		double t1 = GetPreciseTime();
+
+		double sum=0, sum2=0;
+		for (int i=0;i<N;i++) {
+			LocalizationResult r;
+			trk.FetchResults(&r,1);
+			float err = r.pos.z - truePos[r.job.frame].z;
+			sum += err; sum2 += err*err;
+		}
+		double meanErr = sum/N;
+		dbgprintf("%s: Z error mean: %f, stdev: %f. %d images/s\n", names[m], meanErr, sqrt(sum2/N - meanErr*meanErr), (int)(N/(t1-t0)));
+	}
+
+	for (int i=0;i<N;i++) imgs[i].free();
+	img.free();
+	lut.free();
+}
+
+// Localizes the same images with full profile matching and with PCA matching for several numbers of components,
+// and checks that the PCA Z follows the full profile Z
+void TestZLUTPCA()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 60;
+	QueuedCPUTracker trk(cfg);
+
+	ImageData lut = ReadJPEGFile("lut000.jpg");
+	ImageData rescaledLUT;
+	ResampleLUT(&trk, &lut, lut.h, &rescaledLUT);
+	trk.SetConfigValue("zlut_batch", "1");
+
+	const int N = 2000;
+	std::vector<ImageData> imgs(N);
+	std::vector<float> trueZ(N);
+	srand(0);
+	for (int i=0;i<N;i++) {
+		imgs[i] = ImageData::alloc(cfg.width,cfg.height);
+		trueZ[i] = 10 + 20*(rand_uniform<float>()-0.5f);
+		vector3f pos(cfg.width/2 + rand_uniform<float>()-0.5f, cfg.height/2 + rand_uniform<float>()-0.5f, trueZ[i]);
+		GenerateImageFromLUT(&imgs[i], &rescaledLUT, trk.cfg.zlut_minradius, trk.cfg.zlut_maxradius, pos);
+		ApplyPoissonNoise(imgs[i], 28 * 255, 255);
+	}
+
+	const char* components[] = { "0", "2", "5", "10", "20" }; // 0 is full profile matching
+	const int NC = sizeof(components)/sizeof(components[0]);
+	const float Tolerance = 0.05f; // max. rms difference with the full profile Z, in planes
+	std::vector<float> fullZ(N);
+	for (int c=0;c<NC;c++) {
+		bool pca = atoi(components[c]) > 0;
+		if (pca)
+			trk.SetConfigValue("zlut_pca_components", components[c]);
+		trk.SetLocalizationMode((LocMode_t)(LT_QI | LT_NormalizeProfile | LT_LocalizeZ | (pca ? LT_ZLUTPCA : 0)));
+
+		double t0 = GetPreciseTime();
+		for (int i=0;i<N;i++) {
+			LocalizationJob job(i, 0, 0, 0);
+			trk.ScheduleImageData(&imgs[i], &job);
+		}
+		WaitForFinish(&trk, N);
+		double t1 = GetPreciseTime();
+
+		std::vector<float> z(N);
+		for (int i=0;i<N;i++) {
+			LocalizationResult r;
+			trk.FetchResults(&r,1);
+			z[r.job.frame] = r.pos.z;
+		}
+		if (!pca)
+			fullZ = z;
+
+		double errSum2 = 0.0, diffSum2 = 0.0;
+		float maxdiff = 0.0f;
+		for (int i=0;i<N;i++) {
+			float d = fabsf(z[i]-fullZ[i]);
+			errSum2 += sq(z[i]-trueZ[i]);
+			diffSum2 += d*d;
+			maxdiff = std::max(maxdiff, d);
+		}
+		float rmsdiff = sqrt(diffSum2/N);
+		if (pca)
+			dbgprintf("PCA, %s components: Z error rms: %f. Difference with full matching max: %f, rms: %f: %s. %d images/s\n", components[c],
+				sqrt(errSum2/N), maxdiff, rmsdiff, rmsdiff <= Tolerance ? "OK" : "above tolerance", (int)(N/(t1-t0)));
+		else
+			dbgprintf("Full matching: Z error rms: %f. %d images/s\n", sqrt(errSum2/N), (int)(N/(t1-t0)));
+	}
+
+	for (int i=0;i<N;i++) imgs[i].free();
+	lut.free();
+	rescaledLUT.free();
+}
+
+void TestBatchedZ()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 60;
+	QueuedCPUTracker trk(cfg);
+
+	ImageData lut = ReadJPEGFile("lut000.jpg");
+	ImageData rescaledLUT;
+	ResampleLUT(&trk, &lut, lut.h, &rescaledLUT);
+	trk.SetLocalizationMode((LocMode_t)(LT_QI | LT_NormalizeProfile | LT_LocalizeZ));
+
+	const int NImg = 200, Repeat = 20, N = NImg*Repeat;
+	std::vector<ImageData> imgs(NImg);
+	srand(0);
+	for (int i=0;i<NImg;i++) {
+		imgs[i] = ImageData::alloc(cfg.width,cfg.height);
+		vector3f pos(cfg.width/2 + rand_uniform<float>()-0.5f, cfg.height/2 + rand_uniform<float>()-0.5f, 10 + 20*(rand_uniform<float>()-0.5f));
+		GenerateImageFromLUT(&imgs[i], &rescaledLUT, trk.cfg.zlut_minradius, trk.cfg.zlut_maxradius, pos);
+		ApplyPoissonNoise(imgs[i], 28 * 255, 255);
+	}
+
+	std::vector<float> z[2];
+	const char* batchSize[] = { "32", "1" };
+	for (int pass=0;pass<2;pass++) {
+		trk.SetConfigValue("zlut_batch", batchSize[pass]);
+		double t0 = GetPreciseTime();
+		for (int i=0;i<N;i++) {
+			LocalizationJob job(i, 0, 0, 0);
+			trk.ScheduleImageData(&imgs[i%NImg], &job);
+		}
+		WaitForFinish(&trk, N);
+		double t1 = GetPreciseTime();
+
+		z[pass].resize(N);
+		for (int i=0;i<N;i++) {
+			LocalizationResult r;
+			trk.FetchResults(&r,1);
+			z[pass][r.job.frame] = r.pos.z;
+		}
+		dbgprintf("zlut_batch=%s: %d images/s\n", batchSize[pass], (int)(N/(t1-t0)));
+	}
+
+	// The batched path recomputes the planes around the maximum exactly, so both give the same Z up to rounding
+	const float Tolerance = 1e-5f;
+	float maxdiff = 0.0f;
+	int mismatches = 0;
+	for (int i=0;i<N;i++) {
+		float d = fabsf(z[0][i]-z[1][i]);
+		maxdiff = std::max(maxdiff, d);
+		if (d > Tolerance) {
+			if (mismatches < 10)
+				dbgprintf("Job %d: batched Z=%f, single job Z=%f\n", i, z[0][i], z[1][i]);
+			mismatches++;
+		}
+	}
+	dbgprintf("Max Z difference between batched and single job Z: %f, %d of %d above %g: %s\n", maxdiff, mismatches, N, Tolerance, mismatches ? "FAILED" : "OK");
+
+	for (int i=0;i<NImg;i++) imgs[i].free();
+	lut.free();
+	rescaledLUT.free();
+}
+
+// Bias correction by iterating towards the true z for every result, as done before the bias table was inverted
+static float IterativeZLUTBiasCorrection(CImageData* biasTable, float z, int zlut_planes, int bead)
+{
+	float pos = z;
+	for (int k=0;k<4;k++) {
+		float tblpos = pos / (float)zlut_planes * biasTable->w;
+		pos = z - biasTable->interpolate1D(bead, tblpos);
+	}
+	return pos;
+}
+
+// Builds the bias table on the shared executor, and compares the lookup in the inverted table with the per-result iteration
+void TestZLUTBiasInverse()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 60;
+	QueuedCPUTracker trk(cfg);
+
+	ImageData lut = ReadJPEGFile("lut000.jpg");
+	ImageData rescaledLUT;
+	ResampleLUT(&trk, &lut, lut.h, &rescaledLUT);
+	int count, planes, rsteps;
+	trk.GetRadialZLUTSize(count, planes, rsteps);
+
+	double t0 = GetPreciseTime();
+	CImageData bias;
+	trk.ComputeZBiasCorrection(planes*10, &bias, 4, true);
+	double t1 = GetPreciseTime();
+	trk.ComputeZBiasCorrection(planes*10, &bias, 4, true);
+	double t2 = GetPreciseTime();
+	dbgprintf("Bias table (%d planes): %f s, repeated: %f s\n", bias.w, t1-t0, t2-t1);
+
+	const int N = 1000000;
+	std::vector<float> measured(N), zIter(N), zInv(N);
+	srand(0);
+	for (int i=0;i<N;i++)
+		measured[i] = planes * (0.1f + 0.8f*rand_uniform<float>());
+
+	double t3 = GetPreciseTime();
+	for (int i=0;i<N;i++)
+		zIter[i] = IterativeZLUTBiasCorrection(&bias, measured[i], planes, 0);
+	double t4 = GetPreciseTime();
+	for (int i=0;i<N;i++)
+		zInv[i] = trk.ZLUTBiasCorrection(measured[i], planes, 0);
+	double t5 = GetPreciseTime();
+
+	// Both approximate the same inverse, the iteration only converges up to the slope of the bias
+	const float Tolerance = 0.01f;
+	double sum2 = 0.0;
+	float maxdiff = 0.0f;
+	int mismatches = 0;
+	for (int i=0;i<N;i++) {
+		float d = fabsf(zInv[i]-zIter[i]);
+		sum2 += d*d;
+		maxdiff = std::max(maxdiff, d);
+		if (d > Tolerance) mismatches++;
+	}
+	dbgprintf("Iterative correction: %d lookups/ms. Inverted table: %d lookups/ms\n", (int)(N/(1000*(t4-t3))), (int)(N/(1000*(t5-t4))));
+	dbgprintf("Max. difference: %f planes, rms: %f. %d of %d above %g: %s\n", maxdiff, sqrt(sum2/N), mismatches, N, Tolerance, mismatches ? "FAILED" : "OK");
+
+	lut.free();
+	rescaledLUT.free();
+}
+
+// Mixes XY-only, QI+Z and Gaussian beads in the same frame using mode profiles
+void TestModeProfiles()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 60;
+	QueuedCPUTracker trk(cfg);
+
+	ImageData lut = ReadJPEGFile("lut000.jpg");
+	ImageData rescaledLUT;
+	ResampleLUT(&trk, &lut, lut.h, &rescaledLUT);
+
+	trk.SetLocalizationModeProfile(0, (LocMode_t)(LT_QI | LT_NormalizeProfile | LT_LocalizeZ));
+	trk.SetLocalizationModeProfile(1, LT_QI);
+	trk.SetLocalizationModeProfile(2, LT_Gaussian2D);
+
+	const int N = 3000;
+	ImageData img = ImageData::alloc(cfg.width,cfg.height);
+	vector3f pos(cfg.width/2+0.3f, cfg.height/2-0.2f, 15);
+	GenerateImageFromLUT(&img, &rescaledLUT, trk.cfg.zlut_minradius, trk.cfg.zlut_maxradius, pos);
+	ApplyPoissonNoise(img, 28 * 255, 255);
+
+	double t0 = GetPreciseTime();
+	for (int i=0;i<N;i++) {
+		LocalizationJob job(i, 0, 0, 0);
+		trk.ScheduleLocalization(img.data, sizeof(float)*img.w, QTrkFloat, &job, i%3);
+		if (i == N/2) // changing a profile should not stall the queue
+			trk.SetLocalizationModeProfile(1, LT_XCor1D);
+	}
+	WaitForFinish(&trk, N);
+	double t1 = GetPreciseTime();
+
+	vector3f sum[3];
+	for (int i=0;i<N;i++) {
+		LocalizationResult r;
+		trk.FetchResults(&r,1);
+		sum[r.job.frame%3] += r.pos;
+	}
+	for (int p=0;p<3;p++) {
+		vector3f mean = sum[p] * (3.0f/N);
+		dbgprintf("Profile %d: x=%f, y=%f, z=%f\n", p, mean.x, mean.y, mean.z);
+	}
+	dbgprintf("%d images/s. True position: x=%f, y=%f, z=%f\n", (int)(N/(t1-t0)), pos.x, pos.y, pos.z);
+
+	img.free();
+	lut.free();
+	rescaledLUT.free();
+}
+
+// Runs the same jobs with the shared queue, per-worker and per-domain queues. Beads are spread evenly over the queues,
+// or all jobs go to a single bead so the other workers have to steal them. Z has to be the same in every mode.
+void TestBeadAffinity()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 60;
+	QueuedCPUTracker trk(cfg);
+
+	const int NBeads = 64, NImg = 200, N = 10000;
+	ImageData lut = ReadJPEGFile("lut000.jpg");
+	ImageData rescaledLUT;
+	ResampleLUT(&trk, &lut, lut.h, &rescaledLUT);
+	std::vector<int> mapping(NBeads, 0); // all beads share the LUT
+	trk.SetBeadLUTMapping(&mapping[0], NBeads);
+	trk.SetLocalizationMode((LocMode_t)(LT_QI | LT_NormalizeProfile | LT_LocalizeZ));
+
+	std::vector<ImageData> imgs(NImg);
+	srand(0);
+	for (int i=0;i<NImg;i++) {
+		imgs[i] = ImageData::alloc(cfg.width,cfg.height);
+		vector3f pos(cfg.width/2 + rand_uniform<float>()-0.5f, cfg.height/2 + rand_uniform<float>()-0.5f, 10 + 20*(rand_uniform<float>()-0.5f));
+		GenerateImageFromLUT(&imgs[i], &rescaledLUT, trk.cfg.zlut_minradius, trk.cfg.zlut_maxradius, pos);
+		ApplyPoissonNoise(imgs[i], 28 * 255, 255);
+	}
+
+	const char* modes[][2] = { { "0", "1" }, { "1", "1" }, { "2", "2" } };
+	const char* modeNames[] = { "Shared queue", "Queue per worker", "Queue per 2 workers" };
+	std::vector<float> refZ(N);
+	for (int skewed=0;skewed<2;skewed++) {
+		for (int m=0;m<3;m++) {
+			trk.SetConfigValue("affinity_domain_size", modes[m][1]);
+			trk.SetConfigValue("bead_affinity", modes[m][0]);
+
+			double t0 = GetPreciseTime();
+			for (int i=0;i<N;i++) {
+				LocalizationJob job(i, 0, skewed ? 0 : i%NBeads, 0);
+				trk.ScheduleImageData(&imgs[i%NImg], &job);
+			}
+			WaitForFinish(&trk, N);
+			double t1 = GetPreciseTime();
+
+			std::vector<float> z(N);
+			int count = 0;
+			LocalizationResult r;
+			while (trk.FetchResults(&r,1)) {
+				z[r.job.frame] = r.pos.z;
+				count++;
+			}
+			if (m == 0 && !skewed)
+				refZ = z;
+
+			int mismatches = 0;
+			for (int i=0;i<N;i++)
+				if (fabsf(z[i]-refZ[i]) > 1e-4f) mismatches++;
+			dbgprintf("%s, %s: %d images/s. %d of %d results, %d differ from the shared queue: %s\n", modeNames[m], skewed ? "single bead" : "all beads",
+				(int)(N/(t1-t0)), count, N, mismatches, (count == N && mismatches == 0) ? "OK" : "FAILED");
+		}
+	}
+	trk.SetConfigValue("bead_affinity", "0");
+
+	for (int i=0;i<NImg;i++) imgs[i].free();
+	lut.free();
+	rescaledLUT.free();
+}
+
+// Calibration sweep over many beads, to check that LUT building keeps up with the incoming frames
+void TestLUTBuildSpeed()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 60;
+	QueuedCPUTracker trk(cfg);
+
+	ImageData lut = ReadJPEGFile("lut000.jpg");
+	const int NBeads = 200, Planes = 100;
+	ImageData frame = ImageData::alloc(cfg.width, cfg.height*NBeads);
+	std::vector<vector2f> positions(NBeads, vector2f(cfg.width/2,cfg.height/2));
+
+	trk.SetRadialZLUT(0, NBeads, Planes);
+	trk.BeginLUT(BUILDLUT_NORMALIZE);
+	double t0 = GetPreciseTime();
+	for (int p=0;p<Planes;p++) {
+		ImageData roi(&frame.data[0], cfg.width, cfg.height);
+		GenerateImageFromLUT(&roi, &lut, trk.cfg.zlut_minradius, trk.cfg.zlut_maxradius, vector3f(cfg.width/2, cfg.height/2, p/(float)Planes * lut.h), true);
+		for (int b=1;b<NBeads;b++)
+			memcpy(&frame.data[b*cfg.width*cfg.height], roi.data, sizeof(float)*cfg.width*cfg.height);
+		trk.BuildLUT(frame.data, sizeof(float)*cfg.width, QTrkFloat, p, &positions[0]);
+	}
+	double t1 = GetPreciseTime();
+	trk.FinalizeLUT();
+	double t2 = GetPreciseTime();
+	dbgprintf("BuildLUT: %d frames/s. FinalizeLUT: %f s\n", (int)(Planes/(t1-t0)), t2-t1);
+
+	frame.free();
+	lut.free();
+}
 
 void TestQuadrantAlign()
 {
@@ -890,12 +1297,764 @@ void ScatterBiasArea(int roi, float scan_width, int steps, int samples, int qi_i
 }
 
 
+// Many beads using one LUT built from all of them, compared to one LUT per bead
+void TestSharedLUT()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 60;
+	ImageData lut = ReadJPEGFile("lut000.jpg");
+	const int NBeads = 100, Planes = 100, N = 2000;
+	QTrkComputedConfig cc(cfg);
+
+	ImageData frame = ImageData::alloc(cfg.width, cfg.height*NBeads);
+	std::vector<vector2f> positions(NBeads, vector2f(cfg.width/2,cfg.height/2));
+	std::vector<ImageData> imgs(N);
+	std::vector<float> trueZ(N);
+	for (int i=0;i<N;i++) {
+		trueZ[i] = Planes/2 + 20*(rand_uniform<float>()-0.5f);
+		imgs[i] = ImageData::alloc(cfg.width,cfg.height);
+		GenerateImageFromLUT(&imgs[i], &lut, cc.zlut_minradius, cc.zlut_maxradius, vector3f(cfg.width/2, cfg.height/2, trueZ[i]/Planes * lut.h), true);
+		ApplyPoissonNoise(imgs[i], 28 * 255, 255);
+	}
+
+	for (int shared=0;shared<2;shared++) {
+		QueuedCPUTracker trk(cfg);
+		trk.SetLocalizationMode(LT_QI | LT_NormalizeProfile | LT_LocalizeZ);
+		std::vector<int> mapping(NBeads, 0);
+		if (shared)
+			trk.SetBeadLUTMapping(&mapping[0], NBeads);
+		trk.SetRadialZLUT(0, shared ? 1 : NBeads, Planes);
+
+		trk.BeginLUT(BUILDLUT_NORMALIZE);
+		for (int p=0;p<Planes;p++) {
+			for (int b=0;b<NBeads;b++) {
+				ImageData roi(&frame.data[b*cfg.width*cfg.height], cfg.width, cfg.height);
+				GenerateImageFromLUT(&roi, &lut, trk.cfg.zlut_minradius, trk.cfg.zlut_maxradius, vector3f(cfg.width/2, cfg.height/2, p/(float)Planes * lut.h), true);
+			}
+			trk.BuildLUT(frame.data, sizeof(float)*cfg.width, QTrkFloat, p, &positions[0]);
+		}
+		trk.FinalizeLUT();
+
+		double t0 = GetPreciseTime();
+		for (int i=0;i<N;i++) {
+			LocalizationJob job(i, 0, i%NBeads, 0);
+			trk.ScheduleImageData(&imgs[i], &job);
+		}
+		WaitForFinish(&trk, N);
+		double t1 = GetPreciseTime();
+
+		double sum=0, sum2=0;
+		for (int i=0;i<N;i++) {
+			LocalizationResult r;
+			trk.FetchResults(&r,1);
+			float err = r.pos.z - trueZ[r.job.frame];
+			sum += err; sum2 += err*err;
+		}
+		double meanErr = sum/N;
+		int count, planes, rsteps;
+		trk.GetRadialZLUTSize(count, planes, rsteps);
+		dbgprintf("%s: %d LUTs (%d KB). Z error mean: %f, stdev: %f. %d images/s\n", shared ? "Shared LUT" : "LUT per bead", count, count*planes*rsteps*4/1024,
+			meanErr, sqrt(sum2/N - meanErr*meanErr), (int)(N/(t1-t0)));
+	}
+
+	for (int i=0;i<N;i++) imgs[i].free();
+	frame.free();
+	lut.free();
+}
+
+void TestLUTLibrary()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 60;
+	QueuedCPUTracker trk(cfg);
+
+	ImageData lut = ReadJPEGFile("lut000.jpg");
+	const int NBeads = 200, Planes = 100;
+	ImageData frame = ImageData::alloc(cfg.width, cfg.height*NBeads);
+	std::vector<vector2f> positions(NBeads, vector2f(cfg.width/2,cfg.height/2));
+
+	trk.SetRadialZLUT(0, NBeads, Planes);
+	trk.BeginLUT(BUILDLUT_NORMALIZE);
+	for (int p=0;p<Planes;p++) {
+		ImageData roi(&frame.data[0], cfg.width, cfg.height);
+		GenerateImageFromLUT(&roi, &lut, trk.cfg.zlut_minradius, trk.cfg.zlut_maxradius, vector3f(cfg.width/2, cfg.height/2, p/(float)Planes * lut.h), true);
+		for (int b=1;b<NBeads;b++)
+			memcpy(&frame.data[b*cfg.width*cfg.height], roi.data, sizeof(float)*cfg.width*cfg.height);
+		trk.BuildLUT(frame.data, sizeof(float)*cfg.width, QTrkFloat, p, &positions[0]);
+	}
+	trk.FinalizeLUT();
+	trk.SetRadialWeights(ComputeRadialBinWindow(trk.cfg.zlut_radialsteps));
+
+	double t0 = GetPreciseTime();
+	trk.SaveLUTLibrary("lutlib.qlib");
+	double t1 = GetPreciseTime();
+
+	QueuedCPUTracker trk2(cfg);
+	trk2.LoadLUTLibrary("lutlib.qlib");
+	double t2 = GetPreciseTime();
+
+	int count, planes, rsteps;
+	trk2.GetRadialZLUTSize(count, planes, rsteps);
+	std::vector<float> a(count*planes*rsteps), b(count*planes*rsteps);
+	trk.GetRadialZLUT(&a[0]);
+	trk2.GetRadialZLUT(&b[0]);
+	dbgprintf("LUT library: save %f s, load %f s. %d beads, %d planes, identical: %s\n", t1-t0, t2-t1, count, planes, a == b ? "yes" : "no");
+
+	frame.free();
+	lut.free();
+}
+
+void TestStateSnapshot()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 60;
+	QueuedCPUTracker trk(cfg);
+
+	const int NBeads = 10, Planes = 50;
+	int npix = cfg.width*cfg.height;
+	std::vector<float> zlut(NBeads*Planes*trk.cfg.zlut_radialsteps), gain(NBeads*npix), offset(NBeads*npix);
+	for (uint i=0;i<zlut.size();i++) zlut[i] = rand_uniform<float>();
+	for (uint i=0;i<gain.size();i++) { gain[i] = 1.0f + 0.1f*rand_uniform<float>(); offset[i] = rand_uniform<float>(); }
+
+	trk.SetRadialZLUT(&zlut[0], NBeads, Planes);
+	trk.SetPixelCalibrationImages(&offset[0], &gain[0]);
+	trk.SetPixelCalibrationFactors(0.5f, 2.0f);
+	trk.SetLocalizationMode(LT_QI | LT_LocalizeZ | LT_NormalizeProfile);
+	trk.SetLocalizationModeProfile(1, LT_QI | LT_LocalizeZ | LT_ZLUTPCA);
+	trk.SetConfigValue("zlut_pca_components", "6");
+	trk.SaveState("state.qlib");
+
+	double t0 = GetPreciseTime();
+	QueuedTracker* restored = CreateQueuedTrackerFromState("state.qlib");
+	double t1 = GetPreciseTime();
+
+	std::vector<float> rzlut(zlut.size()), roffset, rgain;
+	restored->GetRadialZLUT(&rzlut[0]);
+	restored->GetPixelCalibrationImages(roffset, rgain);
+	float of, gf;
+	restored->GetPixelCalibrationFactors(of, gf);
+	// calibration images are stored quantized to 16 bit
+	auto maxdiff = [](const std::vector<float>& a, const std::vector<float>& b) {
+		float d = a.size() == b.size() ? 0.0f : 1e10f;
+		for (uint i=0;i<a.size() && i<b.size();i++) d = std::max(d, fabsf(a[i]-b[i]));
+		return d;
+	};
+	bool same = rzlut == zlut && maxdiff(roffset, offset) < 1e-4f && maxdiff(rgain, gain) < 1e-4f && of == 0.5f && gf == 2.0f &&
+		restored->GetLocalizationModeProfile(1) == trk.GetLocalizationModeProfile(1) &&
+		restored->GetConfigValues()["zlut_pca_components"] == "6";
+	dbgprintf("State snapshot restored in %f s. Identical: %s\n", t1-t0, same ? "yes" : "no");
+	delete restored;
+}
+
+// Calibrates with one shared sensor map, and compares against the same calibration passed as per-bead images
+void TestPixelCalibrationMap()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 60;
+	const int SensorW = 512, SensorH = 512, NBeads = 200, N = 20000;
+
+	std::vector<float> gain(SensorW*SensorH), offset(SensorW*SensorH);
+	for (uint i=0;i<gain.size();i++) { gain[i] = 1.0f + 0.1f*rand_uniform<float>(); offset[i] = 2.0f*rand_uniform<float>(); }
+
+	std::vector<ROIPosition> rois(NBeads);
+	std::vector<float> beadGain(NBeads*cfg.width*cfg.height), beadOffset(beadGain.size());
+	for (int i=0;i<NBeads;i++) {
+		rois[i].x = rand() % (SensorW-cfg.width);
+		rois[i].y = rand() % (SensorH-cfg.height);
+		for (int y=0;y<cfg.height;y++)
+			for (int x=0;x<cfg.width;x++) {
+				int src = (rois[i].y+y)*SensorW + rois[i].x+x, dst = (i*cfg.height+y)*cfg.width+x;
+				beadGain[dst] = gain[src]; beadOffset[dst] = offset[src];
+			}
+	}
+
+	ImageData img = ImageData::alloc(cfg.width,cfg.height);
+	for (int s=0;s<2;s++) {
+		QueuedCPUTracker trk(cfg);
+		trk.SetLocalizationMode(LT_QI);
+		trk.SetRadialZLUT(0, NBeads, 1);
+		if (s == 0) trk.SetPixelCalibrationMap(&offset[0], &gain[0], SensorW, SensorH, &rois[0], NBeads);
+		else trk.SetPixelCalibrationImages(&beadOffset[0], &beadGain[0]);
+
+		std::vector<float> o, g;
+		trk.GetPixelCalibrationImages(o, g);
+		float maxerr = 0.0f;
+		for (uint i=0;i<g.size();i++) maxerr = std::max(maxerr, std::max(fabsf(g[i]-beadGain[i]), fabsf(o[i]-beadOffset[i])));
+
+		GenerateTestImage(img, cfg.width/2, cfg.height/2, 1.0f, 0.0f);
+		double t0 = GetPreciseTime();
+		for (int i=0;i<N;i++) {
+			LocalizationJob job(i, 0, i%NBeads, 0);
+			trk.ScheduleImageData(&img, &job);
+		}
+		WaitForFinish(&trk, N);
+		double t1 = GetPreciseTime();
+
+		dbgprintf("%s: %d KB calibration data, max. error %f. %d images/s\n", s == 0 ? "Sensor map" : "Per-bead images",
+			(s == 0 ? SensorW*SensorH : (int)beadGain.size()) * 2 * sizeof(ushort) / 1024, maxerr, (int)(N/(t1-t0)));
+	}
+	img.free();
+
+	// A hot pixel only costs precision in its own row, or the map is kept as float
+	QueuedCPUTracker trk(cfg);
+	trk.SetRadialZLUT(0, NBeads, 1);
+	gain[rois[0].y*SensorW + rois[0].x] = 100.0f;
+	trk.SetPixelCalibrationMap(&offset[0], &gain[0], SensorW, SensorH, &rois[0], NBeads);
+	std::vector<float> o, g;
+	trk.GetPixelCalibrationImages(o, g);
+	float maxrel = 0.0f;
+	for (int i=0;i<NBeads;i++)
+		for (int y=0;y<cfg.height;y++)
+			for (int x=0;x<cfg.width;x++) {
+				float v = gain[(rois[i].y+y)*SensorW + rois[i].x+x];
+				maxrel = std::max(maxrel, fabsf(g[(i*cfg.height+y)*cfg.width+x] - v) / v);
+			}
+	gain[0] = std::numeric_limits<float>::quiet_NaN();
+	bool rejected = false;
+	try {
+		trk.SetPixelCalibrationMap(&offset[0], &gain[0], SensorW, SensorH, &rois[0], NBeads);
+	} catch (const std::runtime_error& e) {
+		rejected = true;
+	}
+	dbgprintf("Hot pixel: max. relative gain error %g (%s). NaN gain rejected: %s\n", maxrel,
+		maxrel <= 2*PixelCalibration::MaxQuantizationError ? "ok" : "too large", rejected ? "yes" : "no");
+}
+
+// Accuracy and speed of pixel binned profiles (LT_PixelBinnedProfile) against interpolated samples
+void TestPixelBinnedProfile()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 60;
+	ImageData lut = ReadJPEGFile("lut000.jpg");
+	const int Planes = 100, N = 4000;
+	QTrkComputedConfig cc(cfg);
+
+	std::vector<ImageData> imgs(N);
+	std::vector<vector3f> truePos(N);
+	for (int i=0;i<N;i++) {
+		truePos[i] = vector3f(cfg.width/2 + 4*(rand_uniform<float>()-0.5f), cfg.height/2 + 4*(rand_uniform<float>()-0.5f), Planes/2 + 20*(rand_uniform<float>()-0.5f));
+		imgs[i] = ImageData::alloc(cfg.width,cfg.height);
+		GenerateImageFromLUT(&imgs[i], &lut, cc.zlut_minradius, cc.zlut_maxradius, vector3f(truePos[i].x, truePos[i].y, truePos[i].z/Planes * lut.h), true);
+		ApplyPoissonNoise(imgs[i], 28 * 255, 255);
+	}
+
+	// Profile extraction only
+	CPUTracker trk(cfg.width, cfg.height);
+	trk.SetImageFloat(imgs[0].data);
+	trk.ComputeMeanAndCOM();
+	std::vector<float> prof(cc.zlut_radialsteps), qprof(cc.qi_radialsteps*4);
+	const int M = 20000;
+	vector2f c(cfg.width/2+0.3f, cfg.height/2-0.2f);
+	double t0 = GetPreciseTime();
+	for (int i=0;i<M;i++) trk.ComputeRadialProfile(&prof[0], cc.zlut_radialsteps, cc.zlut_angularsteps, cc.zlut_minradius, cc.zlut_maxradius, c, false);
+	double t1 = GetPreciseTime();
+	for (int i=0;i<M;i++) trk.ComputeBinnedRadialProfile(&prof[0], cc.zlut_radialsteps, cc.zlut_minradius, cc.zlut_maxradius, c);
+	double t2 = GetPreciseTime();
+	bool bhit; // sets up the quadrant directions
+	trk.ComputeQI(c, 1, cc.qi_radialsteps, cc.qi_angstepspq, 1.0f, cc.qi_minradius, cc.qi_maxradius, bhit);
+	double t3 = GetPreciseTime();
+	for (int i=0;i<M;i++) for (int q=0;q<4;q++) trk.ComputeQuadrantProfile(&qprof[q*cc.qi_radialsteps], cc.qi_radialsteps, cc.qi_angstepspq, q, cc.qi_minradius, cc.qi_maxradius, c);
+	double t4 = GetPreciseTime();
+	for (int i=0;i<M;i++) trk.ComputeBinnedQuadrantProfiles(&qprof[0], cc.qi_radialsteps, cc.qi_minradius, cc.qi_maxradius, c);
+	double t5 = GetPreciseTime();
+	dbgprintf("Radial profile: interpolated %.2f us, pixel binned %.2f us. QI quadrant profiles: interpolated %.2f us, pixel binned %.2f us\n",
+		(t1-t0)/M*1e6, (t2-t1)/M*1e6, (t4-t3)/M*1e6, (t5-t4)/M*1e6);
+
+	// Full localization, with a LUT built in the same mode
+	for (int binned=0;binned<2;binned++) {
+		QueuedCPUTracker qtrk(cfg);
+		qtrk.SetLocalizationMode(LT_QI | LT_NormalizeProfile | LT_LocalizeZ | (binned ? LT_PixelBinnedProfile : 0));
+		qtrk.SetRadialZLUT(0, 1, Planes);
+
+		ImageData roi = ImageData::alloc(cfg.width,cfg.height);
+		vector2f center(cfg.width/2, cfg.height/2);
+		qtrk.BeginLUT(BUILDLUT_NORMALIZE | (binned ? BUILDLUT_PIXELBINNED : 0));
+		for (int p=0;p<Planes;p++) {
+			GenerateImageFromLUT(&roi, &lut, cc.zlut_minradius, cc.zlut_maxradius, vector3f(center.x, center.y, p/(float)Planes * lut.h), true);
+			qtrk.BuildLUT(roi.data, sizeof(float)*cfg.width, QTrkFloat, p, &center);
+		}
+		qtrk.FinalizeLUT();
+		roi.free();
+
+		double t0 = GetPreciseTime();
+		for (int i=0;i<N;i++) {
+			LocalizationJob job(i, 0, 0, 0);
+			qtrk.ScheduleImageData(&imgs[i], &job);
+		}
+		WaitForFinish(&qtrk, N);
+		double t1 = GetPreciseTime();
+
+		vector3f sum, sum2;
+		for (int i=0;i<N;i++) {
+			LocalizationResult r;
+			qtrk.FetchResults(&r,1);
+			vector3f d = r.pos - truePos[r.job.frame];
+			sum += d; sum2 += d*d;
+		}
+		vector3f m = sum * (1.0f/N);
+		vector3f sd = sqrt(sum2 * (1.0f/N) - m*m);
+		dbgprintf("%s: bias (%f,%f,%f), stdev (%f,%f,%f). %d images/s\n", binned ? "Pixel binned" : "Interpolated",
+			m.x, m.y, m.z, sd.x, sd.y, sd.z, (int)(N/(t1-t0)));
+	}
+
+	for (int i=0;i<N;i++) imgs[i].free();
+	lut.free();
+}
+
+// The fused quadrant profiles should equal four ComputeQuadrantProfile calls, also with samples outside the ROI
+void TestQuadrantProfiles()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 60;
+	QTrkComputedConfig cc(cfg);
+	CPUTracker trk(cfg.width, cfg.height);
+	ImageData img(trk.srcImage, cfg.width, cfg.height);
+	GenerateTestImage(img, cfg.width/2, cfg.height/2, 5, 0.0f);
+	trk.ComputeMeanAndCOM();
+
+	int nr = cc.qi_radialsteps;
+	std::vector<float> single(nr*4), fused(nr*4);
+	bool bhit; // sets up the quadrant directions
+	trk.ComputeQI(vector2f(cfg.width/2,cfg.height/2), 1, nr, cc.qi_angstepspq, 1.0f, cc.qi_minradius, cc.qi_maxradius, bhit);
+
+	vector2f centers[] = { vector2f(cfg.width/2+0.3f, cfg.height/2-0.2f), vector2f(8.5f, 50.2f) };
+	for (int c=0;c<2;c++) {
+		const int M = 20000;
+		double t0 = GetPreciseTime();
+		for (int i=0;i<M;i++) 
+			for (int q=0;q<4;q++) trk.ComputeQuadrantProfile(&single[q*nr], nr, cc.qi_angstepspq, q, cc.qi_minradius, cc.qi_maxradius, centers[c]);
+		double t1 = GetPreciseTime();
+		for (int i=0;i<M;i++)
+			trk.ComputeQuadrantProfiles(&fused[0], nr, cc.qi_angstepspq, cc.qi_minradius, cc.qi_maxradius, centers[c]);
+		double t2 = GetPreciseTime();
+
+		dbgprintf("%s ring: identical: %s. 4x ComputeQuadrantProfile: %.2f us, ComputeQuadrantProfiles: %.2f us\n", c ? "Clipped" : "Inside",
+			single == fused ? "yes" : "no", (t1-t0)/M*1e6, (t2-t1)/M*1e6);
+	}
+}
+
+// Appends 1000-bead frame records the way ResultManager packs them, and checks that Append never waits for the disk
+void TestResultWriter()
+{
+	const int NBeads = 1000, NFrames = 5000;
+	int recordSize = sizeof(uint) + sizeof(double) + (sizeof(vector3f)+sizeof(int)+sizeof(float))*NBeads;
+	std::vector<uchar> record(recordSize);
+	for (int i=0;i<recordSize;i++) record[i] = rand();
+
+	for (int direct=0;direct<2;direct++) {
+		ResultWriter::Config wc;
+		wc.directIO = direct!=0;
+		double maxAppend = 0.0;
+		double t0 = GetPreciseTime();
+		{
+			ResultWriter w("resultwriter-test.bin", wc);
+			for (int f=0;f<NFrames;f++) {
+				*(int*)&record[0] = f;
+				double ta = GetPreciseTime();
+				w.Append(&record[0], recordSize);
+				maxAppend = std::max(maxAppend, GetPreciseTime()-ta);
+			}
+			w.Flush(true);
+			dbgprintf("%s: %d errors, %d extra buffers. ", direct ? "Direct I/O" : "Buffered", w.ErrorCount(), w.ExtraBuffers());
+		}
+		double t1 = GetPreciseTime();
+
+		FILE* f = fopen("resultwriter-test.bin", "rb");
+		fseek(f, 0, SEEK_END);
+		long size = ftell(f);
+		fseek(f, (long)recordSize*(NFrames-1), SEEK_SET);
+		int lastFrame = -1;
+		fread(&lastFrame, sizeof(int), 1, f);
+		fclose(f);
+		dbgprintf("Size ok: %s, last frame: %d. %.1f MB/s, max. Append time: %.3f ms\n", size == (long)recordSize*NFrames ? "yes" : "no", lastFrame,
+			recordSize*(double)NFrames/(t1-t0)/(1024*1024), maxAppend*1000);
+	}
+	remove("resultwriter-test.bin");
+}
+
+void TestResultFileReader()
+{
+	const int NBeads = 200, NFrames = 20000;
+	std::vector<std::string> names(2);
+	names[0] = "Motor X"; names[1] = "Motor Z";
+	int recordSize = ResultFileRecordSize(NBeads, names.size());
+	std::vector<uchar> record(recordSize);
+
+	ResultWriter* w = new ResultWriter("resultfile-test.bin");
+	std::vector<uchar> hdr = MakeResultFileHeader(NBeads, names);
+	w->Append(&hdr[0], hdr.size());
+	ResultFileReader* reader = 0;
+	for (int f=0;f<NFrames;f++) {
+		// frame, timestamp, 2 frame info columns, positions (bead,frame,0), errors, image means
+		*(uint*)&record[0] = f;
+		double ts = f * 0.001;
+		memcpy(&record[sizeof(uint)], &ts, sizeof(double));
+		float* info = (float*)&record[sizeof(uint)+sizeof(double)];
+		info[0] = info[1] = (float)f;
+		vector3f* pos = (vector3f*)(info + 2);
+		for (int i=0;i<NBeads;i++)
+			pos[i] = vector3f((float)i, (float)f, 0.0f);
+		int* err = (int*)(pos + NBeads);
+		for (int i=0;i<NBeads;i++)
+			err[i] = 0;
+		float* mean = (float*)(err + NBeads);
+		for (int i=0;i<NBeads;i++)
+			mean[i] = 1.0f;
+		w->Append(&record[0], recordSize);
+
+		// Open the file while it is still being written
+		if (f == NFrames/2) {
+			w->Flush(true);
+			reader = new ResultFileReader("resultfile-test.bin");
+			dbgprintf("Live: %d frames available\n", reader->FrameCount());
+		}
+	}
+	delete w;
+	reader->Refresh();
+
+	std::vector<LocalizationResult> trace(NFrames);
+	int errors = 0;
+	double t0 = GetPreciseTime();
+	for (int b=0;b<NBeads;b++) {
+		int n = reader->GetBeadTrace(b, 0, NFrames, &trace[0]);
+		for (int f=0;f<n;f++)
+			if (trace[f].pos.x != b || trace[f].pos.y != f || trace[f].job.frame != f) errors++;
+		if (n != NFrames) errors++;
+	}
+	double t1 = GetPreciseTime();
+
+	std::vector<LocalizationResult> frames(NBeads*10);
+	std::vector<double> timestamps(10);
+	int n = reader->GetFrames(NFrames-5, 10, &frames[0], &timestamps[0]);
+	dbgprintf("Frames: %d, columns: %s, %s. Reading %d bead traces: %.1f ms, %d errors. Last frames: %d (ts=%f)\n", reader->FrameCount(), 
+		reader->FrameInfoNames()[0].c_str(), reader->FrameInfoNames()[1].c_str(), NBeads, (t1-t0)*1000, errors, n, timestamps[n-1]);
+	delete reader;
+	remove("resultfile-test.bin");
+}
+
+// Tracks through a ResultManager writing bead columns, and reads the traces back while only a part of the frames is in memory
+void TestResultColumnFile()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 30;
+	const int NBeads = 50, NFrames = 4000;
+
+	ImageData frame = ImageData::alloc(cfg.width, cfg.height*NBeads);
+	std::vector<ROIPosition> rois(NBeads);
+	for (int b=0;b<NBeads;b++) {
+		ImageData roi(&frame.data[b*cfg.width*cfg.height], cfg.width, cfg.height);
+		GenerateTestImage(roi, cfg.width/2 + b*0.01f, cfg.height/2, 1, 0.0f);
+		rois[b].x = 0; rois[b].y = b*cfg.height;
+	}
+
+	ResultManagerConfig rmcfg = {};
+	rmcfg.numBeads = NBeads;
+	rmcfg.numFrameInfoColumns = 1;
+	rmcfg.scaling = vector3f(1,1,1);
+	rmcfg.writeInterval = 100;
+	rmcfg.maxFramesInMemory = 1000;
+	std::vector<std::string> colNames(1, "Magnet");
+
+	for (int compressed=0;compressed<2;compressed++) {
+		rmcfg.binaryOutput = compressed ? ResultOutputCompressedColumns : ResultOutputColumns;
+
+		QueuedCPUTracker trk(cfg);
+		trk.SetLocalizationMode(LT_OnlyCOM);
+		ResultManager* rm = new ResultManager("resultcolumns-test.bin", "", &rmcfg, colNames);
+		rm->SetTracker(&trk);
+		for (int f=0;f<NFrames;f++) {
+			float magnet = (float)f;
+			rm->StoreFrameInfo(f, f*0.01, &magnet);
+			LocalizationJob job(f, 0, 0, 0);
+			trk.ScheduleFrame(frame.data, sizeof(float)*cfg.width, cfg.width, cfg.height*NBeads, &rois[0], NBeads, QTrkFloat, &job);
+		}
+		trk.Flush();
+		while (rm->GetFrameCounters().processedFrames < NFrames)
+			Threads::Sleep(10);
+
+		// The first frames are only in the file by now
+		std::vector<LocalizationResult> trace(NFrames);
+		int n = rm->GetBeadPositions(0, NFrames, NBeads-1, &trace[0]);
+		int errors = 0;
+		for (int f=0;f<n;f++)
+			if (trace[f].job.frame != f || fabs(trace[f].pos.x - trace[NFrames-1].pos.x) > 1e-4f) errors++;
+		auto counters = rm->GetFrameCounters();
+		dbgprintf("Live: %d frames read, frames in memory start at %d, %d errors\n", n, counters.startFrame, errors);
+
+		rm->SetTracker(0);
+		rm->Flush();
+		delete rm;
+
+		ResultColumnFileReader* reader = new ResultColumnFileReader("resultcolumns-test.bin");
+		double t0 = GetPreciseTime();
+		for (int b=0;b<NBeads;b++)
+			reader->GetBeadTrace(b, 0, NFrames, &trace[0]);
+		double t1 = GetPreciseTime();
+		std::vector<float> magnet(NFrames);
+		reader->GetFrames(0, NFrames, 0, 0, &magnet[0]);
+		FILE* f = fopen("resultcolumns-test.bin", "rb");
+		fseek(f, 0, SEEK_END);
+		long size = ftell(f);
+		fclose(f);
+		dbgprintf("%s file: %d KB, %d frames in %d chunks, last magnet value: %.0f. Reading %d bead traces: %.2f ms\n", compressed ? "Compressed" : "Plain",
+			(int)(size/1024), reader->FrameCount(), reader->NumChunks(), magnet[NFrames-1], NBeads, (t1-t0)*1000);
+		delete reader;
+
+		remove("resultcolumns-test.bin");
+	}
+	frame.free();
+}
+
+struct CountingResultSink : ResultSink {
+	Threads::Mutex mutex;
+	int batches, results;
+	CountingResultSink() { batches=results=0; }
+	void OnResults(const LocalizationResult* r, int count) override {
+		mutex.lock();
+		batches++;
+		results += count;
+		mutex.unlock();
+	}
+};
+
+void TestResultSink()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 30;
+	const int NBeads = 50, NFrames = 2000;
+
+	ImageData frame = ImageData::alloc(cfg.width, cfg.height*NBeads);
+	std::vector<ROIPosition> rois(NBeads);
+	for (int b=0;b<NBeads;b++) {
+		ImageData roi(&frame.data[b*cfg.width*cfg.height], cfg.width, cfg.height);
+		GenerateTestImage(roi, cfg.width/2, cfg.height/2, 1, 0.0f);
+		rois[b].x = 0; rois[b].y = b*cfg.height;
+	}
+
+	QueuedCPUTracker trk(cfg);
+	trk.SetLocalizationMode(LT_OnlyCOM);
+	CountingResultSink sink;
+	trk.SetResultSink(&sink);
+
+	double t0 = GetPreciseTime();
+	for (int f=0;f<NFrames;f++) {
+		LocalizationJob job(f, 0, 0, 0);
+		trk.ScheduleFrame(frame.data, sizeof(float)*cfg.width, cfg.width, cfg.height*NBeads, &rois[0], NBeads, QTrkFloat, &job);
+	}
+	trk.Flush();
+	while (!trk.IsIdle())
+		Threads::Sleep(1);
+	double t1 = GetPreciseTime();
+	trk.SetResultSink(0);
+
+	dbgprintf("Result sink: %d results in %d batches, %d left in the result queue. %.1f k results/s\n", sink.results, sink.batches,
+		trk.GetResultCount(), sink.results / (t1-t0) * 0.001);
+
+	// Without sink, results are queued again
+	LocalizationJob job(NFrames, 0, 0, 0);
+	trk.ScheduleFrame(frame.data, sizeof(float)*cfg.width, cfg.width, cfg.height*NBeads, &rois[0], NBeads, QTrkFloat, &job);
+	trk.Flush();
+	while (!trk.IsIdle())
+		Threads::Sleep(1);
+	dbgprintf("After removing the sink: %d results queued, %d received by the sink\n", trk.GetResultCount(), sink.results);
+	frame.free();
+}
+
+void TestResultStream()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 30;
+	const int NBeads = 20, NFrames = 2000;
+
+	ImageData frame = ImageData::alloc(cfg.width, cfg.height*NBeads);
+	std::vector<ROIPosition> rois(NBeads);
+	for (int b=0;b<NBeads;b++) {
+		ImageData roi(&frame.data[b*cfg.width*cfg.height], cfg.width, cfg.height);
+		GenerateTestImage(roi, cfg.width/2, cfg.height/2, 1, 0.0f);
+		rois[b].x = 0; rois[b].y = b*cfg.height;
+	}
+
+	ResultManagerConfig rmcfg = {};
+	rmcfg.numBeads = NBeads;
+	rmcfg.numFrameInfoColumns = 1;
+	rmcfg.scaling = vector3f(1,1,1);
+	rmcfg.writeInterval = 100;
+	std::vector<std::string> colNames(1, "Magnet");
+
+	QueuedCPUTracker trk(cfg);
+	trk.SetLocalizationMode(LT_OnlyCOM);
+	ResultManager* rm = new ResultManager("", "", &rmcfg, colNames);
+	rm->SetConfigValue("stream_slots", "256");
+	rm->SetConfigValue("stream_name", "qtrk-test-stream");
+	rm->SetTracker(&trk);
+
+	// Normally done by another process
+	ResultStreamReader* rd = QTrkResultStreamOpen("qtrk-test-stream");
+	if (!rd) {
+		dbgprintf("Failed to open the result stream\n");
+		delete rm;
+		frame.free();
+		return;
+	}
+	const ResultStreamHeader* hdr = QTrkResultStreamHeader(rd);
+
+	int received = 0, errors = 0, lastFrame = -1;
+	for (int f=0;f<NFrames;f++) {
+		float magnet = (float)f;
+		rm->StoreFrameInfo(f, f*0.01, &magnet);
+		LocalizationJob job(f, 0, 0, 0);
+		trk.ScheduleFrame(frame.data, sizeof(float)*cfg.width, cfg.width, cfg.height*NBeads, &rois[0], NBeads, QTrkFloat, &job);
+
+		// Read the frames in place
+		while (const ResultStreamSlot* s = QTrkResultStreamNext(rd)) {
+			bool ok = s->frame > lastFrame && ResultStreamFrameInfo(hdr, s)[0] == s->frame;
+			lastFrame = s->frame;
+			if (QTrkResultStreamValid(rd)) {
+				received++;
+				if (!ok) errors++;
+			}
+		}
+	}
+	trk.Flush();
+	while (rm->GetFrameCounters().processedFrames < NFrames)
+		Threads::Sleep(1);
+	vector3f pos[NBeads] = {};
+	int frameNum = lastFrame;
+	while (QTrkResultStreamRead(rd, &frameNum, 0, 0, pos, 0, 0))
+		received++;
+
+	dbgprintf("Result stream: %d frames received, %d skipped, %d errors. Last frame: %d, bead 0 at x=%.2f\n", received, 
+		(int)QTrkResultStreamSkipped(rd), errors, frameNum, pos[0].x);
+	QTrkResultStreamClose(rd);
+
+	rm->SetTracker(0);
+	delete rm;
+	frame.free();
+}
+
+// Compares the online bead statistics with a second pass over the same trace
+void TestBeadStatistics()
+{
+	const int N = 100000, Octaves = 12;
+	BeadStatisticsAccumulator acc(1, Octaves);
+	std::vector<float> x(N);
+	float walk = 0;
+	for (int i=0;i<N;i++) {
+		walk += rand_normal<float>() * 0.01f;
+		x[i] = walk + rand_normal<float>() + 0.001f * i;
+		LocalizationResult r;
+		r.pos = vector3f(x[i], 0, 0);
+		r.error = 0;
+		acc.Add(0, i, &r);
+	}
+	BeadStatistics s = acc.Get(0);
+	float adev[Octaves*3];
+	acc.GetAllanDeviation(0, adev, Octaves);
+
+	double mean = 0, var = 0;
+	for (int i=0;i<N;i++) mean += x[i];
+	mean /= N;
+	for (int i=0;i<N;i++) var += (x[i]-mean)*(x[i]-mean);
+	dbgprintf("Mean: %f (%f), stdev: %f (%f), drift: %g/frame\n", s.mean.x, mean, s.stdev.x, sqrt(var/(N-1)), s.drift.x);
+
+	for (int k=0;k<Octaves;k++) {
+		int m = 1<<k, blocks = N/m;
+		double sumSq = 0, prev = 0;
+		for (int j=0;j<blocks;j++) {
+			double avg = 0;
+			for (int i=0;i<m;i++) avg += x[j*m+i];
+			avg /= m;
+			if (j>0) sumSq += (avg-prev)*(avg-prev);
+			prev = avg;
+		}
+		dbgprintf("tau=%d: Allan deviation %f (%f)\n", m, adev[k*3], sqrt(0.5*sumSq/(blocks-1)));
+	}
+}
+
+// Moves all beads with a common drift, and checks that the reference beads remove it from the other beads
+void TestDriftCorrection()
+{
+	QTrkSettings cfg;
+	cfg.width = cfg.height = 40;
+	const int NBeads = 20, NRef = 4, NFrames = 1000;
+
+	ImageData frame = ImageData::alloc(cfg.width, cfg.height*NBeads);
+	std::vector<ROIPosition> rois(NBeads);
+	for (int b=0;b<NBeads;b++) {
+		rois[b].x = 0; rois[b].y = b*cfg.height;
+	}
+
+	ResultManagerConfig rmcfg = {};
+	rmcfg.numBeads = NBeads;
+	rmcfg.scaling = vector3f(1,1,1);
+	rmcfg.writeInterval = 100;
+
+	QueuedCPUTracker trk(cfg);
+	trk.SetLocalizationMode(LT_OnlyCOM);
+	ResultManager* rm = new ResultManager("", "", &rmcfg, std::vector<std::string>());
+	int refBeads[NRef] = { 0, 5, 10, 15 };
+	rm->SetReferenceBeads(refBeads, NRef, "drift-raw.bin");
+	rm->SetTracker(&trk);
+
+	std::vector<vector3f> drift(NFrames);
+	for (int f=0;f<NFrames;f++) {
+		drift[f] = vector3f(0.004f*f, 2.0f*sinf(f*0.01f), 0);
+		for (int b=0;b<NBeads;b++) {
+			ImageData roi(&frame.data[b*cfg.width*cfg.height], cfg.width, cfg.height);
+			GenerateTestImage(roi, cfg.width/2 + drift[f].x + (b%3), cfg.height/2 + drift[f].y - (b%2), 1, 0.0f);
+		}
+		LocalizationJob job(f, 0, 0, 0);
+		trk.ScheduleFrame(frame.data, sizeof(float)*cfg.width, cfg.width, cfg.height*NBeads, &rois[0], NBeads, QTrkFloat, &job);
+	}
+	trk.Flush();
+	while (rm->GetFrameCounters().processedFrames < NFrames)
+		Threads::Sleep(1);
+
+	std::vector<vector3f> measured(NFrames);
+	int n = rm->GetDrift(0, NFrames, &measured[0]);
+	std::vector<LocalizationResult> first(NBeads), last(NBeads);
+	rm->GetResults(&first[0], 0, 1);
+	rm->GetResults(&last[0], NFrames-1, 1);
+
+	double driftErr = 0, beadErr = 0;
+	for (int f=0;f<n;f++)
+		driftErr = std::max(driftErr, (double)(measured[f] - (drift[f] - drift[0])).length());
+	for (int b=0;b<NBeads;b++)
+		beadErr = std::max(beadErr, (double)(first[b].pos - last[b].pos).length());
+	dbgprintf("Drift correction: %d frames, max drift error %f, max corrected bead motion %f (uncorrected: %f)\n", n, driftErr, beadErr,
+		(drift[NFrames-1] - drift[0]).length());
+
+	rm->SetTracker(0);
+	delete rm;
+	frame.free();
+}
+
 int main()
 {
 #ifdef _DEBUG
 //	Matrix3X3::test();
 #endif
 //	SimpleTest();
+//	TestZLUTPCA();
+//	TestBatchedZ();
+//	TestZLUTBiasInverse();
+//	TestModeProfiles();
+//	TestBeadAffinity();
+//	TestLUTBuildSpeed();
+//	TestImageLUT();
+//	TestSharedLUT();
+//	TestLUTLibrary();
+//	TestStateSnapshot();
+//	TestPixelCalibrationMap();
+//	TestPixelBinnedProfile();
+//	TestQuadrantProfiles();
+//	TestResultWriter();
+//	TestResultFileReader();
+//	TestResultColumnFile();
+//	TestResultSink();
+//	TestResultStream();
+//	TestBeadStatistics();
+//	TestDriftCorrection();
 
 //	GenerateZLUTFittingCurve("lut000.jpg");
 
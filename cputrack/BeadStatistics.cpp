@@ -0,0 +1,123 @@
+#include "std_incl.h"
+#include "BeadStatistics.h"
+#include <limits>
+
+BeadStatisticsAccumulator::BeadStatisticsAccumulator(int numBeads, int numOctaves)
+{
+	this->numOctaves = std::max(1, std::min(numOctaves, BEADSTATS_MAX_OCTAVES));
+	beads.resize(numBeads);
+	Reset();
+}
+
+void BeadStatisticsAccumulator::ClearBead(Bead& b)
+{
+	b.samples = b.errors = b.missing = 0;
+	b.lastFrame = -1;
+	b.meanT = b.m2T = 0;
+	for (int a=0;a<3;a++)
+		b.mean[a] = b.m2[a] = b.cov[a] = 0;
+	Octave empty = {};
+	b.octaves.assign(numOctaves, empty);
+}
+
+void BeadStatisticsAccumulator::Reset()
+{
+	for (uint i=0;i<beads.size();i++)
+		ClearBead(beads[i]);
+}
+
+void BeadStatisticsAccumulator::RemoveBead(int bead)
+{
+	if (bead < 0 || bead >= (int)beads.size())
+		return;
+	beads.erase(beads.begin()+bead);
+	beads.push_back(Bead());
+	ClearBead(beads.back());
+}
+
+void BeadStatisticsAccumulator::Add(int bead, int frame, const LocalizationResult* r)
+{
+	Bead& b = beads[bead];
+	if (!r)
+		b.missing++;
+	else if (r->error)
+		b.errors++;
+	else
+		AddSample(b, frame, r->pos);
+}
+
+void BeadStatisticsAccumulator::AddSample(Bead& b, int frame, const vector3f& pos)
+{
+	double v[3] = { pos.x, pos.y, pos.z };
+
+	// Welford, with the co-moment of frame number and position for the drift slope
+	b.samples++;
+	double dt = frame - b.meanT;
+	b.meanT += dt / b.samples;
+	b.m2T += dt * (frame - b.meanT);
+	for (int a=0;a<3;a++) {
+		double d = v[a] - b.mean[a];
+		b.mean[a] += d / b.samples;
+		b.m2[a] += d * (v[a] - b.mean[a]);
+		b.cov[a] += dt * (v[a] - b.mean[a]);
+	}
+	b.lastFrame = frame;
+
+	// Octave k holds averages over 2^k frames. Consecutive averages give the Allan variance at that tau,
+	// and every two of them form one average of the next octave.
+	for (int k=0;k<numOctaves;k++) {
+		Octave& o = b.octaves[k];
+		if (o.hasPrev) {
+			for (int a=0;a<3;a++) {
+				double d = v[a] - o.prev[a];
+				o.sumSq[a] += d*d;
+			}
+			o.pairs++;
+		}
+		for (int a=0;a<3;a++)
+			o.prev[a] = v[a];
+		o.hasPrev = true;
+
+		if (!o.hasPending) {
+			for (int a=0;a<3;a++)
+				o.pending[a] = v[a];
+			o.hasPending = true;
+			break;
+		}
+		for (int a=0;a<3;a++)
+			v[a] = 0.5 * (o.pending[a] + v[a]);
+		o.hasPending = false;
+	}
+}
+
+BeadStatistics BeadStatisticsAccumulator::Get(int bead)
+{
+	const Bead& b = beads[bead];
+	BeadStatistics s;
+	s.samples = b.samples;
+	s.errors = b.errors;
+	s.missing = b.missing;
+	s.lastFrame = b.lastFrame;
+
+	float stdev[3], drift[3];
+	for (int a=0;a<3;a++) {
+		stdev[a] = b.samples > 1 ? (float)sqrt(b.m2[a] / (b.samples-1)) : 0.0f;
+		drift[a] = b.m2T > 0 ? (float)(b.cov[a] / b.m2T) : 0.0f;
+	}
+	s.mean = vector3f((float)b.mean[0], (float)b.mean[1], (float)b.mean[2]);
+	s.stdev = vector3f(stdev[0], stdev[1], stdev[2]);
+	s.drift = vector3f(drift[0], drift[1], drift[2]);
+	return s;
+}
+
+int BeadStatisticsAccumulator::GetAllanDeviation(int bead, float* adev, int maxOctaves)
+{
+	const Bead& b = beads[bead];
+	int n = std::min(maxOctaves, numOctaves);
+	for (int k=0;k<n;k++) {
+		const Octave& o = b.octaves[k];
+		for (int a=0;a<3;a++)
+			adev[k*3+a] = o.pairs > 0 ? (float)sqrt(0.5 * o.sumSq[a] / o.pairs) : std::numeric_limits<float>::quiet_NaN();
+	}
+	return n;
+}
@@ -0,0 +1,58 @@
+// Per-bead statistics that ResultManager updates as frames complete, so quality control does not need a second pass over the traces.
+#pragma once
+
+#include "qtrk_c_api.h"
+#include <vector>
+
+#define BEADSTATS_MAX_OCTAVES 24
+
+// Labview interface packing
+#pragma pack(push,1)
+struct BeadStatistics
+{
+	int samples; // frames with a valid result
+	int errors; // frames where the result has an error (boundary hit). These are not included in the position statistics.
+	int missing; // frames without a result for this bead
+	int lastFrame; // last frame with a valid result, -1 if none
+	vector3f mean, stdev;
+	vector3f drift; // least squares slope of the position [units/frame]
+};
+#pragma pack(pop)
+
+// Online accumulators: Welford mean and variance, the drift slope, and the non-overlapping Allan variance at taus of 1, 2, 4, ... frames.
+// Every octave averages pairs of values of the octave below, so a sample costs O(1) amortized for all octaves together.
+// Frames must be added in order. Frames without a valid result are skipped, the Allan variance treats the remaining samples as contiguous.
+class BeadStatisticsAccumulator
+{
+public:
+	BeadStatisticsAccumulator(int numBeads, int numOctaves=16);
+
+	void Reset();
+	void Add(int bead, int frame, const LocalizationResult* r); // r is null if the bead has no result in this frame
+	void RemoveBead(int bead); // beads after it move down one index, like ResultManager::RemoveBeadResults
+
+	int NumBeads() { return beads.size(); }
+	int NumOctaves() { return numOctaves; }
+	BeadStatistics Get(int bead);
+	// Allan deviation at tau = 2^octave frames, adev[octave*3+axis] for octave < min(maxOctaves, NumOctaves()).
+	// NaN for octaves with too few samples. Returns the number of octaves written.
+	int GetAllanDeviation(int bead, float* adev, int maxOctaves);
+
+private:
+	struct Octave {
+		double prev[3], pending[3], sumSq[3];
+		int pairs;
+		bool hasPrev, hasPending;
+	};
+	struct Bead {
+		int samples, errors, missing, lastFrame;
+		double meanT, m2T; // frame number
+		double mean[3], m2[3], cov[3]; // cov: co-moment of frame number and position
+		std::vector<Octave> octaves;
+	};
+	void AddSample(Bead& b, int frame, const vector3f& pos);
+	void ClearBead(Bead& b);
+
+	int numOctaves;
+	std::vector<Bead> beads;
+};
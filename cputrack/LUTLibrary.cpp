@@ -0,0 +1,355 @@
+#include "std_incl.h"
+#include "LUTLibrary.h"
+#include "utils.h"
+
+#ifdef WIN32
+#include <windows.h>
+#undef min
+#undef max
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static int64_t AlignLUTLibOffset(int64_t pos)
+{
+	return (pos + LUTLIB_ALIGN - 1) / LUTLIB_ALIGN * LUTLIB_ALIGN;
+}
+
+LUTLibrary::LUTLibrary()
+{
+	base = 0;
+	size = 0;
+#ifdef WIN32
+	file = mapping = 0;
+#else
+	fd = -1;
+#endif
+}
+
+LUTLibrary::~LUTLibrary()
+{
+#ifdef WIN32
+	if (base) UnmapViewOfFile(base);
+	if (mapping) CloseHandle(mapping);
+	if (file) CloseHandle(file);
+#else
+	if (base) munmap((void*)base, size);
+	if (fd >= 0) close(fd);
+#endif
+}
+
+void LUTLibrary::Save(const char* filename, QueuedTracker* qtrk, bool fullState)
+{
+	std::vector<LUTLibrarySection> sections;
+	std::vector<const void*> sectionData;
+
+	auto addSection = [&](uint type, const void* data, int64_t nbytes, int d0, int d1, int d2, int d3) {
+		LUTLibrarySection s = {};
+		s.type = type;
+		s.dims[0] = d0; s.dims[1] = d1; s.dims[2] = d2; s.dims[3] = d3;
+		s.size = nbytes;
+		sections.push_back(s);
+		sectionData.push_back(data);
+	};
+
+	QTrkSettings settings = qtrk->cfg;
+	addSection(LUTLibSettings, &settings, sizeof(settings), 1, 0, 0, 0);
+
+	int count, planes, rsteps;
+	qtrk->GetRadialZLUTSize(count, planes, rsteps);
+	std::vector<float> zlut(count*planes*rsteps);
+	if (!zlut.empty()) {
+		qtrk->GetRadialZLUT(&zlut[0]);
+		addSection(LUTLibRadialZLUT, &zlut[0], sizeof(float)*zlut.size(), count, planes, rsteps, 0);
+	}
+
+	int dims[4] = {};
+	qtrk->GetImageZLUTSize(dims);
+	std::vector<float> imageLUT(dims[0]*dims[1]*dims[2]*dims[3]);
+	if (!imageLUT.empty()) {
+		qtrk->GetImageZLUT(&imageLUT[0]);
+		addSection(LUTLibImageLUT, &imageLUT[0], sizeof(float)*imageLUT.size(), dims[0], dims[1], dims[2], dims[3]);
+	}
+
+	std::vector<float> weights(qtrk->cfg.zlut_radialsteps);
+	if (qtrk->GetRadialWeights(&weights[0]))
+		addSection(LUTLibRadialWeights, &weights[0], sizeof(float)*weights.size(), weights.size(), 0, 0, 0);
+
+	std::vector<int> beadLUT;
+	qtrk->GetBeadLUTMapping(beadLUT);
+	if (!beadLUT.empty())
+		addSection(LUTLibBeadLUTMapping, &beadLUT[0], sizeof(int)*beadLUT.size(), beadLUT.size(), 0, 0, 0);
+
+	std::unique_ptr<CImageData> bias(qtrk->GetZLUTBiasCorrection());
+	if (bias)
+		addSection(LUTLibZBiasCorrection, bias->data, sizeof(float)*bias->numPixels(), bias->w, bias->h, 0, 0);
+
+	std::string configText;
+	LocMode_t modes[QTRK_MAX_MODE_PROFILES];
+	std::vector<float> calibOffset, calibGain;
+	float calibFactors[2];
+	if (fullState) {
+		QueuedTracker::ConfigValueMap cv = qtrk->GetConfigValues();
+		for (auto i = cv.begin(); i != cv.end(); ++i)
+			configText += i->first + "=" + i->second + "\n";
+		if (!configText.empty())
+			addSection(LUTLibConfigValues, configText.c_str(), configText.size(), configText.size(), 0, 0, 0);
+
+		for (int i=0;i<QTRK_MAX_MODE_PROFILES;i++)
+			modes[i] = qtrk->GetLocalizationModeProfile(i);
+		addSection(LUTLibModeProfiles, modes, sizeof(modes), QTRK_MAX_MODE_PROFILES, 0, 0, 0);
+
+		int npix = qtrk->cfg.width * qtrk->cfg.height;
+		qtrk->GetPixelCalibrationImages(calibOffset, calibGain);
+		if (!calibOffset.empty())
+			addSection(LUTLibPixelCalibOffset, &calibOffset[0], sizeof(float)*calibOffset.size(), calibOffset.size()/npix, qtrk->cfg.height, qtrk->cfg.width, 0);
+		if (!calibGain.empty())
+			addSection(LUTLibPixelCalibGain, &calibGain[0], sizeof(float)*calibGain.size(), calibGain.size()/npix, qtrk->cfg.height, qtrk->cfg.width, 0);
+
+		qtrk->GetPixelCalibrationFactors(calibFactors[0], calibFactors[1]);
+		addSection(LUTLibPixelCalibFactors, calibFactors, sizeof(calibFactors), 2, 0, 0, 0);
+	}
+
+	LUTLibraryHeader hdr;
+	hdr.magic = LUTLIB_MAGIC;
+	hdr.version = LUTLIB_VERSION;
+	hdr.numSections = sections.size();
+	hdr.sectionSize = sizeof(LUTLibrarySection);
+
+	int64_t pos = AlignLUTLibOffset(sizeof(hdr) + sizeof(LUTLibrarySection) * sections.size());
+	for (uint i=0;i<sections.size();i++) {
+		sections[i].offset = pos;
+		pos = AlignLUTLibOffset(pos + sections[i].size);
+	}
+
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+		throw std::runtime_error(SPrintf("Can't open %s for writing", filename));
+
+	static const char zeros[LUTLIB_ALIGN] = {};
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	int64_t written = sizeof(hdr);
+	if (!sections.empty()) {
+		fwrite(&sections[0], sizeof(LUTLibrarySection), sections.size(), f);
+		written += sizeof(LUTLibrarySection) * sections.size();
+	}
+	for (uint i=0;i<sections.size();i++) {
+		fwrite(zeros, 1, sections[i].offset - written, f);
+		fwrite(sectionData[i], 1, sections[i].size, f);
+		written = sections[i].offset + sections[i].size;
+	}
+	bool failed = ferror(f) != 0;
+	fclose(f);
+
+	if (failed)
+		throw std::runtime_error(SPrintf("Failed to write LUT library %s", filename));
+}
+
+std::shared_ptr<LUTLibrary> LUTLibrary::Open(const char* filename)
+{
+	std::shared_ptr<LUTLibrary> lib(new LUTLibrary());
+
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE)
+		throw std::runtime_error(SPrintf("Can't open %s", filename));
+	lib->file = file;
+
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(file, &fileSize);
+	lib->size = fileSize.QuadPart;
+
+	if (lib->size > 0) {
+		lib->mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+		if (lib->mapping)
+			lib->base = (const uchar*)MapViewOfFile(lib->mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!lib->base)
+			throw std::runtime_error(SPrintf("Can't map %s", filename));
+	}
+#else
+	lib->fd = open(filename, O_RDONLY);
+	if (lib->fd < 0)
+		throw std::runtime_error(SPrintf("Can't open %s", filename));
+
+	struct stat st;
+	fstat(lib->fd, &st);
+	lib->size = st.st_size;
+
+	if (lib->size > 0) {
+		void* p = mmap(0, lib->size, PROT_READ, MAP_SHARED, lib->fd, 0);
+		if (p == MAP_FAILED)
+			throw std::runtime_error(SPrintf("Can't map %s", filename));
+		lib->base = (const uchar*)p;
+	}
+#endif
+
+	if (lib->size < (int64_t)sizeof(LUTLibraryHeader))
+		throw std::runtime_error(SPrintf("%s is not a LUT library", filename));
+
+	const LUTLibraryHeader* hdr = (const LUTLibraryHeader*)lib->base;
+	if (hdr->magic != LUTLIB_MAGIC)
+		throw std::runtime_error(SPrintf("%s is not a LUT library", filename));
+	if (hdr->version > LUTLIB_VERSION)
+		throw std::runtime_error(SPrintf("LUT library %s has version %d, only up to version %d is supported", filename, hdr->version, LUTLIB_VERSION));
+
+	if (hdr->sectionSize < sizeof(LUTLibrarySection) || sizeof(*hdr) + (int64_t)hdr->sectionSize * hdr->numSections > lib->size)
+		throw std::runtime_error(SPrintf("LUT library %s has an invalid section table", filename));
+
+	const uchar* table = lib->base + sizeof(*hdr);
+	for (uint i=0;i<hdr->numSections;i++) {
+		LUTLibrarySection s = *(const LUTLibrarySection*)&table[i * hdr->sectionSize];
+		if (s.offset < 0 || s.size < 0 || s.offset % LUTLIB_ALIGN != 0 || s.offset + s.size > lib->size)
+			throw std::runtime_error(SPrintf("LUT library %s is truncated or corrupt", filename));
+		lib->sections.push_back(s);
+	}
+
+	return lib;
+}
+
+const LUTLibrarySection* LUTLibrary::FindSection(uint type)
+{
+	for (uint i=0;i<sections.size();i++)
+		if (sections[i].type == type)
+			return &sections[i];
+	return 0;
+}
+
+const QTrkSettings* LUTLibrary::GetSettings()
+{
+	const LUTLibrarySection* s = FindSection(LUTLibSettings);
+	if (!s || s->size < (int64_t)sizeof(QTrkSettings))
+		return 0;
+	return (const QTrkSettings*)SectionData(s);
+}
+
+const float* LUTLibrary::GetRadialZLUT(int& count, int& planes, int& radialsteps)
+{
+	const LUTLibrarySection* s = FindSection(LUTLibRadialZLUT);
+	if (!s) {
+		count = planes = radialsteps = 0;
+		return 0;
+	}
+	count = s->dims[0];
+	planes = s->dims[1];
+	radialsteps = s->dims[2];
+	return SectionData(s);
+}
+
+const float* LUTLibrary::GetImageLUT(int* dims)
+{
+	const LUTLibrarySection* s = FindSection(LUTLibImageLUT);
+	for (int i=0;i<4;i++)
+		dims[i] = s ? s->dims[i] : 0;
+	return s ? SectionData(s) : 0;
+}
+
+const float* LUTLibrary::GetRadialWeights(int& radialsteps)
+{
+	const LUTLibrarySection* s = FindSection(LUTLibRadialWeights);
+	radialsteps = s ? s->dims[0] : 0;
+	return s ? SectionData(s) : 0;
+}
+
+const float* LUTLibrary::GetZBiasCorrection(int& w, int& h)
+{
+	const LUTLibrarySection* s = FindSection(LUTLibZBiasCorrection);
+	w = s ? s->dims[0] : 0;
+	h = s ? s->dims[1] : 0;
+	return s ? SectionData(s) : 0;
+}
+
+const int* LUTLibrary::GetBeadLUTMapping(int& numBeads)
+{
+	const LUTLibrarySection* s = FindSection(LUTLibBeadLUTMapping);
+	numBeads = s ? s->dims[0] : 0;
+	return s ? (const int*)SectionData(s) : 0;
+}
+
+QueuedTracker::ConfigValueMap LUTLibrary::GetConfigValues()
+{
+	QueuedTracker::ConfigValueMap cv;
+	const LUTLibrarySection* s = FindSection(LUTLibConfigValues);
+	if (!s)
+		return cv;
+
+	const char* text = (const char*)SectionData(s), *end = text + s->size;
+	while (text < end) {
+		const char* eol = std::find(text, end, '\n');
+		const char* sep = std::find(text, eol, '=');
+		if (sep != eol)
+			cv[std::string(text, sep)] = std::string(sep+1, eol);
+		text = eol+1;
+	}
+	return cv;
+}
+
+bool LUTLibrary::GetModeProfiles(LocMode_t* dst)
+{
+	const LUTLibrarySection* s = FindSection(LUTLibModeProfiles);
+	if (!s)
+		return false;
+	const LocMode_t* modes = (const LocMode_t*)SectionData(s);
+	for (int i=0;i<QTRK_MAX_MODE_PROFILES;i++)
+		dst[i] = i < s->dims[0] ? modes[i] : (LocMode_t)0;
+	return true;
+}
+
+const float* LUTLibrary::GetPixelCalibration(uint type, int& count)
+{
+	const LUTLibrarySection* s = FindSection(type);
+	count = s ? s->dims[0] : 0;
+	return s ? SectionData(s) : 0;
+}
+
+bool LUTLibrary::GetPixelCalibrationFactors(float& offsetFactor, float& gainFactor)
+{
+	const LUTLibrarySection* s = FindSection(LUTLibPixelCalibFactors);
+	if (!s)
+		return false;
+	offsetFactor = SectionData(s)[0];
+	gainFactor = SectionData(s)[1];
+	return true;
+}
+
+void LUTLibrary::Validate(const QTrkComputedConfig& cfg)
+{
+	for (uint i=0;i<sections.size();i++) {
+		int64_t nElem = 1;
+		for (int d=0;d<4;d++)
+			if (sections[i].dims[d] > 0) nElem *= sections[i].dims[d];
+		uint elemSize = sections[i].type == LUTLibConfigValues ? 1 : 4;
+		if (sections[i].type != LUTLibSettings && nElem * elemSize > sections[i].size)
+			throw std::runtime_error(SPrintf("LUT library section %d is smaller than its dimensions", i));
+	}
+
+	int count, planes, rsteps;
+	GetRadialZLUT(count, planes, rsteps);
+	if (count > 0 && rsteps != cfg.zlut_radialsteps)
+		throw std::runtime_error(SPrintf("LUT library has %d radial steps, tracker uses zlut_radialsteps=%d", rsteps, cfg.zlut_radialsteps));
+
+	int wsteps;
+	if (GetRadialWeights(wsteps) && wsteps != cfg.zlut_radialsteps)
+		throw std::runtime_error(SPrintf("LUT library radial weights have %d elements, tracker uses zlut_radialsteps=%d", wsteps, cfg.zlut_radialsteps));
+
+	int dims[4];
+	if (GetImageLUT(dims) && (dims[0] != count || dims[1] != planes))
+		throw std::runtime_error("LUT library image LUT and radial ZLUT have different bead or plane counts");
+
+	int numBeads;
+	const int* beadLUT = GetBeadLUTMapping(numBeads);
+	for (int i=0;beadLUT && i<numBeads;i++)
+		if (beadLUT[i] < 0 || beadLUT[i] >= count)
+			throw std::runtime_error(SPrintf("LUT library maps bead %d to LUT %d, but has %d LUTs", i, beadLUT[i], count));
+	if (!beadLUT)
+		numBeads = count;
+
+	uint calibTypes[] = { LUTLibPixelCalibOffset, LUTLibPixelCalibGain };
+	for (int i=0;i<2;i++) {
+		const LUTLibrarySection* s = FindSection(calibTypes[i]);
+		if (s && (s->dims[0] != numBeads || s->dims[1] != cfg.height || s->dims[2] != cfg.width))
+			throw std::runtime_error(SPrintf("LUT library pixel calibration images are %dx%d for %d beads, expected %dx%d for %d beads", s->dims[2], s->dims[1], s->dims[0], cfg.width, cfg.height, numBeads));
+	}
+}
@@ -0,0 +1,84 @@
+// LUT library file: a binary container holding all LUTs of a tracker together with the settings they were built with.
+// Sections are page aligned, so an opened library is memory-mapped read-only and the LUT data is used in place.
+// Several tracker processes opening the same file share a single copy in the page cache.
+// Readers skip section types they do not know, so a state snapshot is also a valid LUT library.
+
+#pragma once
+
+#include "QueuedTracker.h"
+#include <memory>
+
+#define LUTLIB_MAGIC 0x42494c51 // "QLIB"
+#define LUTLIB_VERSION 1
+#define LUTLIB_ALIGN 4096
+
+enum LUTLibrarySectionType {
+	LUTLibSettings = 1, // QTrkSettings
+	LUTLibRadialZLUT = 2, // float [count][planes][radialsteps], dims = { count, planes, radialsteps }
+	LUTLibImageLUT = 3, // float [count][planes][height][width], dims = { count, planes, height, width }
+	LUTLibRadialWeights = 4, // float [radialsteps], dims = { radialsteps }
+	LUTLibZBiasCorrection = 5, // float [count][biasplanes], dims = { biasplanes, count }, see QueuedTracker::SetZLUTBiasCorrection
+	LUTLibBeadLUTMapping = 11, // int [numBeads], dims = { numBeads }, see QueuedTracker::SetBeadLUTMapping
+
+	// State snapshot sections, see QueuedTracker::SaveState
+	LUTLibConfigValues = 6, // text, "name=value" lines from QueuedTracker::GetConfigValues
+	LUTLibModeProfiles = 7, // LocMode_t [QTRK_MAX_MODE_PROFILES]
+	LUTLibPixelCalibOffset = 8, // float [count][height][width], dims = { count, height, width }
+	LUTLibPixelCalibGain = 9, // float [count][height][width], dims = { count, height, width }
+	LUTLibPixelCalibFactors = 10 // float { offsetFactor, gainFactor }
+};
+
+struct LUTLibraryHeader {
+	uint magic;
+	uint version;
+	uint numSections;
+	uint sectionSize; // sizeof(LUTLibrarySection), so readers can skip fields added by newer versions
+};
+
+// The section table directly follows the header
+struct LUTLibrarySection {
+	uint type;
+	uint reserved;
+	int dims[4];
+	int64_t offset; // from the start of the file, multiple of LUTLIB_ALIGN
+	int64_t size; // in bytes
+};
+
+class LUTLibrary {
+public:
+	~LUTLibrary();
+
+	// Writes all LUTs of the tracker to a library file. With fullState, the state snapshot sections are written as well.
+	static void Save(const char* filename, QueuedTracker* qtrk, bool fullState=false);
+	// Maps a library file. The returned library keeps the mapping open for as long as a tracker uses its data.
+	static std::shared_ptr<LUTLibrary> Open(const char* filename);
+
+	const LUTLibrarySection* FindSection(uint type);
+	const float* SectionData(const LUTLibrarySection* s) { return (const float*)(base + s->offset); }
+
+	const QTrkSettings* GetSettings(); // null if the file has no settings section
+	const float* GetRadialZLUT(int& count, int& planes, int& radialsteps);
+	const float* GetImageLUT(int* dims);
+	const float* GetRadialWeights(int& radialsteps);
+	const float* GetZBiasCorrection(int& w, int& h);
+	const int* GetBeadLUTMapping(int& numBeads); // null if every bead has its own LUT
+
+	QueuedTracker::ConfigValueMap GetConfigValues();
+	bool GetModeProfiles(LocMode_t* dst); // dst = [QTRK_MAX_MODE_PROFILES]
+	const float* GetPixelCalibration(uint type, int& count); // type is LUTLibPixelCalibOffset or LUTLibPixelCalibGain
+	bool GetPixelCalibrationFactors(float& offsetFactor, float& gainFactor);
+
+	// Throws if the LUTs can not be used with the given tracker settings
+	void Validate(const QTrkComputedConfig& cfg);
+
+private:
+	LUTLibrary();
+	const uchar* base;
+	int64_t size;
+	std::vector<LUTLibrarySection> sections;
+#ifdef WIN32
+	void* file, *mapping;
+#else
+	int fd;
+#endif
+};
@@ -1,18 +1,39 @@
 #include "std_incl.h"
 #include "QueuedCPUTracker.h"
+#include "LUTLibrary.h"
 #include <float.h>
 #include <functional>
 
 #include "DebugResultCompare.h"
 
 #ifndef CUDA_TRACK
-QueuedTracker* CreateQueuedTracker(const QTrkComputedConfig& cc){ 
+QueuedTracker* CreateQueuedTracker(const QTrkComputedConfig& cc){
 	return new QueuedCPUTracker(cc);
 }
 void SetCUDADevices(int* dev, int ndev) {
 }
 #endif
 
+QueuedCPUTracker::State::State()
+{
+	version = 0;
+	lutModeFlags = LT_OnlyCOM;
+	zlut_count = zlut_planes = 0;
+	zlut_pca_k = 0;
+	for (int i=0;i<4;i++) image_lut_dims[i]=0;
+	image_lut_dz_elems = 0;
+}
+
+std::shared_ptr<float> QueuedCPUTracker::AllocFloats(int n, const float* src)
+{
+	std::shared_ptr<float> p(new float[n], std::default_delete<float[]>());
+	if (src)
+		std::copy(src, src+n, p.get());
+	else
+		std::fill(p.get(), p.get()+n, 0.0f);
+	return p;
+}
+
 bool QueuedCPUTracker::IsIdle()
 {
 	return GetQueueLength() == 0;
@@ -45,18 +66,62 @@ void QueuedCPUTracker::JobFinished(QueuedCPUTracker::Job* j)
 	jobs_mutex.unlock();
 }
 
-QueuedCPUTracker::Job* QueuedCPUTracker::GetNextJob()
+// Takes up to maxJobs jobs, but leaves enough in the queue to keep the other threads busy.
+// Jobs come from the worker's home queue first, and are stolen from the other queues when it is empty.
+int QueuedCPUTracker::GetNextJobs(int worker, Job** dst, int maxJobs)
 {
-	QueuedCPUTracker::Job *j = 0;
+	int count = 0;
 	jobs_mutex.lock();
-	if (!jobs.empty()) {
-		j = jobs.front();
-		jobs.pop_front();
-		jobCount --;
-		jobsInProgress ++;
+	int share = (jobCount + threads.size() - 1) / threads.size();
+	maxJobs = std::min(maxJobs, std::max(1, share));
+	int nq = jobQueues.size(), home = HomeQueue(worker);
+	for (int k=0;k<nq && count<maxJobs;k++) {
+		std::deque<Job*>& q = jobQueues[(home+k) % nq];
+		while (count < maxJobs && !q.empty()) {
+			dst[count++] = q.front();
+			q.pop_front();
+		}
 	}
+	jobCount -= count;
+	jobsInProgress += count;
 	jobs_mutex.unlock();
-	return j;
+	return count;
+}
+
+int QueuedCPUTracker::HomeQueue(int worker)
+{
+	if (affinityMode == AffinityWorker)
+		return worker;
+	if (affinityMode == AffinityDomain)
+		return std::min((int)jobQueues.size()-1, worker / affinityDomainSize);
+	return 0;
+}
+
+void QueuedCPUTracker::SetAffinityMode(int mode, int domainSize)
+{
+	jobs_mutex.lock();
+	std::deque<Job*> all;
+	for (int i=0;i<jobQueues.size();i++)
+		all.insert(all.end(), jobQueues[i].begin(), jobQueues[i].end());
+
+	affinityMode = mode;
+	affinityDomainSize = std::max(1, domainSize);
+	int nq = 1;
+	if (mode == AffinityWorker)
+		nq = threads.size();
+	else if (mode == AffinityDomain)
+		nq = (threads.size() + affinityDomainSize - 1) / affinityDomainSize;
+	jobQueues.clear();
+	jobQueues.resize(nq);
+
+	for (int i=0;i<all.size();i++)
+		jobQueues[BeadQueue(all[i]->job.zlutIndex)].push_back(all[i]);
+	jobs_mutex.unlock();
+
+	// Keep workers on a fixed core, so the beads they own stay in that core's cache
+	for (int k=0;k<threads.size();k++)
+		if (!Threads::SetAffinity(threads[k].thread, mode == AffinityOff ? -1 : k))
+			dbgprintf("Failed to set the CPU affinity of worker %d\n", k);
 }
 
 QueuedCPUTracker::Job* QueuedCPUTracker::AllocateJob()
@@ -66,7 +131,7 @@ QueuedCPUTracker::Job* QueuedCPUTracker::AllocateJob()
 	if (!jobs_buffer.empty()) {
 		j = jobs_buffer.back();
 		jobs_buffer.pop_back();
-	} else 
+	} else
 		j = new Job;
 	jobs_buffer_mutex.unlock();
 	return j;
@@ -75,7 +140,7 @@ QueuedCPUTracker::Job* QueuedCPUTracker::AllocateJob()
 void QueuedCPUTracker::AddJob(Job* j)
 {
 	jobs_mutex.lock();
-	jobs.push_back(j);
+	jobQueues[BeadQueue(j->job.zlutIndex)].push_back(j);
 	jobCount++;
 	jobs_mutex.unlock();
 }
@@ -87,14 +152,14 @@ int QueuedCPUTracker::GetQueueLength(int *maxQueueLength)
 	jc = jobCount + jobsInProgress;
 	jobs_mutex.unlock();
 
-	if (maxQueueLength) 
+	if (maxQueueLength)
 		*maxQueueLength = this->maxQueueSize;
 
 	return jc;
 }
 
-QueuedCPUTracker::QueuedCPUTracker(const QTrkComputedConfig& cc) 
-	: jobs_mutex("jobs"), jobs_buffer_mutex("jobs_buffer"), results_mutex("results")
+QueuedCPUTracker::QueuedCPUTracker(const QTrkComputedConfig& cc)
+	: jobs_mutex("jobs"), jobs_buffer_mutex("jobs_buffer"), results_mutex("results"), state_mutex("state")
 {
 	cfg = cc;
 	quitWork = false;
@@ -102,30 +167,35 @@ QueuedCPUTracker::QueuedCPUTracker(const QTrkComputedConfig& cc)
 	if (cfg.numThreads < 0) {
 		cfg.numThreads = Threads::GetCPUCount();
 		dbgprintf("Using %d threads\n", cfg.numThreads);
-	} 
+	}
 
 	maxQueueSize = std::max(2,cfg.numThreads) * 50;
 	jobCount = 0;
 	resultCount = 0;
 
-	zlut_cmpprofiles = 0;
 	zlut_enablecmpprof = false;
-	zluts = 0;
-	zlut_count = zlut_planes = 0;
+	cmpProfileCount = 0;
+	zlut_buildflags = 0;
+	lutJobsPending = 0;
+	lutJobsRejected = 0;
+	lutBuildCount = lutBuildPlanes = 0;
+	zlut_pca_components = 10;
+	zlut_batchsize = 32;
+	image_lut_iterations = 5;
+	affinityMode = AffinityOff;
+	affinityDomainSize = 1;
+	jobQueues.resize(1);
 	processJobs = false;
 	jobsInProgress = 0;
 	dbgPrintResults = false;
 
 	qi_radialbinweights = ComputeRadialBinWindow(cfg.qi_radialsteps);
-	
-	calib_gain = calib_offset = 0;
+
 	gc_gainFactor = gc_offsetFactor = 1.0f;
-	localizeMode = LT_OnlyCOM;
 
-	for (int i=0;i<4;i++) image_lut_dims[i]=0;
-	image_lut_nElem_per_bead=0;
-	image_lut = 0;
-	image_lut_dz = image_lut_dz2 = 0;
+	lastStateVersion = 0;
+	state = new State();
+	workerStateVersion = 0;
 
 	downsampleWidth = cfg.width >> cfg.downsample;
 	downsampleHeight = cfg.height >> cfg.downsample;
@@ -145,49 +215,104 @@ QueuedCPUTracker::~QueuedCPUTracker()
 	}
 
 	// free job memory
-	DeleteAllElems(jobs);
+	for (int i=0;i<jobQueues.size();i++)
+		DeleteAllElems(jobQueues[i]);
 	DeleteAllElems(jobs_buffer);
 
-	delete[] calib_gain;
-	delete[] calib_offset;
-	if (zluts) delete[] zluts;
-	if (zlut_cmpprofiles) delete[] zlut_cmpprofiles;
-	if (image_lut) delete[] image_lut;
-	if (image_lut_dz) delete[] image_lut_dz;
-	if (image_lut_dz2) delete[] image_lut_dz2;
+	delete state.load();
+	DeleteAllElems(retiredStates);
+	delete[] workerStateVersion;
 }
 
-void QueuedCPUTracker::SetPixelCalibrationImages(float* offset, float* gain)
+// Announce the last published version before loading the state, so nothing is read from a state that may already be deleted.
+// lastStateVersion is stored after the state is published, so the state loaded afterwards is that version or a newer one.
+// A CommitStateUpdate that retires it comes after our announcement, so its ReclaimStates keeps it.
+const QueuedCPUTracker::State* QueuedCPUTracker::AcquireState(Thread* th)
 {
-	if (zlut_count > 0) {
-		int nelem = cfg.width*cfg.height*zlut_count;
+	workerStateVersion[th->index].store(lastStateVersion.load());
+	return state.load();
+}
 
-		if (calib_gain == 0 && gain)  {
-			calib_gain = new float[nelem];
-			memcpy(calib_gain, gain, sizeof(float)*nelem);
-		}
-		else if (calib_gain && gain == 0) {
-			delete[] calib_gain;
-			calib_gain = 0;
-		}
+void QueuedCPUTracker::ReleaseState(Thread* th)
+{
+	workerStateVersion[th->index].store(WorkerIdle);
+}
 
-		if (calib_offset == 0 && offset) {
-			calib_offset = new float[nelem];
-			memcpy(calib_offset, offset, sizeof(float)*nelem);
-		}
-		else if (calib_offset && offset == 0) {
-			delete[] calib_offset;
-			calib_offset = 0;
-		}
+QueuedCPUTracker::State* QueuedCPUTracker::BeginStateUpdate()
+{
+	state_mutex.lock();
+	return new State(*state.load());
+}
+
+void QueuedCPUTracker::CommitStateUpdate(State* s)
+{
+	s->version = lastStateVersion + 1;
+	retiredStates.push_back(state.exchange(s));
+	lastStateVersion.store(s->version);
+	ReclaimStates();
+	state_mutex.unlock();
+}
+
+// Copy of the current state for use on the API side. The shared buffers stay valid for as long as the copy exists.
+QueuedCPUTracker::State QueuedCPUTracker::GetStateCopy()
+{
+	state_mutex.lock();
+	State s = *state.load();
+	state_mutex.unlock();
+	return s;
+}
+
+// Delete retired states that no worker can still be using. Called with state_mutex locked.
+void QueuedCPUTracker::ReclaimStates()
+{
+	int oldestInUse = WorkerIdle;
+	for (int i=0;i<threads.size();i++)
+		oldestInUse = std::min(oldestInUse, workerStateVersion[i].load());
+
+	for (std::list<State*>::iterator i = retiredStates.begin(); i != retiredStates.end(); ) {
+		if ((*i)->version < oldestInUse) {
+			delete *i;
+			i = retiredStates.erase(i);
+		} else
+			++i;
+	}
+}
+
+// Point the thread's tracker to the ZLUT data of the given state version
+void QueuedCPUTracker::BindState(Thread* th, const State* st)
+{
+	if (th->boundStateVersion == st->version)
+		return;
+
+	CPUTracker* trk = th->tracker;
+	trk->SetRadialZLUT(st->zluts.get(), st->zlut_planes, cfg.zlut_radialsteps, st->zlut_count, cfg.zlut_minradius, cfg.zlut_maxradius, false, false);
+	trk->SetRadialWeights(st->zcmp.get());
+	trk->SetRadialZLUTBasis(st->zlut_pca.get(), st->zlut_pca_k);
+	th->boundStateVersion = st->version;
+}
+
+void QueuedCPUTracker::SetPixelCalibrationImages(float* offset, float* gain)
+{
+	State* s = BeginStateUpdate();
+	s->calib = PixelCalibration::FromBeadImages(offset, gain, cfg.width, cfg.height, s->BeadCount());
 
 #ifdef _DEBUG
-		std::string path = GetLocalModulePath();
-		for (int i=0;i<zlut_count;i++) {
-			if(calib_gain) FloatToJPEGFile( SPrintf("%s/gain-bead%d.jpg", path.c_str(), i).c_str(), &calib_gain[cfg.width*cfg.height*i], cfg.width,cfg.height);
-			if(calib_offset) FloatToJPEGFile( SPrintf("%s/offset-bead%d.jpg", path.c_str(), i).c_str(), &calib_offset[cfg.width*cfg.height*i], cfg.width,cfg.height);
-		}
-#endif
+	std::string path = GetLocalModulePath();
+	for (int i=0;i<s->BeadCount();i++) {
+		if(gain) FloatToJPEGFile( SPrintf("%s/gain-bead%d.jpg", path.c_str(), i).c_str(), &gain[cfg.width*cfg.height*i], cfg.width,cfg.height);
+		if(offset) FloatToJPEGFile( SPrintf("%s/offset-bead%d.jpg", path.c_str(), i).c_str(), &offset[cfg.width*cfg.height*i], cfg.width,cfg.height);
 	}
+#endif
+	CommitStateUpdate(s);
+}
+
+void QueuedCPUTracker::SetPixelCalibrationMap(float* offset, float* gain, int sensorWidth, int sensorHeight, ROIPosition* roiPositions, int numBeads)
+{
+	std::shared_ptr<PixelCalibration> calib = PixelCalibration::FromSensorMap(offset, gain, sensorWidth, sensorHeight, roiPositions, numBeads, cfg.width, cfg.height);
+
+	State* s = BeginStateUpdate();
+	s->calib = calib;
+	CommitStateUpdate(s);
 }
 
 void QueuedCPUTracker::SetPixelCalibrationFactors(float offsetFactor, float gainFactor)
@@ -199,6 +324,21 @@ void QueuedCPUTracker::SetPixelCalibrationFactors(float offsetFactor, float gain
 }
 
 
+void QueuedCPUTracker::GetPixelCalibrationImages(std::vector<float>& offset, std::vector<float>& gain)
+{
+	State s = GetStateCopy();
+	PixelCalibration::GetImages(s.calib.get(), offset, gain);
+}
+
+void QueuedCPUTracker::GetPixelCalibrationFactors(float& offsetFactor, float& gainFactor)
+{
+	gc_mutex.lock();
+	offsetFactor = gc_offsetFactor;
+	gainFactor = gc_gainFactor;
+	gc_mutex.unlock();
+}
+
+
 void QueuedCPUTracker::Break(bool brk)
 {
 	processJobs = !brk;
@@ -210,6 +350,7 @@ void QueuedCPUTracker::Start()
 	quitWork = false;
 
 	threads.resize(cfg.numThreads);
+	workerStateVersion = new std::atomic<int>[cfg.numThreads];
 	for (int k=0;k<cfg.numThreads;k++) {
 
 		threads[k].mutex = new Threads::Mutex();
@@ -219,7 +360,9 @@ void QueuedCPUTracker::Start()
 #endif
 		threads[k].tracker = new CPUTracker(downsampleWidth, downsampleHeight, cfg.xc1_profileLength);
 		threads[k].manager = this;
+		threads[k].index = k;
 		threads[k].tracker->trackerID = k;
+		workerStateVersion[k].store(WorkerIdle);
 	}
 
 	for (int k=0;k<threads.size();k++) {
@@ -235,14 +378,23 @@ void QueuedCPUTracker::WorkerThreadMain(void* arg)
 	Thread* th = (Thread*)arg;
 	QueuedCPUTracker* this_ = th->manager;
 
+	std::vector<Job*> batch;
+
 	while (!this_->quitWork) {
-		Job* j = 0;
-		if (this_->processJobs) 
-			j = this_->GetNextJob();
+		int count = 0;
+		if (this_->processJobs) {
+			batch.resize(std::max(1, this_->zlut_batchsize));
+			count = this_->GetNextJobs(th->index, &batch[0], batch.size());
+			if (count > 0) {
+				const State* st = this_->AcquireState(th);
+				this_->ProcessJobs(th, &batch[0], count, st);
+				this_->ReleaseState(th);
+			}
+		}
 
-		if (j) {
-			this_->ProcessJob(th, j);
-			this_->JobFinished(j);
+		if (count > 0) {
+			for (int i=0;i<count;i++)
+				this_->JobFinished(batch[i]);
 		} else {
 			Threads::Sleep(1);
 		}
@@ -250,37 +402,18 @@ void QueuedCPUTracker::WorkerThreadMain(void* arg)
 	//dbgprintf("Thread %p ending.\n", arg);
 }
 
-void QueuedCPUTracker::ApplyOffsetGain(CPUTracker* trk, int beadIndex)
+void QueuedCPUTracker::LocalizeXY(CPUTracker* trk, Job* j, const State* st, LocalizationResult& result, bool& boundaryHit)
 {
-	if (calib_offset || calib_gain) {
-		int index = cfg.width*cfg.height*beadIndex;
-
-		//gc_mutex.lock();
-		//float gf = gc_gainFactor, of = gc_offsetFactor;
-		//gc_mutex.unlock();
-		float gf=1,of=1;
-
-		trk->ApplyOffsetGain(calib_offset ? &calib_offset[index] : 0, calib_gain ? &calib_gain[index] : 0, of, gf);
-//		if (j->job.frame%100==0)
-	}
-}
-
-void QueuedCPUTracker::ProcessJob(QueuedCPUTracker::Thread *th, Job* j)
-{
-	CPUTracker* trk = th->tracker;
-	th->lock();
-
-	SetTrackerImage(trk, j);
+	LocMode_t localizeMode = j->localizeMode;
+	SetTrackerImage(trk, j, st);
 
 	if (localizeMode & LT_ClearFirstFourPixels) {
 		trk->srcImage[0]=trk->srcImage[1]=trk->srcImage[2]=trk->srcImage[3]=0;
 	}
 
-	ApplyOffsetGain(trk, j->job.zlutIndex);
-
 //	dbgprintf("Job: id %d, bead %d\n", j->id, j->zlut);
 
-	LocalizationResult result={};
+	result = LocalizationResult();
 	result.job = j->job;
 
 	vector2f com = trk->ComputeMeanAndCOM(cfg.com_bgcorrection);
@@ -289,16 +422,17 @@ void QueuedCPUTracker::ProcessJob(QueuedCPUTracker::Thread *th, Job* j)
 	if (_isnan(com.x) || _isnan(com.y))
 		com = vector2f(cfg.width/2,cfg.height/2);
 
-	bool boundaryHit = false;
+	boundaryHit = false;
 
 	if (localizeMode & LT_XCor1D) {
 		result.firstGuess = com;
 		vector2f resultPos = trk->ComputeXCorInterpolated(com, cfg.xc1_iterations, cfg.xc1_profileWidth, boundaryHit);
 		result.pos.x = resultPos.x;
 		result.pos.y = resultPos.y;
-	} else if (localizeMode & LT_QI ){ 
+	} else if (localizeMode & LT_QI ){
 		result.firstGuess = com;
-		vector2f resultPos = trk->ComputeQI(com, cfg.qi_iterations, cfg.qi_radialsteps, cfg.qi_angstepspq, cfg.qi_angstep_factor, cfg.qi_minradius, cfg.qi_maxradius, boundaryHit, &qi_radialbinweights[0]);
+		vector2f resultPos = trk->ComputeQI(com, cfg.qi_iterations, cfg.qi_radialsteps, cfg.qi_angstepspq, cfg.qi_angstep_factor, cfg.qi_minradius, cfg.qi_maxradius, boundaryHit, &qi_radialbinweights[0],
+			(localizeMode & LT_PixelBinnedProfile) != 0);
 		result.pos.x = resultPos.x;
 		result.pos.y = resultPos.y;
 	} else if (localizeMode & LT_Gaussian2D) {
@@ -310,36 +444,100 @@ void QueuedCPUTracker::ProcessJob(QueuedCPUTracker::Thread *th, Job* j)
 		result.firstGuess.x = result.pos.x = com.x;
 		result.firstGuess.y = result.pos.y = com.y;
 	}
+}
 
-	bool normalizeProfile = (localizeMode & LT_NormalizeProfile)!=0;
+void QueuedCPUTracker::ComputeZProfile(CPUTracker* trk, float* prof, LocMode_t localizeMode, vector2f center, bool& boundaryHit)
+{
+	if (localizeMode & LT_FourierLUT) {
+		trk->FourierRadialProfile(prof,cfg.zlut_radialsteps, cfg.zlut_angularsteps, cfg.zlut_minradius, cfg.zlut_maxradius);
+	} else if (localizeMode & LT_PixelBinnedProfile) {
+		trk->ComputeBinnedRadialProfile(prof, cfg.zlut_radialsteps, cfg.zlut_minradius, cfg.zlut_maxradius, center, &boundaryHit, (localizeMode & LT_NormalizeProfile)!=0);
+	} else {
+		bool normalizeProfile = (localizeMode & LT_NormalizeProfile)!=0;
+		trk->ComputeRadialProfile(prof,cfg.zlut_radialsteps, cfg.zlut_angularsteps, cfg.zlut_minradius, cfg.zlut_maxradius, center, false, &boundaryHit, normalizeProfile );
+	}
+}
+
+// Jobs that only need a single profile compare have their Z stage batched, the others are processed one by one.
+// LUT building jobs are added to the worker's partial LUT. The results of all jobs are passed on together.
+void QueuedCPUTracker::ProcessJobs(Thread* th, Job** jobs, int count, const State* st)
+{
+	th->jobResults.clear();
+	int nbatch = 0;
+	for (int i=0;i<count;i++) {
+		if (jobs[i]->lutPlane >= 0)
+			ProcessLUTJob(th, jobs[i], st);
+		else if (CanBatchZ(st, jobs[i]->localizeMode))
+			std::swap(jobs[nbatch++], jobs[i]);
+		else
+			ProcessJob(th, jobs[i], st);
+	}
+	if (nbatch > 0)
+		ProcessJobBatch(th, jobs, nbatch, st);
+
+	if (!th->jobResults.empty())
+		StoreResults(&th->jobResults[0], th->jobResults.size());
+}
+
+// Passes results to the sink, or queues them for FetchResults if there is none
+void QueuedCPUTracker::StoreResults(const LocalizationResult* r, int count)
+{
+	if (DeliverResults(r, count))
+		return;
+	results_mutex.lock();
+	results.insert(results.end(), r, r+count);
+	resultCount += count;
+	results_mutex.unlock();
+}
+
+void QueuedCPUTracker::ProcessJob(QueuedCPUTracker::Thread *th, Job* j, const State* st)
+{
+	CPUTracker* trk = th->tracker;
+	th->lock();
+	BindState(th, st);
+
+	LocMode_t localizeMode = j->localizeMode;
+	LocalizationResult result;
+	bool boundaryHit;
+	LocalizeXY(trk, j, st, result, boundaryHit);
+
+	int lut = st->LUTIndex(j->job.zlutIndex);
 	if(localizeMode & LT_LocalizeZ) {
 		float* prof=ALLOCA_ARRAY(float,cfg.zlut_radialsteps);
 
 		for (int i=0;i< ((localizeMode & LT_ZLUTAlign) ? 5 : 1) ; i++) {
-			if (localizeMode & LT_FourierLUT) {
-				trk->FourierRadialProfile(prof,cfg.zlut_radialsteps, cfg.zlut_angularsteps, cfg.zlut_minradius, cfg.zlut_maxradius);
-			} else {
-				trk->ComputeRadialProfile(prof,cfg.zlut_radialsteps, cfg.zlut_angularsteps, cfg.zlut_minradius, cfg.zlut_maxradius, result.pos2D(), false, &boundaryHit, normalizeProfile );
-			}
-			float *cmpprof = 0;
-
-			if (zlut_enablecmpprof)
-				cmpprof = &zlut_cmpprofiles[j->job.zlutIndex*zlut_planes];
+			ComputeZProfile(trk, prof, localizeMode, result.pos2D(), boundaryHit);
+			float *cmpprof = CompareProfileBuffer(th, st, lut);
 
 			if (i > 0) {
 				// update with Quadrant Align
-				result.pos = trk->QuadrantAlign(result.pos, j->job.zlutIndex, cfg.qi_angstepspq, boundaryHit);
+				result.pos = trk->QuadrantAlign(result.pos, lut, cfg.qi_angstepspq, boundaryHit);
 			}
-			result.pos.z = trk->LUTProfileCompare(prof, j->job.zlutIndex, cmpprof, CPUTracker::LUTProfMaxQuadraticFit);
+			if ((localizeMode & LT_ZLUTPCA) && st->zlut_pca)
+				result.pos.z = trk->LUTProfileComparePCA(prof, lut, cmpprof);
+			else
+				result.pos.z = trk->LUTProfileCompare(prof, lut, cmpprof, CPUTracker::LUTProfMaxQuadraticFit);
 			//dbgprintf("[%d] x=%f, y=%f, z=%f\n", i, result.pos.x,result.pos.y,result.pos.z);
 		}
 
 		if (localizeMode & LT_LocalizeZWeighted) {
-			result.pos.z = trk->LUTProfileCompareAdjustedWeights(prof, j->job.zlutIndex, result.pos.z);
+			result.pos.z = trk->LUTProfileCompareAdjustedWeights(prof, lut, result.pos.z);
 		}
 
-		if (zlut_bias_correction)
-			result.pos.z = ZLUTBiasCorrection(result.pos.z, zlut_planes, j->job.zlutIndex);
+		result.pos.z = ZLUTBiasCorrection(st->zlut_bias_inverse.get(), result.pos.z, st->zlut_planes, lut);
+	}
+
+	// Refine XYZ against the image LUT, starting from the radial LUT z if there is one
+	if ((localizeMode & LT_ImageLUT) && st->image_lut_dz && lut < st->image_lut_dims[0]) {
+		int offset = st->ImageLUTNElemPerBead() * lut;
+		vector3f initial = result.pos;
+		if (!(localizeMode & LT_LocalizeZ))
+			initial.z = st->image_lut_dims[1] / 2;
+
+		bool imageLUTBoundaryHit;
+		result.pos = trk->ComputeImageLUT(&st->image_lut.get()[offset], &st->image_lut_dz.get()[offset], &st->image_lut_dz2.get()[offset],
+			st->image_lut_dims[1], st->image_lut_dims[3], st->image_lut_dims[2], initial, image_lut_iterations, imageLUTBoundaryHit);
+		boundaryHit = boundaryHit || imageLUTBoundaryHit;
 	}
 
 	if(dbgPrintResults)
@@ -348,86 +546,265 @@ void QueuedCPUTracker::ProcessJob(QueuedCPUTracker::Thread *th, Job* j)
 	th->unlock();
 
 	result.error = boundaryHit ? 1 : 0;
-
-	results_mutex.lock();
-	results.push_back(result);
-	resultCount++;
-	results_mutex.unlock();
+	th->jobResults.push_back(result);
 }
 
+// Modes that only do a single profile compare per job can have their Z stage batched
+bool QueuedCPUTracker::CanBatchZ(const State* st, LocMode_t mode)
+{
+	return zlut_batchsize > 1 && st->zluts && (mode & LT_LocalizeZ) && !(mode & (LT_ZLUTAlign | LT_LocalizeZWeighted | LT_ZLUTPCA | LT_ImageLUT));
+}
 
-void QueuedCPUTracker::SetRadialZLUT(float* data, int num_zluts, int planes)
+// Localizes a batch of jobs. XY and the radial profiles are computed per job,
+// then the profiles are grouped by ZLUT and compared to it with a single matrix product per group.
+void QueuedCPUTracker::ProcessJobBatch(Thread* th, Job** batch, int count, const State* st)
 {
-//	jobs_mutex.lock();
-//	results_mutex.lock();
-	if (zlut_bias_correction)
-		delete zlut_bias_correction;
+	CPUTracker* trk = th->tracker;
+	int res = cfg.zlut_radialsteps;
+	th->lock();
+	BindState(th, st);
+
+	// Beads that share a LUT are compared in the same group
+	std::stable_sort(batch, batch+count, [st](Job* a, Job* b) { return st->LUTIndex(a->job.zlutIndex) < st->LUTIndex(b->job.zlutIndex); });
+
+	th->batchProfiles.resize(count*res);
+	th->batchZ.resize(count);
+	th->batchResults.resize(count);
+
+	for (int i=0;i<count;i++) {
+		LocalizationResult& result = th->batchResults[i];
+		bool boundaryHit;
+		LocalizeXY(trk, batch[i], st, result, boundaryHit);
+		ComputeZProfile(trk, &th->batchProfiles[i*res], batch[i]->localizeMode, result.pos2D(), boundaryHit);
+		result.error = boundaryHit ? 1 : 0;
+	}
+
+	for (int start=0;start<count;) {
+		int zlutIndex = st->LUTIndex(batch[start]->job.zlutIndex);
+		int end = start+1;
+		while (end < count && st->LUTIndex(batch[end]->job.zlutIndex) == zlutIndex)
+			end++;
+
+		float* cmpprof = CompareProfileBuffer(th, st, zlutIndex);
+		trk->LUTProfileCompareBatch(&th->batchProfiles[start*res], end-start, zlutIndex, &st->zlut_norms.get()[zlutIndex*st->zlut_planes], &th->batchZ[start], cmpprof);
+
+		for (int i=start;i<end;i++) {
+			LocalizationResult& result = th->batchResults[i];
+			result.pos.z = ZLUTBiasCorrection(st->zlut_bias_inverse.get(), th->batchZ[i], st->zlut_planes, zlutIndex);
+
+			if(dbgPrintResults)
+				dbgprintf("fr:%d, bead: %d: x=%f, y=%f, z=%f\n",result.job.frame, result.job.zlutIndex, result.pos.x, result.pos.y, result.pos.z);
+		}
+		start = end;
+	}
+
+	th->unlock();
+
+	th->jobResults.insert(th->jobResults.end(), th->batchResults.begin(), th->batchResults.begin()+count);
+}
+
 
-	if (zluts) delete[] zluts;
+// Replaces the radial ZLUT of state s. Derived data and the bias correction table are reset.
+void QueuedCPUTracker::SetRadialZLUTData(State* s, float* data, int num_zluts, int planes)
+{
 	int res = cfg.zlut_radialsteps;
 	int total = num_zluts*res*planes;
 	if (total > 0) {
-		zluts = new float[planes*res*num_zluts];
-		std::fill(zluts,zluts+(planes*res*num_zluts), 0.0f);
-		zlut_planes = planes;
-		zlut_count = num_zluts;
-		if(data)
-			std::copy(data, data+(planes*res*num_zluts), zluts);
+		s->zluts = AllocFloats(total, data);
+		s->zlut_planes = planes;
+		s->zlut_count = num_zluts;
 	}
 	else
-		zluts = 0;
+		s->zluts.reset();
 
-	if (zlut_cmpprofiles) delete[] zlut_cmpprofiles;
-	zlut_cmpprofiles = new float [num_zluts*planes];
+	s->zlut_bias_inverse.reset();
 
-	UpdateZLUTs();
-//	results_mutex.unlock();
-//	jobs_mutex.unlock();
+	UpdateZLUTNorms(s);
+	UpdateZLUTBasis(s);
+}
+
+void QueuedCPUTracker::SetRadialZLUT(float* data, int num_zluts, int planes)
+{
+	ClearZLUTBiasCorrection();
+
+	State* s = BeginStateUpdate();
+	SetRadialZLUTData(s, data, num_zluts, planes);
+	CommitStateUpdate(s);
 }
 
 void QueuedCPUTracker::SetRadialWeights(float *rweights)
 {
+	State* s = BeginStateUpdate();
 	if (rweights)
-		zcmp.assign(rweights, rweights + cfg.zlut_radialsteps);
+		s->zcmp = AllocFloats(cfg.zlut_radialsteps, rweights);
 	else
-		zcmp.clear();
+		s->zcmp.reset();
 
-	for (int i=0;i<threads.size();i++){
-		threads[i].lock();
-		threads[i].tracker->SetRadialWeights(rweights);
-		threads[i].unlock();
+	// norms and basis are computed on weighted profiles
+	UpdateZLUTNorms(s);
+	UpdateZLUTBasis(s);
+	CommitStateUpdate(s);
+}
+
+void QueuedCPUTracker::SetBeadLUTMapping(const int* lutIndex, int numBeads)
+{
+	for (int i=0;lutIndex && i<numBeads;i++)
+		if (lutIndex[i] < 0)
+			throw std::runtime_error(SPrintf("SetBeadLUTMapping: bead %d has invalid LUT index %d", i, lutIndex[i]));
+
+	State* s = BeginStateUpdate();
+	if (lutIndex && numBeads > 0)
+		s->beadLUT = std::make_shared<std::vector<int> >(lutIndex, lutIndex+numBeads);
+	else
+		s->beadLUT.reset();
+	CommitStateUpdate(s);
+}
+
+void QueuedCPUTracker::GetBeadLUTMapping(std::vector<int>& lutIndex)
+{
+	State s = GetStateCopy();
+	if (s.beadLUT) lutIndex = *s.beadLUT;
+	else lutIndex.clear();
+}
+
+bool QueuedCPUTracker::GetRadialWeights(float* dst)
+{
+	State s = GetStateCopy();
+	if (!s.zcmp)
+		return false;
+	std::copy(s.zcmp.get(), s.zcmp.get()+cfg.zlut_radialsteps, dst);
+	return true;
+}
+
+// The LUTs of the library are used in place: the state buffers alias the read-only mapping and keep the library open.
+// This is safe because published LUT buffers are never written, LUT building starts from a copy (see PrepareLUTBuild).
+void QueuedCPUTracker::SetLUTLibrary(std::shared_ptr<LUTLibrary> lib)
+{
+	lib->Validate(cfg);
+	ClearZLUTBiasCorrection();
+
+	int count, planes, rsteps, wsteps, dims[4];
+	float* zlut = (float*)lib->GetRadialZLUT(count, planes, rsteps);
+	float* imageLUT = (float*)lib->GetImageLUT(dims);
+	float* weights = (float*)lib->GetRadialWeights(wsteps);
+	int numBeads;
+	const int* beadLUT = lib->GetBeadLUTMapping(numBeads);
+
+	State* s = BeginStateUpdate();
+	if (beadLUT)
+		s->beadLUT = std::make_shared<std::vector<int> >(beadLUT, beadLUT+numBeads);
+	else
+		s->beadLUT.reset();
+	s->zcmp = weights ? std::shared_ptr<float>(lib, weights) : std::shared_ptr<float>();
+
+	for (int i=0;i<4;i++)
+		s->image_lut_dims[i] = imageLUT ? dims[i] : 0;
+	s->image_lut = imageLUT ? std::shared_ptr<float>(lib, imageLUT) : std::shared_ptr<float>();
+	UpdateImageLUTDerivatives(s);
+
+	if (zlut) {
+		s->zluts = std::shared_ptr<float>(lib, zlut);
+		s->zlut_count = count;
+		s->zlut_planes = planes;
+	} else {
+		s->zluts.reset();
+		s->zlut_count = s->zlut_planes = 0;
 	}
+	s->zlut_bias_inverse.reset();
+
+	UpdateZLUTNorms(s);
+	UpdateZLUTBasis(s);
+	CommitStateUpdate(s);
 
+	int bw, bh;
+	const float* bias = lib->GetZBiasCorrection(bw, bh);
+	if (bias)
+		SetZLUTBiasCorrection(CImageData(ImageData((float*)bias, bw, bh)));
 }
 
-void QueuedCPUTracker::UpdateZLUTs()
+void QueuedCPUTracker::OnZLUTBiasCorrectionChanged()
 {
-	for (int i=0;i<threads.size();i++){
-		threads[i].lock();
-		threads[i].tracker->SetRadialZLUT(zluts, zlut_planes, cfg.zlut_radialsteps, zlut_count, cfg.zlut_minradius, cfg.zlut_maxradius, false, false);
-		threads[i].unlock();
+	State* s = BeginStateUpdate();
+	if (zlut_bias_inverse)
+		s->zlut_bias_inverse = std::make_shared<CImageData>(*zlut_bias_inverse);
+	else
+		s->zlut_bias_inverse.reset();
+	CommitStateUpdate(s);
+}
+
+void QueuedCPUTracker::UpdateZLUTNorms(State* s)
+{
+	int res = cfg.zlut_radialsteps;
+	if (!s->zluts) {
+		s->zlut_norms.reset();
+		return;
+	}
+	s->zlut_norms = AllocFloats(s->zlut_count*s->zlut_planes);
+
+	float* zluts = s->zluts.get(), *zcmp = s->zcmp.get();
+	for (int i=0;i<s->zlut_count*s->zlut_planes;i++) {
+		float* prof = &zluts[i*res];
+		double sum = 0.0;
+		for (int r=0;r<res;r++) {
+			double v = prof[r] * (zcmp ? zcmp[r] : 1.0f);
+			sum += v*v;
+		}
+		s->zlut_norms.get()[i] = sum;
+	}
+}
+
+void QueuedCPUTracker::UpdateZLUTBasis(State* s)
+{
+	int res = cfg.zlut_radialsteps;
+
+	if (!s->zluts || !(s->lutModeFlags & LT_ZLUTPCA)) {
+		s->zlut_pca.reset();
+		s->zlut_pca_k = 0;
+	} else {
+		int planes = s->zlut_planes;
+		int k = s->zlut_pca_k = std::max(1, std::min(zlut_pca_components, std::min(planes, res)));
+		int stride = res + k * res + planes * k;
+		s->zlut_pca = AllocFloats(stride * s->zlut_count);
+
+		float* weights = s->zcmp.get();
+		float* pca = s->zlut_pca.get(), *zluts = s->zluts.get();
+		parallel_for(s->zlut_count, [&](int i) {
+			float* mean = &pca[stride * i];
+			float* basis = &mean[res];
+			ComputeZLUTPrincipalBasis(&zluts[i*planes*res], planes, res, weights, k, mean, basis, &basis[k*res]);
+		});
 	}
 }
 
 void QueuedCPUTracker::GetRadialZLUTSize(int &count, int& planes, int &rsteps)
 {
-	count = zlut_count;
-	planes = zlut_planes;
+	State s = GetStateCopy();
+	count = s.zlut_count;
+	planes = s.zlut_planes;
 	rsteps = cfg.zlut_radialsteps;
 }
 
 
 void QueuedCPUTracker::GetRadialZLUT(float *zlut)
 {
-	int nElem = zlut_planes*cfg.zlut_radialsteps*zlut_count;
-	if (nElem>0) {
-		results_mutex.lock();
-		memcpy(zlut, zluts, sizeof(float)* nElem);
-		results_mutex.unlock();
+	State s = GetStateCopy();
+	int nElem = s.zlut_planes*cfg.zlut_radialsteps*s.zlut_count;
+	if (nElem>0 && s.zluts) {
+		memcpy(zlut, s.zluts.get(), sizeof(float)* nElem);
 	}
 }
 
-void QueuedCPUTracker::ScheduleLocalization(void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo)
+void QueuedCPUTracker::ScheduleLocalization(void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo, int modeProfile)
+{
+	LocMode_t localizeMode = GetLocalizationModeProfile(modeProfile);
+
+	Job* j = CreateJob(data, pitch, pdt, jobInfo);
+	j->localizeMode = localizeMode;
+	AddJob(j);
+}
+
+// Waits for room in the queue and copies the ROI into a job
+QueuedCPUTracker::Job* QueuedCPUTracker::CreateJob(void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob* jobInfo)
 {
 	if (processJobs) {
 		while(maxQueueSize != 0 && GetQueueLength () >= maxQueueSize)
@@ -445,9 +822,11 @@ void QueuedCPUTracker::ScheduleLocalization(void* data, int pitch, QTRK_PixelDat
 		memcpy(&j->data[dstPitch*y], & ((uchar*)data)[pitch*y], dstPitch);
 
 	j->dataType = pdt;
+	j->localizeMode = LT_OnlyCOM;
+	j->lutPlane = -1;
+	j->haveLUTPos = false;
 	j->job = *jobInfo;
-
-	AddJob(j);
+	return j;
 }
 
 int QueuedCPUTracker::FetchResults(LocalizationResult* dstResults, int maxResults)
@@ -482,7 +861,7 @@ bool QueuedCPUTracker::GetDebugImage(int id, int *w, int *h,float** data)
 
 		*data = new float [cfg.width*cfg.height];
 		memcpy(*data, threads[id].tracker->GetDebugImage(), sizeof(float)* cfg.width*cfg.height);
-		
+
 		threads[id].unlock();
 		return true;
 	}
@@ -495,6 +874,11 @@ QueuedTracker::ConfigValueMap QueuedCPUTracker::GetConfigValues()
 {
 	ConfigValueMap cvm;
 	cvm["trace"] = dbgPrintResults ? "1" : "0";
+	cvm["zlut_pca_components"] = SPrintf("%d", zlut_pca_components);
+	cvm["zlut_batch"] = SPrintf("%d", zlut_batchsize);
+	cvm["imagelut_iterations"] = SPrintf("%d", image_lut_iterations);
+	cvm["bead_affinity"] = SPrintf("%d", affinityMode);
+	cvm["affinity_domain_size"] = SPrintf("%d", affinityDomainSize);
 	return cvm;
 }
 
@@ -503,25 +887,57 @@ void QueuedCPUTracker::SetConfigValue(std::string name, std::string value)
 {
 	if (name == "trace")
 		dbgPrintResults = !!atoi(value.c_str());
+	if (name == "bead_affinity")
+		SetAffinityMode(atoi(value.c_str()), affinityDomainSize);
+	if (name == "affinity_domain_size")
+		SetAffinityMode(affinityMode, atoi(value.c_str()));
+	if (name == "zlut_batch")
+		zlut_batchsize = std::max(1, atoi(value.c_str()));
+	if (name == "imagelut_iterations")
+		image_lut_iterations = std::max(1, atoi(value.c_str()));
+	if (name == "zlut_pca_components") {
+		State* s = BeginStateUpdate();
+		zlut_pca_components = atoi(value.c_str());
+		UpdateZLUTBasis(s);
+		CommitStateUpdate(s);
+	}
 }
 
 void QueuedCPUTracker::SetLocalizationMode(LocMode_t lt)
 {
-	while (!IsIdle());
-	localizeMode = lt;
+	SetLocalizationModeProfile(0, lt);
+}
+
+// Takes effect for all jobs scheduled after this call, queued jobs keep the mode they were scheduled with
+void QueuedCPUTracker::SetLocalizationModeProfile(int profile, LocMode_t lt)
+{
+	QueuedTracker::SetLocalizationModeProfile(profile, lt);
+
+	LocMode_t flags = 0;
+	for (int i=0;i<QTRK_MAX_MODE_PROFILES;i++)
+		flags |= modeProfiles[i];
+
+	State* s = BeginStateUpdate();
+	bool updateBasis = ((flags ^ s->lutModeFlags) & LT_ZLUTPCA) != 0;
+	s->lutModeFlags = flags;
+	if (updateBasis)
+		UpdateZLUTBasis(s);
+	CommitStateUpdate(s);
 }
 
 void QueuedCPUTracker::GetImageZLUTSize(int* dims)
 {
+	State s = GetStateCopy();
 	for (int i=0;i<4;i++)
-		dims[i]=image_lut_dims[i];
+		dims[i]=s.image_lut_dims[i];
 }
 
 
-void QueuedCPUTracker::GetImageZLUT(float* dst) 
+void QueuedCPUTracker::GetImageZLUT(float* dst)
 {
-	if (image_lut) {
-		memcpy(dst, image_lut, sizeof(float)*image_lut_nElem_per_bead*image_lut_dims[0]);
+	State s = GetStateCopy();
+	if (s.image_lut) {
+		memcpy(dst, s.image_lut.get(), sizeof(float)*s.ImageLUTNElemPerBead()*s.image_lut_dims[0]);
 	}
 }
 
@@ -530,180 +946,364 @@ void QueuedCPUTracker::EnableRadialZLUTCompareProfile(bool enabled)
 	zlut_enablecmpprof=enabled;
 }
 
-// dst = [count * planes]
+// Returns the worker's compare profile buffer for the given LUT, or null if compare profiles are disabled. Called with the worker locked.
+float* QueuedCPUTracker::CompareProfileBuffer(Thread* th, const State* st, int lut)
+{
+	int n = st->zlut_count*st->zlut_planes;
+	if (!zlut_enablecmpprof || !st->zluts || lut >= st->zlut_count)
+		return 0;
+	if (th->cmpProfileLUT != st->zluts.get() || th->cmpProfiles.size() != n) {
+		th->cmpProfiles.assign(n, 0.0f);
+		th->cmpProfileSeq.assign(st->zlut_count, 0);
+		th->cmpProfileLUT = st->zluts.get();
+	}
+	th->cmpProfileSeq[lut] = ++cmpProfileCount;
+	return &th->cmpProfiles[lut*st->zlut_planes];
+}
+
+// dst = [count * planes], the most recent profile of every LUT over all workers
 void QueuedCPUTracker::GetRadialZLUTCompareProfile(float* dst)
 {
-	if (zlut_cmpprofiles){ 
-		for (int i=0;i<zlut_count*zlut_planes;i++)
-			dst[i]=zlut_cmpprofiles[i];
+	State s = GetStateCopy();
+	int n = s.zlut_count*s.zlut_planes;
+	std::fill(dst, dst+n, 0.0f);
+	std::vector<int> latest(s.zlut_count, 0);
+	for (int k=0;k<threads.size();k++) {
+		Thread& th = threads[k];
+		th.lock();
+		if (s.zluts && th.cmpProfileLUT == s.zluts.get() && th.cmpProfiles.size() == n) {
+			for (int i=0;i<s.zlut_count;i++) {
+				if (th.cmpProfileSeq[i] > latest[i]) {
+					std::copy(&th.cmpProfiles[i*s.zlut_planes], &th.cmpProfiles[(i+1)*s.zlut_planes], &dst[i*s.zlut_planes]);
+					latest[i] = th.cmpProfileSeq[i];
+				}
+			}
+		}
+		th.unlock();
 	}
 }
 
 
 bool QueuedCPUTracker::SetImageZLUT(float* src, float *radial_lut, int* dims)
 {
-	if (image_lut)  {
-		delete[] image_lut;
-		image_lut=0;
-	}
+	ClearZLUTBiasCorrection();
 
+	State* s = BeginStateUpdate();
 	for (int i=0;i<4;i++)
-		image_lut_dims[i]=dims[i];
+		s->image_lut_dims[i]=dims[i];
 
-	image_lut_nElem_per_bead = dims[1]*dims[2]*dims[3];
-
-	if (image_lut_nElem_per_bead > 0 && dims[0] > 0) {
-		image_lut = new float [image_lut_nElem_per_bead*image_lut_dims[0]];
-		memset(image_lut, 0, sizeof(float)*image_lut_nElem_per_bead*image_lut_dims[0]);
-	}
-
-	if (src) {
-		memcpy(image_lut, src, sizeof(float)*image_lut_nElem_per_bead*image_lut_dims[0]);
-	}
+	int nElem = s->ImageLUTNElemPerBead() * dims[0];
+	if (nElem > 0)
+		s->image_lut = AllocFloats(nElem, src);
+	else
+		s->image_lut.reset();
+	UpdateImageLUTDerivatives(s);
 
-	SetRadialZLUT(radial_lut, dims[0], dims[1]);
+	SetRadialZLUTData(s, radial_lut, dims[0], dims[1]);
+	CommitStateUpdate(s);
 
 	return true; // returning true indicates this implementation support ImageLUT
 }
 
+// Start the LUT build from the current LUTs
+void QueuedCPUTracker::PrepareLUTBuild(const State& st)
+{
+	int nElem = st.zlut_count*st.zlut_planes*cfg.zlut_radialsteps;
+	lutBuildCount = st.zlut_count;
+	lutBuildPlanes = st.zlut_planes;
+	lutJobsRejected = 0;
+	lut_build = st.zluts ? AllocFloats(nElem, st.zluts.get()) : std::shared_ptr<float>();
+
+	if (st.image_lut)
+		image_lut_build = AllocFloats(st.ImageLUTNElemPerBead()*st.image_lut_dims[0], st.image_lut.get());
+	else
+		image_lut_build.reset();
+}
 
 void QueuedCPUTracker::BeginLUT(uint flags)
 {
 	zlut_buildflags = flags;
+	ClearLUTAccumulators();
+	PrepareLUTBuild(GetStateCopy());
 }
 
+// Queues one LUT job per bead. The workers add the profiles to their own partial LUT, and the partial LUTs only become visible in FinalizeLUT.
+// The image data is copied, so it can be reused as soon as BuildLUT returns.
 void QueuedCPUTracker::BuildLUT(void* data, int pitch, QTRK_PixelDataType pdt, int plane, vector2f* known_pos)
 {
-	parallel_for(zlut_count,[&] (int i) {
-//	for(int i=0;i<zlut_count;i++) {
-		CPUTracker trk (cfg.width,cfg.height);
-		void *img_data = (uchar*)data + pitch * cfg.height * i;
+	State st = GetStateCopy();
+	if (!lut_build)
+		PrepareLUTBuild(st);
+	if (!lut_build)
+		return;
+
+	for (int i=0;i<st.BeadCount();i++) {
+		LocalizationJob jobInfo;
+		jobInfo.zlutIndex = i;
+
+		Job* j = CreateJob((uchar*)data + pitch * cfg.height * i, pitch, pdt, &jobInfo);
+		j->lutPlane = plane;
+		j->haveLUTPos = known_pos != 0;
+		if (known_pos)
+			j->lutPos = known_pos[i];
+		lutJobsPending++;
+		AddJob(j);
+	}
+}
 
-		if (pdt == QTrkFloat) {
-			trk.SetImage((float*)img_data, pitch);
-		} else if (pdt == QTrkU8) {
-			trk.SetImage8Bit((uchar*)img_data, pitch);
-		} else {
-			trk.SetImage16Bit((ushort*)img_data,pitch);
-		}
-		ApplyOffsetGain(&trk, i);
+void QueuedCPUTracker::ProcessLUTJob(Thread* th, Job* j, const State* st)
+{
+	CPUTracker* trk = th->tracker;
+	int res = cfg.zlut_radialsteps;
+	int bead = j->job.zlutIndex, plane = j->lutPlane;
+	int lut = st->LUTIndex(bead);
+
+	// The partial LUTs have the size of the LUT at the start of the build
+	if (st->zlut_count != lutBuildCount || st->zlut_planes != lutBuildPlanes) {
+		if (lutJobsRejected++ == 0)
+			dbgprintf("LUT job of bead %d, plane %d rejected: the LUT size changed from %dx%d to %dx%d during the build\n",
+				bead, plane, lutBuildCount, lutBuildPlanes, st->zlut_count, st->zlut_planes);
+		lutJobsPending--;
+		return;
+	}
 
-		vector2f pos;
+	th->lock();
+	SetTrackerImage(trk, j, st);
 
-		if (known_pos) {
-			pos = known_pos[i];
-		} else {
-			vector2f com = trk.ComputeMeanAndCOM();
-			bool bhit;
-			pos = trk.ComputeQI(com, cfg.qi_iterations, cfg.qi_radialsteps, cfg.qi_angstepspq, cfg.qi_angstep_factor, cfg.qi_minradius, cfg.qi_maxradius, bhit);
-			dbgprintf("BuildLUT() COMPos: %f,%f, QIPos: x=%f, y=%f\n", com.x,com.y, pos.x, pos.y);
-		}
-		if (zlut_buildflags & BUILDLUT_IMAGELUT) {
-			int h=ImageLUTHeight(), w=ImageLUTWidth();
-			float* lut_dst = &image_lut[ i * image_lut_nElem_per_bead + w*h* plane ];
+	vector2f pos;
+
+	if (j->haveLUTPos) {
+		pos = j->lutPos;
+	} else {
+		vector2f com = trk->ComputeMeanAndCOM();
+		bool bhit;
+		pos = trk->ComputeQI(com, cfg.qi_iterations, cfg.qi_radialsteps, cfg.qi_angstepspq, cfg.qi_angstep_factor, cfg.qi_minradius, cfg.qi_maxradius, bhit);
+		dbgprintf("BuildLUT() COMPos: %f,%f, QIPos: x=%f, y=%f\n", com.x,com.y, pos.x, pos.y);
+	}
+	if ((zlut_buildflags & BUILDLUT_IMAGELUT) && image_lut_build && lut < st->image_lut_dims[0]) {
+		int h=st->image_lut_dims[2], w=st->image_lut_dims[3];
+		float* lut_dst = &image_lut_build.get()[ lut * st->ImageLUTNElemPerBead() + w*h* plane ];
 
-			vector2f ilut_scale(1,1);
-			float startx = pos.x - w/2*ilut_scale.x;
-			float starty = pos.y - h/2*ilut_scale.y;
+		vector2f ilut_scale(1,1);
+		float startx = pos.x - w/2*ilut_scale.x;
+		float starty = pos.y - h/2*ilut_scale.y;
 
-			for (int y=0;y<h;y++) {
-				for (int x=0;x<w;x++) {
+		Threads::Mutex& m = image_lut_mutex[lut % NumImageLUTMutexes];
+		m.lock();
+		for (int y=0;y<h;y++) {
+			for (int x=0;x<w;x++) {
 
-					float px = startx + x*ilut_scale.x;
-					float py = starty + y*ilut_scale.y;
+				float px = startx + x*ilut_scale.x;
+				float py = starty + y*ilut_scale.y;
 
-					bool outside=false;
-					float v = Interpolate(trk.srcImage, trk.width, trk.height, px, py, &outside);
-					lut_dst[y*w+x] += v - trk.mean;
-				}
+				bool outside=false;
+				float v = Interpolate(trk->srcImage, trk->width, trk->height, px, py, &outside);
+				lut_dst[y*w+x] += v - trk->mean;
 			}
 		}
+		m.unlock();
+	}
 
-		float *bead_zlut=GetZLUTByIndex(i);
-		float *tmp = new float[cfg.zlut_radialsteps];
+	float *tmp = ALLOCA_ARRAY(float, res);
 
-		if (zlut_buildflags  & BUILDLUT_FOURIER){
-			trk.FourierRadialProfile(tmp, cfg.zlut_radialsteps, cfg.zlut_angularsteps, cfg.zlut_minradius, cfg.zlut_maxradius);
-			if (plane==0) {
-				for (int i=0;i<trk.width*trk.height;i++)
-					trk.srcImage[i]=sqrtf(trk.srcImage[i]);
-				trk.SaveImage("freqimg.jpg");
-			}
+	if (zlut_buildflags  & BUILDLUT_FOURIER){
+		trk->FourierRadialProfile(tmp, res, cfg.zlut_angularsteps, cfg.zlut_minradius, cfg.zlut_maxradius);
+		if (plane==0) {
+			for (int i=0;i<trk->width*trk->height;i++)
+				trk->srcImage[i]=sqrtf(trk->srcImage[i]);
+			trk->SaveImage("freqimg.jpg");
 		}
-		else {
-			trk.ComputeRadialProfile(tmp, cfg.zlut_radialsteps, cfg.zlut_angularsteps, cfg.zlut_minradius, cfg.zlut_maxradius, pos, false, 0, (zlut_buildflags&BUILDLUT_NORMALIZE)!=0);
-		}
-	//	WriteArrayAsCSVRow("rlut-test.csv", tmp, cfg.zlut_radialsteps, plane>0);
-		for(int i=0;i<cfg.zlut_radialsteps;i++) 
-			bead_zlut[plane*cfg.zlut_radialsteps+i] += tmp[i];
-		delete[] tmp;
-	} );
+	}
+	else if (zlut_buildflags & BUILDLUT_PIXELBINNED) {
+		trk->ComputeBinnedRadialProfile(tmp, res, cfg.zlut_minradius, cfg.zlut_maxradius, pos, 0, (zlut_buildflags&BUILDLUT_NORMALIZE)!=0);
+	}
+	else {
+		trk->ComputeRadialProfile(tmp, res, cfg.zlut_angularsteps, cfg.zlut_minradius, cfg.zlut_maxradius, pos, false, 0, (zlut_buildflags&BUILDLUT_NORMALIZE)!=0);
+	}
+//	WriteArrayAsCSVRow("rlut-test.csv", tmp, cfg.zlut_radialsteps, plane>0);
+
+	int nElem = st->zlut_count*st->zlut_planes*res;
+	if (th->lutAccum.empty())
+		th->lutAccum.assign(nElem, 0.0f);
+	if (lut < st->zlut_count && plane >= 0 && plane < st->zlut_planes) {
+		float *bead_zlut = &th->lutAccum[lut * st->zlut_planes * res];
+		for(int i=0;i<res;i++)
+			bead_zlut[plane*res+i] += tmp[i];
+	}
+	th->unlock();
+
+	lutJobsPending--;
+}
+
+void QueuedCPUTracker::ClearLUTAccumulators()
+{
+	for (int i=0;i<threads.size();i++) {
+		threads[i].lock();
+		threads[i].lutAccum.clear();
+		threads[i].unlock();
+	}
 }
 
 void QueuedCPUTracker::FinalizeLUT()
 {
-	// normalize radial LUT?
+	// wait for the workers to finish the queued LUT jobs. Paused workers would never get to them.
+	while (lutJobsPending > 0) {
+		if (!processJobs)
+			throw std::runtime_error(SPrintf("FinalizeLUT: the tracker is paused with %d LUT jobs queued", (int)lutJobsPending));
+		Threads::Sleep(1);
+	}
+
+	if (!lut_build)
+		return;
+
+	State st = GetStateCopy();
+	int rejected = lutJobsRejected;
+	if (rejected > 0 || st.zlut_count != lutBuildCount || st.zlut_planes != lutBuildPlanes) {
+		ClearLUTAccumulators();
+		lut_build.reset();
+		image_lut_build.reset();
+		throw std::runtime_error(SPrintf("FinalizeLUT: the LUT size changed from %dx%d to %dx%d during the build (%d LUT jobs rejected)",
+			lutBuildCount, lutBuildPlanes, st.zlut_count, st.zlut_planes, rejected));
+	}
 
-	if (zluts) {
-		for (int i=0;i<zlut_count*zlut_planes;i++) {
+	State* s = BeginStateUpdate();
+	int res = cfg.zlut_radialsteps;
+	float* zluts = lut_build.get();
+
+	// Sum the partial LUTs of all workers, normalize and compute the profile norms in one pass per profile.
+	int nElem = s->zlut_count*s->zlut_planes*res;
+	std::vector<float*> partialLUTs;
+	for (int k=0;k<threads.size();k++) {
+		threads[k].lock();
+		if (threads[k].lutAccum.size() == nElem)
+			partialLUTs.push_back(&threads[k].lutAccum[0]);
+	}
 
-		//	WriteArrayAsCSVRow("finalize-lut.csv", &zluts[cfg.zlut_radialsteps*i], cfg.zlut_radialsteps, i>0);
-			NormalizeRadialProfile(&zluts[cfg.zlut_radialsteps*i], cfg.zlut_radialsteps);
+	int nprof = s->zlut_count*s->zlut_planes;
+	s->zluts = lut_build;
+	s->zlut_norms = AllocFloats(nprof);
+	float* norms = s->zlut_norms.get(), *zcmp = s->zcmp.get();
+	const int ProfilesPerItem = 64;
+	Executor::Shared().ForEach((nprof + ProfilesPerItem - 1) / ProfilesPerItem, [&](int item, int worker) {
+		int end = std::min(nprof, (item+1)*ProfilesPerItem);
+		for (int i=item*ProfilesPerItem;i<end;i++) {
+			float* prof = &zluts[res*i];
+			for (int k=0;k<partialLUTs.size();k++) {
+				const float* partial = &partialLUTs[k][res*i];
+				for (int r=0;r<res;r++)
+					prof[r] += partial[r];
+			}
+		//	WriteArrayAsCSVRow("finalize-lut.csv", prof, res, i>0);
+			NormalizeRadialProfile(prof, res);
 
+			double sum = 0.0;
+			for (int r=0;r<res;r++) {
+				float v = prof[r] * (zcmp ? zcmp[r] : 1.0f);
+				sum += v*v;
+			}
+			norms[i] = sum;
 		}
+	});
+
+	for (int k=0;k<threads.size();k++) {
+		threads[k].lutAccum.clear();
+		threads[k].unlock();
 	}
 
-	int w = ImageLUTWidth();
-	int h = ImageLUTHeight();
+	UpdateZLUTBasis(s);
 
-	if (w * h > 0) {
+	if (image_lut_build) {
+		s->image_lut = image_lut_build;
+		UpdateImageLUTDerivatives(s);
+	}
+	CommitStateUpdate(s);
 
-		image_lut_dz = new float [image_lut_nElem_per_bead * ImageLUTNumBeads()];
-		image_lut_dz2 = new float [image_lut_nElem_per_bead * ImageLUTNumBeads()];
+	lut_build.reset();
+	image_lut_build.reset();
+}
 
-		// Compute 1st and 2nd order derivatives
-		for (int i=0;i<image_lut_dims[0];i++) {
-			for (int z=1;z<image_lut_dims[1]-1;z++) {
-				float *img = &image_lut[ image_lut_nElem_per_bead * i + w*h*z ]; // current plane
-				float *imgL = &image_lut[ image_lut_nElem_per_bead * i + w*h*(z-1) ]; // one plane below
-				float *imgU = &image_lut[ image_lut_nElem_per_bead * i + w*h*(z+1) ]; // one plane above
 
-				float *img_dz = &image_lut_dz[ image_lut_nElem_per_bead * i + w*h*z ];
-				float *img_dz2 = &image_lut_dz2[ image_lut_nElem_per_bead * i + w*h*z ];
+// Compute 1st and 2nd order z derivatives of the image LUT, used by LT_ImageLUT.
+// Every (bead, plane) is an independent work item, and computes both derivatives in a single pass over its pixels.
+// The top and bottom planes use the stencil of their neighbouring plane.
+void QueuedCPUTracker::UpdateImageLUTDerivatives(State* s)
+{
+	int w = s->image_lut_dims[3];
+	int h = s->image_lut_dims[2];
+	int planes = s->image_lut_dims[1];
+	int nElemPerBead = s->ImageLUTNElemPerBead();
+	int nElem = nElemPerBead * s->image_lut_dims[0];
+
+	// The dims can already be those of the new LUT, the old buffers are pooled with their own size
+	RecycleBuffer(s->image_lut_dz, s->image_lut_dz_elems);
+	RecycleBuffer(s->image_lut_dz2, s->image_lut_dz_elems);
+	s->image_lut_dz.reset();
+	s->image_lut_dz2.reset();
+	s->image_lut_dz_elems = 0;
+
+	if (!s->image_lut || w * h == 0 || planes < 3)
+		return;
+
+	s->image_lut_dz = AllocPooled(nElem);
+	s->image_lut_dz2 = AllocPooled(nElem);
+	s->image_lut_dz_elems = nElem;
+	float* image_lut = s->image_lut.get(), *image_lut_dz = s->image_lut_dz.get(), *image_lut_dz2 = s->image_lut_dz2.get();
+
+	Executor::Shared().ForEach(s->image_lut_dims[0] * planes, [&](int item, int worker) {
+		int bead = item / planes, z = item % planes;
+		int zc = std::max(1, std::min(planes-2, z)); // center of the stencil
+
+		const float *img = &image_lut[ nElemPerBead * bead + w*h*zc ]; // current plane
+		const float *imgL = &image_lut[ nElemPerBead * bead + w*h*(zc-1) ]; // one plane below
+		const float *imgU = &image_lut[ nElemPerBead * bead + w*h*(zc+1) ]; // one plane above
+
+		float *img_dz = &image_lut_dz[ nElemPerBead * bead + w*h*z ];
+		float *img_dz2 = &image_lut_dz2[ nElemPerBead * bead + w*h*z ];
+
+		// Numerical approx of derivatives, with plane distance 1
+		for (int k=0;k<w*h;k++) {
+			img_dz[k] = 0.5f * ( imgU[k] - imgL[k] );
+			img_dz2[k] = imgU[k] - 2*img[k] + imgL[k];
+		}
+	});
+}
 
-				// Numerical approx of derivatives..
-				for (int y=0;y<h;y++) {
-					for (int x=0;x<w;x++) {
-						const float h = 1.0f;
-						img_dz[y*w+x] = 0.5f * ( imgU[y*w+x] - imgL[y*w+x] ) / h;
-						img_dz2[y*w+x] = (imgU[y*w+x] - 2*img[y*w+x] + imgL[y*w+x]) / (h*h);
-					}
-				}
-			}
-			for (int k=0;k<w*h;k++) {
-				// Top and bottom planes are simply copied from the neighbouring planes
-				image_lut_dz[ image_lut_nElem_per_bead * i + w*h*0 + k] = image_lut_dz[ image_lut_nElem_per_bead * i + w*h*1 + k];
-				image_lut_dz[ image_lut_nElem_per_bead * i + w*h*(image_lut_dims[1]-1) + k] = image_lut_dz[ image_lut_nElem_per_bead * i + w*h*(image_lut_dims[1]-2) + k];
-				image_lut_dz2[ image_lut_nElem_per_bead * i + w*h*0 + k] = image_lut_dz2[ image_lut_nElem_per_bead * i + w*h*1 + k];
-				image_lut_dz2[ image_lut_nElem_per_bead * i + w*h*(image_lut_dims[1]-1) + k] = image_lut_dz2[ image_lut_nElem_per_bead * i + w*h*(image_lut_dims[1]-2) + k];
-			}
+// Returns a buffer of n floats, reusing a buffer of a replaced LUT once no state refers to it anymore. Called with state_mutex locked.
+std::shared_ptr<float> QueuedCPUTracker::AllocPooled(int n)
+{
+	for (std::list<PooledBuffer>::iterator i = bufferPool.begin(); i != bufferPool.end(); ++i) {
+		if (i->size == n && i->buffer.use_count() == 1) {
+			std::shared_ptr<float> p = i->buffer;
+			bufferPool.erase(i);
+			return p;
 		}
 	}
+	return std::shared_ptr<float>(new float[n], std::default_delete<float[]>());
+}
+
+void QueuedCPUTracker::RecycleBuffer(std::shared_ptr<float> p, int n)
+{
+	if (!p)
+		return;
+	const int MaxPooledBuffers = 4;
+	PooledBuffer pb = { n, p };
+	bufferPool.push_front(pb);
+	if (bufferPool.size() > MaxPooledBuffers)
+		bufferPool.pop_back();
 }
 
 
-void QueuedCPUTracker::SetTrackerImage(CPUTracker* trk, Job* j)
+// Converts the job's ROI to float, applying the pixel calibration of the bead in the same pass
+void QueuedCPUTracker::SetTrackerImage(CPUTracker* trk, Job* j, const State* st)
 {
+	const PixelCalibration* calib = st->calib.get();
+	int bead = j->job.zlutIndex;
 
 	if (j->dataType == QTrkU8) {
-		trk->SetImage8Bit(j->data, cfg.width);
+		trk->SetImageCalibrated(j->data, cfg.width, calib, bead);
 	} else if (j->dataType == QTrkU16) {
-		trk->SetImage16Bit((ushort*)j->data, cfg.width*2);
+		trk->SetImageCalibrated((ushort*)j->data, cfg.width*2, calib, bead);
 	} else {
-		trk->SetImageFloat((float*)j->data);
+		trk->SetImageCalibrated((float*)j->data, cfg.width*4, calib, bead);
 	}
-
 }
-
-
-
@@ -6,6 +6,9 @@
 #include "cpu_tracker.h"
 
 #include <list>
+#include <memory>
+#include <atomic>
+#include <climits>
 
 class QueuedCPUTracker : public QueuedTracker {
 public:
@@ -18,18 +21,25 @@ public:
 
 	// QueuedTracker interface
 	void SetLocalizationMode(LocMode_t lt) override;
+	void SetLocalizationModeProfile(int profile, LocMode_t lt) override;
 	void SetRadialZLUT(float* data, int num_zluts, int planes) override;
 	void GetRadialZLUT(float* zlut) override;
 	void GetRadialZLUTSize(int& count ,int& planes, int& rsteps) override;
 	void SetRadialWeights(float* rweights) override;
 	void SetRadialWeights(std::vector<float> weights) { SetRadialWeights(&weights[0]); }
-	void ScheduleLocalization(void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo) override;
+	bool GetRadialWeights(float* dst) override;
+	void SetBeadLUTMapping(const int* lutIndex, int numBeads) override;
+	void GetBeadLUTMapping(std::vector<int>& lutIndex) override;
+	void SetLUTLibrary(std::shared_ptr<LUTLibrary> lib) override;
+	void ScheduleLocalization(void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo, int modeProfile=0) override;
 
 	void EnableRadialZLUTCompareProfile(bool enabled);
 	void GetRadialZLUTCompareProfile(float* dst); // dst = [count * planes]
 
 	void BeginLUT(uint flags);
 	void BuildLUT(void* data, int pitch, QTRK_PixelDataType pdt, int plane, vector2f* known_pos=0) override;
+	// Throws if the tracker is paused with LUT jobs queued (the build continues after resuming),
+	// or if the LUT size changed since BeginLUT (the build is discarded).
 	void FinalizeLUT() override;
 
 	void GetImageZLUTSize(int* dims);
@@ -38,6 +48,9 @@ public:
 
 	void SetPixelCalibrationImages(float* offset, float* gain) override;
 	void SetPixelCalibrationFactors(float offsetFactor, float gainFactor) override;
+	void SetPixelCalibrationMap(float* offset, float* gain, int sensorWidth, int sensorHeight, ROIPosition* roiPositions, int numBeads) override;
+	void GetPixelCalibrationImages(std::vector<float>& offset, std::vector<float>& gain) override;
+	void GetPixelCalibrationFactors(float& offsetFactor, float& gainFactor) override;
 
 	int GetQueueLength(int *maxQueueLength=0) override; // In queue + in progress
 	int FetchResults(LocalizationResult* results, int maxResults) override;
@@ -52,30 +65,79 @@ public:
 	void SetConfigValue(std::string name, std::string value) override;
 
 	std::string GetProfileReport() { return "CPU tracker currently has no profile reporting"; }
+protected:
+	void OnZLUTBiasCorrectionChanged() override;
+
 private:
+	// Everything the workers read while processing a job. A published state is never modified:
+	// API calls build a new version and swap it in, while jobs in progress finish on the version they started with.
+	// Large buffers are shared between versions, so a new version only copies what changed.
+	struct State {
+		State();
+		int version;
+		LocMode_t lutModeFlags; // union of all mode profiles, decides which derived LUT data is kept
+
+		int zlut_count, zlut_planes;
+		std::shared_ptr<float> zluts; // [count * planes * radialsteps]
+		std::shared_ptr<float> zlut_norms; // |wz|^2 for every bead and plane, used by the batched Z stage
+		std::shared_ptr<float> zcmp; // radial weights [radialsteps], or null
+		std::shared_ptr<float> zlut_pca; // principal component basis for LT_ZLUTPCA, layout described in CPUTracker::zlut_pca
+		int zlut_pca_k;
+
+		std::shared_ptr<PixelCalibration> calib; // applied while converting the ROI, see SetTrackerImage
+		std::shared_ptr<CImageData> zlut_bias_inverse; // see QueuedTracker::UpdateZLUTBiasInverse
+
+		int image_lut_dims[4];
+		std::shared_ptr<float> image_lut, image_lut_dz, image_lut_dz2;
+		int image_lut_dz_elems; // size of image_lut_dz and image_lut_dz2, which can differ from image_lut_dims while they are replaced
+		int ImageLUTNElemPerBead() const { return image_lut_dims[1]*image_lut_dims[2]*image_lut_dims[3]; }
+
+		std::shared_ptr<std::vector<int> > beadLUT; // LUT index per bead, or null if bead i uses LUT i
+		int LUTIndex(int bead) const { return (beadLUT && bead >= 0 && bead < (int)beadLUT->size()) ? (*beadLUT)[bead] : bead; }
+		int BeadCount() const { return beadLUT ? beadLUT->size() : zlut_count; }
+	};
+
 	struct Thread {
-		Thread() { tracker=0; manager=0; thread=0;  mutex=0; }
+		Thread() { tracker=0; manager=0; thread=0;  mutex=0; index=0; boundStateVersion=-1; cmpProfileLUT=0; }
+		int index;
 		CPUTracker *tracker;
 		Threads::Handle* thread;
 		QueuedCPUTracker* manager;
 		Threads::Mutex *mutex;
+		int boundStateVersion; // state version the tracker's ZLUT pointers were last set from
+
+		// buffers for ProcessJobBatch
+		std::vector<float> batchProfiles, batchZ;
+		std::vector<LocalizationResult> batchResults;
+		std::vector<LocalizationResult> jobResults; // results of all jobs passed to ProcessJobs, delivered at once
+
+		std::vector<float> lutAccum; // partial radial LUT built by this worker, summed in FinalizeLUT
+
+		// Compare profiles of the last job per LUT [count * planes], kept per worker as published states are read-only
+		std::vector<float> cmpProfiles;
+		std::vector<int> cmpProfileSeq; // per LUT, when its profile was written
+		const float* cmpProfileLUT; // LUT the profiles belong to
 
 		void lock() { mutex->lock(); }
 		void unlock(){ mutex->unlock(); }
 	};
 
 	struct Job {
-		Job() { data=0; dataType=QTrkU8; }
+		Job() { data=0; dataType=QTrkU8; localizeMode=LT_OnlyCOM; lutPlane=-1; haveLUTPos=false; }
 		~Job() { delete[] data; }
 
 		uchar* data;
 		QTRK_PixelDataType dataType;
+		LocMode_t localizeMode;
 		LocalizationJob job;
+
+		int lutPlane; // LUT plane this image is added to, or -1 for a localization job
+		bool haveLUTPos;
+		vector2f lutPos;
 	};
 
-	LocMode_t localizeMode;
 	Threads::Mutex jobs_mutex, jobs_buffer_mutex, results_mutex;
-	std::deque<Job*> jobs;
+	std::vector< std::deque<Job*> > jobQueues; // a single queue, or one per worker/cache domain with bead affinity enabled
 	int jobCount;
 	std::vector<Job*> jobs_buffer; // stores memory
 	std::deque<LocalizationResult> results;
@@ -84,44 +146,88 @@ private:
 	int jobsInProgress;
 
 	Threads::Mutex gc_mutex;
-	float *calib_gain, *calib_offset, gc_gainFactor, gc_offsetFactor;
+	float gc_gainFactor, gc_offsetFactor;
 
 	int downsampleWidth, downsampleHeight;
 
 	std::vector<Thread> threads;
-	float* zluts;
-	float* zlut_cmpprofiles;
+
+	// Versioned state with epoch based reclamation: every worker announces a version that is not newer than the one it uses,
+	// and a retired version is deleted once no worker is on that version or an older one.
+	std::atomic<State*> state;
+	std::atomic<int>* workerStateVersion; // [numThreads], WorkerIdle if the worker holds no state
+	enum { WorkerIdle = INT_MAX };
+	std::atomic<int> lastStateVersion; // version of the published state, stored after it is published
+	Threads::Mutex state_mutex; // serializes state updates
+	std::list<State*> retiredStates;
+
+	const State* AcquireState(Thread* th);
+	void ReleaseState(Thread* th);
+	State* BeginStateUpdate(); // locks state_mutex and returns a copy of the current state
+	void CommitStateUpdate(State* s); // publishes s and unlocks state_mutex
+	State GetStateCopy();
+	void ReclaimStates();
+	void BindState(Thread* th, const State* st);
+
 	bool zlut_enablecmpprof;
-	int zlut_count, zlut_planes;
+	std::atomic<int> cmpProfileCount;
+	float* CompareProfileBuffer(Thread* th, const State* st, int lut);
 	uint zlut_buildflags;
-
-	std::vector<float> zcmp;
+	std::shared_ptr<float> lut_build, image_lut_build; // LUTs being accumulated between BeginLUT and FinalizeLUT
+	std::atomic<int> lutJobsPending;
+	int lutBuildCount, lutBuildPlanes; // LUT size when the build started
+	std::atomic<int> lutJobsRejected; // LUT jobs that saw a different LUT size
+	enum { NumImageLUTMutexes = 16 };
+	Threads::Mutex image_lut_mutex[NumImageLUTMutexes]; // guards image_lut_build, striped by bead
+	void PrepareLUTBuild(const State& st);
+	void ClearLUTAccumulators();
+	void UpdateImageLUTDerivatives(State* s);
+	int image_lut_iterations;
+	void ProcessLUTJob(Thread* th, Job* j, const State* st);
+
+	int zlut_batchsize;
+	int zlut_pca_components;
 	std::vector<float> qi_radialbinweights;
-	float* GetZLUTByIndex(int index) { return &zluts[ index * (zlut_planes*cfg.zlut_radialsteps) ]; }
-	void UpdateZLUTs();
+	void UpdateZLUTNorms(State* s);
+	void UpdateZLUTBasis(State* s);
+	void SetRadialZLUTData(State* s, float* data, int num_zluts, int planes);
 
-	int image_lut_dims[4], image_lut_nElem_per_bead;
-	int ImageLUTNumBeads() { return image_lut_dims[0]; }
-	int ImageLUTWidth() { return image_lut_dims[3]; }
-	int ImageLUTHeight() { return image_lut_dims[2]; }
-	float* image_lut, *image_lut_dz, *image_lut_dz2;
+	static std::shared_ptr<float> AllocFloats(int n, const float* src=0);
 
-	float* GetImageLUTByIndex(int index, int plane=0) { 
-		return &image_lut [ index * image_lut_nElem_per_bead + plane * (image_lut_dims[2]*image_lut_dims[3]) ]; 
-	}
+	// Large buffers of replaced versions, reused when they are no longer referenced by any state
+	struct PooledBuffer {
+		int size;
+		std::shared_ptr<float> buffer;
+	};
+	std::list<PooledBuffer> bufferPool;
+	std::shared_ptr<float> AllocPooled(int n);
+	void RecycleBuffer(std::shared_ptr<float> p, int n);
+
+	// Bead affinity scheduling: 0 = off, 1 = every bead has a home worker, 2 = every bead has a home cache domain.
+	// Idle workers steal jobs from the other queues.
+	enum AffinityMode { AffinityOff=0, AffinityWorker=1, AffinityDomain=2 };
+	int affinityMode, affinityDomainSize;
+	void SetAffinityMode(int mode, int domainSize);
+	int HomeQueue(int worker);
+	int BeadQueue(int zlutIndex) { return jobQueues.size()==1 ? 0 : abs(zlutIndex) % jobQueues.size(); }
 
 	// signal threads to stop their work
 	bool quitWork, processJobs, dbgPrintResults;
 
 	void JobFinished(Job* j);
-	Job* GetNextJob();
+	int GetNextJobs(int worker, Job** dst, int maxJobs);
 	Job* AllocateJob();
+	Job* CreateJob(void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob* jobInfo);
 	void AddJob(Job* j);
-	void ProcessJob(Thread* th, Job* j);
+	void ProcessJobs(Thread* th, Job** jobs, int count, const State* st);
+	void ProcessJob(Thread* th, Job* j, const State* st);
+	void StoreResults(const LocalizationResult* results, int count);
+	void ProcessJobBatch(Thread* th, Job** batch, int count, const State* st);
+	bool CanBatchZ(const State* st, LocMode_t mode);
+	void LocalizeXY(CPUTracker* trk, Job* j, const State* st, LocalizationResult& result, bool& boundaryHit);
+	void ComputeZProfile(CPUTracker* trk, float* prof, LocMode_t mode, vector2f center, bool& boundaryHit);
 
-	void SetTrackerImage(CPUTracker* trk, Job *job);
-	void ApplyOffsetGain(CPUTracker* trk, int beadIndex);
+	void SetTrackerImage(CPUTracker* trk, Job *job, const State* st);
 
 	static void WorkerThreadMain(void* arg);
 };
-
@@ -2,6 +2,8 @@
 #include "QueuedTracker.h"
 #include "utils.h"
 #include "cpu_tracker.h"
+#include "LUTLibrary.h"
+#include <float.h>
 
 void QTrkComputedConfig::Update()
 {
@@ -56,10 +58,57 @@ void QTrkComputedConfig::WriteToLog()
 QueuedTracker::QueuedTracker()
 {
 	zlut_bias_correction=0;
+	zlut_bias_inverse=0;
+	resultSink=0;
+	sinkGeneration=0;
+	sinkCalls[0]=sinkCalls[1]=0;
+	for (int i=0;i<QTRK_MAX_MODE_PROFILES;i++)
+		modeProfiles[i]=LT_OnlyCOM;
 }
 
 QueuedTracker::~QueuedTracker()
 {
+	ClearZLUTBiasCorrection();
+}
+
+void QueuedTracker::SetResultSink(ResultSink* sink)
+{
+	setSinkMutex.lock();
+	sinkMutex.lock();
+	int prev = sinkGeneration & 1;
+	resultSink = sink;
+	sinkGeneration++;
+	sinkMutex.unlock();
+
+	// Calls that picked up the previous sink are counted in the other slot than new ones, so this can not be starved
+	while (true) {
+		sinkMutex.lock();
+		int calls = sinkCalls[prev];
+		sinkMutex.unlock();
+		if (calls == 0)
+			break;
+		Threads::Sleep(1);
+	}
+	setSinkMutex.unlock();
+}
+
+bool QueuedTracker::DeliverResults(const LocalizationResult* results, int count)
+{
+	sinkMutex.lock();
+	ResultSink* sink = resultSink;
+	int slot = sinkGeneration & 1;
+	if (sink) sinkCalls[slot]++;
+	sinkMutex.unlock();
+
+	if (!sink)
+		return false;
+	if (count > 0)
+		sink->OnResults(results, count);
+
+	sinkMutex.lock();
+	sinkCalls[slot]--;
+	sinkMutex.unlock();
+	return true;
 }
 
 void QueuedTracker::ScheduleImageData(ImageData* data, const LocalizationJob* job)
@@ -79,6 +128,20 @@ void QueuedTracker::ScheduleLocalization(uchar* data, int pitch, QTRK_PixelDataT
 
 
 
+void QueuedTracker::SetLocalizationModeProfile(int profile, LocMode_t locType)
+{
+	if (profile < 0 || profile >= QTRK_MAX_MODE_PROFILES)
+		throw std::runtime_error(SPrintf("Invalid localization mode profile %d (max %d)", profile, QTRK_MAX_MODE_PROFILES-1));
+	modeProfiles[profile] = locType;
+}
+
+LocMode_t QueuedTracker::GetLocalizationModeProfile(int profile)
+{
+	if (profile < 0 || profile >= QTRK_MAX_MODE_PROFILES)
+		throw std::runtime_error(SPrintf("Invalid localization mode profile %d (max %d)", profile, QTRK_MAX_MODE_PROFILES-1));
+	return modeProfiles[profile];
+}
+
 ImageData QueuedTracker::DebugImage(int ID)
 {
 	ImageData img;
@@ -88,7 +151,7 @@ ImageData QueuedTracker::DebugImage(int ID)
 
 
 
-int QueuedTracker::ScheduleFrame(void *imgptr, int pitch, int width, int height, ROIPosition *positions, int numROI, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo)
+int QueuedTracker::ScheduleFrame(void *imgptr, int pitch, int width, int height, ROIPosition *positions, int numROI, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo, const int* modeProfiles)
 {
 	uchar* img = (uchar*)imgptr;
 	int bpp = PDT_BytesPerPixel(pdt);
@@ -104,7 +167,7 @@ int QueuedTracker::ScheduleFrame(void *imgptr, int pitch, int width, int height,
 		uchar *roiptr = &img[pitch * pos.y + pos.x * bpp];
 		LocalizationJob job = *jobInfo;
 		job.zlutIndex = i + jobInfo->zlutIndex; // used as offset
-		ScheduleLocalization(roiptr, pitch, pdt, &job);
+		ScheduleLocalization(roiptr, pitch, pdt, &job, modeProfiles ? modeProfiles[i] : 0);
 		count++;
 	}
 	return count;
@@ -112,34 +175,216 @@ int QueuedTracker::ScheduleFrame(void *imgptr, int pitch, int width, int height,
 
 
 
-float QueuedTracker::ZLUTBiasCorrection(float z, int zlut_planes, int bead)
+const float PixelCalibration::MaxQuantizationError = 1e-4f;
+
+void PixelCalibration::Map::Set(const float* src, int width, int height, const char* name)
 {
-	if (!zlut_bias_correction)
+	q.clear();
+	base.clear();
+	scale.clear();
+	f.clear();
+	pitch = width;
+	int n = width*height;
+	if (!src || n == 0)
+		return;
+
+	double sumAbs = 0.0;
+	for (int i=0;i<n;i++) {
+		if (!(fabsf(src[i]) <= FLT_MAX))
+			throw std::runtime_error(SPrintf("Pixel calibration: %s has a non-finite value at pixel (%d,%d)", name, i%width, i/width));
+		sumAbs += fabsf(src[i]);
+	}
+	// Rounding is off by at most half a step
+	double maxError = MaxQuantizationError * sumAbs / n;
+
+	base.resize(height);
+	scale.resize(height);
+	for (int y=0;y<height;y++) {
+		const float* row = &src[y*width];
+		float minv = row[0], maxv = row[0];
+		for (int x=1;x<width;x++) {
+			minv = std::min(minv, row[x]);
+			maxv = std::max(maxv, row[x]);
+		}
+		base[y] = minv;
+		scale[y] = (maxv - minv) / 65535.0f;
+		if (0.5 * scale[y] > maxError) {
+			dbgprintf("Pixel calibration: %s row %d spans [%g, %g], stored as float\n", name, y, minv, maxv);
+			base.clear();
+			scale.clear();
+			f.assign(src, src+n);
+			return;
+		}
+	}
+
+	q.resize(n);
+	for (int y=0;y<height;y++) {
+		float invScale = scale[y] > 0.0f ? 1.0f / scale[y] : 0.0f;
+		for (int x=0;x<width;x++) {
+			int i = y*width+x;
+			q[i] = (ushort)std::min(65535.0f, (src[i] - base[y]) * invScale + 0.5f);
+		}
+	}
+}
+
+const float* PixelCalibration::Map::GetRow(int i, int n, float* tmp) const
+{
+	if (!f.empty())
+		return &f[i];
+	float b = base[i/pitch], s = scale[i/pitch];
+	for (int x=0;x<n;x++)
+		tmp[x] = b + s * q[i+x];
+	return tmp;
+}
+
+std::shared_ptr<PixelCalibration> PixelCalibration::FromBeadImages(const float* offset, const float* gain, int roiWidth, int roiHeight, int numBeads)
+{
+	if ((!offset && !gain) || numBeads <= 0)
+		return std::shared_ptr<PixelCalibration>();
+
+	std::shared_ptr<PixelCalibration> pc = std::make_shared<PixelCalibration>();
+	pc->offset.Set(offset, roiWidth, roiHeight*numBeads, "offset image");
+	pc->gain.Set(gain, roiWidth, roiHeight*numBeads, "gain image");
+	pc->pitch = pc->roiWidth = roiWidth;
+	pc->roiHeight = roiHeight;
+	pc->numBeads = numBeads;
+	pc->beadStart.resize(numBeads);
+	for (int i=0;i<numBeads;i++)
+		pc->beadStart[i] = roiWidth*roiHeight*i;
+	return pc;
+}
+
+std::shared_ptr<PixelCalibration> PixelCalibration::FromSensorMap(const float* offset, const float* gain, int sensorWidth, int sensorHeight,
+	const ROIPosition* roiPositions, int numBeads, int roiWidth, int roiHeight)
+{
+	if ((!offset && !gain) || numBeads <= 0)
+		return std::shared_ptr<PixelCalibration>();
+
+	std::shared_ptr<PixelCalibration> pc = std::make_shared<PixelCalibration>();
+	pc->beadStart.resize(numBeads);
+	for (int i=0;i<numBeads;i++) {
+		const ROIPosition& p = roiPositions[i];
+		if (p.x < 0 || p.y < 0 || p.x + roiWidth > sensorWidth || p.y + roiHeight > sensorHeight)
+			throw std::runtime_error(SPrintf("Pixel calibration map: ROI of bead %d at (%d,%d) is outside the %dx%d sensor", i, p.x, p.y, sensorWidth, sensorHeight));
+		pc->beadStart[i] = p.y * sensorWidth + p.x;
+	}
+	pc->offset.Set(offset, sensorWidth, sensorHeight, "offset map");
+	pc->gain.Set(gain, sensorWidth, sensorHeight, "gain map");
+	pc->pitch = sensorWidth;
+	pc->roiWidth = roiWidth;
+	pc->roiHeight = roiHeight;
+	pc->numBeads = numBeads;
+	return pc;
+}
+
+void PixelCalibration::GetBeadImages(int bead, float* offsetDst, float* gainDst) const
+{
+	int start = beadStart[bead];
+	for (int y=0;y<roiHeight;y++) {
+		for (int x=0;x<roiWidth;x++) {
+			int i = start + y*pitch + x;
+			if (offsetDst) offsetDst[y*roiWidth+x] = offset.IsSet() ? offset.Value(i) : 0.0f;
+			if (gainDst) gainDst[y*roiWidth+x] = gain.IsSet() ? gain.Value(i) : 1.0f;
+		}
+	}
+}
+
+void PixelCalibration::GetImages(const PixelCalibration* calib, std::vector<float>& offset, std::vector<float>& gain)
+{
+	offset.clear();
+	gain.clear();
+	if (!calib)
+		return;
+
+	int n = calib->roiWidth*calib->roiHeight;
+	if (calib->offset.IsSet()) offset.resize(n*calib->numBeads);
+	if (calib->gain.IsSet()) gain.resize(n*calib->numBeads);
+	for (int i=0;i<calib->numBeads;i++)
+		calib->GetBeadImages(i, offset.empty() ? 0 : &offset[n*i], gain.empty() ? 0 : &gain[n*i]);
+}
+
+int QueuedTracker::GetBeadCount()
+{
+	std::vector<int> mapping;
+	GetBeadLUTMapping(mapping);
+	if (!mapping.empty())
+		return mapping.size();
+
+	int count, planes, radialsteps;
+	GetRadialZLUTSize(count, planes, radialsteps);
+	return count;
+}
+
+// Looks up the correction for a measured z in the table built by UpdateZLUTBiasInverse
+float QueuedTracker::ZLUTBiasCorrection(CImageData* inverseTable, float z, int zlut_planes, int lutIndex)
+{
+	if (!inverseTable)
 		return z;
 
-	/*
-        bias = d(r,4);
-        measured_pos = d(r,1) + bias;
-        pos = measured_pos;
-        for k=1:2
-            guess_bias = interp1(d(r,1), bias, pos);
-            pos = measured_pos - guess_bias;
-        end
-		*/
-
-	// we have to reverse the bias table: we know that true_z + bias(true_z) = measured_z, but we can only get bias(measured_z)
-	// It seems that one can iterate towards the right position:
-	
-	float pos = z;
-	for (int k=0;k<4;k++) {
-		float tblpos = pos / (float)zlut_planes * zlut_bias_correction->w;
-		float bias = zlut_bias_correction->interpolate1D(bead, tblpos);
-		pos = z - bias;
+	float tblpos = z / (float)zlut_planes * (inverseTable->w-1);
+	return z - inverseTable->interpolate1D(lutIndex, tblpos);
+}
+
+// We know that true_z + bias(true_z) = measured_z, but results only give us measured_z.
+// Instead of iterating towards true_z for every result, the bias table is inverted once: 
+// measured z is made monotonic with a running max, and the correction measured_z - true_z is
+// resampled on a uniform grid of measured z over [0, zlut_planes].
+void QueuedTracker::UpdateZLUTBiasInverse()
+{
+	if (zlut_bias_inverse) {
+		delete zlut_bias_inverse;
+		zlut_bias_inverse = 0;
+	}
+	if (!zlut_bias_correction)
+		return;
+
+	int count, zlut_planes, radialsteps;
+	GetRadialZLUTSize(count, zlut_planes, radialsteps);
+
+	CImageData* bc = zlut_bias_correction;
+	int w = bc->w, invw = std::max(2, w*2);
+	zlut_bias_inverse = new CImageData(invw, bc->h);
+
+	std::vector<float> truez(w), measured(w);
+	for (int bead=0;bead<bc->h;bead++) {
+		for (int p=0;p<w;p++) {
+			truez[p] = p / (float)w * zlut_planes;
+			measured[p] = truez[p] + bc->at(p, bead);
+			if (p > 0)
+				measured[p] = std::max(measured[p], measured[p-1]);
+		}
+
+		int p=0;
+		for (int g=0;g<invw;g++) {
+			float mz = g / (float)(invw-1) * zlut_planes;
+			float tz;
+			while (p < w-2 && measured[p+1] <= mz)
+				p++;
+
+			if (w < 2 || mz <= measured[0])
+				tz = mz - (measured[0] - truez[0]);
+			else if (mz >= measured[w-1])
+				tz = mz - (measured[w-1] - truez[w-1]);
+			else {
+				float d = measured[p+1] - measured[p];
+				float f = d > 0.0f ? (mz - measured[p]) / d : 0.0f;
+				tz = truez[p] + f * (truez[p+1] - truez[p]);
+			}
+			zlut_bias_inverse->at(g, bead) = mz - tz;
+		}
 	}
-	return pos;
 }
 
+void QueuedTracker::ClearZLUTBiasCorrection()
+{
+	if (zlut_bias_correction) delete zlut_bias_correction;
+	if (zlut_bias_inverse) delete zlut_bias_inverse;
+	zlut_bias_correction = zlut_bias_inverse = 0;
+}
 
+
+// Every worker of the shared executor keeps its tracker and image buffer for the whole table,
+// and only rebinds the ZLUT when it moves on to another bead.
 void QueuedTracker::ComputeZBiasCorrection(int bias_planes, CImageData* result, int smpPerPixel, bool useSplineInterp)
 {
 	int count,zlut_planes,radialsteps;
@@ -150,24 +395,34 @@ void QueuedTracker::ComputeZBiasCorrection(int bias_planes, CImageData* result,
 	std::vector<float> qi_rweights = ComputeRadialBinWindow(cfg.qi_radialsteps);
 	std::vector<float> zlut_rweights = ComputeRadialBinWindow(cfg.zlut_radialsteps);
 
-	if (zlut_bias_correction)
-		delete zlut_bias_correction;
-
+	ClearZLUTBiasCorrection();
 	zlut_bias_correction = new CImageData(bias_planes, count);
 
-	parallel_for(count*bias_planes, [&](int job) {
-	//for (int job=0;job<count*bias_planes;job++) {
+	Executor& executor = Executor::Shared();
+	std::vector<CPUTracker*> trackers(executor.NumWorkers(), (CPUTracker*)0);
+	std::vector<ImageData> images(executor.NumWorkers());
+	std::vector<int> trackerBead(executor.NumWorkers(), -1);
+
+	executor.ForEach(count*bias_planes, [&](int job, int worker) {
 		int bead = job/bias_planes;
 		int plane = job%bias_planes;
 		
 		float *zlut_ptr = &zlut_data[ bead * (zlut_planes*radialsteps) ];
-		CPUTracker trk (cfg.width,cfg.height);
 		ImageData zlut(zlut_ptr, radialsteps, zlut_planes);
-		trk.SetRadialZLUT(zlut.data, zlut.h, zlut.w, 1, cfg.zlut_minradius,cfg.zlut_maxradius, false, false);
-		trk.SetRadialWeights(&zlut_rweights[0]);
+
+		if (!trackers[worker]) {
+			trackers[worker] = new CPUTracker(cfg.width,cfg.height);
+			images[worker] = ImageData::alloc(cfg.width,cfg.height);
+		}
+		CPUTracker& trk = *trackers[worker];
+		ImageData& img = images[worker];
+		if (trackerBead[worker] != bead) {
+			trk.SetRadialZLUT(zlut.data, zlut.h, zlut.w, 1, cfg.zlut_minradius,cfg.zlut_maxradius, false, false);
+			trk.SetRadialWeights(&zlut_rweights[0]);
+			trackerBead[worker] = bead;
+		}
 
 		vector3f pos(cfg.width/2,cfg.height/2, plane /(float) bias_planes * zlut_planes );
-		ImageData img = ImageData::alloc(cfg.width,cfg.height);
 		GenerateImageFromLUT(&img, &zlut, cfg.zlut_minradius, cfg.zlut_maxradius, pos, useSplineInterp,smpPerPixel);
 
 		bool bhit;
@@ -177,22 +432,30 @@ void QueuedTracker::ComputeZBiasCorrection(int bias_planes, CImageData* result,
 		float z = trk.ComputeZ(qi, cfg.zlut_angularsteps, 0);
 		zlut_bias_correction->at(plane, bead) = z - pos.z;
 
-		//trk.ComputeRadialProfile(
-		img.free();
-		if ((job%(count*bias_planes/10)) == 0) 
+		if ((job%std::max(1,count*bias_planes/10)) == 0) 
 			dbgprintf("job=%d\n", job);
-//	}
 	});
 
+	DeleteAllElems(trackers);
+	for (int i=0;i<images.size();i++)
+		images[i].free();
+	delete[] zlut_data;
+
+	UpdateZLUTBiasInverse();
+
 	if (result)
 		*result = *zlut_bias_correction;
+
+	OnZLUTBiasCorrectionChanged();
 }
 
 
 void QueuedTracker::SetZLUTBiasCorrection(const CImageData& bc)
 {
-	if (zlut_bias_correction) delete zlut_bias_correction;
+	ClearZLUTBiasCorrection();
 	zlut_bias_correction = new CImageData(bc);
+	UpdateZLUTBiasInverse();
+	OnZLUTBiasCorrectionChanged();
 }
 
 CImageData* QueuedTracker::GetZLUTBiasCorrection()
@@ -201,3 +464,91 @@ CImageData* QueuedTracker::GetZLUTBiasCorrection()
 	return 0;
 }
 
+// Copies the library contents in through the regular setters. The bias correction is set last, because setting a LUT clears it.
+void QueuedTracker::SetLUTLibrary(std::shared_ptr<LUTLibrary> lib)
+{
+	lib->Validate(cfg);
+
+	int numBeads;
+	SetBeadLUTMapping(lib->GetBeadLUTMapping(numBeads), numBeads);
+
+	int count, planes, rsteps, dims[4];
+	float* zlut = (float*)lib->GetRadialZLUT(count, planes, rsteps);
+	float* imageLUT = (float*)lib->GetImageLUT(dims);
+	if (!imageLUT || !SetImageZLUT(imageLUT, zlut, dims))
+		SetRadialZLUT(zlut, count, planes);
+
+	SetRadialWeights((float*)lib->GetRadialWeights(rsteps));
+
+	int bw, bh;
+	const float* bias = lib->GetZBiasCorrection(bw, bh);
+	if (bias)
+		SetZLUTBiasCorrection(CImageData(ImageData((float*)bias, bw, bh)));
+}
+
+void QueuedTracker::SaveLUTLibrary(const char* filename)
+{
+	LUTLibrary::Save(filename, this);
+}
+
+void QueuedTracker::LoadLUTLibrary(const char* filename)
+{
+	SetLUTLibrary(LUTLibrary::Open(filename));
+}
+
+void QueuedTracker::SaveState(const char* filename)
+{
+	LUTLibrary::Save(filename, this, true);
+}
+
+void QueuedTracker::LoadState(const char* filename)
+{
+	RestoreState(LUTLibrary::Open(filename));
+}
+
+// Mode profiles are restored before the LUTs, because they decide which derived LUT data is computed.
+// The pixel calibration is restored after, because its size depends on the number of LUTs.
+void QueuedTracker::RestoreState(std::shared_ptr<LUTLibrary> lib)
+{
+	lib->Validate(cfg);
+
+	ConfigValueMap cv = lib->GetConfigValues();
+	for (auto i = cv.begin(); i != cv.end(); ++i)
+		SetConfigValue(i->first, i->second);
+
+	LocMode_t modes[QTRK_MAX_MODE_PROFILES];
+	if (lib->GetModeProfiles(modes)) {
+		SetLocalizationMode(modes[0]);
+		for (int i=1;i<QTRK_MAX_MODE_PROFILES;i++)
+			SetLocalizationModeProfile(i, modes[i]);
+	}
+
+	SetLUTLibrary(lib);
+
+	int offsetCount, gainCount;
+	const float* offset = lib->GetPixelCalibration(LUTLibPixelCalibOffset, offsetCount);
+	const float* gain = lib->GetPixelCalibration(LUTLibPixelCalibGain, gainCount);
+	SetPixelCalibrationImages((float*)offset, (float*)gain);
+
+	float offsetFactor, gainFactor;
+	if (lib->GetPixelCalibrationFactors(offsetFactor, gainFactor))
+		SetPixelCalibrationFactors(offsetFactor, gainFactor);
+}
+
+QueuedTracker* CreateQueuedTrackerFromState(const char* filename)
+{
+	std::shared_ptr<LUTLibrary> lib = LUTLibrary::Open(filename);
+	const QTrkSettings* settings = lib->GetSettings();
+	if (!settings)
+		throw std::runtime_error(SPrintf("%s has no tracker settings", filename));
+
+	QueuedTracker* qtrk = CreateQueuedTracker(QTrkComputedConfig(*settings));
+	try {
+		qtrk->RestoreState(lib);
+	} catch (...) {
+		delete qtrk;
+		throw;
+	}
+	return qtrk;
+}
+
@@ -5,6 +5,7 @@
 #include "std_incl.h" 
 #include "threads.h"
 #include <map>
+#include <memory>
 
 
 #include "qtrk_c_api.h"
@@ -13,10 +14,60 @@ template<typename T>
 struct TImageData;
 typedef TImageData<float> ImageData;
 class CImageData;
+class LUTLibrary;
 
 // minimum number of samples for a profile radial bin. Below this the image mean will be used
 #define MIN_RADPROFILE_SMP_COUNT 4
 
+// Number of localization mode profiles that can be selected per job
+#define QTRK_MAX_MODE_PROFILES 16
+
+
+// Pixel calibration, applied while a ROI is converted to float: pixel = (pixel + offset) * gain.
+// Offset and gain maps are stored either as one ROI-sized map per bead, or as a single sensor map shared by all beads,
+// addressed through the ROI position of every bead.
+struct PixelCalibration {
+	// A map is quantized to 16 bit with a base and scale per row, so an outlier only costs precision in its own row.
+	// If a row would be off by more than MaxQuantizationError times the mean magnitude of the map, the map is kept as float.
+	struct Map {
+		std::vector<ushort> q; // empty if not set or kept as float
+		std::vector<float> base, scale; // per row: value = base[row] + scale[row] * q
+		std::vector<float> f; // the values, if quantizing them was too lossy
+		int pitch;
+
+		// Throws if src has non-finite values
+		void Set(const float* src, int width, int height, const char* name);
+		bool IsSet() const { return !q.empty() || !f.empty(); }
+		float Value(int i) const { return f.empty() ? base[i/pitch] + scale[i/pitch] * q[i] : f[i]; }
+		// Values [i, i+n) of a single row. Quantized rows are dequantized into tmp.
+		const float* GetRow(int i, int n, float* tmp) const;
+	};
+	static const float MaxQuantizationError;
+	Map offset, gain;
+	int pitch; // row pitch of the maps in pixels
+	int roiWidth, roiHeight, numBeads;
+	std::vector<int> beadStart; // index of the top-left ROI pixel of every bead in the maps
+
+	// offset and gain are [numBeads*roiHeight*roiWidth], either can be null. Returns null if both are.
+	static std::shared_ptr<PixelCalibration> FromBeadImages(const float* offset, const float* gain, int roiWidth, int roiHeight, int numBeads);
+	// offset and gain are [sensorHeight*sensorWidth], roiPositions are the top-left corners of the bead ROIs
+	static std::shared_ptr<PixelCalibration> FromSensorMap(const float* offset, const float* gain, int sensorWidth, int sensorHeight,
+		const ROIPosition* roiPositions, int numBeads, int roiWidth, int roiHeight);
+
+	bool HasBead(int bead) const { return bead >= 0 && bead < numBeads; }
+	void GetBeadImages(int bead, float* offset, float* gain) const; // dequantized [roiHeight*roiWidth] images, either can be null
+	// Dequantized images of all beads, in the layout of QueuedTracker::SetPixelCalibrationImages. Left empty if a map is not set.
+	static void GetImages(const PixelCalibration* calib, std::vector<float>& offset, std::vector<float>& gain);
+};
+
+// Receives results as the tracker completes them, instead of having them queued for FetchResults.
+class ResultSink
+{
+public:
+	virtual ~ResultSink() {}
+	// Called by the tracker threads, possibly by several at once. Results arrive in batches and are only valid during the call.
+	virtual void OnResults(const LocalizationResult* results, int count) = 0;
+};
 
 // Abstract tracker interface, implementated by QueuedCUDATracker and QueuedCPUTracker
 class QueuedTracker
@@ -27,29 +78,51 @@ public:
 
 	virtual void SetLocalizationMode(LocMode_t locType) = 0;
 
+	// Mode profiles allow beads with different localization modes in the same frame. 
+	// Profile 0 is the mode set by SetLocalizationMode, the other profiles are selected per job.
+	// A job uses the mode of its profile at the time it is scheduled, so changing a profile does not wait for the queue to drain.
+	virtual void SetLocalizationModeProfile(int profile, LocMode_t locType);
+	LocMode_t GetLocalizationModeProfile(int profile);
+
 	// These are per-bead! So both gain and offset are sized [width*height*numbeads], similar to ZLUT
 	// result=gain*(pixel+offset)
 	virtual void SetPixelCalibrationImages(float* offset, float* gain) = 0;
 	virtual void SetPixelCalibrationFactors(float offsetFactor, float gainFactor) = 0;
+	// A single sensor-sized offset and gain map [sensorWidth*sensorHeight] shared by all beads, instead of per-bead images.
+	// roiPositions = [numBeads], the top-left sensor position of every bead ROI. Either map can be null.
+	virtual void SetPixelCalibrationMap(float* offset, float* gain, int sensorWidth, int sensorHeight, ROIPosition* roiPositions, int numBeads) = 0;
+	// Copies of the calibration images, left empty if an image is not set
+	virtual void GetPixelCalibrationImages(std::vector<float>& offset, std::vector<float>& gain) = 0;
+	virtual void GetPixelCalibrationFactors(float& offsetFactor, float& gainFactor) = 0;
 
 	// Frame and timestamp are ignored by tracking code itself, but usable for the calling code
 	// Pitch: Distance in bytes between two successive rows of pixels (e.g. address of (0,0) -  address of (0,1) )
 	// ZlutIndex: Which ZLUT to use for ComputeZ/BuildZLUT
-	virtual void ScheduleLocalization(void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo) = 0;
+	// modeProfile: Which localization mode profile to use
+	virtual void ScheduleLocalization(void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo, int modeProfile=0) = 0;
 	void ScheduleImageData(ImageData* data, const LocalizationJob *jobInfo);
 	virtual void ClearResults() = 0;
 	virtual void Flush() = 0; // stop waiting for more jobs to do, and just process the current batch
 
 	// Schedule an entire frame at once, allowing for further optimizations
-	virtual int ScheduleFrame(void *imgptr, int pitch, int width, int height, ROIPosition *positions, int numROI, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo);
+	// modeProfiles: Optional mode profile per ROI [numROI]
+	virtual int ScheduleFrame(void *imgptr, int pitch, int width, int height, ROIPosition *positions, int numROI, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo, const int* modeProfiles=0);
 	
 	// data can be zero to allocate ZLUT data.
 	virtual void SetRadialZLUT(float* data, int count, int planes) = 0; 
 	virtual void GetRadialZLUT(float* dst) = 0; 
 	virtual void GetRadialZLUTSize(int& count, int& planes, int& radialsteps) = 0;
 
+	// Bead to LUT mapping: beads with the same LUT index share one physical LUT, so the LUT count (SetRadialZLUT) can be smaller than the bead count.
+	// LocalizationJob::zlutIndex stays the bead index, and pixel calibration images stay per bead.
+	// lutIndex = [numBeads], or null to use LUT i for bead i. BuildLUT sums the images of all beads that share a LUT.
+	virtual void SetBeadLUTMapping(const int* lutIndex, int numBeads) = 0;
+	virtual void GetBeadLUTMapping(std::vector<int>& lutIndex) = 0; // empty if no mapping is set
+	int GetBeadCount(); // number of beads in the mapping, or the LUT count without a mapping
+
 	// Set radial weights used for comparing LUT profiles, zcmp has to have 'zlut_radialsteps' elements
 	virtual void SetRadialWeights(float* zcmp) = 0;
+	virtual bool GetRadialWeights(float* dst) { return false; } // returns false if no weights are set
 
 	// allows to obtain the matching profile between all the different Radial ZLUT planes and the track bead profile
 	virtual void EnableRadialZLUTCompareProfile(bool enabled) = 0;
@@ -60,16 +133,32 @@ public:
 	virtual void GetImageZLUT(float* dst) {}
 	virtual bool SetImageZLUT(float* dst, float *radial_zlut, int* dims) { return false; }
 
+	// Replaces all LUTs, radial weights and the bias correction with the contents of a LUT library file.
+	// The default implementation copies the data, QueuedCPUTracker uses the mapped data in place and keeps lib alive while it does.
+	virtual void SetLUTLibrary(std::shared_ptr<LUTLibrary> lib);
+	void SaveLUTLibrary(const char* filename);
+	void LoadLUTLibrary(const char* filename);
+
+	// State snapshots: a LUT library that also holds the config values, localization mode profiles and pixel calibration.
+	// Restoring a snapshot brings a restarted tracker back to where it was without recalibrating.
+	void SaveState(const char* filename);
+	void LoadState(const char* filename);
+	void RestoreState(std::shared_ptr<LUTLibrary> lib);
+
 #define BUILDLUT_IMAGELUT 1
 #define BUILDLUT_FOURIER 2
 #define BUILDLUT_NORMALIZE 4
 #define BUILDLUT_BIASCORRECT 8
+#define BUILDLUT_PIXELBINNED 16 // LUT profiles for LT_PixelBinnedProfile
 	virtual void BeginLUT(uint flags) = 0;
 	virtual void BuildLUT(void* data, int pitch, QTRK_PixelDataType pdt, int plane, vector2f* known_pos=0) = 0;
 	virtual void FinalizeLUT() = 0;
 	
 	virtual int GetResultCount() = 0;
 	virtual int FetchResults(LocalizationResult* results, int maxResults) = 0;
+	// Completed results are passed to the sink instead of being queued. Results queued before are left for FetchResults.
+	// Returns after all calls to the previous sink have finished, so it can be deleted afterwards. Use null to queue results again.
+	void SetResultSink(ResultSink* sink);
 
 	virtual int GetQueueLength(int *maxQueueLen=0) = 0;
 	virtual bool IsIdle() = 0;
@@ -88,16 +177,30 @@ public:
 
 	void ScheduleLocalization(uchar* data, int pitch, QTRK_PixelDataType pdt, uint frame, uint timestamp, vector3f* initial, uint zlutIndex);
 	void ComputeZBiasCorrection(int bias_planes, CImageData* result, int smpPerPixel, bool useSplineInterp);
-	float ZLUTBiasCorrection(float z, int zlut_planes, int bead);
+	float ZLUTBiasCorrection(float z, int zlut_planes, int lutIndex) { return ZLUTBiasCorrection(zlut_bias_inverse, z, zlut_planes, lutIndex); }
+	static float ZLUTBiasCorrection(CImageData* inverseTable, float z, int zlut_planes, int lutIndex);
 	void SetZLUTBiasCorrection(const CImageData& data); // w=zlut_planes, h=zlut_count
 	CImageData *GetZLUTBiasCorrection();
 
 protected:
-	CImageData* zlut_bias_correction;
+	CImageData* zlut_bias_correction; // bias as function of true z: [bead][bias plane]
+	CImageData* zlut_bias_inverse; // correction as function of measured z, derived from zlut_bias_correction
+	void UpdateZLUTBiasInverse();
+	void ClearZLUTBiasCorrection();
+	LocMode_t modeProfiles[QTRK_MAX_MODE_PROFILES];
+	virtual void OnZLUTBiasCorrectionChanged() {}
+	// Passes results to the sink. Returns false if there is no sink, the results should then be queued.
+	bool DeliverResults(const LocalizationResult* results, int count);
+	// sinkMutex is only held to pick up the sink, not during OnResults. The calls in progress are counted per sink generation,
+	// so SetResultSink can wait for the calls to the previous sink while new results already go to the next one.
+	ResultSink* resultSink;
+	int sinkGeneration, sinkCalls[2];
+	Threads::Mutex sinkMutex, setSinkMutex;
 };
 
 void CopyImageToFloat(uchar* data, int width, int height, int pitch, QTRK_PixelDataType pdt, float* dst);
 QueuedTracker* CreateQueuedTracker(const QTrkComputedConfig& cc);
+QueuedTracker* CreateQueuedTrackerFromState(const char* filename); // creates a tracker with the settings of a state snapshot and restores it
 void SetCUDADevices(int *devices, int numdev); // empty for CPU tracker
 
 
@@ -0,0 +1,661 @@
+#include "std_incl.h"
+#include "ResultFileReader.h"
+#include "utils.h"
+
+#ifdef WIN32
+#include <windows.h>
+#undef min
+#undef max
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+std::vector<uchar> MakeResultFileHeader(int numBeads, const std::vector<std::string>& frameInfoNames, int firstFrame)
+{
+	std::vector<uchar> buf(sizeof(ResultFileHeader));
+	for (uint i=0;i<frameInfoNames.size();i++) {
+		auto& n = frameInfoNames[i];
+		buf.insert(buf.end(), n.c_str(), n.c_str()+n.length()+1);
+	}
+	buf.resize((buf.size() + RESULTFILE_ALIGN - 1) / RESULTFILE_ALIGN * RESULTFILE_ALIGN);
+
+	ResultFileHeader* h = (ResultFileHeader*)&buf[0];
+	h->magic = RESULTFILE_MAGIC;
+	h->version = RESULTFILE_VERSION;
+	h->numBeads = numBeads;
+	h->numFrameInfoColumns = frameInfoNames.size();
+	h->dataOffset = buf.size();
+	h->recordSize = ResultFileRecordSize(numBeads, frameInfoNames.size());
+	h->firstFrame = firstFrame;
+	h->headerSize = sizeof(ResultFileHeader);
+	return buf;
+}
+
+std::vector<uchar> MakeResultColumnFileHeader(int numBeads, const std::vector<std::string>& frameInfoNames, int chunkFrames, int flags)
+{
+	std::vector<uchar> buf(sizeof(ResultColumnFileHeader));
+	for (uint i=0;i<frameInfoNames.size();i++) {
+		auto& n = frameInfoNames[i];
+		buf.insert(buf.end(), n.c_str(), n.c_str()+n.length()+1);
+	}
+	buf.resize((buf.size() + RESULTFILE_ALIGN - 1) / RESULTFILE_ALIGN * RESULTFILE_ALIGN);
+
+	ResultColumnFileHeader* h = (ResultColumnFileHeader*)&buf[0];
+	h->magic = RESULTCOLFILE_MAGIC;
+	h->version = RESULTCOLFILE_VERSION;
+	h->numBeads = numBeads;
+	h->numFrameInfoColumns = frameInfoNames.size();
+	h->dataOffset = buf.size();
+	h->chunkFrames = chunkFrames;
+	h->flags = flags;
+	h->headerSize = sizeof(ResultColumnFileHeader);
+	return buf;
+}
+
+// Maps float/double bits to unsigned integers with the same ordering as the values
+static inline uint OrderFloat(uint u) { return (u & 0x80000000u) ? ~u : (u | 0x80000000u); }
+static inline uint UnorderFloat(uint u) { return (u & 0x80000000u) ? (u & 0x7fffffffu) : ~u; }
+static inline uint64_t OrderDouble(uint64_t u) { return (u >> 63) ? ~u : (u | (1ULL << 63)); }
+static inline uint64_t UnorderDouble(uint64_t u) { return (u >> 63) ? (u & ~(1ULL << 63)) : ~u; }
+
+static int BitWidth(uint64_t v) { int w=0; while (v) { w++; v >>= 1; } return w; }
+
+class BitWriter {
+public:
+	BitWriter(std::vector<uchar>& dst) : dst(dst), acc(0), nbits(0) {}
+	void Put(uint64_t v, int w) {
+		if (w > 32) {
+			Put32((uint)v, 32);
+			Put32((uint)(v >> 32), w-32);
+		} else
+			Put32((uint)v, w);
+	}
+	void Put32(uint v, int w) {
+		acc |= (uint64_t)v << nbits;
+		nbits += w;
+		while (nbits >= 8) {
+			dst.push_back((uchar)acc);
+			acc >>= 8;
+			nbits -= 8;
+		}
+	}
+	void Align() { if (nbits > 0) Put32(0, 8-nbits); }
+private:
+	std::vector<uchar>& dst;
+	uint64_t acc;
+	int nbits;
+};
+
+class BitReader {
+public:
+	BitReader(const uchar* src, const uchar* end) : src(src), end(end), acc(0), nbits(0) {}
+	bool Get(uint64_t& v, int w) {
+		uint lo, hi=0;
+		if (w > 32) {
+			if (!Get32(lo, 32) || !Get32(hi, w-32)) return false;
+		} else if (!Get32(lo, w))
+			return false;
+		v = lo | ((uint64_t)hi << 32);
+		return true;
+	}
+	bool Get32(uint& v, int w) {
+		while (nbits < w) {
+			if (src == end) return false;
+			acc |= (uint64_t)*src++ << nbits;
+			nbits += 8;
+		}
+		v = (uint)(acc & ((1ULL << w) - 1));
+		acc >>= w;
+		nbits -= w;
+		return true;
+	}
+	void Align() { acc = 0; nbits = 0; }
+	const uchar* src, *end;
+private:
+	uint64_t acc;
+	int nbits;
+};
+
+// Delta + zigzag + bit packing of a stream of n values with the given number of bits (32 or 64)
+static void PackStream(const uint64_t* v, int n, int bits, std::vector<uchar>& dst)
+{
+	BitWriter bw(dst);
+	uint64_t prev = 0, mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+	uint64_t z[RESULTCOL_GROUP];
+	for (int g=0;g<n;g+=RESULTCOL_GROUP) {
+		int cnt = std::min(RESULTCOL_GROUP, n-g);
+		uint64_t maxz = 0;
+		for (int i=0;i<cnt;i++) {
+			uint64_t d = (v[g+i] - prev) & mask;
+			prev = v[g+i];
+			// zigzag: sign bit to the lowest bit
+			uint64_t sign = (d >> (bits-1)) & 1;
+			z[i] = ((d << 1) & mask) ^ (sign ? mask : 0);
+			maxz |= z[i];
+		}
+		int w = BitWidth(maxz);
+		dst.push_back((uchar)w);
+		for (int i=0;i<cnt;i++)
+			bw.Put(z[i], w);
+		bw.Align();
+	}
+}
+
+static bool UnpackStream(BitReader& br, int n, int bits, uint64_t* v)
+{
+	uint64_t prev = 0, mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+	for (int g=0;g<n;g+=RESULTCOL_GROUP) {
+		int cnt = std::min(RESULTCOL_GROUP, n-g);
+		if (br.src == br.end) return false;
+		int w = *br.src++;
+		if (w > bits) return false;
+		for (int i=0;i<cnt;i++) {
+			uint64_t z;
+			if (!br.Get(z, w)) return false;
+			uint64_t d = (z >> 1) ^ ((z & 1) ? mask : 0);
+			prev = (prev + d) & mask;
+			v[g+i] = prev;
+		}
+		br.Align();
+	}
+	return true;
+}
+
+// Column types in a block
+enum { ColFloat, ColInt, ColDouble };
+
+static void PackColumn(const uchar* src, int n, int type, std::vector<uint64_t>& tmp, std::vector<uchar>& dst)
+{
+	tmp.resize(n);
+	for (int i=0;i<n;i++) {
+		if (type == ColDouble) {
+			uint64_t u; memcpy(&u, src + 8*i, 8);
+			tmp[i] = OrderDouble(u);
+		} else {
+			uint u; memcpy(&u, src + 4*i, 4);
+			tmp[i] = type == ColFloat ? OrderFloat(u) : u;
+		}
+	}
+	PackStream(&tmp[0], n, type == ColDouble ? 64 : 32, dst);
+}
+
+static bool UnpackColumn(BitReader& br, int n, int type, std::vector<uint64_t>& tmp, uchar* dst)
+{
+	tmp.resize(n);
+	if (!UnpackStream(br, n, type == ColDouble ? 64 : 32, &tmp[0]))
+		return false;
+	for (int i=0;i<n;i++) {
+		if (type == ColDouble) {
+			uint64_t u = UnorderDouble(tmp[i]);
+			memcpy(dst + 8*i, &u, 8);
+		} else {
+			uint u = type == ColFloat ? UnorderFloat((uint)tmp[i]) : (uint)tmp[i];
+			memcpy(dst + 4*i, &u, 4);
+		}
+	}
+	return true;
+}
+
+static const int BeadColumnTypes[5] = { ColFloat, ColFloat, ColFloat, ColInt, ColFloat }; // x, y, z, error, imageMean
+
+void CompressResultColumnChunk(const uchar* chunk, int numBeads, int numFrameInfoColumns, std::vector<uchar>& dst)
+{
+	const ResultColumnChunk* c = (const ResultColumnChunk*)chunk;
+	int n = c->numFrames, ni = numFrameInfoColumns;
+	std::vector<uint64_t> tmp;
+
+	dst.resize(sizeof(ResultColumnChunk) + sizeof(uint)*(numBeads+2));
+	std::vector<uint> offsets(numBeads+2);
+
+	// Frame table
+	const uchar* src = chunk + sizeof(ResultColumnChunk);
+	offsets[0] = dst.size();
+	PackColumn(src, n, ColDouble, tmp, dst);
+	src += sizeof(double)*n;
+	for (int i=0;i<ni;i++) {
+		PackColumn(src, n, ColFloat, tmp, dst);
+		src += sizeof(float)*n;
+	}
+
+	for (int b=0;b<numBeads;b++) {
+		offsets[b+1] = dst.size();
+		for (int k=0;k<5;k++) {
+			PackColumn(src, n, BeadColumnTypes[k], tmp, dst);
+			src += sizeof(float)*n;
+		}
+	}
+	dst.resize((dst.size() + 7) & ~7);
+	offsets[numBeads+1] = dst.size();
+
+	ResultColumnChunk* dc = (ResultColumnChunk*)&dst[0];
+	*dc = *c;
+	dc->size = dst.size();
+	memcpy(&dst[sizeof(ResultColumnChunk)], &offsets[0], sizeof(uint)*offsets.size());
+}
+
+bool DecompressResultColumnBlock(const uchar* chunk, int numBeads, int numFrameInfoColumns, int block, std::vector<uchar>& dst)
+{
+	const ResultColumnChunk* c = (const ResultColumnChunk*)chunk;
+	const uint* offsets = (const uint*)(c+1);
+	int n = c->numFrames;
+	if (offsets[block] > offsets[block+1] || offsets[block+1] > (uint)c->size)
+		return false;
+
+	BitReader br(chunk + offsets[block], chunk + offsets[block+1]);
+	std::vector<uint64_t> tmp;
+	if (block == 0) {
+		dst.resize((sizeof(double) + sizeof(float)*numFrameInfoColumns) * n);
+		if (!UnpackColumn(br, n, ColDouble, tmp, &dst[0]))
+			return false;
+		for (int i=0;i<numFrameInfoColumns;i++)
+			if (!UnpackColumn(br, n, ColFloat, tmp, &dst[(sizeof(double) + sizeof(float)*i) * n]))
+				return false;
+	} else {
+		dst.resize(sizeof(float)*5*n);
+		for (int k=0;k<5;k++)
+			if (!UnpackColumn(br, n, BeadColumnTypes[k], tmp, &dst[sizeof(float)*k*n]))
+				return false;
+	}
+	return true;
+}
+
+MappedResultFile::MappedResultFile(const char* filename)
+{
+	this->filename = filename;
+	base = 0;
+	mappedSize = 0;
+	numBeads = numFrames = 0;
+
+#ifdef WIN32
+	mapping = 0;
+	// The writer still has the file open for writing
+	HANDLE h = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (h == INVALID_HANDLE_VALUE)
+		throw std::runtime_error(SPrintf("Can't open %s", filename));
+	file = h;
+#else
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error(SPrintf("Can't open %s", filename));
+#endif
+}
+
+MappedResultFile::~MappedResultFile()
+{
+	Unmap();
+#ifdef WIN32
+	CloseHandle(file);
+#else
+	close(fd);
+#endif
+}
+
+void MappedResultFile::Unmap()
+{
+#ifdef WIN32
+	if (base) UnmapViewOfFile(base);
+	if (mapping) CloseHandle(mapping);
+	mapping = 0;
+#else
+	if (base) munmap((void*)base, mappedSize);
+#endif
+	base = 0;
+	mappedSize = 0;
+}
+
+void MappedResultFile::Map(int64_t len)
+{
+	Unmap();
+	if (len <= 0)
+		return;
+#ifdef WIN32
+	mapping = CreateFileMappingA(file, 0, PAGE_READONLY, (DWORD)(len >> 32), (DWORD)len, 0);
+	if (mapping)
+		base = (const uchar*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, (SIZE_T)len);
+#else
+	void* p = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+	base = p == MAP_FAILED ? 0 : (const uchar*)p;
+#endif
+	if (!base)
+		throw std::runtime_error(SPrintf("Can't map %s", filename.c_str()));
+	mappedSize = len;
+}
+
+int64_t MappedResultFile::FileSize()
+{
+#ifdef WIN32
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(file, &fileSize);
+	return fileSize.QuadPart;
+#else
+	struct stat st;
+	fstat(fd, &st);
+	return st.st_size;
+#endif
+}
+
+void MappedResultFile::ReadNames(int offset, int end, int count)
+{
+	const char* p = (const char*)base + offset, *e = (const char*)base + end;
+	frameInfoNames.resize(count);
+	for (int i=0;i<count && p<e;i++) {
+		frameInfoNames[i] = std::string(p, strnlen(p, e-p));
+		p += frameInfoNames[i].length()+1;
+	}
+}
+
+ResultFileReader::ResultFileReader(const char* filename) : MappedResultFile(filename)
+{
+	int64_t size = FileSize();
+	if (size < (int64_t)sizeof(ResultFileHeader))
+		throw std::runtime_error(SPrintf("%s is not a result file", filename));
+	Map(sizeof(ResultFileHeader));
+
+	hdr = *(const ResultFileHeader*)base;
+	if (hdr.magic != RESULTFILE_MAGIC)
+		throw std::runtime_error(SPrintf("%s is not a result file", filename));
+	if (hdr.version > RESULTFILE_VERSION)
+		throw std::runtime_error(SPrintf("Result file %s has version %d, only up to version %d is supported", filename, hdr.version, RESULTFILE_VERSION));
+	if (hdr.numBeads < 0 || hdr.numFrameInfoColumns < 0 || hdr.recordSize != ResultFileRecordSize(hdr.numBeads, hdr.numFrameInfoColumns) ||
+		hdr.headerSize < (int)sizeof(ResultFileHeader) || hdr.dataOffset < hdr.headerSize || hdr.dataOffset > size)
+		throw std::runtime_error(SPrintf("Result file %s has an invalid header", filename));
+
+	numBeads = hdr.numBeads;
+	Map(hdr.dataOffset);
+	ReadNames(hdr.headerSize, hdr.dataOffset, hdr.numFrameInfoColumns);
+	Refresh();
+}
+
+int ResultFileReader::Refresh(int64_t maxSize)
+{
+	int64_t size = FileSize();
+	if (maxSize >= 0 && size > maxSize)
+		size = maxSize;
+
+	// Only map whole records
+	int n = size > hdr.dataOffset ? (int)((size - hdr.dataOffset) / hdr.recordSize) : 0;
+	if (n == numFrames)
+		return numFrames;
+	int64_t len = hdr.dataOffset + (int64_t)n * hdr.recordSize;
+	if (len != mappedSize)
+		Map(len);
+
+	// The last block of a file written with direct I/O is zero padded until the writer flushes, skip records that are not there yet
+	while (n > 0) {
+		uint frame = *(const uint*)(base + hdr.dataOffset + (int64_t)(n-1) * hdr.recordSize);
+		if (frame == (uint)(hdr.firstFrame + n-1))
+			break;
+		n--;
+	}
+	numFrames = n;
+	return numFrames;
+}
+
+const uchar* ResultFileReader::Record(int frame)
+{
+	int i = frame - hdr.firstFrame;
+	if (i < 0 || i >= numFrames)
+		return 0;
+	return base + hdr.dataOffset + (int64_t)i * hdr.recordSize;
+}
+
+int ResultFileReader::GetFrames(int start, int count, LocalizationResult* results, double* timestamps, float* frameInfo)
+{
+	int nb = hdr.numBeads, ni = hdr.numFrameInfoColumns;
+	int n = std::max(0, std::min(count, hdr.firstFrame + numFrames - start));
+
+	for (int f=0;f<n;f++) {
+		const uchar* rec = Record(start+f);
+		if (!rec) return f;
+		if (timestamps) memcpy(&timestamps[f], rec + sizeof(uint), sizeof(double));
+		const uchar* src = rec + sizeof(uint) + sizeof(double);
+		if (frameInfo) memcpy(&frameInfo[f*ni], src, sizeof(float)*ni);
+		src += sizeof(float)*ni;
+		if (results) {
+			const uchar* pos = src, *err = pos + sizeof(vector3f)*nb, *mean = err + sizeof(int)*nb;
+			for (int i=0;i<nb;i++) {
+				LocalizationResult& r = results[f*nb+i];
+				r = LocalizationResult();
+				r.job.frame = start+f;
+				r.job.zlutIndex = i;
+				memcpy(&r.pos, pos + sizeof(vector3f)*i, sizeof(vector3f));
+				memcpy(&r.error, err + sizeof(int)*i, sizeof(int));
+				memcpy(&r.imageMean, mean + sizeof(float)*i, sizeof(float));
+			}
+		}
+	}
+	return n;
+}
+
+int ResultFileReader::GetBeadTrace(int bead, int start, int count, LocalizationResult* results)
+{
+	int nb = hdr.numBeads, ni = hdr.numFrameInfoColumns;
+	if (bead < 0 || bead >= nb)
+		return 0;
+
+	// Offsets of this bead's fields within a record
+	int posOfs = sizeof(uint) + sizeof(double) + sizeof(float)*ni + sizeof(vector3f)*bead;
+	int errOfs = sizeof(uint) + sizeof(double) + sizeof(float)*ni + sizeof(vector3f)*nb + sizeof(int)*bead;
+	int meanOfs = errOfs + sizeof(int)*nb;
+
+	int n = std::max(0, std::min(count, hdr.firstFrame + numFrames - start));
+	for (int f=0;f<n;f++) {
+		const uchar* rec = Record(start+f);
+		if (!rec) return f;
+		LocalizationResult& r = results[f];
+		r = LocalizationResult();
+		r.job.frame = start+f;
+		r.job.zlutIndex = bead;
+		memcpy(&r.pos, rec + posOfs, sizeof(vector3f));
+		memcpy(&r.error, rec + errOfs, sizeof(int));
+		memcpy(&r.imageMean, rec + meanOfs, sizeof(float));
+	}
+	return n;
+}
+
+
+ResultColumnFileReader::ResultColumnFileReader(const char* filename) : MappedResultFile(filename)
+{
+	scanOffset = 0;
+	complete = false;
+
+	int64_t size = FileSize();
+	if (size < (int64_t)sizeof(ResultColumnFileHeader))
+		throw std::runtime_error(SPrintf("%s is not a bead column file", filename));
+	Map(sizeof(ResultColumnFileHeader));
+
+	hdr = *(const ResultColumnFileHeader*)base;
+	if (hdr.magic != RESULTCOLFILE_MAGIC)
+		throw std::runtime_error(SPrintf("%s is not a bead column file", filename));
+	if (hdr.version > RESULTCOLFILE_VERSION)
+		throw std::runtime_error(SPrintf("Bead column file %s has version %d, only up to version %d is supported", filename, hdr.version, RESULTCOLFILE_VERSION));
+	if (hdr.numBeads < 0 || hdr.numFrameInfoColumns < 0 || hdr.headerSize < (int)sizeof(ResultColumnFileHeader) || 
+		hdr.dataOffset < hdr.headerSize || hdr.dataOffset > size)
+		throw std::runtime_error(SPrintf("Bead column file %s has an invalid header", filename));
+
+	numBeads = hdr.numBeads;
+	Map(hdr.dataOffset);
+	ReadNames(hdr.headerSize, hdr.dataOffset, hdr.numFrameInfoColumns);
+	scanOffset = hdr.dataOffset;
+	Refresh();
+}
+
+bool ResultColumnFileReader::ReadDirectory(int64_t size)
+{
+	if (size < hdr.dataOffset + (int64_t)sizeof(ResultColumnDirTrailer))
+		return false;
+	const ResultColumnDirTrailer* t = (const ResultColumnDirTrailer*)(base + size - sizeof(ResultColumnDirTrailer));
+	if (t->magic != RESULTCOLDIR_MAGIC || t->numChunks < 0 || t->dirOffset < hdr.dataOffset || 
+		t->dirOffset + (int64_t)sizeof(ResultColumnDirEntry) * t->numChunks + (int64_t)sizeof(ResultColumnDirTrailer) != size)
+		return false;
+
+	const ResultColumnDirEntry* dir = (const ResultColumnDirEntry*)(base + t->dirOffset);
+	std::vector<ResultColumnDirEntry> entries(dir, dir + t->numChunks);
+	int n = 0;
+	for (uint i=0;i<entries.size();i++) {
+		auto& e = entries[i];
+		if (e.offset < hdr.dataOffset || !ValidChunk(e.offset, t->dirOffset) || e.numFrames != ((const ResultColumnChunk*)(base + e.offset))->numFrames ||
+			(i > 0 && e.startFrame != entries[i-1].startFrame + entries[i-1].numFrames))
+			return false;
+		n += e.numFrames;
+	}
+	chunks.swap(entries);
+	numFrames = n;
+	return true;
+}
+
+bool ResultColumnFileReader::ValidChunk(int64_t offset, int64_t end)
+{
+	if (offset + (int64_t)sizeof(ResultColumnChunk) > end)
+		return false;
+	const ResultColumnChunk* c = (const ResultColumnChunk*)(base + offset);
+	if (c->magic != RESULTCOLCHUNK_MAGIC || c->numFrames <= 0 || offset + c->size > end)
+		return false;
+	if (IsCompressed())
+		return c->size >= (int)(sizeof(ResultColumnChunk) + sizeof(uint)*(hdr.numBeads+2)) && c->size % 8 == 0;
+	return c->size == ResultColumnChunkSize(hdr.numBeads, hdr.numFrameInfoColumns, c->numFrames);
+}
+
+int ResultColumnFileReader::Refresh(int64_t maxSize)
+{
+	if (complete)
+		return numFrames;
+
+	int64_t size = FileSize();
+	if (maxSize >= 0 && size > maxSize)
+		size = maxSize;
+	if (size > mappedSize)
+		Map(size);
+
+	if (ReadDirectory(size)) {
+		complete = true;
+		return numFrames;
+	}
+
+	// Still being written: follow the chunks from the last one found
+	while (ValidChunk(scanOffset, size)) {
+		const ResultColumnChunk* c = (const ResultColumnChunk*)(base + scanOffset);
+		if (!chunks.empty() && c->startFrame != chunks.back().startFrame + chunks.back().numFrames)
+			break;
+		ResultColumnDirEntry e;
+		e.offset = scanOffset;
+		e.startFrame = c->startFrame;
+		e.numFrames = c->numFrames;
+		chunks.push_back(e);
+		numFrames += c->numFrames;
+		scanOffset += c->size;
+	}
+	return numFrames;
+}
+
+int ResultColumnFileReader::FindChunk(int frame)
+{
+	// Last chunk starting at or before the frame
+	int lo = 0, hi = chunks.size();
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (chunks[mid].startFrame <= frame) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == 0 || frame >= chunks[lo-1].startFrame + chunks[lo-1].numFrames)
+		return -1;
+	return lo-1;
+}
+
+const float* ResultColumnFileReader::BeadColumns(int chunk, int bead)
+{
+	if (IsCompressed()) {
+		if (!DecompressResultColumnBlock(base + chunks[chunk].offset, hdr.numBeads, hdr.numFrameInfoColumns, 1+bead, beadBuffer))
+			return 0;
+		return (const float*)&beadBuffer[0];
+	}
+	int n = chunks[chunk].numFrames;
+	const uchar* p = base + chunks[chunk].offset + sizeof(ResultColumnChunk) + (sizeof(double) + sizeof(float)*hdr.numFrameInfoColumns) * n;
+	return (const float*)p + (int64_t)5 * n * bead;
+}
+
+const double* ResultColumnFileReader::FrameTable(int chunk)
+{
+	if (IsCompressed()) {
+		if (!DecompressResultColumnBlock(base + chunks[chunk].offset, hdr.numBeads, hdr.numFrameInfoColumns, 0, frameBuffer))
+			return 0;
+		return (const double*)&frameBuffer[0];
+	}
+	return (const double*)(base + chunks[chunk].offset + sizeof(ResultColumnChunk));
+}
+
+int ResultColumnFileReader::GetFrames(int start, int count, LocalizationResult* results, double* timestamps, float* frameInfo)
+{
+	int nb = hdr.numBeads, ni = hdr.numFrameInfoColumns;
+	int f = start;
+	while (f < start+count) {
+		int k = FindChunk(f);
+		if (k < 0) break;
+		int n = chunks[k].numFrames, i0 = f - chunks[k].startFrame;
+		int m = std::min(n - i0, start + count - f);
+
+		if (timestamps || frameInfo) {
+			const double* ts = FrameTable(k);
+			if (!ts) break;
+			const float* info = (const float*)(ts + n);
+			for (int j=0;j<m;j++) {
+				if (timestamps) timestamps[f-start+j] = ts[i0+j];
+				if (frameInfo) {
+					for (int i=0;i<ni;i++)
+						frameInfo[(f-start+j)*ni+i] = info[i*n+i0+j];
+				}
+			}
+		}
+		if (results) {
+			for (int b=0;b<nb;b++) {
+				const float* col = BeadColumns(k, b);
+				if (!col) return f-start;
+				for (int j=0;j<m;j++) {
+					LocalizationResult& r = results[(f-start+j)*nb+b];
+					r = LocalizationResult();
+					r.job.frame = f+j;
+					r.job.zlutIndex = b;
+					r.pos = vector3f(col[i0+j], col[n+i0+j], col[2*n+i0+j]);
+					r.error = ((const int*)col)[3*n+i0+j];
+					r.imageMean = col[4*n+i0+j];
+				}
+			}
+		}
+		f += m;
+	}
+	return f-start;
+}
+
+int ResultColumnFileReader::GetBeadTrace(int bead, int start, int count, LocalizationResult* results)
+{
+	if (bead < 0 || bead >= hdr.numBeads)
+		return 0;
+
+	int f = start;
+	while (f < start+count) {
+		int k = FindChunk(f);
+		if (k < 0) break;
+		int n = chunks[k].numFrames, i0 = f - chunks[k].startFrame;
+		int m = std::min(n - i0, start + count - f);
+
+		// The bead's columns are contiguous within the chunk
+		const float* cols = BeadColumns(k, bead);
+		if (!cols) break;
+		const float* x = cols + i0, *y = x + n, *z = y + n, *mean = z + 2*n;
+		const int* err = (const int*)(z + n);
+		for (int j=0;j<m;j++) {
+			LocalizationResult& r = results[f-start+j];
+			r = LocalizationResult();
+			r.job.frame = f+j;
+			r.job.zlutIndex = bead;
+			r.pos = vector3f(x[j], y[j], z[j]);
+			r.error = err[j];
+			r.imageMean = mean[j];
+		}
+		f += m;
+	}
+	return f-start;
+}
@@ -0,0 +1,201 @@
+// Binary result files written by ResultManager, and memory-mapped readers for them.
+// Both readers can follow a file that is still being written. Records and chunks are validated, but the end of a file written
+// with direct I/O can still be incomplete: pass the number of bytes known to be written (ResultWriter::BytesWritten) to Refresh
+// when reading such a file live.
+//
+// Frame records (ResultOutputBinary): every frame is stored in a fixed-size record, so record i holds frame firstFrame+i and any
+// frame range or bead trace is found without scanning the file.
+//
+// Bead columns (ResultOutputColumns): frames are stored in chunks, and within a chunk every bead has its own block of columns.
+// A bead trace over a long time range is then read as one block per chunk instead of touching every frame record.
+// With RESULTCOL_COMPRESSED, every block of a chunk is compressed separately, so single beads still decode without the rest.
+
+#pragma once
+
+#include "qtrk_c_api.h"
+#include <string>
+#include <vector>
+
+#define RESULTFILE_MAGIC 0x53455251 // "QRES"
+#define RESULTFILE_VERSION 4
+#define RESULTFILE_ALIGN 16 // alignment of the first record or chunk
+#define RESULTCOLFILE_MAGIC 0x4c4f4351 // "QCOL"
+#define RESULTCOLFILE_VERSION 1
+#define RESULTCOLCHUNK_MAGIC 0x4b484351 // "QCHK"
+#define RESULTCOLDIR_MAGIC 0x52494451 // "QDIR"
+#define RESULTCOL_COMPRESSED 1 // ResultColumnFileHeader::flags
+#define RESULTCOL_GROUP 128 // values per bit width in a compressed stream
+
+struct ResultFileHeader {
+	uint magic;
+	uint version;
+	int numBeads;
+	int numFrameInfoColumns;
+	int dataOffset; // start of the first record, multiple of RESULTFILE_ALIGN
+	int recordSize; // bytes per frame
+	int firstFrame; // frame number of the first record
+	int headerSize; // sizeof(ResultFileHeader), the zero-terminated frame info column names follow
+};
+
+// Frame record, little endian and packed:
+//   uint frame
+//   double timestamp
+//   float frameInfo[numFrameInfoColumns]
+//   vector3f pos[numBeads]
+//   int error[numBeads]
+//   float imageMean[numBeads]
+inline int ResultFileRecordSize(int numBeads, int numFrameInfoColumns) {
+	return sizeof(uint) + sizeof(double) + sizeof(float)*numFrameInfoColumns + (sizeof(vector3f)+sizeof(int)+sizeof(float))*numBeads;
+}
+
+// Builds the header and column names, padded up to the data offset
+std::vector<uchar> MakeResultFileHeader(int numBeads, const std::vector<std::string>& frameInfoNames, int firstFrame=0);
+
+struct ResultColumnFileHeader {
+	uint magic; // RESULTCOLFILE_MAGIC
+	uint version;
+	int numBeads;
+	int numFrameInfoColumns;
+	int dataOffset; // start of the first chunk, multiple of RESULTFILE_ALIGN
+	int chunkFrames; // frames per chunk. Chunks written by a flush can be shorter.
+	int flags; // RESULTCOL_COMPRESSED
+	int headerSize; // sizeof(ResultColumnFileHeader), the zero-terminated frame info column names follow
+};
+
+// Chunk of n frames, directly followed by:
+//   double timestamp[n]
+//   float frameInfo[numFrameInfoColumns][n]
+//   for every bead: float x[n], y[n], z[n]; int error[n]; float imageMean[n]
+//
+// A compressed chunk is followed by uint blockOffset[numBeads+2], relative to the chunk start, and the blocks: the frame table
+// (timestamps and frame info) and then one block per bead. Blocks decompress to the layout above.
+// Every column is a stream of n values. Floats and doubles are mapped to integers with the same ordering, so values that are
+// close have a small difference. Each value is stored as the zigzag coded difference to the previous one, in groups of
+// RESULTCOL_GROUP values: one byte with the bit width of the largest difference in the group, then the differences bit packed.
+struct ResultColumnChunk {
+	uint magic; // RESULTCOLCHUNK_MAGIC
+	int startFrame;
+	int numFrames;
+	int size; // in bytes, including this header and padding
+};
+
+// Chunk directory, appended when the file is closed. The file then ends with a ResultColumnDirTrailer.
+// Readers of a file without directory find the chunks by following their sizes.
+struct ResultColumnDirEntry {
+	int64_t offset;
+	int startFrame;
+	int numFrames;
+};
+
+struct ResultColumnDirTrailer {
+	int64_t dirOffset;
+	int numChunks;
+	uint magic; // RESULTCOLDIR_MAGIC
+};
+
+// Chunk sizes are padded to a multiple of 8, so the timestamps and the directory are aligned
+inline int64_t ResultColumnChunkSize(int numBeads, int numFrameInfoColumns, int numFrames) {
+	int64_t size = sizeof(ResultColumnChunk) + (sizeof(double) + sizeof(float)*numFrameInfoColumns + (sizeof(vector3f)+sizeof(int)+sizeof(float))*numBeads) * (int64_t)numFrames;
+	return (size + 7) & ~7;
+}
+
+std::vector<uchar> MakeResultColumnFileHeader(int numBeads, const std::vector<std::string>& frameInfoNames, int chunkFrames, int flags=0);
+
+// Compresses a chunk of the uncompressed layout
+void CompressResultColumnChunk(const uchar* chunk, int numBeads, int numFrameInfoColumns, std::vector<uchar>& dst);
+// Decompresses block 0 (frame table) or block 1+bead of a compressed chunk. Returns false if the chunk is corrupt.
+bool DecompressResultColumnBlock(const uchar* chunk, int numBeads, int numFrameInfoColumns, int block, std::vector<uchar>& dst);
+
+// Common interface of the readers, and the read-only file mapping they share
+class MappedResultFile
+{
+public:
+	virtual ~MappedResultFile();
+
+	// Maps data appended since the last call. maxSize limits the mapping to bytes known to be written completely (-1 for the whole file).
+	// Returns the number of frames available.
+	virtual int Refresh(int64_t maxSize=-1) = 0;
+
+	int NumBeads() { return numBeads; }
+	const std::vector<std::string>& FrameInfoNames() { return frameInfoNames; }
+	int NumFrameInfoColumns() { return frameInfoNames.size(); }
+	virtual int FirstFrame() = 0;
+	int FrameCount() { return numFrames; } // frames available as of the last Refresh
+
+	// Reads frames [start, start+count). results = [count*numBeads], timestamps = [count], frameInfo = [count*numFrameInfoColumns]; any can be null.
+	// Returns the number of frames read, which is less than count if the file ends earlier.
+	virtual int GetFrames(int start, int count, LocalizationResult* results, double* timestamps=0, float* frameInfo=0) = 0;
+	// Reads a single bead over frames [start, start+count)
+	virtual int GetBeadTrace(int bead, int start, int count, LocalizationResult* results) = 0;
+
+protected:
+	MappedResultFile(const char* filename); // throws if the file can not be opened
+	int64_t FileSize();
+	void Map(int64_t len);
+	void Unmap();
+	void ReadNames(int offset, int end, int count); // zero-terminated frame info column names in the mapped header
+
+	std::string filename;
+	const uchar* base;
+	int64_t mappedSize;
+	int numBeads, numFrames;
+	std::vector<std::string> frameInfoNames;
+#ifdef WIN32
+	void* file, *mapping;
+#else
+	int fd;
+#endif
+};
+
+class ResultFileReader : public MappedResultFile
+{
+public:
+	// Maps the file read-only. Throws if it can not be opened or is not a result file.
+	ResultFileReader(const char* filename);
+
+	int Refresh(int64_t maxSize=-1);
+	int FirstFrame() { return hdr.firstFrame; }
+
+	// Pointer to the record of the given frame, null if it is not in the file
+	const uchar* Record(int frame);
+
+	int GetFrames(int start, int count, LocalizationResult* results, double* timestamps=0, float* frameInfo=0);
+	int GetBeadTrace(int bead, int start, int count, LocalizationResult* results);
+
+private:
+	ResultFileHeader hdr;
+};
+
+class ResultColumnFileReader : public MappedResultFile
+{
+public:
+	// Maps the file read-only. Throws if it can not be opened or is not a bead column file.
+	ResultColumnFileReader(const char* filename);
+
+	int Refresh(int64_t maxSize=-1);
+	int FirstFrame() { return chunks.empty() ? 0 : chunks[0].startFrame; }
+
+	int NumChunks() { return chunks.size(); }
+	const ResultColumnChunk* GetChunk(int i) { return (const ResultColumnChunk*)(base + chunks[i].offset); }
+	int FindChunk(int frame); // -1 if the frame is not in the file
+	bool IsCompressed() { return (hdr.flags & RESULTCOL_COMPRESSED) != 0; }
+	// Column block of a bead: x[n], y[n], z[n], error[n], imageMean[n] with n = GetChunk(chunk)->numFrames
+	// For compressed files, the block is decompressed into a buffer that is reused by the next call. Null if the chunk is corrupt.
+	const float* BeadColumns(int chunk, int bead);
+	// Frame table: timestamp[n], followed by frameInfo[numFrameInfoColumns][n]. Buffered like BeadColumns.
+	const double* FrameTable(int chunk);
+
+	int GetFrames(int start, int count, LocalizationResult* results, double* timestamps=0, float* frameInfo=0);
+	int GetBeadTrace(int bead, int start, int count, LocalizationResult* results);
+
+private:
+	bool ReadDirectory(int64_t size);
+	bool ValidChunk(int64_t offset, int64_t end); // chunk header at offset, ending before end
+
+	std::vector<uchar> beadBuffer, frameBuffer; // decompressed blocks
+
+	ResultColumnFileHeader hdr;
+	std::vector<ResultColumnDirEntry> chunks;
+	int64_t scanOffset; // where the next chunk is expected
+	bool complete; // the directory was read, the file is closed
+};
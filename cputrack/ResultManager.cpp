@@ -1,30 +1,92 @@
 #include "std_incl.h"
 #include "ResultManager.h"
 #include "utils.h"
-
-#define BINFILE_VERSION 3
+#include <memory>
 
 TextResultFile::TextResultFile(const char *fn, bool write)
 {
 	f = fopen(fn, write?"w":"r");
+	if (!f)
+		throw std::runtime_error(SPrintf("Unable to open file %s", fn));
+	row = 0;
 }
 
-void TextResultFile::LoadRow(std::vector<vector3f>& pos)
+TextResultFile::~TextResultFile()
 {
+	fclose(f);
+}
 
+void TextResultFile::LoadRow(std::vector<vector3f>& pos)
+{
+	pos.clear();
+	std::string line;
+	for (int c; (c = fgetc(f)) != EOF && c != '\n'; )
+		line += (char)c;
+
+	// Skip frame number and timestamp
+	const char* p = line.c_str();
+	char* end;
+	strtod(p, &end);
+	strtod(end, &end);
+	while (true) {
+		vector3f v;
+		p = end; v.x = (float)strtod(p, &end);
+		if (end == p) break;
+		p = end; v.y = (float)strtod(p, &end);
+		p = end; v.z = (float)strtod(p, &end);
+		pos.push_back(v);
+	}
 }
 
 void TextResultFile::SaveRow(std::vector<vector3f>& pos)
 {
+	fprintf(f, "%d\t%f\t", row++, 0.0);
+	for (uint i=0;i<pos.size();i++)
+		fprintf(f, "%.7f\t%.7f\t%.7f\t", pos[i].x, pos[i].y, pos[i].z);
+	fputs("\n", f);
 }
 
-void BinaryResultFile::LoadRow(std::vector<vector3f>& pos)
+BinaryResultFile::BinaryResultFile(const char* fn, bool write)
+{
+	f = 0;
+	reader = 0;
+	row = 0;
+	if (write) {
+		f = fopen(fn, "wb");
+		if (!f)
+			throw std::runtime_error(SPrintf("Unable to open file %s", fn));
+	} else
+		reader = new ResultFileReader(fn);
+}
+
+BinaryResultFile::~BinaryResultFile()
 {
+	if (f) fclose(f);
+	delete reader;
+}
 
+void BinaryResultFile::LoadRow(std::vector<vector3f>& pos)
+{
+	pos.clear();
+	const uchar* rec = reader->Record(reader->FirstFrame() + row);
+	if (!rec)
+		return;
+	pos.resize(reader->NumBeads());
+	memcpy(pos.data(), rec + sizeof(uint) + sizeof(double) + sizeof(float)*reader->NumFrameInfoColumns(), sizeof(vector3f)*pos.size());
+	row++;
 }
 
 void BinaryResultFile::SaveRow(std::vector<vector3f>& pos)
 {
+	int nb = pos.size();
+	if (row == 0) {
+		std::vector<uchar> hdr = MakeResultFileHeader(nb, std::vector<std::string>());
+		fwrite(&hdr[0], hdr.size(), 1, f);
+	}
+	std::vector<uchar> rec(ResultFileRecordSize(nb, 0));
+	*(uint*)&rec[0] = row++;
+	if (nb > 0) memcpy(&rec[sizeof(uint)+sizeof(double)], pos.data(), sizeof(vector3f)*nb);
+	fwrite(&rec[0], rec.size(), 1, f);
 }
 
 
@@ -40,168 +102,442 @@ ResultManager::FrameCounters::FrameCounters()
 }
 
 ResultManager::ResultManager(const char *outfile, const char* frameInfoFile, ResultManagerConfig *cfg, std::vector<std::string> colnames)
+	: beadStats(cfg->numBeads)
 {
 	config = *cfg;
 	outputFile = outfile;
 	this->frameInfoFile = frameInfoFile;
 
 	qtrk = 0;
+	resultWriter = frameInfoWriter = 0;
+	fileReader = 0;
+	publisher = 0;
+	completedFrames = publishedFrames = 0;
+	rawWriter = 0;
+	streamSlots = 4096;
 
-	thread = Threads::Create(ThreadLoop, this);
-	quit=false;
-
-	if (!outputFile.empty())
-		remove(outfile);
-	if (!this->frameInfoFile.empty())
-		remove(frameInfoFile);
+	// Frames can arrive ahead of the window while the thread has not yet removed old ones
+	numFramesInMemory = 0;
+	ResizeFrameRing(config.maxFramesInMemory > 0 ? config.maxFramesInMemory + std::max(1024u, config.maxFramesInMemory/4) : 4096);
 
 	frameInfoNames = colnames;
 
+	// Column chunks hold at least a write interval, but never more frames than are kept in memory
+	columnChunkFrames = std::max(config.writeInterval, 1024);
+	columnChunkFrames = std::min(columnChunkFrames, (1<<30) / std::max(1, (int)ResultColumnChunkSize(config.numBeads, config.numFrameInfoColumns, 1)));
+	if (config.maxFramesInMemory > 0)
+		columnChunkFrames = std::min(columnChunkFrames, (int)config.maxFramesInMemory);
+	columnChunkFrames = std::max(1, columnChunkFrames);
+
+	// Files are opened once and written by the writer threads, so storing results never waits for the disk.
+	// Both are opened before taking ownership, so a failure to open the second one doesn't leak the first.
+	std::unique_ptr<ResultWriter> rw, fw;
+	if (!outputFile.empty())
+		rw.reset(new ResultWriter(outfile));
+	if (!config.binaryOutput && !this->frameInfoFile.empty())
+		fw.reset(new ResultWriter(frameInfoFile));
+	resultWriter = rw.release();
+	frameInfoWriter = fw.release();
+
 	if (config.binaryOutput) {
 		WriteBinaryFileHeader();
 	}
 
+	quit=false;
+	thread = Threads::Create(ThreadLoop, this);
+
 	dbgprintf("Allocating ResultManager with %d beads, %d motor columns and writeinterval %d\n", cfg->numBeads, cfg->numFrameInfoColumns, cfg->writeInterval);
 }
 
 void ResultManager::WriteBinaryFileHeader()
 {
-	FILE* f = fopen(outputFile.c_str(), "wb");
-	if (!f) {
-		throw std::runtime_error( SPrintf("Unable to open file %s", outputFile.c_str()));
-	}
-
-	// Write file header
-	int version = BINFILE_VERSION;
-	fwrite(&version, sizeof(int), 1, f);
-	fwrite(&config.numBeads, sizeof(int), 1, f);
-	fwrite(&config.numFrameInfoColumns, sizeof(int), 1, f);
-	long data_offset_pos = ftell(f);
-	int tmp=1234;
-	fwrite(&tmp,sizeof(int), 1,f);
-	for (int i=0;i<config.numFrameInfoColumns;i++) {
-		auto& n = frameInfoNames[i];
-		fwrite(n.c_str(), n.length()+1, 1, f);
-	}
-	long data_offset = ftell(f);
-	dbgprintf("frame data offset: %d\n", data_offset);
-	fseek(f, data_offset_pos, SEEK_SET);
-	fwrite(&data_offset, sizeof(long), 1, f);
-	
+	if (!resultWriter)
+		return;
+
+	std::vector<std::string> names(frameInfoNames);
+	names.resize(config.numFrameInfoColumns);
+	std::vector<uchar> hdr;
+	if (ColumnOutput()) {
+		hdr = MakeResultColumnFileHeader(config.numBeads, names, columnChunkFrames, 
+			config.binaryOutput == ResultOutputCompressedColumns ? RESULTCOL_COMPRESSED : 0);
+		dbgprintf("column chunks: %d frames\n", columnChunkFrames);
+	} else {
+		hdr = MakeResultFileHeader(config.numBeads, names);
+		dbgprintf("frame data offset: %d\n", ((ResultFileHeader*)&hdr[0])->dataOffset);
+	}
+	resultWriter->Append(&hdr[0], hdr.size());
+
 	dbgprintf("writing %d beads and %d frame-info columns into file %s\n", config.numBeads, config.numFrameInfoColumns, outputFile.c_str());
-	fclose(f);
 }
 
 ResultManager::~ResultManager()
 {
+	SetTracker(0);
 	quit = true;
 	Threads::WaitAndClose(thread);
 
-	DeleteAllElems(frameResults);
+	if (resultWriter && ColumnOutput()) {
+		// Chunk directory, so readers of the finished file do not have to follow the chunks
+		ResultColumnDirTrailer t;
+		t.dirOffset = resultWriter->BytesAppended();
+		t.numChunks = columnChunks.size();
+		t.magic = RESULTCOLDIR_MAGIC;
+		if (!columnChunks.empty())
+			resultWriter->Append(&columnChunks[0], sizeof(ResultColumnDirEntry)*columnChunks.size());
+		resultWriter->Append(&t, sizeof(t));
+	}
+
+	delete publisher;
+	delete rawWriter;
+	delete fileReader;
+	delete resultWriter;
+	delete frameInfoWriter;
 }
 
 
-void ResultManager::StoreResult(LocalizationResult *r)
+void ResultManager::OnResults(const LocalizationResult* results, int count)
 {
-	if (CheckResultSpace(r->job.frame)) {
+	StageResults(results, count);
+}
 
-		LocalizationResult scaled = *r;
+void ResultManager::StageResults(const LocalizationResult* results, int count)
+{
+	stagingMutex.lock();
+	size_t n = stagedResults.size();
+	stagedResults.resize(n + count);
+	for (int i=0;i<count;i++) {
+		LocalizationResult& r = stagedResults[n+i];
+		r = results[i];
 		// Make roi-centered pos
-		scaled.pos = scaled.pos - vector3f( qtrk->cfg.width*0.5f, qtrk->cfg.height*0.5f, 0);
-		scaled.pos = ( scaled.pos + config.offset ) * config.scaling;
-		FrameResult* fr = frameResults[r->job.frame - cnt.startFrame];
-		fr->results[r->job.zlutIndex] = scaled;
-		fr->count++;
+		r.pos = r.pos - roiCenter;
+		r.pos = ( r.pos + config.offset ) * config.scaling;
+	}
+	stagingMutex.unlock();
+}
 
-		// Advance processedFrames, either because measurements have been completed or because frames have been lost
-		while (cnt.processedFrames - cnt.startFrame < (int) frameResults.size() && 
-			(frameResults[cnt.processedFrames-cnt.startFrame]->count == config.numBeads || cnt.capturedFrames - cnt.processedFrames > 1000 ))
-		{
-			if (frameResults[cnt.processedFrames-cnt.startFrame]->count < config.numBeads)
-				cnt.lostFrames ++;
+void ResultManager::StoreResult(const LocalizationResult *r)
+{
+	if (CheckResultSpace(r->job.frame)) {
+		FrameResult* fr = GetFrame(r->job.frame);
+		fr->results[r->job.zlutIndex] = *r;
+		fr->received[r->job.zlutIndex] = 1;
+		fr->count++;
 
-			cnt.processedFrames ++;
-		}
+		ProcessFrames();
 
 		cnt.localizationsDone ++;
 	} else
 		cnt.lostFrames++;
 }
 
-void ResultManager::WriteBinaryResults()
+void ResultManager::ProcessFrames()
 {
-	if (outputFile.empty())
-		return;
+	// Advance processedFrames, either because measurements have been completed or because frames have been lost
+	while (cnt.processedFrames < cnt.startFrame + numFramesInMemory && 
+		(GetFrame(cnt.processedFrames)->count == config.numBeads || cnt.capturedFrames - cnt.processedFrames > 1000 ))
+	{
+		if (GetFrame(cnt.processedFrames)->count < config.numBeads)
+			cnt.lostFrames ++;
+
+		cnt.processedFrames ++;
+	}
+	CompleteFrames();
+}
+
+void ResultManager::CompleteFrames()
+{
+	for (; completedFrames < cnt.processedFrames; completedFrames++) {
+		FrameResult* fr = GetFrame(completedFrames);
+		if (!referenceBeads.empty())
+			CorrectDrift(completedFrames, fr);
+		for (int i=0;i<config.numBeads;i++)
+			beadStats.Add(i, completedFrames, fr->received[i] ? &fr->results[i] : 0);
+	}
+}
 
-	FILE* f = fopen(outputFile.c_str(), "ab");
-	if (!f) {
-		dbgprintf("ResultManager::WriteBinaryResult() Unable to open file %s\n", outputFile.c_str());
-		cnt.fileError ++;
+void ResultManager::PublishFrames(int end)
+{
+	if (!publisher) {
+		publishedFrames = end;
 		return;
 	}
+	for (; publishedFrames < end; publishedFrames++) {
+		FrameResult* fr = GetFrame(publishedFrames);
+		publisher->Publish(publishedFrames, fr->timestamp, fr->hasFrameInfo ? fr->frameInfo : 0, fr->results, fr->count);
+	}
+}
 
-	for (int j=cnt.lastSaveFrame; j<cnt.processedFrames;j++)
-	{
-		auto fr = frameResults[j-cnt.startFrame];
-		if (f) {
-			fwrite(&j, sizeof(uint), 1, f);
-			fwrite(&fr->timestamp, sizeof(double), 1, f);
-			fwrite(&fr->frameInfo[0], sizeof(float), config.numFrameInfoColumns, f);
-			for (int i=0;i<config.numBeads;i++) 
-			{
-				LocalizationResult *r = &fr->results[i];
-				fwrite(&r->pos, sizeof(vector3f), 1, f);
-			}
-			for (int i=0;i<config.numBeads;i++)
-				fwrite(&fr->results[i].error, sizeof(int), 1, f);
-			for (int i=0;i<config.numBeads;i++) {
-				fwrite(&fr->results[i].imageMean, sizeof(float), 1, f);
-			}
+void ResultManager::CorrectDrift(int frame, FrameResult* fr)
+{
+	// Every reference bead is measured relative to its position in the first frame it had a valid result in,
+	// minus the drift at that time, so a reference that starts late or comes back after errors does not make the drift jump.
+	vector3f sum;
+	int n = 0;
+	for (uint i=0;i<referenceBeads.size();i++) {
+		int b = referenceBeads[i];
+		if (referenceValid[i] && fr->received[b] && !fr->results[b].error) {
+			sum += fr->results[b].pos - referenceStart[i];
+			n++;
 		}
 	}
-	fclose(f);
+	// Without any valid reference, the drift of the previous frame is used
+	if (n > 0)
+		lastDrift = sum * (1.0f / n);
+	fr->drift = lastDrift;
+
+	for (uint i=0;i<referenceBeads.size();i++) {
+		int b = referenceBeads[i];
+		if (!referenceValid[i] && fr->received[b] && !fr->results[b].error) {
+			referenceStart[i] = fr->results[b].pos - lastDrift;
+			referenceValid[i] = true;
+		}
+	}
+
+	if (rawWriter) {
+		rawBuffer.resize(ResultFileRecordSize(config.numBeads, config.numFrameInfoColumns));
+		PackFrameRecord(&rawBuffer[0], frame, fr);
+		rawWriter->Append(&rawBuffer[0], rawBuffer.size());
+	}
+
+	for (int i=0;i<config.numBeads;i++)
+		if (fr->received[i])
+			fr->results[i].pos -= lastDrift;
+}
+
+void ResultManager::SetReferenceBeads(const int* beads, int count, const char* rawFile)
+{
+	updateMutex.lock();
+	resultMutex.lock();
+	referenceBeads.clear();
+	for (int i=0;i<count;i++)
+		if (beads[i] >= 0 && beads[i] < config.numBeads)
+			referenceBeads.push_back(beads[i]);
+	referenceStart.assign(referenceBeads.size(), vector3f());
+	referenceValid.assign(referenceBeads.size(), false);
+	lastDrift = vector3f();
+
+	delete rawWriter;
+	rawWriter = 0;
+	if (rawFile && rawFile[0] && !referenceBeads.empty()) {
+		try {
+			rawWriter = new ResultWriter(rawFile);
+			std::vector<std::string> names(frameInfoNames);
+			names.resize(config.numFrameInfoColumns);
+			std::vector<uchar> hdr = MakeResultFileHeader(config.numBeads, names, completedFrames);
+			rawWriter->Append(&hdr[0], hdr.size());
+		} catch (const std::runtime_error& e) {
+			dbgprintf("ResultManager: %s\n", e.what());
+			cnt.fileError = 1;
+		}
+	}
+	resultMutex.unlock();
+	updateMutex.unlock();
+}
+
+int ResultManager::GetDrift(int startFrame, int count, vector3f* drift)
+{
+	resultMutex.lock();
+	int start = std::max(startFrame, cnt.startFrame);
+	int end = std::min(startFrame + count, completedFrames);
+	for (int f=start; f<end; f++)
+		drift[f-startFrame] = GetFrame(f)->drift;
+	resultMutex.unlock();
+	return std::max(0, end-start);
+}
+
+void ResultManager::WriteBinaryResults(int start, int end)
+{
+	if (!resultWriter)
+		return;
+
+	// Frame record: frame, timestamp, frame info columns, positions, errors, image means
+	size_t recordSize = ResultFileRecordSize(config.numBeads, config.numFrameInfoColumns);
+	int nframes = end - start;
+	if (nframes <= 0)
+		return;
+	writeBuffer.resize(recordSize*nframes);
+
+	uchar* dst = &writeBuffer[0];
+	for (int j=start; j<end;j++)
+		dst = PackFrameRecord(dst, j, GetFrame(j));
+	resultWriter->Append(&writeBuffer[0], writeBuffer.size());
+}
+
+uchar* ResultManager::PackFrameRecord(uchar* dst, int frame, FrameResult* fr)
+{
+	int nb = config.numBeads, ni = config.numFrameInfoColumns;
+	*(uint*)dst = frame; dst += sizeof(uint);
+	memcpy(dst, &fr->timestamp, sizeof(double)); dst += sizeof(double);
+	if (ni > 0) memcpy(dst, fr->frameInfo, sizeof(float)*ni);
+	dst += sizeof(float)*ni;
+	for (int i=0;i<nb;i++) {
+		memcpy(dst, &fr->results[i].pos, sizeof(vector3f));
+		dst += sizeof(vector3f);
+	}
+	for (int i=0;i<nb;i++) {
+		memcpy(dst, &fr->results[i].error, sizeof(int));
+		dst += sizeof(int);
+	}
+	for (int i=0;i<nb;i++) {
+		memcpy(dst, &fr->results[i].imageMean, sizeof(float));
+		dst += sizeof(float);
+	}
+	return dst;
+}
+
+// Formats v like printf("%.7f\t"). A float times 10^7 is exact in a double (24+17 mantissa bits), so v is rounded exactly,
+// with ties away from zero like the VS2012 CRT. That CRT rounds a 17 digit decimal of v instead, so a value within 1e-17
+// (relative) of a tie can end up one in the last digit apart, and glibc rounds ties to even. Values that need more
+// than 17 significant digits, and non-finite ones, go through sprintf.
+static char* FormatFixed7(char* dst, float v)
+{
+	static const char pairs[] =
+		"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+		"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+		"8081828384858687888990919293949596979899";
+
+	double x = fabs((double)v) * 1e7;
+	if (!(x < 1e17))
+		return dst + sprintf(dst, "%.7f\t", v);
+
+	uint64_t q = (uint64_t)x;
+	if (x - (double)q >= 0.5)
+		q++;
+
+	// Negative zero is printed with a sign as well
+	if (v < 0 || (v == 0 && 1/v < 0))
+		*dst++ = '-';
+	uint64_t ip = q / 10000000;
+	uint frac = (uint)(q - ip * 10000000);
+	char digits[20];
+	int n = 0;
+	do {
+		digits[n++] = '0' + (char)(ip % 10);
+		ip /= 10;
+	} while (ip);
+	while (n > 0)
+		*dst++ = digits[--n];
+
+	*dst = '.';
+	dst[7] = '0' + (char)(frac % 10);
+	frac /= 10;
+	for (int i=5;i>=1;i-=2) {
+		memcpy(dst+i, &pairs[(frac % 100)*2], 2);
+		frac /= 100;
+	}
+	dst[8] = '\t';
+	return dst + 9;
+}
+
+// Frame number and timestamp columns, "%d\t%f\t"
+static char* FormatFrameColumns(char* dst, int frame, double timestamp)
+{
+	return dst + sprintf(dst, "%d\t%f\t", frame, timestamp);
 }
 
-void ResultManager::WriteTextResults()
+void ResultManager::WriteTextResults(int start, int end)
 {
-	FILE* f = outputFile.empty () ? 0 : fopen(outputFile.c_str(), "a");
-	FILE* finfo = frameInfoFile.empty() ? 0 : fopen(frameInfoFile.c_str(), "a");
+	int nframes = end - start;
+	if (nframes <= 0)
+		return;
 
-	for (int k=cnt.lastSaveFrame; k<cnt.processedFrames;k++)
+	// Every frame is formatted straight into the buffers, which are appended to the writers in one go.
+	// sprintf output of the frame columns and of large values stays below 64 characters per column.
+	const int MaxColumnChars = 64;
+	if (resultWriter) writeBuffer.resize((size_t)nframes * (2 + 3*config.numBeads) * MaxColumnChars);
+	if (frameInfoWriter) infoBuffer.resize((size_t)nframes * (2 + config.numFrameInfoColumns) * MaxColumnChars);
+	char* text = resultWriter ? (char*)&writeBuffer[0] : 0;
+	char* info = frameInfoWriter ? (char*)&infoBuffer[0] : 0;
+
+	for (int k=start; k<end;k++)
 	{
-		auto fr = frameResults[k-cnt.startFrame];
-		if (f) {
-			fprintf(f,"%d\t%f\t", k, fr->timestamp);
+		FrameResult* fr = GetFrame(k);
+		if (text) {
+			text = FormatFrameColumns(text, k, fr->timestamp);
 			for (int i=0;i<config.numBeads;i++) 
 			{
 				LocalizationResult *r = &fr->results[i];
-				fprintf(f, "%.7f\t%.7f\t%.7f\t", r->pos.x,r->pos.y,r->pos.z);
+				text = FormatFixed7(text, r->pos.x);
+				text = FormatFixed7(text, r->pos.y);
+				text = FormatFixed7(text, r->pos.z);
 			}
-			fputs("\n", f);
+			*text++ = '\n';
 		}
-		if (finfo) {
-			fprintf(finfo,"%d\t%f\t", k, fr->timestamp);
+		if (info) {
+			info = FormatFrameColumns(info, k, fr->timestamp);
 			for (int i=0;i<config.numFrameInfoColumns;i++)
-				fprintf(finfo, "%.7f\t", fr->frameInfo[i]);
-			fputs("\n", finfo);
+				info = FormatFixed7(info, fr->frameInfo[i]);
+			*info++ = '\n';
 		}
 	}
-	if(finfo) fclose(finfo);
-	if(f) fclose(f);
+	if (text) resultWriter->Append(&writeBuffer[0], text - (char*)&writeBuffer[0]);
+	if (info) frameInfoWriter->Append(&infoBuffer[0], info - (char*)&infoBuffer[0]);
+}
+
+int ResultManager::WriteColumnResults(int start, int end, bool flush)
+{
+	int nb = config.numBeads, ni = config.numFrameInfoColumns;
+
+	while (resultWriter && (end - start >= columnChunkFrames || (flush && end > start))) {
+		int n = std::min(columnChunkFrames, end - start);
+		writeBuffer.resize(ResultColumnChunkSize(nb, ni, n));
+
+		ResultColumnChunk* c = (ResultColumnChunk*)&writeBuffer[0];
+		c->magic = RESULTCOLCHUNK_MAGIC;
+		c->startFrame = start;
+		c->numFrames = n;
+		c->size = writeBuffer.size();
+		double* ts = (double*)(c+1);
+		float* info = (float*)(ts + n);
+		float* cols = info + ni*n;
+		for (int j=0;j<n;j++) {
+			FrameResult* fr = GetFrame(start+j);
+			ts[j] = fr->timestamp;
+			for (int i=0;i<ni;i++)
+				info[i*n+j] = fr->frameInfo[i];
+			// Bead block: x[n], y[n], z[n], error[n], imageMean[n]
+			for (int b=0;b<nb;b++) {
+				float* col = cols + 5*n*b;
+				LocalizationResult& r = fr->results[b];
+				col[j] = r.pos.x;
+				col[n+j] = r.pos.y;
+				col[2*n+j] = r.pos.z;
+				((int*)col)[3*n+j] = r.error;
+				col[4*n+j] = r.imageMean;
+			}
+		}
 
+		ResultColumnDirEntry e;
+		e.offset = resultWriter->BytesAppended();
+		e.startFrame = start;
+		e.numFrames = n;
+		columnChunks.push_back(e);
+		if (config.binaryOutput == ResultOutputCompressedColumns) {
+			CompressResultColumnChunk(&writeBuffer[0], nb, ni, compressBuffer);
+			resultWriter->Append(&compressBuffer[0], compressBuffer.size());
+		} else
+			resultWriter->Append(&writeBuffer[0], writeBuffer.size());
+		start += n;
+	}
+	return resultWriter ? start : end;
 }
 
-void ResultManager::Write()
+void ResultManager::Write(bool flush)
 {
 	resultMutex.lock();
-	if (config.binaryOutput)
-		WriteBinaryResults();
-	else
-		WriteTextResults();
+	int start = cnt.lastSaveFrame, end = cnt.processedFrames;
+	resultMutex.unlock();
 
-	dbgprintf("Saved frame %d to %d\n", cnt.lastSaveFrame, cnt.processedFrames);
-	cnt.lastSaveFrame = cnt.processedFrames;
+	if (ColumnOutput())
+		end = WriteColumnResults(start, end, flush);
+	else if (config.binaryOutput)
+		WriteBinaryResults(start, end);
+	else
+		WriteTextResults(start, end);
 
+	dbgprintf("Saved frame %d to %d\n", start, end);
+	resultMutex.lock();
+	cnt.lastSaveFrame = end;
 	resultMutex.unlock();
 }
 
@@ -216,64 +552,103 @@ QueuedTracker* ResultManager::GetTracker()
 void ResultManager::SetTracker(QueuedTracker *qtrk)
 {
 	trackerMutex.lock();
+	// After this returns the old tracker no longer calls OnResults
+	if (this->qtrk)
+		this->qtrk->SetResultSink(0);
 	this->qtrk = qtrk;
+	if (qtrk) {
+		roiCenter = vector3f(qtrk->cfg.width*0.5f, qtrk->cfg.height*0.5f, 0);
+		qtrk->SetResultSink(this);
+	}
 	trackerMutex.unlock();
 }
 
 bool ResultManager::Update()
 {
-	trackerMutex.lock();
+	updateMutex.lock();
 
-	if (!qtrk) {
-		trackerMutex.unlock();
-		return 0;
+	// Results normally arrive through OnResults, only those queued before the tracker was set are fetched here
+	int count = 0;
+	trackerMutex.lock();
+	if (qtrk) {
+		fetchBuffer.resize(1024);
+		count = qtrk->FetchResults( &fetchBuffer[0], fetchBuffer.size() );
+		StageResults(&fetchBuffer[0], count);
 	}
+	trackerMutex.unlock();
 
-	const int NResultBuf = 40;
-	LocalizationResult resultbuf[NResultBuf];
-
-	int count = qtrk->FetchResults( resultbuf, NResultBuf );
+	stagingMutex.lock();
+	storeResults.swap(stagedResults);
+	storeInfo.swap(stagedInfo);
+	storeInfoColumns.swap(stagedInfoColumns);
+	stagingMutex.unlock();
+	bool stored = !storeResults.empty() || !storeInfo.empty();
 
+	// Frame info is stored just before the results of the same frame, as it was captured before they were computed.
+	// Storing all of it first would move capturedFrames far ahead, and frames far behind it are counted as lost.
 	resultMutex.lock();
-	for (int i=0;i<count;i++)
-		StoreResult(&resultbuf[i]);
-
-	trackerMutex.unlock();
-
-	if (cnt.processedFrames - cnt.lastSaveFrame >= config.writeInterval) {
-		Write();
+	uint info = 0;
+	for (uint i=0;i<storeResults.size();i++) {
+		for (; info<storeInfo.size() && storeInfo[info].frame <= storeResults[i].job.frame; info++)
+			StoreStagedFrameInfo(storeInfo[info].frame, storeInfo[info].timestamp, storeInfoColumns.data() + info*config.numFrameInfoColumns);
+		StoreResult(&storeResults[i]);
 	}
+	for (; info<storeInfo.size(); info++)
+		StoreStagedFrameInfo(storeInfo[info].frame, storeInfo[info].timestamp, storeInfoColumns.data() + info*config.numFrameInfoColumns);
+	if (!storeInfo.empty())
+		ProcessFrames();
 
-	if (config.maxFramesInMemory>0 && frameResults.size () > config.maxFramesInMemory) {
+	int del = 0;
+	if (config.maxFramesInMemory>0 && numFramesInMemory > (int)config.maxFramesInMemory) {
 
-		int del = frameResults.size()-config.maxFramesInMemory;
+		del = numFramesInMemory-config.maxFramesInMemory;
 
-		if (cnt.processedFrames < cnt.startFrame) {
+		// Results of the tracker threads arrive slightly out of order, so incomplete frames are kept while the ring has room
+		if (cnt.processedFrames < cnt.startFrame+del && numFramesInMemory < (int)frameSlots.size())
+			del = cnt.processedFrames-cnt.startFrame;
+
+		if (cnt.processedFrames < cnt.startFrame+del) {
 			// write away any results that might be in there, unfinished localizations will be zero.
-			int lost = cnt.startFrame-cnt.processedFrames;
+			int lost = cnt.startFrame+del-cnt.processedFrames;
 			cnt.processedFrames += lost;
 			cnt.lostFrames += lost;
-
-			Write();
+			CompleteFrames();
 		}
+	}
+	// Frames leave memory only after they are written, so they can still be read back from the file
+	int interval = ColumnOutput() ? columnChunkFrames : config.writeInterval;
+	bool flush = del > 0 && cnt.lastSaveFrame < cnt.startFrame+del;
+	bool write = flush || cnt.processedFrames - cnt.lastSaveFrame >= interval;
+	int publishEnd = completedFrames;
+	resultMutex.unlock();
+
+	storeResults.clear();
+	storeInfo.clear();
+	storeInfoColumns.clear();
+
+	PublishFrames(publishEnd);
+	if (write)
+		Write(flush);
 
+	if (del > 0) {
 		dbgprintf("Removing %d frames from memory\n", del);
-		
-		for (int i=0;i<del;i++)
-			delete frameResults[i];
-		frameResults.erase(frameResults.begin(), frameResults.begin()+del);
 
+		// The slots are cleared when they are reused
+		resultMutex.lock();
+		numFramesInMemory -= del;
 		cnt.startFrame += del;
+		resultMutex.unlock();
 	}
-	resultMutex.unlock();
+	updateMutex.unlock();
 
-	return count>0;
+	return count>0 || stored || write;
 }
 
 void ResultManager::ThreadLoop(void *param)
 {
 	ResultManager* rm = (ResultManager*)param;
 
+	// Results and frame info are staged by the tracker and capture threads, this thread stores, writes and frees them
 	while(true) {
 		if (!rm->Update())
 			Threads::Sleep(20);
@@ -283,25 +658,59 @@ void ResultManager::ThreadLoop(void *param)
 	}
 }
 
-int ResultManager::GetBeadPositions(int startfr, int end, int bead, LocalizationResult* results)
+int ResultManager::ReadFromFile(int start, int count, int bead, LocalizationResult* results)
 {
-	int count = end-startfr;
+	if (!config.binaryOutput || !resultWriter || count <= 0)
+		return 0;
 
+	readerMutex.lock();
+	int n = 0;
+	try {
+		if (!fileReader) {
+			resultWriter->Flush(true);
+			if (ColumnOutput())
+				fileReader = new ResultColumnFileReader(outputFile.c_str());
+			else
+				fileReader = new ResultFileReader(outputFile.c_str());
+		}
+		// Only map what the writer thread has completely written
+		if (fileReader->Refresh(resultWriter->BytesWritten()) < start+count - fileReader->FirstFrame()) {
+			resultWriter->Flush(true);
+			fileReader->Refresh(resultWriter->BytesWritten());
+		}
+		if (bead < 0)
+			n = fileReader->GetFrames(start, count, results);
+		else
+			n = fileReader->GetBeadTrace(bead, start, count, results);
+	} catch (const std::runtime_error& e) {
+		dbgprintf("ResultManager::ReadFromFile: %s\n", e.what());
+	}
+	readerMutex.unlock();
+	return n;
+}
+
+int ResultManager::GetBeadPositions(int startfr, int end, int bead, LocalizationResult* results)
+{
 	resultMutex.lock();
 	if (end > cnt.processedFrames)
 		end = cnt.processedFrames;
 
-	int start = startfr - cnt.startFrame;
-	if (start < 0) start = 0;
-	if (count > cnt.processedFrames-cnt.startFrame)
-		count = cnt.processedFrames-cnt.startFrame;
-
-	for (int i=0;i<count;i++){
-		results[i] = frameResults[i+start]->results[bead];
-	}
+	int memStart = std::min(std::max(startfr, cnt.startFrame), end);
+	for (int f=memStart;f<end;f++)
+		results[f-startfr] = GetFrame(f)->results[bead];
 	resultMutex.unlock();
 
-	return count;
+	if (end <= startfr)
+		return 0;
+
+	// Frames before the in-memory window come from the result file
+	int fileCount = memStart-startfr;
+	if (fileCount > 0 && ReadFromFile(startfr, fileCount, bead, results) < fileCount) {
+		// Not available, return only the frames in memory
+		memmove(results, results+fileCount, sizeof(LocalizationResult)*(end-memStart));
+		return end-memStart;
+	}
+	return end-startfr;
 }
 
 
@@ -313,25 +722,33 @@ void ResultManager::Flush()
 
 	Update();
 
-	resultMutex.lock();
+	updateMutex.lock();
 
-	Write();
+	Write(true);
 
 	// Dump stats about unfinished frames for debugging
 #ifdef _DEBUG
-	for (uint i=0;i<frameResults.size();i++) {
-		FrameResult *fr = frameResults[i];
+	resultMutex.lock();
+	for (int i=0;i<numFramesInMemory;i++) {
+		FrameResult *fr = GetFrame(cnt.startFrame+i);
 //		dbgprintf("Frame %d. TS: %f, Count: %d\n", i, fr->timestamp, fr->count);
 		if (fr->count != config.numBeads) {
-			for (int j=0;j<fr->results.size();j++) {
+			for (int j=0;j<config.numBeads;j++) {
 				if( fr->results[j].job.frame == 0)
 					dbgprintf("%d, ", j );
 			}
 			dbgprintf("\n");
 		}
 	}
-#endif
 	resultMutex.unlock();
+#endif
+	// SetReferenceBeads can replace the raw position writer, so that one is flushed while locked
+	if (rawWriter) rawWriter->Flush(true);
+	updateMutex.unlock();
+
+	// Wait for the disk outside updateMutex, so results and frame info can still be stored meanwhile
+	if (resultWriter) resultWriter->Flush(true);
+	if (frameInfoWriter) frameInfoWriter->Flush(true);
 }
 
 
@@ -339,20 +756,85 @@ ResultManager::FrameCounters ResultManager::GetFrameCounters()
 {
 	resultMutex.lock();
 	FrameCounters c = cnt;
+	// SetReferenceBeads replaces the raw position writer with resultMutex locked
+	if (rawWriter) c.fileError += rawWriter->ErrorCount();
 	resultMutex.unlock();
+	if (resultWriter) c.fileError += resultWriter->ErrorCount();
+	if (frameInfoWriter) c.fileError += frameInfoWriter->ErrorCount();
 	return c;
 }
 
+void ResultManager::SetConfigValue(std::string name, std::string value)
+{
+	if (name == "stream_name" || name == "stream_slots") {
+		updateMutex.lock();
+		std::string streamName = publisher ? publisher->Name() : "";
+		if (name == "stream_name")
+			streamName = value;
+		else
+			streamSlots = std::max(2, atoi(value.c_str()));
+		delete publisher;
+		publisher = 0;
+		try {
+			if (!streamName.empty())
+				publisher = new ResultPublisher(streamName.c_str(), config.numBeads, config.numFrameInfoColumns, streamSlots);
+		} catch (const std::runtime_error& e) {
+			dbgprintf("ResultManager::SetConfigValue: %s\n", e.what());
+		}
+		updateMutex.unlock();
+		return;
+	}
+
+	ResultWriter* writers[] = { resultWriter, frameInfoWriter };
+	for (int i=0;i<2;i++) {
+		if (!writers[i]) continue;
+		ResultWriter::Config wc = writers[i]->GetConfig();
+		if (name == "writer_buffer_size")
+			wc.bufferSize = std::max(0, atoi(value.c_str()));
+		else if (name == "writer_direct_io")
+			wc.directIO = !!atoi(value.c_str());
+		else if (name == "writer_sync")
+			wc.sync = (ResultWriter::SyncPolicy)std::max(0, std::min(2, atoi(value.c_str())));
+		else if (name == "writer_flush_interval")
+			wc.flushIntervalMs = std::max(0, atoi(value.c_str()));
+		else
+			continue;
+		writers[i]->Configure(wc);
+	}
+}
+
+QueuedTracker::ConfigValueMap ResultManager::GetConfigValues()
+{
+	QueuedTracker::ConfigValueMap cvm;
+	ResultWriter::Config wc = resultWriter ? resultWriter->GetConfig() : ResultWriter::Config();
+	cvm["writer_buffer_size"] = SPrintf("%d", (int)wc.bufferSize);
+	cvm["writer_direct_io"] = wc.directIO ? "1" : "0";
+	cvm["writer_sync"] = SPrintf("%d", (int)wc.sync);
+	cvm["writer_flush_interval"] = SPrintf("%d", wc.flushIntervalMs);
+	updateMutex.lock();
+	cvm["stream_name"] = publisher ? publisher->Name() : "";
+	cvm["stream_slots"] = SPrintf("%d", streamSlots);
+	updateMutex.unlock();
+	return cvm;
+}
+
 int ResultManager::GetResults(LocalizationResult* results, int startFrame, int numFrames)
 {
 	resultMutex.lock();
 
-	if (startFrame >= cnt.startFrame && numFrames+startFrame <= cnt.processedFrames)  {
-		for (int f=0;f<numFrames;f++) {
-			int index = f + startFrame - cnt.startFrame;
+	if (numFrames+startFrame <= cnt.processedFrames)  {
+		// Frames before the in-memory window come from the result file
+		int memStart = std::min(std::max(startFrame, cnt.startFrame), startFrame+numFrames);
+		for (int f=memStart;f<startFrame+numFrames;f++) {
+			FrameResult* fr = GetFrame(f);
 			for (int j=0;j<config.numBeads;j++)
-				results[config.numBeads*f+j] = frameResults[index]->results[j];
+				results[config.numBeads*(f-startFrame)+j] = fr->results[j];
 		}
+		resultMutex.unlock();
+
+		if (memStart > startFrame)
+			ReadFromFile(startFrame, memStart-startFrame, -1, results);
+		return numFrames;
 	}
 	resultMutex.unlock();
 
@@ -371,18 +853,71 @@ bool ResultManager::CheckResultSpace(int fr)
 		return false;
 	}
 
-	while (fr >= cnt.startFrame + frameResults.size()) {
-		frameResults.push_back (new FrameResult( config.numBeads, config.numFrameInfoColumns));
+	if (fr >= cnt.startFrame + (int)frameSlots.size()) {
+		int capacity = frameSlots.size();
+		while (fr >= cnt.startFrame + capacity)
+			capacity *= 2;
+		dbgprintf("ResultManager: Growing frame ring to %d frames\n", capacity);
+		ResizeFrameRing(capacity);
+	}
+
+	// Clear the slots of frames entering the window
+	for (; cnt.startFrame + numFramesInMemory <= fr; numFramesInMemory++) {
+		FrameResult* slot = GetFrame(cnt.startFrame + numFramesInMemory);
+		std::fill(slot->results, slot->results + config.numBeads, LocalizationResult());
+		std::fill(slot->received, slot->received + config.numBeads, 0);
+		std::fill(slot->frameInfo, slot->frameInfo + config.numFrameInfoColumns, 0.0f);
+		slot->count = 0;
+		slot->timestamp = 0;
+		slot->hasFrameInfo = false;
+		slot->drift = vector3f();
 	}
 	return true;
 }
 
+void ResultManager::ResizeFrameRing(int capacity)
+{
+	int nb = config.numBeads, ni = config.numFrameInfoColumns;
+	std::vector<FrameResult> slots(capacity);
+	std::vector<LocalizationResult> results(capacity*nb);
+	std::vector<uchar> received(capacity*nb);
+	std::vector<float> frameInfo(capacity*ni);
+	for (int i=0;i<capacity;i++) {
+		slots[i].results = results.data() + i*nb;
+		slots[i].received = received.data() + i*nb;
+		slots[i].frameInfo = frameInfo.data() + i*ni;
+	}
+
+	// Move the frames in memory to their slot in the new ring
+	for (int f=cnt.startFrame; f<cnt.startFrame+numFramesInMemory; f++) {
+		FrameResult* src = GetFrame(f), *dst = &slots[f % capacity];
+		std::copy(src->results, src->results + nb, dst->results);
+		std::copy(src->received, src->received + nb, dst->received);
+		std::copy(src->frameInfo, src->frameInfo + ni, dst->frameInfo);
+		dst->count = src->count;
+		dst->timestamp = src->timestamp;
+		dst->hasFrameInfo = src->hasFrameInfo;
+		dst->drift = src->drift;
+	}
+	frameSlots.swap(slots);
+	slotResults.swap(results);
+	slotReceived.swap(received);
+	slotFrameInfo.swap(frameInfo);
+}
+
 void ResultManager::StoreFrameInfo(int frame, double timestamp, float* columns)
 {
-	resultMutex.lock();
+	StagedFrameInfo info = { frame, timestamp };
+	stagingMutex.lock();
+	stagedInfo.push_back(info);
+	stagedInfoColumns.insert(stagedInfoColumns.end(), columns, columns+config.numFrameInfoColumns);
+	stagingMutex.unlock();
+}
 
+void ResultManager::StoreStagedFrameInfo(int frame, double timestamp, const float* columns)
+{
 	if (CheckResultSpace(frame)) {
-		FrameResult* fr = frameResults[frame-cnt.startFrame];		
+		FrameResult* fr = GetFrame(frame);
 
 		if (!fr->hasFrameInfo) {
 			fr->timestamp = timestamp;
@@ -392,8 +927,6 @@ void ResultManager::StoreFrameInfo(int frame, double timestamp, float* columns)
 			fr->hasFrameInfo=true;
 		}
 	}
-
-	resultMutex.unlock();
 }
 
 
@@ -409,13 +942,48 @@ bool ResultManager::RemoveBeadResults(int bead)
 {
 	// TODO: We need to modify the saved data file
 
-	for (uint i=0;i<frameResults.size();i++) {
-		auto fr = frameResults[i];
+	updateMutex.lock();
+	resultMutex.lock();
+	for (int i=0;i<numFramesInMemory;i++) {
+		FrameResult* fr = GetFrame(cnt.startFrame+i);
 
+		// Slots have a fixed size, the last bead becomes empty
 		fr->count--;
-		fr->results.erase(fr->results.begin()+bead);
+		std::copy(fr->results+bead+1, fr->results+config.numBeads, fr->results+bead);
+		std::copy(fr->received+bead+1, fr->received+config.numBeads, fr->received+bead);
+		fr->results[config.numBeads-1] = LocalizationResult();
+		fr->received[config.numBeads-1] = 0;
+	}
+	beadStats.RemoveBead(bead);
+
+	// Reference beads after the removed one move down, the removed one is no longer a reference
+	for (int i=referenceBeads.size()-1;i>=0;i--) {
+		if (referenceBeads[i] == bead) {
+			referenceBeads.erase(referenceBeads.begin()+i);
+			referenceStart.erase(referenceStart.begin()+i);
+			referenceValid.erase(referenceValid.begin()+i);
+		} else if (referenceBeads[i] > bead)
+			referenceBeads[i]--;
 	}
+	resultMutex.unlock();
+	updateMutex.unlock();
 
 	return true;
 }
 
+int ResultManager::GetBeadStatistics(int bead, BeadStatistics* stats, float* allanDev, int maxOctaves)
+{
+	resultMutex.lock();
+	*stats = beadStats.Get(bead);
+	int n = allanDev ? beadStats.GetAllanDeviation(bead, allanDev, maxOctaves) : 0;
+	resultMutex.unlock();
+	return n;
+}
+
+void ResultManager::ResetBeadStatistics()
+{
+	resultMutex.lock();
+	beadStats.Reset();
+	resultMutex.unlock();
+}
+
@@ -4,6 +4,10 @@
 #include "QueuedTracker.h"
 #include <list>
 #include "threads.h"
+#include "ResultWriter.h"
+#include "ResultFileReader.h"
+#include "ResultStream.h"
+#include "BeadStatistics.h"
 
 
 class ResultFile
@@ -15,27 +19,42 @@ public:
 	virtual void SaveRow(std::vector<vector3f>& pos) = 0;
 };
 
+// Rows in the format of the ResultManager text output: frame, timestamp, x, y, z for every bead
 class TextResultFile : public ResultFile
 {
 public:
 	TextResultFile(const char* fn, bool write);
-	void LoadRow(std::vector<vector3f>& pos);
+	~TextResultFile();
+	void LoadRow(std::vector<vector3f>& pos); // pos is empty at the end of the file
 	void SaveRow(std::vector<vector3f>& pos);
 private:
 	FILE *f;
+	int row;
 };
 
+// Rows in the binary result file format (ResultFileReader.h). The header is written with the first row.
 class BinaryResultFile : public ResultFile
 {
 public:
 	BinaryResultFile(const char* fn, bool write);
-	void LoadRow(std::vector<vector3f>& pos);
+	~BinaryResultFile();
+	void LoadRow(std::vector<vector3f>& pos); // pos is empty at the end of the file
 	void SaveRow(std::vector<vector3f>& pos);
 protected:
 	FILE *f;
+	ResultFileReader* reader;
+	int row;
 };
 
 
+// ResultManagerConfig::binaryOutput
+enum ResultOutputFormat {
+	ResultOutputText = 0,
+	ResultOutputBinary = 1, // frame records, see ResultFileReader.h
+	ResultOutputColumns = 2, // chunks with a column block per bead, see ResultFileReader.h
+	ResultOutputCompressedColumns = 3 // same, losslessly compressed
+};
+
 // Labview interface packing
 #pragma pack(push,1)
 struct ResultManagerConfig
@@ -45,28 +64,32 @@ struct ResultManagerConfig
 	vector3f offset; // output will be (position + offset) * scaling
 	int writeInterval; // [frames]
 	uint maxFramesInMemory; // 0 for infinite
-	uint8_t binaryOutput;
+	uint8_t binaryOutput; // ResultOutputFormat
 };
 #pragma pack(pop)
 
-// Runs a seperate result fetching thread
-class ResultManager
+// Receives results from the tracker as a result sink, and runs a seperate thread that stores and writes them.
+// The tracker and acquisition threads only append results and frame info to a staging queue. The manager thread moves them
+// into the frame ring, and formats, compresses and publishes the completed frames without holding resultMutex.
+class ResultManager : public ResultSink
 {
 public:
 	ResultManager(const char *outfile, const char *frameinfo, ResultManagerConfig *cfg, std::vector<std::string> colnames);
 	~ResultManager();
 
 	void SaveSection(int start, int end, const char *beadposfile, const char *infofile);
+	// Registers the manager as result sink of the tracker, and unregisters it from the previous one
 	void SetTracker(QueuedTracker *qtrk);
 	QueuedTracker* GetTracker();
 
+	// Frames that are no longer in memory (maxFramesInMemory) are read from the binary output file
 	int GetBeadPositions(int startFrame, int endFrame, int bead, LocalizationResult* r);
 	int GetResults(LocalizationResult* results, int startFrame, int numResults);
 	void Flush();
 
 	struct FrameCounters {
 		FrameCounters();
-		int startFrame; // startFrame for frameResults
+		int startFrame; // first frame in the frame ring
 		int processedFrames; // frame where all data is retrieved (all beads)
 		int lastSaveFrame;
 		int capturedFrames;  // lock by resultMutex
@@ -81,41 +104,115 @@ public:
 	// Make sure that the space for that frame is allocated
 
 	bool RemoveBeadResults(int bead);
+
+	// Statistics over all frames completed since the start or the last reset, see BeadStatistics.h
+	// allanDev = [maxOctaves*3] or null, returns the number of octaves written
+	int GetBeadStatistics(int bead, BeadStatistics* stats, float* allanDev=0, int maxOctaves=0);
+	void ResetBeadStatistics();
+
+	// Drift correction: when a frame completes, the mean displacement of the reference beads is subtracted from all beads,
+	// before the frame is stored, written, published or added to the statistics. count=0 turns it off.
+	// rawFile: optional binary frame record file (ResultFileReader.h) that receives the uncorrected positions of the frames completed from now on.
+	void SetReferenceBeads(const int* beads, int count, const char* rawFile=0);
+	// Drift that was subtracted from the frames, drift[f-startFrame] for the completed frames f that are still in memory.
+	// Returns the number of frames written.
+	int GetDrift(int startFrame, int count, vector3f* drift);
 	
 	const ResultManagerConfig& Config() { return config; }
 
+	// Output file settings: "writer_buffer_size" [bytes], "writer_direct_io" [0/1], "writer_sync" [0=none, 1=every write, 2=on flush], 
+	// "writer_flush_interval" [ms]
+	// Live stream for other processes (ResultStream.h): "stream_name" [empty to stop publishing], "stream_slots" [frames in the ring]
+	void SetConfigValue(std::string name, std::string value);
+	QueuedTracker::ConfigValueMap GetConfigValues();
+
 protected:
 	bool CheckResultSpace(int fr);
-	void Write();
-	void WriteBinaryResults();
-	void WriteTextResults();
-
-	void StoreResult(LocalizationResult* r);
+	// Write and publish run with updateMutex locked. Only the update path changes the ring, and completed frames do not change,
+	// so frames [start, end) are read without resultMutex.
+	void Write(bool flush=false); // flush: also write a partial column chunk
+	void WriteBinaryResults(int start, int end);
+	void WriteTextResults(int start, int end);
+	int WriteColumnResults(int start, int end, bool flush); // returns the end of the frames written
+	void PublishFrames(int end);
+	bool ColumnOutput() { return config.binaryOutput == ResultOutputColumns || config.binaryOutput == ResultOutputCompressedColumns; }
+
+	void OnResults(const LocalizationResult* results, int count) override;
+	void StageResults(const LocalizationResult* results, int count); // with the positions converted to output units
+	void StoreResult(const LocalizationResult* r);
+	void ProcessFrames(); // advances processedFrames past completed or lost frames
+	void StoreStagedFrameInfo(int frame, double timestamp, const float* columns);
+	void CompleteFrames(); // corrects the drift and updates the statistics of the frames processed since the last call
 	static void ThreadLoop(void *param);
 	bool Update();
 	void WriteBinaryFileHeader();
+	int ReadFromFile(int start, int count, int bead, LocalizationResult* results); // bead=-1 for all beads
 
+	// Slot of the frame ring. The results and frame info point into the preallocated ring arrays.
 	struct FrameResult
 	{
-		FrameResult(int nResult, int nFrameInfo) : frameInfo(nFrameInfo), results(nResult) { count=0; timestamp=0; hasFrameInfo=false;}
-		std::vector<LocalizationResult> results;
-		std::vector<float> frameInfo;
+		LocalizationResult* results; // [numBeads]
+		uchar* received; // [numBeads], nonzero if the bead has a result
+		float* frameInfo; // [numFrameInfoColumns]
 		int count;
 		double timestamp;
 		bool hasFrameInfo;
+		vector3f drift; // subtracted from the positions when the frame completed
 	};
 
+	// Frames [cnt.startFrame, cnt.startFrame+numFramesInMemory) are kept in a ring of fixed-size slots, frame f in slot f % capacity.
+	// The ring is sized from maxFramesInMemory, so it is only reallocated if frames arrive far ahead of the window.
+	FrameResult* GetFrame(int frame) { return &frameSlots[frame % frameSlots.size()]; }
+	void ResizeFrameRing(int capacity);
+	uchar* PackFrameRecord(uchar* dst, int frame, FrameResult* fr); // returns the end of the record
+
 	Threads::Mutex resultMutex, trackerMutex;
 
 	std::vector<std::string> frameInfoNames;
 
-	std::deque< FrameResult* > frameResults;
+	std::vector<FrameResult> frameSlots;
+	std::vector<LocalizationResult> slotResults;
+	std::vector<uchar> slotReceived;
+	std::vector<float> slotFrameInfo;
+	int numFramesInMemory;
 	FrameCounters cnt;
 	ResultManagerConfig config;
 
 	ResultFile* resultFile;
+	ResultWriter* resultWriter, *frameInfoWriter; // frameInfoWriter is only used for text output
+	std::vector<uchar> writeBuffer; // frames are packed or formatted here and appended to the writer at once
+	std::vector<uchar> infoBuffer; // frame info text
+	int columnChunkFrames;
+	std::vector<ResultColumnDirEntry> columnChunks; // written as chunk directory when closing
+	std::vector<uchar> compressBuffer;
+	ResultPublisher* publisher;
+	int completedFrames, publishedFrames, streamSlots;
+	BeadStatisticsAccumulator beadStats;
+
+	void CorrectDrift(int frame, FrameResult* fr);
+	std::vector<int> referenceBeads;
+	std::vector<vector3f> referenceStart; // reference position, valid once the bead had a result
+	std::vector<bool> referenceValid;
+	vector3f lastDrift;
+	ResultWriter* rawWriter; // uncorrected positions
+	std::vector<uchar> rawBuffer;
+	MappedResultFile* fileReader; // opened on the first request for frames that were removed from memory
+	Threads::Mutex readerMutex;
 
 	QueuedTracker* qtrk;
+	vector3f roiCenter; // of the ROIs of qtrk, subtracted from the positions
+	std::vector<LocalizationResult> fetchBuffer; // results that were queued by the tracker before the sink was set
+
+	// Staging queue, filled by OnResults and StoreFrameInfo. Update swaps it with the store buffers.
+	struct StagedFrameInfo {
+		int frame;
+		double timestamp;
+	};
+	Threads::Mutex stagingMutex;
+	std::vector<LocalizationResult> stagedResults, storeResults;
+	std::vector<StagedFrameInfo> stagedInfo, storeInfo;
+	std::vector<float> stagedInfoColumns, storeInfoColumns; // [numFrameInfoColumns] per frame info
+	Threads::Mutex updateMutex; // held while storing, writing and publishing, and by API calls that change written frames
 
 	std::string outputFile, frameInfoFile;
 	Threads::Handle* thread;
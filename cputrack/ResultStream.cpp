@@ -0,0 +1,258 @@
+#include "std_incl.h"
+#include "ResultStream.h"
+#include "utils.h"
+#include <atomic>
+
+#ifdef WIN32
+#include <windows.h>
+#undef min
+#undef max
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// The sequence counters in shared memory are accessed as atomics, which only works if those are plain lock-free 64 bit values
+static std::atomic<int64_t>& SharedCounter(int64_t& x) { return *reinterpret_cast<std::atomic<int64_t>*>(&x); }
+static std::atomic<int64_t>& SharedCounter(const int64_t& x) { return SharedCounter(const_cast<int64_t&>(x)); }
+static_assert(sizeof(std::atomic<int64_t>) == sizeof(int64_t), "shared counters need lock-free 64 bit atomics");
+
+static std::string ShmName(const char* name)
+{
+	return name[0] == '/' ? name : std::string("/") + name;
+}
+
+ResultPublisher::ResultPublisher(const char* name, int numBeads, int numFrameInfoColumns, int numSlots)
+{
+	this->name = name;
+	int slotSize = ResultStreamSlotSize(numBeads, numFrameInfoColumns);
+	int64_t dataOffset = (sizeof(ResultStreamHeader) + RESULTSTREAM_ALIGN - 1) / RESULTSTREAM_ALIGN * RESULTSTREAM_ALIGN;
+	size = dataOffset + (int64_t)slotSize * numSlots;
+
+#ifdef WIN32
+	mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, 0, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, name);
+	base = mapping ? (uchar*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)size) : 0;
+	if (!base) {
+		if (mapping) CloseHandle(mapping);
+		throw std::runtime_error(SPrintf("Unable to create result stream %s", name));
+	}
+#else
+	// A stream left behind by a process that crashed is replaced
+	shmName = ShmName(name);
+	shm_unlink(shmName.c_str());
+	int fd = shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	void* p = MAP_FAILED;
+	if (fd >= 0 && ftruncate(fd, size) == 0)
+		p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (fd >= 0) close(fd);
+	if (p == MAP_FAILED) {
+		if (fd >= 0) shm_unlink(shmName.c_str());
+		throw std::runtime_error(SPrintf("Unable to create result stream %s", name));
+	}
+	base = (uchar*)p;
+#endif
+
+	// Readers check the magic last, so it is written after the rest of the header
+	memset(base, 0, dataOffset);
+	hdr = (ResultStreamHeader*)base;
+	hdr->version = RESULTSTREAM_VERSION;
+	hdr->numBeads = numBeads;
+	hdr->numFrameInfoColumns = numFrameInfoColumns;
+	hdr->numSlots = numSlots;
+	hdr->slotSize = slotSize;
+	hdr->dataOffset = dataOffset;
+	for (int i=0;i<numSlots;i++)
+		((ResultStreamSlot*)(base + dataOffset + (int64_t)slotSize*i))->seq = 0;
+	std::atomic_thread_fence(std::memory_order_release);
+	hdr->magic = RESULTSTREAM_MAGIC;
+}
+
+ResultPublisher::~ResultPublisher()
+{
+#ifdef WIN32
+	UnmapViewOfFile(base);
+	CloseHandle(mapping);
+#else
+	munmap(base, size);
+	shm_unlink(shmName.c_str());
+#endif
+}
+
+void ResultPublisher::Publish(int frame, double timestamp, const float* frameInfo, const LocalizationResult* results, int count)
+{
+	int64_t n = SharedCounter(hdr->published).load(std::memory_order_relaxed);
+	ResultStreamSlot* s = (ResultStreamSlot*)(base + hdr->dataOffset + (int64_t)hdr->slotSize * (n % hdr->numSlots));
+
+	SharedCounter(s->seq).store(2*n+1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	s->frame = frame;
+	s->count = count;
+	s->timestamp = timestamp;
+	s->hasFrameInfo = frameInfo ? 1 : 0;
+	int nb = hdr->numBeads, ni = hdr->numFrameInfoColumns;
+	float* info = (float*)(s+1);
+	if (ni > 0) {
+		if (frameInfo) memcpy(info, frameInfo, sizeof(float)*ni);
+		else memset(info, 0, sizeof(float)*ni);
+	}
+	vector3f* pos = (vector3f*)(info + ni);
+	int* error = (int*)(pos + nb);
+	float* imageMean = (float*)(error + nb);
+	for (int i=0;i<nb;i++) {
+		pos[i] = results[i].pos;
+		error[i] = results[i].error;
+		imageMean[i] = results[i].imageMean;
+	}
+
+	SharedCounter(s->seq).store(2*n+2, std::memory_order_release);
+	SharedCounter(hdr->published).store(n+1, std::memory_order_release);
+}
+
+
+struct ResultStreamReader
+{
+	const ResultStreamHeader* hdr;
+	int64_t size;
+	int64_t next; // stream frame to read next
+	int64_t skipped;
+	const ResultStreamSlot* current;
+	int64_t currentSeq;
+#ifdef WIN32
+	HANDLE mapping;
+#endif
+
+	const ResultStreamSlot* Slot(int64_t n) { return (const ResultStreamSlot*)((const uchar*)hdr + hdr->dataOffset + (int64_t)hdr->slotSize * (n % hdr->numSlots)); }
+};
+
+CDLL_EXPORT ResultStreamReader* DLL_CALLCONV QTrkResultStreamOpen(const char* name)
+{
+	void* p = 0;
+	int64_t size = 0;
+#ifdef WIN32
+	HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+	if (!mapping)
+		return 0;
+	p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	MEMORY_BASIC_INFORMATION mbi;
+	if (p && VirtualQuery(p, &mbi, sizeof(mbi)))
+		size = mbi.RegionSize;
+	if (!p) {
+		CloseHandle(mapping);
+		return 0;
+	}
+#else
+	int fd = shm_open(ShmName(name).c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return 0;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(ResultStreamHeader)) {
+		size = st.st_size;
+		p = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) p = 0;
+	}
+	close(fd);
+	if (!p)
+		return 0;
+#endif
+
+	ResultStreamReader* rd = new ResultStreamReader();
+	rd->hdr = (const ResultStreamHeader*)p;
+	rd->size = size;
+#ifdef WIN32
+	rd->mapping = mapping;
+#endif
+
+	const ResultStreamHeader* h = rd->hdr;
+	bool valid = size >= (int64_t)sizeof(ResultStreamHeader) && h->magic == RESULTSTREAM_MAGIC;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	valid = valid && h->version <= RESULTSTREAM_VERSION && h->numSlots > 0 &&
+		h->slotSize >= ResultStreamSlotSize(h->numBeads, h->numFrameInfoColumns) && h->dataOffset + (int64_t)h->slotSize * h->numSlots <= size;
+	if (!valid) {
+		QTrkResultStreamClose(rd);
+		return 0;
+	}
+
+	int64_t published = SharedCounter(h->published).load(std::memory_order_acquire);
+	rd->next = std::max((int64_t)0, published - h->numSlots);
+	rd->skipped = 0;
+	rd->current = 0;
+	rd->currentSeq = 0;
+	return rd;
+}
+
+CDLL_EXPORT void DLL_CALLCONV QTrkResultStreamClose(ResultStreamReader* rd)
+{
+	if (!rd) return;
+#ifdef WIN32
+	UnmapViewOfFile(rd->hdr);
+	CloseHandle(rd->mapping);
+#else
+	munmap((void*)rd->hdr, rd->size);
+#endif
+	delete rd;
+}
+
+CDLL_EXPORT const ResultStreamHeader* DLL_CALLCONV QTrkResultStreamHeader(ResultStreamReader* rd)
+{
+	return rd->hdr;
+}
+
+CDLL_EXPORT const ResultStreamSlot* DLL_CALLCONV QTrkResultStreamNext(ResultStreamReader* rd)
+{
+	int numSlots = rd->hdr->numSlots;
+	while (true) {
+		int64_t published = SharedCounter(rd->hdr->published).load(std::memory_order_acquire);
+		if (rd->next >= published)
+			return 0;
+		if (published - rd->next > numSlots) {
+			rd->skipped += published - numSlots - rd->next;
+			rd->next = published - numSlots;
+		}
+
+		const ResultStreamSlot* s = rd->Slot(rd->next);
+		int64_t seq = SharedCounter(s->seq).load(std::memory_order_acquire);
+		if (seq == 2*rd->next+2) {
+			rd->current = s;
+			rd->currentSeq = seq;
+			rd->next++;
+			return s;
+		}
+		// Overwritten by a newer frame since published was read, try again further ahead
+		rd->skipped++;
+		rd->next++;
+	}
+}
+
+CDLL_EXPORT bool DLL_CALLCONV QTrkResultStreamValid(ResultStreamReader* rd)
+{
+	if (!rd->current)
+		return false;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return SharedCounter(rd->current->seq).load(std::memory_order_relaxed) == rd->currentSeq;
+}
+
+CDLL_EXPORT bool DLL_CALLCONV QTrkResultStreamRead(ResultStreamReader* rd, int* frame, double* timestamp, float* frameInfo, vector3f* pos, int* error, float* imageMean)
+{
+	const ResultStreamHeader* h = rd->hdr;
+	int nb = h->numBeads, ni = h->numFrameInfoColumns;
+	while (const ResultStreamSlot* s = QTrkResultStreamNext(rd)) {
+		if (frame) *frame = s->frame;
+		if (timestamp) *timestamp = s->timestamp;
+		if (frameInfo && ni > 0) memcpy(frameInfo, ResultStreamFrameInfo(h, s), sizeof(float)*ni);
+		if (pos) memcpy(pos, ResultStreamPos(h, s), sizeof(vector3f)*nb);
+		if (error) memcpy(error, ResultStreamError(h, s), sizeof(int)*nb);
+		if (imageMean) memcpy(imageMean, ResultStreamImageMean(h, s), sizeof(float)*nb);
+		if (QTrkResultStreamValid(rd))
+			return true;
+		rd->skipped++;
+	}
+	return false;
+}
+
+CDLL_EXPORT int64_t DLL_CALLCONV QTrkResultStreamSkipped(ResultStreamReader* rd)
+{
+	return rd->skipped;
+}
@@ -0,0 +1,96 @@
+// Live result stream: ResultManager publishes every completed frame into a named shared memory ring, so local processes
+// can follow the results as they come in, without copies through the LabVIEW API.
+// There is one producer and any number of readers. Readers take no locks and are never waited for: a reader that falls more
+// than the ring size behind skips frames.
+//
+// Every slot has a sequence number that is odd while the producer writes the slot (a seqlock). Readers read a slot in place,
+// and afterwards check that its sequence number did not change.
+//
+// Stream names are system wide. On Windows a name like "Local\qtrk" is used as is, on other systems it is a POSIX shared memory
+// object and a '/' is put in front if the name does not start with one.
+
+#pragma once
+
+#include "dllmacros.h"
+#include "qtrk_c_api.h"
+#include <string>
+
+#define RESULTSTREAM_MAGIC 0x4d525351 // "QSRM"
+#define RESULTSTREAM_VERSION 1
+#define RESULTSTREAM_ALIGN 64 // slots start on their own cache line
+
+struct ResultStreamHeader {
+	uint magic;
+	uint version;
+	int numBeads;
+	int numFrameInfoColumns;
+	int numSlots;
+	int slotSize; // bytes, multiple of RESULTSTREAM_ALIGN
+	int64_t dataOffset; // offset of the first slot
+	int64_t published; // number of frames published. Frame n of the stream is in slot n % numSlots.
+};
+
+// Slot header, followed by:
+//   float frameInfo[numFrameInfoColumns]
+//   vector3f pos[numBeads]
+//   int error[numBeads]
+//   float imageMean[numBeads]
+struct ResultStreamSlot {
+	int64_t seq; // 2n+1 while frame n of the stream is written, 2n+2 when it is complete
+	int frame; // tracker frame number
+	int count; // beads with a result, less than numBeads if results were lost
+	double timestamp;
+	int hasFrameInfo; // frame info is published as it is known when the frame is complete
+	int reserved;
+};
+
+inline int ResultStreamSlotSize(int numBeads, int numFrameInfoColumns) {
+	int size = sizeof(ResultStreamSlot) + sizeof(float)*numFrameInfoColumns + (sizeof(vector3f)+sizeof(int)+sizeof(float))*numBeads;
+	return (size + RESULTSTREAM_ALIGN - 1) / RESULTSTREAM_ALIGN * RESULTSTREAM_ALIGN;
+}
+
+inline const float* ResultStreamFrameInfo(const ResultStreamHeader* h, const ResultStreamSlot* s) { return (const float*)(s+1); }
+inline const vector3f* ResultStreamPos(const ResultStreamHeader* h, const ResultStreamSlot* s) { return (const vector3f*)(ResultStreamFrameInfo(h,s) + h->numFrameInfoColumns); }
+inline const int* ResultStreamError(const ResultStreamHeader* h, const ResultStreamSlot* s) { return (const int*)(ResultStreamPos(h,s) + h->numBeads); }
+inline const float* ResultStreamImageMean(const ResultStreamHeader* h, const ResultStreamSlot* s) { return (const float*)(ResultStreamError(h,s) + h->numBeads); }
+
+// Producer side, owned by ResultManager
+class ResultPublisher
+{
+public:
+	// Creates the shared memory. Throws if it can not be created.
+	ResultPublisher(const char* name, int numBeads, int numFrameInfoColumns, int numSlots);
+	~ResultPublisher(); // readers that still have the stream open keep their mapping
+
+	// results = [numBeads], frameInfo = [numFrameInfoColumns] or null
+	void Publish(int frame, double timestamp, const float* frameInfo, const LocalizationResult* results, int count);
+
+	const std::string& Name() { return name; }
+	int NumSlots() { return hdr->numSlots; }
+
+private:
+	std::string name;
+	ResultStreamHeader* hdr;
+	uchar* base;
+	int64_t size;
+#ifdef WIN32
+	void* mapping;
+#else
+	std::string shmName;
+#endif
+};
+
+// C reader API for other processes. A reader starts at the oldest frame that is still in the ring.
+struct ResultStreamReader;
+
+CDLL_EXPORT ResultStreamReader* DLL_CALLCONV QTrkResultStreamOpen(const char* name); // null if there is no such stream
+CDLL_EXPORT void DLL_CALLCONV QTrkResultStreamClose(ResultStreamReader* rd);
+CDLL_EXPORT const ResultStreamHeader* DLL_CALLCONV QTrkResultStreamHeader(ResultStreamReader* rd);
+// Zero copy: returns the slot of the next frame in shared memory, or null if no new frame was published.
+// Read it in place, then call QTrkResultStreamValid to check that the producer did not overwrite it meanwhile.
+CDLL_EXPORT const ResultStreamSlot* DLL_CALLCONV QTrkResultStreamNext(ResultStreamReader* rd);
+CDLL_EXPORT bool DLL_CALLCONV QTrkResultStreamValid(ResultStreamReader* rd);
+// Copies the next frame. frameInfo = [numFrameInfoColumns], pos, error and imageMean = [numBeads], any can be null.
+// Returns false if no new frame was published.
+CDLL_EXPORT bool DLL_CALLCONV QTrkResultStreamRead(ResultStreamReader* rd, int* frame, double* timestamp, float* frameInfo, vector3f* pos, int* error, float* imageMean);
+CDLL_EXPORT int64_t DLL_CALLCONV QTrkResultStreamSkipped(ResultStreamReader* rd); // frames skipped because the reader fell behind
@@ -0,0 +1,354 @@
+#include "std_incl.h"
+#include "ResultWriter.h"
+#include "utils.h"
+
+#ifdef WIN32
+#include <windows.h>
+#include <malloc.h>
+#undef min
+#undef max
+#else
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static size_t AlignUp(size_t x) { return (x + RESULTWRITER_ALIGN - 1) / RESULTWRITER_ALIGN * RESULTWRITER_ALIGN; }
+
+ResultWriter::ResultWriter(const char* filename, const Config& cfg)
+{
+	this->filename = filename;
+	config = cfg;
+	config.bufferSize = AlignUp(std::max(cfg.bufferSize, (size_t)RESULTWRITER_ALIGN));
+	writing = 0;
+	appended = handedOff = written = 0;
+	errors = extraBuffers = 0;
+#ifdef WIN32
+	file = 0;
+#else
+	fd = -1;
+#endif
+
+	Open(true);
+
+	// Double buffered: one buffer is filled while the other is written
+	active = AllocBuffer();
+	active->fileOffset = 0;
+	freeBuffers.push_back(AllocBuffer());
+	lastHandoff = GetPreciseTime();
+
+	quit = false;
+	thread = Threads::Create(ThreadLoop, this);
+}
+
+ResultWriter::~ResultWriter()
+{
+	Flush(true);
+	quit = true;
+	Threads::WaitAndClose(thread);
+
+	if (config.sync != SyncNone)
+		Sync();
+	Close();
+
+	FreeBuffer(active);
+	for (uint i=0;i<freeBuffers.size();i++)
+		FreeBuffer(freeBuffers[i]);
+}
+
+ResultWriter::Buffer* ResultWriter::AllocBuffer()
+{
+	Buffer* b = new Buffer();
+#ifdef WIN32
+	b->data = (uchar*)_aligned_malloc(config.bufferSize, RESULTWRITER_ALIGN);
+#else
+	void* p = 0;
+	if (posix_memalign(&p, RESULTWRITER_ALIGN, config.bufferSize) != 0) p = 0;
+	b->data = (uchar*)p;
+#endif
+	if (!b->data) {
+		delete b;
+		throw std::runtime_error(SPrintf("ResultWriter: Failed to allocate a %d KB buffer", (int)(config.bufferSize/1024)));
+	}
+	b->size = 0;
+	b->fileOffset = 0;
+	b->partial = false;
+	return b;
+}
+
+void ResultWriter::FreeBuffer(Buffer* b)
+{
+#ifdef WIN32
+	_aligned_free(b->data);
+#else
+	free(b->data);
+#endif
+	delete b;
+}
+
+void ResultWriter::Open(bool truncate)
+{
+#ifdef WIN32
+	HANDLE h = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0, truncate ? CREATE_ALWAYS : OPEN_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | (config.directIO ? FILE_FLAG_NO_BUFFERING : 0), 0);
+	if (h == INVALID_HANDLE_VALUE)
+		throw std::runtime_error(SPrintf("Unable to open file %s", filename.c_str()));
+	file = h;
+#else
+	int flags = O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0);
+#ifdef O_DIRECT
+	if (config.directIO) flags |= O_DIRECT;
+#endif
+	fd = open(filename.c_str(), flags, 0644);
+	if (fd < 0)
+		throw std::runtime_error(SPrintf("Unable to open file %s", filename.c_str()));
+#endif
+}
+
+void ResultWriter::Close()
+{
+#ifdef WIN32
+	if (file) CloseHandle(file);
+	file = 0;
+#else
+	if (fd >= 0) close(fd);
+	fd = -1;
+#endif
+}
+
+void ResultWriter::Sync()
+{
+#ifdef WIN32
+	FlushFileBuffers(file);
+#elif defined(__APPLE__)
+	fsync(fd);
+#else
+	fdatasync(fd);
+#endif
+}
+
+void ResultWriter::Append(const void* data, size_t len)
+{
+	const uchar* src = (const uchar*)data;
+	mutex.lock();
+	while (len > 0) {
+		size_t n = std::min(len, config.bufferSize - active->size);
+		memcpy(active->data + active->size, src, n);
+		active->size += n;
+		appended += n;
+		src += n;
+		len -= n;
+		if (active->size == config.bufferSize)
+			Handoff(false);
+	}
+	mutex.unlock();
+}
+
+void ResultWriter::Handoff(bool partial)
+{
+	Buffer* next;
+	if (freeBuffers.empty()) {
+		next = AllocBuffer();
+		extraBuffers++;
+	} else {
+		next = freeBuffers.back();
+		freeBuffers.pop_back();
+	}
+
+	// Direct I/O only writes whole blocks, so a partial last block is written padded and written again from the next buffer
+	size_t carry = config.directIO ? active->size % RESULTWRITER_ALIGN : 0;
+	memcpy(next->data, active->data + active->size - carry, carry);
+	next->size = carry;
+	next->fileOffset = active->fileOffset + active->size - carry;
+	next->partial = false;
+
+	active->partial = partial;
+	fullBuffers.push_back(active);
+	active = next;
+	handedOff = appended;
+	lastHandoff = GetPreciseTime();
+}
+
+bool ResultWriter::WriteBuffer(Buffer* b)
+{
+	size_t len = b->size;
+	if (config.directIO) {
+		len = AlignUp(len);
+		memset(b->data + b->size, 0, len - b->size);
+	}
+
+	bool ok = true;
+#ifdef WIN32
+	LARGE_INTEGER pos;
+	pos.QuadPart = b->fileOffset;
+	ok = SetFilePointerEx(file, pos, 0, FILE_BEGIN) != 0;
+	for (size_t done=0; ok && done<len; ) {
+		DWORD n = 0;
+		ok = WriteFile(file, b->data + done, (DWORD)(len-done), &n, 0) && n > 0;
+		done += n;
+	}
+	if (ok && b->partial && len != b->size) {
+		pos.QuadPart = b->fileOffset + b->size;
+		ok = SetFilePointerEx(file, pos, 0, FILE_BEGIN) && SetEndOfFile(file);
+	}
+#else
+	for (size_t done=0; ok && done<len; ) {
+		ssize_t n = pwrite(fd, b->data + done, len-done, b->fileOffset + done);
+		ok = n > 0;
+		if (ok) done += n;
+	}
+	if (ok && b->partial && len != b->size)
+		ok = ftruncate(fd, b->fileOffset + b->size) == 0;
+#endif
+	if (!ok)
+		dbgprintf("ResultWriter: Failed to write %d bytes to %s\n", (int)len, filename.c_str());
+	else if (config.sync == SyncEveryWrite)
+		Sync();
+	return ok;
+}
+
+void ResultWriter::ThreadLoop(void* param)
+{
+	ResultWriter* w = (ResultWriter*)param;
+
+	while (true) {
+		w->mutex.lock();
+		Buffer* b = 0;
+		if (!w->fullBuffers.empty()) {
+			b = w->fullBuffers.front();
+			w->fullBuffers.pop_front();
+			w->writing++;
+		} else if (w->config.flushIntervalMs > 0 && w->appended > w->handedOff &&
+			(GetPreciseTime() - w->lastHandoff) * 1000 > w->config.flushIntervalMs) {
+			w->Handoff(true);
+		}
+		w->mutex.unlock();
+
+		if (b) {
+			bool ok = w->WriteBuffer(b);
+			w->mutex.lock();
+			if (!ok) w->errors++;
+			else w->written = b->fileOffset + b->size;
+			b->size = 0;
+			w->freeBuffers.push_back(b);
+			w->writing--;
+			w->mutex.unlock();
+			continue;
+		}
+
+		if (w->quit)
+			break;
+		Threads::Sleep(5);
+	}
+}
+
+void ResultWriter::Flush(bool wait)
+{
+	mutex.lock();
+	if (appended > handedOff)
+		Handoff(true);
+	mutex.unlock();
+
+	if (wait) {
+		while (true) {
+			mutex.lock();
+			bool done = fullBuffers.empty() && writing == 0;
+			mutex.unlock();
+			if (done) break;
+			Threads::Sleep(1);
+		}
+		if (config.sync == SyncOnFlush)
+			Sync();
+	}
+}
+
+void ResultWriter::Configure(const Config& cfg)
+{
+	Flush(true);
+
+	mutex.lock();
+	// Data appended meanwhile has to be written with the old settings
+	while (!fullBuffers.empty() || writing > 0 || active->size > (config.directIO ? appended % RESULTWRITER_ALIGN : 0)) {
+		if (appended > handedOff)
+			Handoff(true);
+		mutex.unlock();
+		Threads::Sleep(1);
+		mutex.lock();
+	}
+
+	bool ok = true;
+	try {
+		config = cfg;
+		config.bufferSize = AlignUp(std::max(cfg.bufferSize, (size_t)RESULTWRITER_ALIGN));
+		Buffer* a = AllocBuffer();
+		Buffer* b = AllocBuffer();
+		FreeBuffer(active);
+		for (uint i=0;i<freeBuffers.size();i++)
+			FreeBuffer(freeBuffers[i]);
+		active = a;
+		freeBuffers.assign(1, b);
+
+		Close();
+		Open(false);
+	} catch (const std::runtime_error& e) {
+		dbgprintf("ResultWriter::Configure: %s\n", e.what());
+		ok = false;
+	}
+
+	// The next write starts at the end of the file, or at the start of its last block for direct I/O
+	active->size = config.directIO ? appended % RESULTWRITER_ALIGN : 0;
+	active->fileOffset = appended - active->size;
+	if (ok && active->size > 0) {
+#ifdef WIN32
+		LARGE_INTEGER pos;
+		pos.QuadPart = active->fileOffset;
+		DWORD nread = 0;
+		ok = SetFilePointerEx(file, pos, 0, FILE_BEGIN) && ReadFile(file, active->data, RESULTWRITER_ALIGN, &nread, 0) && nread >= active->size;
+#else
+		ok = pread(fd, active->data, RESULTWRITER_ALIGN, active->fileOffset) >= (ssize_t)active->size;
+#endif
+	}
+	if (!ok)
+		errors++;
+	mutex.unlock();
+}
+
+ResultWriter::Config ResultWriter::GetConfig()
+{
+	mutex.lock();
+	Config c = config;
+	mutex.unlock();
+	return c;
+}
+
+int64_t ResultWriter::BytesAppended()
+{
+	mutex.lock();
+	int64_t r = appended;
+	mutex.unlock();
+	return r;
+}
+
+int64_t ResultWriter::BytesWritten()
+{
+	mutex.lock();
+	int64_t r = written;
+	mutex.unlock();
+	return r;
+}
+
+int ResultWriter::ErrorCount()
+{
+	mutex.lock();
+	int r = errors;
+	mutex.unlock();
+	return r;
+}
+
+int ResultWriter::ExtraBuffers()
+{
+	mutex.lock();
+	int r = extraBuffers;
+	mutex.unlock();
+	return r;
+}
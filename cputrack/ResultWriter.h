@@ -0,0 +1,81 @@
+// Asynchronous file writer used by ResultManager.
+// Producers copy data into a large in-memory buffer and return immediately. Full buffers are written by a
+// dedicated thread through a file handle that stays open, so callers never wait on the disk.
+#pragma once
+
+#include "threads.h"
+#include <deque>
+
+#define RESULTWRITER_ALIGN 4096 // block size used for unbuffered (direct) I/O
+
+class ResultWriter
+{
+public:
+	enum SyncPolicy {
+		SyncNone = 0, // leave it to the OS
+		SyncEveryWrite = 1, // fdatasync / FlushFileBuffers after every block written
+		SyncOnFlush = 2 // only when Flush(true) is called, and when closing
+	};
+
+	struct Config {
+		Config() { bufferSize = 4*1024*1024; directIO = false; sync = SyncNone; flushIntervalMs = 1000; }
+		size_t bufferSize; // bytes per buffer, rounded up to RESULTWRITER_ALIGN
+		bool directIO; // O_DIRECT / FILE_FLAG_NO_BUFFERING, bypasses the page cache
+		SyncPolicy sync;
+		int flushIntervalMs; // a partially filled buffer is written after this time. 0 to only write full buffers
+	};
+
+	// Creates (truncates) the file. Throws if it can not be opened.
+	ResultWriter(const char* filename, const Config& cfg = Config());
+	~ResultWriter(); // writes everything and closes the file
+
+	// Copies data into the active buffer. Never blocks on disk I/O: when the writer thread falls behind, more buffers are allocated.
+	void Append(const void* data, size_t len);
+	// Hands the active buffer to the writer thread. With wait=true, returns after everything appended so far is on disk.
+	void Flush(bool wait);
+	// Applies a new configuration. Flushes and waits first, the file is reopened if the I/O mode changes.
+	void Configure(const Config& cfg);
+	Config GetConfig();
+
+	int64_t BytesAppended(); // logical file size
+	int64_t BytesWritten(); // bytes that are completely written to the file
+	int ErrorCount();
+	int ExtraBuffers(); // number of times a buffer had to be allocated because the writer thread was behind
+
+private:
+	struct Buffer {
+		uchar* data;
+		size_t size; // bytes used
+		int64_t fileOffset;
+		bool partial; // handed over by Flush, the file is truncated to its end after writing
+	};
+
+	Buffer* AllocBuffer();
+	void FreeBuffer(Buffer* b);
+	void Handoff(bool partial); // call with mutex locked
+	bool WriteBuffer(Buffer* b);
+	void Open(bool truncate);
+	void Close();
+	void Sync();
+	static void ThreadLoop(void* param);
+
+	std::string filename;
+	Config config;
+	Threads::Mutex mutex; // guards the buffer lists and counters
+	Buffer* active;
+	std::vector<Buffer*> freeBuffers;
+	std::deque<Buffer*> fullBuffers;
+	int writing; // buffers taken by the writer thread, but not yet written
+	int64_t appended, handedOff, written; // logical bytes appended, handed to the writer thread, and written
+	double lastHandoff;
+	int errors, extraBuffers;
+
+#ifdef WIN32
+	void* file;
+#else
+	int fd;
+#endif
+
+	Threads::Handle* thread;
+	Atomic<bool> quit;
+};
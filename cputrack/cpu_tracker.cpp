@@ -56,6 +56,8 @@ CPUTracker::CPUTracker(int w, int h, int xcorwindow)
 	zluts = 0;
 	zlut_planes = zlut_res = zlut_count = 0;
 	zlut_minradius = zlut_maxradius = 0.0f;
+	zlut_pca = 0;
+	zlut_pca_k = 0;
 	xcorw = xcorwindow;
 	qa_fft_forward = qa_fft_backward = 0;
 
@@ -87,6 +89,8 @@ CPUTracker::~CPUTracker()
 
 	if (fft2d)
 		delete fft2d;
+
+	DeleteAllElems(radialBinTables);
 }
 
 void CPUTracker::SetImageFloat(float *src)
@@ -284,7 +288,7 @@ void CPUTracker::AllocateQIFFTs(int nr)
 }
 
 vector2f CPUTracker::ComputeQI(vector2f initial, int iterations, int radialSteps, int angularStepsPerQ, 
-	float angStepIterationFactor, float minRadius, float maxRadius, bool& boundaryHit, float* radialWeights)
+	float angStepIterationFactor, float minRadius, float maxRadius, bool& boundaryHit, float* radialWeights, bool pixelBinned)
 {
 	int nr=radialSteps;
 #ifdef _DEBUG
@@ -318,8 +322,11 @@ vector2f CPUTracker::ComputeQI(vector2f initial, int iterations, int radialSteps
 		// check bounds
 		boundaryHit = CheckBoundaries(center, maxRadius);
 
-		for (int q=0;q<4;q++) {
-			ComputeQuadrantProfile(buf+q*nr, nr, angsteps, q, minRadius, maxRadius, center, radialWeights);
+		if (pixelBinned) {
+			// the offsets are relative to the rounded center the profiles were computed for
+			center = ComputeBinnedQuadrantProfiles(buf, nr, minRadius, maxRadius, center, radialWeights);
+		} else {
+			ComputeQuadrantProfiles(buf, nr, angsteps, minRadius, maxRadius, center, radialWeights);
 		}
 #ifdef QI_DEBUG
 		cmp_cpu_qi_prof.assign (buf,buf+4*nr);
@@ -478,11 +485,9 @@ vector3f CPUTracker::QuadrantAlign(vector3f pos, int beadIndex, int angularSteps
 	scalar_t* q0=buf, *q1=buf+res, *q2=buf+res*2, *q3=buf+res*3;
 
 	boundaryHit = CheckBoundaries(vector2f(pos.x,pos.y), zlut_maxradius);
-	for (int q=0;q<4;q++) {
-		scalar_t *quadrantProfile = buf+q*res;
-		ComputeQuadrantProfile(quadrantProfile, res, angularStepsPerQuadrant, q, zlut_minradius, zlut_maxradius, vector2f(pos.x,pos.y));
-		NormalizeRadialProfile(quadrantProfile, res);
-	}
+	ComputeQuadrantProfiles(buf, res, angularStepsPerQuadrant, zlut_minradius, zlut_maxradius, vector2f(pos.x,pos.y));
+	for (int q=0;q<4;q++)
+		NormalizeRadialProfile(buf+q*res, res);
 	
 	//WriteImageAsCSV("qa_qdr.txt" , buf, res,4);
 	
@@ -590,6 +595,139 @@ CPUTracker::Gauss2DResult CPUTracker::Compute2DGaussianMLE(vector2f initial, int
 }
 
 
+// Solves the symmetric 3x3 system H*x = g. Returns false if H is singular.
+static bool Solve3x3(double H[3][3], double g[3], double x[3])
+{
+	double c00 = H[1][1]*H[2][2] - H[1][2]*H[2][1];
+	double c01 = H[1][2]*H[2][0] - H[1][0]*H[2][2];
+	double c02 = H[1][0]*H[2][1] - H[1][1]*H[2][0];
+	double det = H[0][0]*c00 + H[0][1]*c01 + H[0][2]*c02;
+	if (fabs(det) < 1e-20)
+		return false;
+	double inv[3][3] = {
+		{ c00, H[0][2]*H[2][1] - H[0][1]*H[2][2], H[0][1]*H[1][2] - H[0][2]*H[1][1] },
+		{ c01, H[0][0]*H[2][2] - H[0][2]*H[2][0], H[0][2]*H[1][0] - H[0][0]*H[1][2] },
+		{ c02, H[0][1]*H[2][0] - H[0][0]*H[2][1], H[0][0]*H[1][1] - H[0][1]*H[1][0] }
+	};
+	for (int i=0;i<3;i++)
+		x[i] = (inv[i][0]*g[0] + inv[i][1]*g[1] + inv[i][2]*g[2]) / det;
+	return true;
+}
+
+/*
+The image is modelled as bg + A * L(z, px - x + lutw/2, py - y + luth/2), where L is the image LUT sampled like BuildLUT does.
+Near the nearest plane p, L(z) = L_p + dz * L'_p + dz^2/2 * L''_p using the precomputed derivative stacks.
+Per iteration, A and bg follow from a linear least squares fit, then x,y,z are updated with a Newton step 
+(Gauss-Newton for x,y, with the second derivative term included for z).
+Only pixels inside a circle of the LUT size are used, so the corners of the ROI don't contribute.
+The pixel loop fills per-pixel arrays, and all sums are computed from those in separate flat loops.
+*/
+vector3f CPUTracker::ComputeImageLUT(const float* lut, const float* lut_dz, const float* lut_dz2, int planes, int lutw, int luth, vector3f initial, int iterations, bool& boundaryHit)
+{
+	vector3f pos = initial;
+	float radius = std::min(lutw,luth)/2 - 1.0f;
+	int maxPixels = width*height;
+	imageLUTScratch.resize(maxPixels*6);
+	float* smp = &imageLUTScratch[0];
+	float* M = &smp[maxPixels];
+	float* Mx = &M[maxPixels];
+	float* My = &Mx[maxPixels];
+	float* Mz = &My[maxPixels];
+	float* Mzz = &Mz[maxPixels];
+
+	boundaryHit = false;
+	if (planes < 1 || radius < 2)
+		return pos;
+
+	for (int it=0;it<iterations;it++) {
+		int plane = std::max(0, std::min(planes-1, (int)(pos.z + 0.5f)));
+		float dz = pos.z - plane;
+		const float* L = &lut[lutw*luth*plane];
+		const float* D = &lut_dz[lutw*luth*plane];
+		const float* D2 = &lut_dz2[lutw*luth*plane];
+
+		float ox = lutw/2 - pos.x, oy = luth/2 - pos.y; // LUT coordinate of image pixel (0,0)
+		int x0 = std::max(0, (int)ceilf(pos.x - radius)), x1 = std::min(width-1, (int)(pos.x + radius));
+		int y0 = std::max(0, (int)ceilf(pos.y - radius)), y1 = std::min(height-1, (int)(pos.y + radius));
+		if (x0 > pos.x - radius + 1 || y0 > pos.y - radius + 1 || x1 < pos.x + radius - 1 || y1 < pos.y + radius - 1)
+			boundaryHit = true;
+
+		int n=0;
+		for (int y=y0;y<=y1;y++) {
+			for (int x=x0;x<=x1;x++) {
+				float u = x + ox, v = y + oy;
+				float ru = u - lutw/2, rv = v - luth/2;
+				if (ru*ru+rv*rv > radius*radius || u < 0 || v < 0 || u >= lutw-1 || v >= luth-1)
+					continue;
+
+				int iu = (int)u, iv = (int)v;
+				float fu = u-iu, fv = v-iv;
+				int i = iv*lutw+iu;
+				float w00 = (1-fu)*(1-fv), w10 = fu*(1-fv), w01 = (1-fu)*fv, w11 = fu*fv;
+
+				float l00 = L[i] + dz * (D[i] + 0.5f*dz*D2[i]);
+				float l10 = L[i+1] + dz * (D[i+1] + 0.5f*dz*D2[i+1]);
+				float l01 = L[i+lutw] + dz * (D[i+lutw] + 0.5f*dz*D2[i+lutw]);
+				float l11 = L[i+lutw+1] + dz * (D[i+lutw+1] + 0.5f*dz*D2[i+lutw+1]);
+
+				smp[n] = srcImage[y*width+x];
+				M[n] = w00*l00 + w10*l10 + w01*l01 + w11*l11;
+				// moving the bead by +x moves the LUT coordinate by -x
+				Mx[n] = -((1-fv)*(l10-l00) + fv*(l11-l01));
+				My[n] = -((1-fu)*(l01-l00) + fu*(l11-l10));
+				Mzz[n] = w00*D2[i] + w10*D2[i+1] + w01*D2[i+lutw] + w11*D2[i+lutw+1];
+				Mz[n] = w00*D[i] + w10*D[i+1] + w01*D[i+lutw] + w11*D[i+lutw+1] + dz * Mzz[n];
+				n++;
+			}
+		}
+
+		if (n < 16) {
+			boundaryHit = true;
+			break;
+		}
+
+		// Linear fit of amplitude and background
+		double sM=0, sMM=0, sd=0, sMd=0;
+		for (int k=0;k<n;k++) {
+			sM += M[k];
+			sMM += M[k]*M[k];
+			sd += smp[k];
+			sMd += M[k]*smp[k];
+		}
+		double denom = n*sMM - sM*sM;
+		if (denom <= 0.0)
+			break;
+		float A = (n*sMd - sM*sd) / denom;
+		float bg = (sd - A*sM) / n;
+
+		double H[3][3] = {}, g[3] = {}, step[3];
+		double rzz = 0.0;
+		for (int k=0;k<n;k++) {
+			float r = smp[k] - bg - A*M[k];
+			float jx = A*Mx[k], jy = A*My[k], jz = A*Mz[k];
+			g[0] += jx*r; g[1] += jy*r; g[2] += jz*r;
+			H[0][0] += jx*jx; H[0][1] += jx*jy; H[0][2] += jx*jz;
+			H[1][1] += jy*jy; H[1][2] += jy*jz;
+			H[2][2] += jz*jz;
+			rzz += r*A*Mzz[k];
+		}
+		H[1][0] = H[0][1]; H[2][0] = H[0][2]; H[2][1] = H[1][2];
+		if (H[2][2] - rzz > 0.1 * H[2][2])
+			H[2][2] -= rzz;
+
+		if (!Solve3x3(H, g, step))
+			break;
+
+		pos.x += std::max(-1.0, std::min(1.0, step[0]));
+		pos.y += std::max(-1.0, std::min(1.0, step[1]));
+		pos.z += std::max(-1.0, std::min(1.0, step[2]));
+		pos.z = std::max(0.0f, std::min(planes-1.0f, pos.z));
+	}
+
+	return pos;
+}
+
+
 float CPUTracker::ComputeAsymmetry(vector2f center, int radialSteps, int angularSteps, 
 						float minRadius, float maxRadius, float *dstAngProf)
 {
@@ -678,6 +816,208 @@ void CPUTracker::ComputeQuadrantProfile(scalar_t* dst, int radialSteps, int angu
 }
 
 
+// Interpolate without the bounds check, for samples known to be inside the image
+static inline scalar_t InterpolateInside(const float* image, int width, scalar_t x, scalar_t y)
+{
+	int rx=x, ry=y;
+	const float* p = &image[width*ry+rx];
+	scalar_t v0 = Lerp(p[0], p[1], x-rx);
+	scalar_t v1 = Lerp(p[width], p[width+1], x-rx);
+	return Lerp(v0, v1, y-ry);
+}
+
+// All four quadrant profiles in one sweep, equal to calling ComputeQuadrantProfile for every quadrant.
+// The quadrants mirror the same sample offsets (dx,dy) around the center, so the offsets are computed once per radius
+// for all angular samples. If the outer ring is inside the image the samples are interpolated without bounds checks.
+void CPUTracker::ComputeQuadrantProfiles(scalar_t* dst, int radialSteps, int angularSteps, float minRadius, float maxRadius, vector2f center, float* radialWeights)
+{
+	if (angularSteps < MIN_RADPROFILE_SMP_COUNT)
+		angularSteps = MIN_RADPROFILE_SMP_COUNT;
+
+	scalar_t* dirx = ALLOCA_ARRAY(scalar_t, angularSteps*4);
+	scalar_t* diry = dirx + angularSteps;
+	scalar_t* dx = diry + angularSteps;
+	scalar_t* dy = dx + angularSteps;
+	scalar_t angstepf = (scalar_t) quadrantDirs.size() / angularSteps;
+	for (int a=0;a<angularSteps;a++) {
+		int i = (int)angstepf * a;
+		dirx[a] = quadrantDirs[i].x;
+		diry[a] = quadrantDirs[i].y;
+	}
+
+	bool inside = center.x - maxRadius >= 0.0f && center.y - maxRadius >= 0.0f &&
+		center.x + maxRadius + 1 < width && center.y + maxRadius + 1 < height;
+
+	scalar_t rstep = (maxRadius - minRadius) / radialSteps;
+	for (int i=0;i<radialSteps; i++) {
+		scalar_t r = minRadius + rstep * i;
+		for (int a=0;a<angularSteps;a++) {
+			dx[a] = dirx[a] * r;
+			dy[a] = diry[a] * r;
+		}
+
+		scalar_t sum[4] = {};
+		int nPixels[4] = {};
+		if (inside) {
+			for (int a=0;a<angularSteps;a++) {
+				scalar_t xp = center.x + dx[a], xm = center.x - dx[a];
+				scalar_t yp = center.y + dy[a], ym = center.y - dy[a];
+				sum[0] += InterpolateInside(srcImage,width, xp,yp);
+				sum[1] += InterpolateInside(srcImage,width, xm,yp);
+				sum[2] += InterpolateInside(srcImage,width, xm,ym);
+				sum[3] += InterpolateInside(srcImage,width, xp,ym);
+				MARKPIXELI(xp,yp); MARKPIXELI(xm,yp); MARKPIXELI(xm,ym); MARKPIXELI(xp,ym);
+			}
+			nPixels[0] = nPixels[1] = nPixels[2] = nPixels[3] = angularSteps;
+		} else {
+			for (int a=0;a<angularSteps;a++) {
+				scalar_t xs[4] = { center.x + dx[a], center.x - dx[a], center.x - dx[a], center.x + dx[a] };
+				scalar_t ys[4] = { center.y + dy[a], center.y + dy[a], center.y - dy[a], center.y - dy[a] };
+				for (int q=0;q<4;q++) {
+					bool outside;
+					scalar_t v = Interpolate(srcImage,width,height, xs[q],ys[q], &outside);
+					if (!outside) {
+						sum[q] += v;
+						nPixels[q]++;
+						MARKPIXELI(xs[q],ys[q]);
+					}
+				}
+			}
+		}
+
+		for (int q=0;q<4;q++) {
+			scalar_t v = nPixels[q]>=MIN_RADPROFILE_SMP_COUNT ? sum[q]/nPixels[q] : mean;
+			dst[q*radialSteps+i] = radialWeights ? v * radialWeights[i] : v;
+		}
+	}
+}
+
+void RadialBinTable::Build(int width, int radialSteps, float minRadius, float maxRadius, float centerX, float centerY)
+{
+	float rstep = (maxRadius - minRadius) / radialSteps;
+	extent = (int)ceilf(maxRadius) + 1;
+	pixels.clear();
+
+	for (int dy=-extent;dy<=extent;dy++) {
+		for (int dx=-extent;dx<=extent;dx++) {
+			float x = dx - centerX, y = dy - centerY;
+			float t = (sqrtf(x*x+y*y) - minRadius) / rstep;
+			if (t <= -1.0f || t >= radialSteps)
+				continue;
+
+			Pixel p;
+			p.offset = dy*width+dx;
+			p.dx = dx; p.dy = dy;
+			p.bin = (short)floorf(t);
+			p.frac = t - p.bin;
+			if (y >= 0.0f) p.quadrant = x >= 0.0f ? 0 : 1;
+			else p.quadrant = x < 0.0f ? 2 : 3;
+			pixels.push_back(p);
+		}
+	}
+}
+
+const RadialBinTable& CPUTracker::GetRadialBinTable(int radialSteps, float minRadius, float maxRadius, vector2f& center, int& cx, int& cy)
+{
+	RadialBinTableSet* set = 0;
+	for (uint i=0;i<radialBinTables.size();i++) {
+		RadialBinTableSet* s = radialBinTables[i];
+		if (s->radialSteps == radialSteps && s->minRadius == minRadius && s->maxRadius == maxRadius)
+			set = s;
+	}
+	if (!set) {
+		set = new RadialBinTableSet();
+		set->radialSteps = radialSteps;
+		set->minRadius = minRadius;
+		set->maxRadius = maxRadius;
+		radialBinTables.push_back(set);
+	}
+
+	int qx = (int)floorf(center.x * RADIALBIN_SUBPIXEL + 0.5f);
+	int qy = (int)floorf(center.y * RADIALBIN_SUBPIXEL + 0.5f);
+	cx = (int)floorf(qx / (float)RADIALBIN_SUBPIXEL);
+	cy = (int)floorf(qy / (float)RADIALBIN_SUBPIXEL);
+	int sx = qx - cx * RADIALBIN_SUBPIXEL, sy = qy - cy * RADIALBIN_SUBPIXEL;
+	center = vector2f(qx / (float)RADIALBIN_SUBPIXEL, qy / (float)RADIALBIN_SUBPIXEL);
+
+	RadialBinTable& tbl = set->tables[sy*RADIALBIN_SUBPIXEL+sx];
+	if (tbl.pixels.empty())
+		tbl.Build(width, radialSteps, minRadius, maxRadius, sx / (float)RADIALBIN_SUBPIXEL, sy / (float)RADIALBIN_SUBPIXEL);
+	return tbl;
+}
+
+// sum and weight are [stride*(quadrants ? 4 : 1)], indexed by bin+1, so the bins outside the profile need no branches
+void CPUTracker::AccumulateRadialBins(const RadialBinTable& tbl, int cx, int cy, float* sum, float* weight, int stride, bool quadrants)
+{
+	const float* src = &srcImage[cy*width+cx];
+	int n = tbl.pixels.size();
+	const RadialBinTable::Pixel* pix = n > 0 ? &tbl.pixels[0] : 0;
+
+	if (cx >= tbl.extent && cy >= tbl.extent && cx + tbl.extent < width && cy + tbl.extent < height) {
+		for (int i=0;i<n;i++) {
+			const RadialBinTable::Pixel& p = pix[i];
+			float v = src[p.offset];
+			int b = (quadrants ? p.quadrant*stride : 0) + p.bin + 1;
+			sum[b] += v * (1.0f-p.frac); weight[b] += 1.0f-p.frac;
+			sum[b+1] += v * p.frac; weight[b+1] += p.frac;
+		}
+	} else {
+		for (int i=0;i<n;i++) {
+			const RadialBinTable::Pixel& p = pix[i];
+			int x = cx + p.dx, y = cy + p.dy;
+			if (x < 0 || y < 0 || x >= width || y >= height)
+				continue;
+			float v = src[p.offset];
+			int b = (quadrants ? p.quadrant*stride : 0) + p.bin + 1;
+			sum[b] += v * (1.0f-p.frac); weight[b] += 1.0f-p.frac;
+			sum[b+1] += v * p.frac; weight[b+1] += p.frac;
+		}
+	}
+}
+
+vector2f CPUTracker::ComputeBinnedRadialProfile(float* dst, int radialSteps, float minradius, float maxradius, vector2f center, bool* pBoundaryHit, bool normalize)
+{
+	bool boundaryHit = CheckBoundaries(center, maxradius);
+	if (pBoundaryHit) *pBoundaryHit = boundaryHit;
+
+	int cx, cy;
+	const RadialBinTable& tbl = GetRadialBinTable(radialSteps, minradius, maxradius, center, cx, cy);
+
+	int stride = radialSteps+2;
+	float* sum = ALLOCA_ARRAY(float, stride*2);
+	float* weight = sum + stride;
+	std::fill(sum, sum+stride*2, 0.0f);
+	AccumulateRadialBins(tbl, cx, cy, sum, weight, stride, false);
+
+	for (int i=0;i<radialSteps;i++)
+		dst[i] = weight[i+1] > 0.0f ? sum[i+1] / weight[i+1] : mean;
+
+	if (normalize)
+		NormalizeRadialProfile(dst, radialSteps);
+	return center;
+}
+
+vector2f CPUTracker::ComputeBinnedQuadrantProfiles(scalar_t* dst, int radialSteps, float minRadius, float maxRadius, vector2f center, float* radialWeights)
+{
+	int cx, cy;
+	const RadialBinTable& tbl = GetRadialBinTable(radialSteps, minRadius, maxRadius, center, cx, cy);
+
+	int stride = radialSteps+2;
+	float* sum = ALLOCA_ARRAY(float, stride*8);
+	float* weight = sum + stride*4;
+	std::fill(sum, sum+stride*8, 0.0f);
+	AccumulateRadialBins(tbl, cx, cy, sum, weight, stride, true);
+
+	for (int q=0;q<4;q++) {
+		for (int i=0;i<radialSteps;i++) {
+			int b = q*stride+i+1;
+			scalar_t v = weight[b] > 0.0f ? sum[b] / weight[b] : mean;
+			dst[q*radialSteps+i] = radialWeights ? v * radialWeights[i] : v;
+		}
+	}
+	return center;
+}
+
 
 vector2f CPUTracker::ComputeMeanAndCOM(float bgcorrection)
 {
@@ -901,6 +1241,152 @@ float CPUTracker::LUTProfileCompareAdjustedWeights(float* rprof, int zlutIndex,
 	return ComputeMaxInterp<double, ZLUT_LSQFIT_NWEIGHTS>::Compute(rprof_diff, zlut_planes, ZLUTWeights_d);
 }
 
+// C[m x n] = A[m x k] * B[n x k]^T. 
+// Blocked over B so a tile of ZLUT planes stays in cache while all profiles pass over it, 4 rows of A per pass to reuse the loads from B.
+static void MatMulTransposed(const float* A, const float* B, float* C, int m, int n, int k)
+{
+	const int BlockN = 32, BlockK = 256;
+
+	std::fill(C, C+m*n, 0.0f);
+	for (int k0=0;k0<k;k0+=BlockK) {
+		int k1 = std::min(k, k0+BlockK);
+		for (int n0=0;n0<n;n0+=BlockN) {
+			int n1 = std::min(n, n0+BlockN);
+			int i=0;
+			for (;i+4<=m;i+=4) {
+				const float *a0=&A[i*k], *a1=&A[(i+1)*k], *a2=&A[(i+2)*k], *a3=&A[(i+3)*k];
+				for (int j=n0;j<n1;j++) {
+					const float* b = &B[j*k];
+					float s0=0.0f, s1=0.0f, s2=0.0f, s3=0.0f;
+					for (int q=k0;q<k1;q++) {
+						s0 += a0[q]*b[q];
+						s1 += a1[q]*b[q];
+						s2 += a2[q]*b[q];
+						s3 += a3[q]*b[q];
+					}
+					C[i*n+j] += s0;
+					C[(i+1)*n+j] += s1;
+					C[(i+2)*n+j] += s2;
+					C[(i+3)*n+j] += s3;
+				}
+			}
+			for (;i<m;i++) {
+				const float *a = &A[i*k];
+				for (int j=n0;j<n1;j++) {
+					const float* b = &B[j*k];
+					float sum=0.0f;
+					for (int q=k0;q<k1;q++)
+						sum += a[q]*b[q];
+					C[i*n+j] += sum;
+				}
+			}
+		}
+	}
+}
+
+// Batched LUTProfileCompare for 'count' profiles that all use the same ZLUT.
+// Uses -|w(x-z)|^2 = 2 (w^2 x).z - |wz|^2 - |wx|^2, so all scores come from one [count x planes] matrix product.
+// Near the best plane these scores are a small difference of large terms, so they only locate the maximum.
+// The planes around it are compared again like LUTProfileCompare does, which gives the same Z.
+// zlutNorms = [planes] holding |wz|^2 of each plane.
+void CPUTracker::LUTProfileCompareBatch(float* profiles, int count, int zlutIndex, float* zlutNorms, float* dstZ, float* cmpProf)
+{
+	if (!zluts) {
+		std::fill(dstZ, dstZ+count, 0.0f);
+		return;
+	}
+
+	double* profNorms = ALLOCA_ARRAY(double, count);
+	batchWeighted.resize(count*zlut_res);
+	for (int i=0;i<count;i++) {
+		float* prof = &profiles[i*zlut_res], *weighted = &batchWeighted[i*zlut_res];
+		double sum = 0.0;
+		for (int r=0;r<zlut_res;r++) {
+			float w = zlut_radialweights.empty() ? 1.0f : zlut_radialweights[r];
+			sum += (double)prof[r]*w * prof[r]*w;
+			weighted[r] = prof[r]*w*w;
+		}
+		profNorms[i] = sum;
+	}
+
+	float* zlut_sel = GetRadialZLUT(zlutIndex);
+	batchScores.resize(count*zlut_planes);
+	MatMulTransposed(&batchWeighted[0], zlut_sel, &batchScores[0], count, zlut_planes, zlut_res);
+
+	double* rprof_diff = ALLOCA_ARRAY(double, zlut_planes);
+	for (int i=0;i<count;i++) {
+		for (int k=0;k<zlut_planes;k++)
+			rprof_diff[k] = 2.0 * batchScores[i*zlut_planes+k] - zlutNorms[k] - profNorms[i];
+
+		// The interpolation window is ZLUT_LSQFIT_NWEIGHTS wide around the maximum. A window twice as wide is recomputed,
+		// in case the exact maximum is a few planes off.
+		float* rprof = &profiles[i*zlut_res];
+		int iMax = std::max_element(rprof_diff, rprof_diff+zlut_planes) - rprof_diff;
+		int k0 = std::max(0, iMax-ZLUT_LSQFIT_NWEIGHTS), k1 = std::min(zlut_planes, iMax+ZLUT_LSQFIT_NWEIGHTS+1);
+		for (int k=k0;k<k1;k++) {
+			double diffsum = 0.0;
+			for (int r = 0; r<zlut_res;r++) {
+				double d = rprof[r]-zlut_sel[k*zlut_res+r];
+				if (!zlut_radialweights.empty())
+					d*=zlut_radialweights[r];
+				d = -d*d;
+				diffsum += d;
+			}
+			rprof_diff[k] = diffsum;
+		}
+
+		if (cmpProf)
+			std::copy(rprof_diff, rprof_diff+zlut_planes, cmpProf);
+
+		dstZ[i] = ComputeMaxInterp<double, ZLUT_LSQFIT_NWEIGHTS>::Compute(rprof_diff, zlut_planes, ZLUTWeights_d);
+	}
+}
+
+void CPUTracker::SetRadialZLUTBasis(float* data, int k)
+{
+	zlut_pca = data;
+	zlut_pca_k = k;
+}
+
+// Same as LUTProfileCompare, but the comparison is done on the first k principal components instead of all radial steps
+float CPUTracker::LUTProfileComparePCA(float* rprof, int zlutIndex, float* cmpProf)
+{
+	if (!zlut_pca)
+		return LUTProfileCompare(rprof, zlutIndex, cmpProf, LUTProfMaxQuadraticFit);
+
+	int k = zlut_pca_k;
+	float* mean = GetRadialZLUTBasis(zlutIndex);
+	float* basis = &mean[zlut_res];
+	float* coeffs = &basis[k*zlut_res];
+
+	float* wprof = ALLOCA_ARRAY(float, zlut_res);
+	for (int r=0;r<zlut_res;r++)
+		wprof[r] = rprof[r] * (zlut_radialweights.empty() ? 1.0f : zlut_radialweights[r]) - mean[r];
+
+	double* proj = ALLOCA_ARRAY(double, k);
+	for (int c=0;c<k;c++) {
+		double sum = 0.0;
+		for (int r=0;r<zlut_res;r++)
+			sum += wprof[r]*basis[c*zlut_res+r];
+		proj[c] = sum;
+	}
+
+	double* rprof_diff = ALLOCA_ARRAY(double, zlut_planes);
+	for (int p=0;p<zlut_planes;p++) {
+		double diffsum = 0.0;
+		for (int c=0;c<k;c++) {
+			double d = proj[c] - coeffs[p*k+c];
+			diffsum -= d*d;
+		}
+		rprof_diff[p] = diffsum;
+	}
+
+	if (cmpProf)
+		std::copy(rprof_diff, rprof_diff+zlut_planes, cmpProf);
+
+	return ComputeMaxInterp<double, ZLUT_LSQFIT_NWEIGHTS>::Compute(rprof_diff, zlut_planes, ZLUTWeights_d);
+}
+
 
 void CPUTracker::SaveImage(const char *filename)
 {
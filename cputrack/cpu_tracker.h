@@ -20,6 +20,22 @@ public:
 	void XCorFFTHelper(complex_t* xc, complex_t* xcr, scalar_t* result);
 };
 
+// Assignment of ROI pixels to radial bins around a sub-pixel center, for profiles computed in a single pass over the pixels.
+// A pixel at radius r falls between two bins and is split over both by linear weights. Pixels are also tagged with their QI quadrant.
+#define RADIALBIN_SUBPIXEL 8 // centers are quantized to 1/RADIALBIN_SUBPIXEL pixel, so there is one table per quantized center
+struct RadialBinTable {
+	struct Pixel {
+		int offset; // relative to the pixel at the integer part of the center: dy*width+dx
+		short dx, dy;
+		short bin; // receives 1-frac, bin+1 receives frac. Can be -1 or radialSteps-1, the outer half then falls outside the profile
+		short quadrant;
+		float frac;
+	};
+	int extent; // dx and dy are within [-extent, extent]
+	std::vector<Pixel> pixels;
+	void Build(int width, int radialSteps, float minRadius, float maxRadius, float centerX, float centerY);
+};
+
 class CPUTracker
 {
 public:
@@ -44,8 +60,28 @@ public:
 
 	float* GetRadialZLUT(int index)  { return &zluts[zlut_res*zlut_planes*index]; }
 
+	// Per-bead principal component basis of the ZLUT (external memory), see ComputeZLUTPrincipalBasis
+	// Per bead: mean[zlut_res], basis[zlut_pca_k * zlut_res], coeffs[zlut_planes * zlut_pca_k]
+	float* zlut_pca;
+	int zlut_pca_k;
+	int ZLUTBasisStride() { return zlut_res + zlut_pca_k * zlut_res + zlut_planes * zlut_pca_k; }
+	float* GetRadialZLUTBasis(int index) { return &zlut_pca[ZLUTBasisStride()*index]; }
+
+	std::vector<float> batchScores, batchWeighted; // scratch space for LUTProfileCompareBatch
+	std::vector<float> imageLUTScratch; // scratch space for ComputeImageLUT
+
 	XCor1DBuffer* xcorBuffer;
 	std::vector<vector2f> quadrantDirs; // single quadrant
+
+	// Cached ring assignment tables, one set per radial profile configuration
+	struct RadialBinTableSet {
+		int radialSteps;
+		float minRadius, maxRadius;
+		RadialBinTable tables[RADIALBIN_SUBPIXEL*RADIALBIN_SUBPIXEL]; // built on first use
+	};
+	std::vector<RadialBinTableSet*> radialBinTables;
+	const RadialBinTable& GetRadialBinTable(int radialSteps, float minRadius, float maxRadius, vector2f& center, int& cx, int& cy);
+	void AccumulateRadialBins(const RadialBinTable& tbl, int cx, int cy, float* sum, float* weight, int stride, bool quadrants);
 	int qi_radialsteps;
 	kissfft<scalar_t> *qi_fft_forward, *qi_fft_backward;
 
@@ -68,7 +104,7 @@ public:
 	bool CheckBoundaries(vector2f center, float radius);
 	vector2f ComputeXCorInterpolated(vector2f initial, int iterations, int profileWidth, bool& boundaryHit);
 	vector2f ComputeQI(vector2f initial, int iterations, int radialSteps, int angularStepsPerQuadrant, 
-		float angStepIterationFactor, float minRadius, float maxRadius, bool& boundaryHit, float* radialweights=0);
+		float angStepIterationFactor, float minRadius, float maxRadius, bool& boundaryHit, float* radialweights=0, bool pixelBinned=false);
 
 	struct Gauss2DResult {
 		vector2f pos;
@@ -77,6 +113,9 @@ public:
 
 	Gauss2DResult Compute2DGaussianMLE(vector2f initial ,int iterations, float sigma);
 
+	// XYZ fit against a single bead's image LUT [planes][h][w] and its z derivatives, with z in LUT planes
+	vector3f ComputeImageLUT(const float* lut, const float* lut_dz, const float* lut_dz2, int planes, int lutw, int luth, vector3f initial, int iterations, bool& boundaryHit);
+
 	scalar_t QI_ComputeOffset(complex_t* qi_profile, int nr, int axisForDebug);
 	scalar_t QuadrantAlign_ComputeOffset(complex_t* profile, complex_t* zlut_prof_fft, int nr, int axisForDebug);
 
@@ -86,11 +125,17 @@ public:
 	void SetImage16Bit(ushort* srcImage, uint srcpitch) { SetImage(srcImage, srcpitch); }
 	void SetImage8Bit(uchar* srcImage, uint srcpitch) { SetImage(srcImage, srcpitch); }
 	void SetImageFloat(float* srcImage);
+	// Converts and calibrates in one pass. Same as SetImage if calib is null or has no maps for this bead
+	template<typename TPixel> void SetImageCalibrated(TPixel* srcImage, uint srcpitch, const PixelCalibration* calib, int bead);
 	void SaveImage(const char *filename);
 
 	vector2f ComputeMeanAndCOM(float bgcorrection=0.0f);
 	void ComputeRadialProfile(float* dst, int radialSteps, int angularSteps, float minradius, float maxradius, vector2f center, bool crp, bool* boundaryHit=0, bool normalize=true);
 	void ComputeQuadrantProfile(scalar_t* dst, int radialSteps, int angularSteps, int quadrant, float minRadius, float maxRadius, vector2f center, float* radialWeights=0);
+	void ComputeQuadrantProfiles(scalar_t* dst, int radialSteps, int angularSteps, float minRadius, float maxRadius, vector2f center, float* radialWeights=0); // dst = [4*radialSteps]
+	// Pixel binned versions of the profiles above. The center is rounded to 1/RADIALBIN_SUBPIXEL pixel, the rounded center is returned.
+	vector2f ComputeBinnedRadialProfile(float* dst, int radialSteps, float minradius, float maxradius, vector2f center, bool* boundaryHit=0, bool normalize=true);
+	vector2f ComputeBinnedQuadrantProfiles(scalar_t* dst, int radialSteps, float minRadius, float maxRadius, vector2f center, float* radialWeights=0); // dst = [4*radialSteps]
 
 	float ComputeZ(vector2f center, int angularSteps, int zlutIndex, bool* boundaryHit=0, float* profile=0, float* cmpprof=0, bool normalizeProfile=true)
 	{
@@ -108,6 +153,9 @@ public:
 	enum LUTProfileMaxComputeMode { LUTProfMaxQuadraticFit, LUTProfMaxSplineFit, LUTProfMaxSimpleInterp };
 	float LUTProfileCompare(float* profile, int zlutIndex, float* cmpProf, LUTProfileMaxComputeMode maxPosMethod, float* lsqfittedcurve=0, int *maxPos=0);
 	float LUTProfileCompareAdjustedWeights(float* rprof, int zlutIndex, float z_estim);
+	void LUTProfileCompareBatch(float* profiles, int count, int zlutIndex, float* zlutNorms, float* dstZ, float* cmpProf);
+	void SetRadialZLUTBasis(float* data, int k);
+	float LUTProfileComparePCA(float* rprof, int zlutIndex, float* cmpProf);
 
 	float* GetDebugImage() { return debugImage; }
 
@@ -134,3 +182,38 @@ void CPUTracker::SetImage(TPixel* data, uint pitchInBytes)
 
 	mean=0.0f;
 }
+
+template<typename TPixel>
+void CPUTracker::SetImageCalibrated(TPixel* data, uint pitchInBytes, const PixelCalibration* calib, int bead)
+{
+	if (!calib || !calib->HasBead(bead)) {
+		SetImage(data, pitchInBytes);
+		return;
+	}
+
+	int start = calib->beadStart[bead];
+	bool haveOffset = calib->offset.IsSet(), haveGain = calib->gain.IsSet();
+	float* offsetRow = ALLOCA_ARRAY(float, width), *gainRow = ALLOCA_ARRAY(float, width);
+	uchar* bp = (uchar*)data;
+
+	for (int y=0;y<height;y++) {
+		TPixel* row = (TPixel*)bp;
+		float* dst = &srcImage[y*width];
+		int i = start + y*calib->pitch;
+		const float* offset = haveOffset ? calib->offset.GetRow(i, width, offsetRow) : 0;
+		const float* gain = haveGain ? calib->gain.GetRow(i, width, gainRow) : 0;
+		if (offset && gain) {
+			for (int x=0;x<width;x++)
+				dst[x] = (row[x] + offset[x]) * gain[x];
+		} else if (offset) {
+			for (int x=0;x<width;x++)
+				dst[x] = row[x] + offset[x];
+		} else {
+			for (int x=0;x<width;x++)
+				dst[x] = row[x] * gain[x];
+		}
+		bp += pitchInBytes;
+	}
+
+	mean=0.0f;
+}
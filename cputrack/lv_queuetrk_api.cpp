@@ -177,6 +177,41 @@ CDLL_EXPORT void DLL_CALLCONV qtrk_set_image_lut(QueuedTracker* qtrk, LVArrayND<
 	}
 }
 
+// lutIndex: LUT index per bead. An empty array gives every bead its own LUT
+CDLL_EXPORT void DLL_CALLCONV qtrk_set_bead_lut_mapping(QueuedTracker* qtrk, LVArray<int>** lutIndex, ErrorCluster* e)
+{
+	if (ValidateTracker(qtrk, e, "set_bead_lut_mapping")) {
+		try {
+			int n = (*lutIndex)->dimSize;
+			qtrk->SetBeadLUTMapping(n > 0 ? (*lutIndex)->elem : 0, n);
+		} catch(const std::runtime_error &exc) {
+			FillErrorCluster(kAppErrorBase, exc.what(), e );
+		}
+	}
+}
+
+CDLL_EXPORT void DLL_CALLCONV qtrk_save_lut_library(QueuedTracker* qtrk, const char* filename, ErrorCluster* e)
+{
+	if (ValidateTracker(qtrk, e, "save_lut_library")) {
+		try {
+			qtrk->SaveLUTLibrary(filename);
+		} catch(const std::runtime_error &exc) {
+			FillErrorCluster(kAppErrorBase, exc.what(), e );
+		}
+	}
+}
+
+CDLL_EXPORT void DLL_CALLCONV qtrk_load_lut_library(QueuedTracker* qtrk, const char* filename, ErrorCluster* e)
+{
+	if (ValidateTracker(qtrk, e, "load_lut_library")) {
+		try {
+			qtrk->LoadLUTLibrary(filename);
+		} catch(const std::runtime_error &exc) {
+			FillErrorCluster(kAppErrorBase, exc.what(), e );
+		}
+	}
+}
+
 CDLL_EXPORT void DLL_CALLCONV qtrk_set_pixel_calib_factors(QueuedTracker* qtrk, float offsetFactor, float gainFactor, ErrorCluster* e)
 {
 	if (ValidateTracker(qtrk, e, "set pixel calib factors")) {
@@ -187,8 +222,7 @@ CDLL_EXPORT void DLL_CALLCONV qtrk_set_pixel_calib_factors(QueuedTracker* qtrk,
 CDLL_EXPORT void DLL_CALLCONV qtrk_set_pixel_calib(QueuedTracker* qtrk, LVArray3D<float>** offset, LVArray3D<float>** gain, ErrorCluster* e)
 {
 	if (ValidateTracker(qtrk, e, "set pixel calibration images")) {
-		int count, planes, radialSteps;
-		qtrk->GetRadialZLUTSize(count, planes, radialSteps);
+		int count = qtrk->GetBeadCount();
 
 		float *offset_data = 0, *gain_data = 0;
 
@@ -198,7 +232,7 @@ CDLL_EXPORT void DLL_CALLCONV qtrk_set_pixel_calib(QueuedTracker* qtrk, LVArray3
 				return;
 			}
 			if (count != (*offset)->dimSizes[0]) {
-				ArgumentErrorMsg(e, SPrintf("set_pixel_calib: Expecting offset to have %d images (same as ZLUT). %d given", count, (*offset)->dimSizes[0]));
+				ArgumentErrorMsg(e, SPrintf("set_pixel_calib: Expecting offset to have %d images (one per bead). %d given", count, (*offset)->dimSizes[0]));
 				return;
 			}
 			offset_data = (*offset)->elem;
@@ -210,13 +244,46 @@ CDLL_EXPORT void DLL_CALLCONV qtrk_set_pixel_calib(QueuedTracker* qtrk, LVArray3
 				return;
 			}
 			if (count != (*gain)->dimSizes[0]) {
-				ArgumentErrorMsg(e, SPrintf("set_pixel_calib: Expecting gain to have %d images (same as ZLUT). %d given", count, (*gain)->dimSizes[0]));
+				ArgumentErrorMsg(e, SPrintf("set_pixel_calib: Expecting gain to have %d images (one per bead). %d given", count, (*gain)->dimSizes[0]));
+				return;
+			}
+			gain_data = (*gain)->elem;
+		}
+
+		try {
+			qtrk->SetPixelCalibrationImages(offset_data, gain_data);
+		} catch (const std::runtime_error& exc) {
+			FillErrorCluster(kAppErrorBase, exc.what(), e );
+		}
+	}
+}
+
+// Sensor-sized offset and gain maps [sensorHeight][sensorWidth], shared by all beads. Either can be an empty array.
+// roipos holds the top-left corner of every bead ROI, in bead order.
+CDLL_EXPORT void DLL_CALLCONV qtrk_set_pixel_calib_map(QueuedTracker* qtrk, LVArray2D<float>** offset, LVArray2D<float>** gain, LVArray<ROIPosition>** roipos, ErrorCluster* e)
+{
+	if (ValidateTracker(qtrk, e, "set pixel calibration map")) {
+		float *offset_data = 0, *gain_data = 0;
+		int w = 0, h = 0;
+
+		if ((*offset)->numElem() != 0) {
+			offset_data = (*offset)->elem;
+			w = (*offset)->dimSizes[1]; h = (*offset)->dimSizes[0];
+		}
+		if ((*gain)->numElem() != 0) {
+			if (offset_data && (w != (*gain)->dimSizes[1] || h != (*gain)->dimSizes[0])) {
+				ArgumentErrorMsg(e, SPrintf("set_pixel_calib_map: Gain map (%d,%d) does not match offset map (%d,%d)", (*gain)->dimSizes[1], (*gain)->dimSizes[0], w, h));
 				return;
 			}
 			gain_data = (*gain)->elem;
+			w = (*gain)->dimSizes[1]; h = (*gain)->dimSizes[0];
 		}
 
-		qtrk->SetPixelCalibrationImages(offset_data, gain_data);
+		try {
+			qtrk->SetPixelCalibrationMap(offset_data, gain_data, w, h, (*roipos)->elem, (*roipos)->dimSize);
+		} catch (const std::runtime_error& exc) {
+			FillErrorCluster(kAppErrorBase, exc.what(), e );
+		}
 	}
 }
 
@@ -243,6 +310,49 @@ CDLL_EXPORT QueuedTracker* qtrk_create(QTrkSettings* settings, LStrHandle warnin
 }
 
 
+// Creates a tracker from a state snapshot written by qtrk_save_state, using the settings stored in the snapshot
+CDLL_EXPORT QueuedTracker* qtrk_create_from_state(const char* filename, LStrHandle warnings, ErrorCluster* e)
+{
+	QueuedTracker* tracker = 0;
+	try {
+		tracker = CreateQueuedTrackerFromState(filename);
+		tracker->cfg.WriteToLog();
+
+		std::string w = tracker->GetWarnings();
+		if (!w.empty()) SetLVString(warnings, w.c_str());
+
+		trackerListMutex.lock();
+		trackerList.push_back(tracker);
+		trackerListMutex.unlock();
+	} catch(const std::runtime_error &exc) {
+		FillErrorCluster(kAppErrorBase, exc.what(), e );
+	}
+	return tracker;
+}
+
+CDLL_EXPORT void DLL_CALLCONV qtrk_save_state(QueuedTracker* qtrk, const char* filename, ErrorCluster* e)
+{
+	if (ValidateTracker(qtrk, e, "save_state")) {
+		try {
+			qtrk->SaveState(filename);
+		} catch(const std::runtime_error &exc) {
+			FillErrorCluster(kAppErrorBase, exc.what(), e );
+		}
+	}
+}
+
+CDLL_EXPORT void DLL_CALLCONV qtrk_load_state(QueuedTracker* qtrk, const char* filename, ErrorCluster* e)
+{
+	if (ValidateTracker(qtrk, e, "load_state")) {
+		try {
+			qtrk->LoadState(filename);
+		} catch(const std::runtime_error &exc) {
+			FillErrorCluster(kAppErrorBase, exc.what(), e );
+		}
+	}
+}
+
+
 CDLL_EXPORT void qtrk_destroy(QueuedTracker* qtrk, ErrorCluster* error)
 {
 	trackerListMutex.lock();
@@ -364,11 +474,10 @@ CDLL_EXPORT void qtrk_build_lut_plane(QueuedTracker* qtrk, LVArray3D<float> **da
 			return;
 		}
 
-		int cnt,planes,rsteps;
-		qtrk->GetRadialZLUTSize(cnt, planes, rsteps);
-
-		if ((*data)->dimSizes[0] != cnt) {
-			ArgumentErrorMsg(err, SPrintf("Invalid number of images given (%d). Expecting %d", (*data)->dimSizes[0], cnt));
+		// BuildLUT reads one ROI per bead. Beads can share a LUT, so there can be more beads than LUTs.
+		int beads = qtrk->GetBeadCount();
+		if ((*data)->dimSizes[0] != beads) {
+			ArgumentErrorMsg(err, SPrintf("Invalid number of images given (%d). Expecting one per bead: %d beads", (*data)->dimSizes[0], beads));
 			return;
 		}
 
@@ -380,8 +489,13 @@ CDLL_EXPORT void qtrk_build_lut_plane(QueuedTracker* qtrk, LVArray3D<float> **da
 
 CDLL_EXPORT void qtrk_finalize_lut(QueuedTracker* qtrk, ErrorCluster *e)
 {
-	if (ValidateTracker(qtrk, e, "finalize_lut"))
-		qtrk->FinalizeLUT();
+	if (ValidateTracker(qtrk, e, "finalize_lut")) {
+		try {
+			qtrk->FinalizeLUT();
+		} catch(const std::runtime_error &exc) {
+			FillErrorCluster(kAppErrorBase, exc.what(), e );
+		}
+	}
 }
 
 
@@ -447,6 +561,16 @@ CDLL_EXPORT void qtrk_set_localization_mode(QueuedTracker* qtrk, uint locType, E
 	}
 }
 
+CDLL_EXPORT void qtrk_set_localization_mode_profile(QueuedTracker* qtrk, int profile, uint locType, ErrorCluster* e)
+{
+	if (ValidateTracker(qtrk, e, "set_localization_mode_profile")) {
+		if (profile < 0 || profile >= QTRK_MAX_MODE_PROFILES)
+			ArgumentErrorMsg(e, SPrintf("Invalid mode profile %d (max %d)", profile, QTRK_MAX_MODE_PROFILES-1));
+		else
+			qtrk->SetLocalizationModeProfile(profile, (LocMode_t)locType );
+	}
+}
+
 CDLL_EXPORT int qtrk_idle(QueuedTracker* qtrk, ErrorCluster* e)
 {
 	if (ValidateTracker(qtrk, e, "is_idle"))
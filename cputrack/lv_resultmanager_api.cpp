@@ -23,14 +23,19 @@ CDLL_EXPORT void DLL_CALLCONV rm_destroy_all()
 	DeleteAllElems(rm_instances);
 }
 
-CDLL_EXPORT ResultManager* DLL_CALLCONV rm_create(const char *file, const char *frameinfo, ResultManagerConfig* cfg, LStrHandle* names)
+CDLL_EXPORT ResultManager* DLL_CALLCONV rm_create(const char *file, const char *frameinfo, ResultManagerConfig* cfg, LStrHandle* names, ErrorCluster* err)
 {
 	std::vector<std::string> colNames;
 	
 	if (names) colNames = LVGetStringArray(cfg->numFrameInfoColumns, names);
-	ResultManager* rm = new ResultManager(file, frameinfo, cfg, colNames);
 
-	rm_instances.insert(rm);
+	ResultManager* rm = 0;
+	try {
+		rm = new ResultManager(file, frameinfo, cfg, colNames);
+		rm_instances.insert(rm);
+	} catch(const std::runtime_error &exc) {
+		FillErrorCluster(kAppErrorBase, exc.what(), err);
+	}
 	return rm;
 }
 
@@ -103,6 +108,48 @@ CDLL_EXPORT int DLL_CALLCONV rm_getresults(ResultManager* rm, int startFrame, in
 	return 0;
 }
 
+// allanDev = [maxOctaves*3]: Allan deviation of x,y,z at tau = 1,2,4,... frames. Returns the number of octaves written.
+CDLL_EXPORT int DLL_CALLCONV rm_getbeadstatistics(ResultManager* rm, int bead, BeadStatistics* stats, float* allanDev, int maxOctaves, ErrorCluster* err)
+{
+	if (ValidRM(rm, err)) {
+		if (bead < 0 || bead >= rm->Config().numBeads)
+			ArgumentErrorMsg(err,SPrintf( "Invalid bead index: %d. Accepted range: [0-%d]", bead, rm->Config().numBeads));
+		else
+			return rm->GetBeadStatistics(bead, stats, allanDev, maxOctaves);
+	}
+	return 0;
+}
+
+CDLL_EXPORT void DLL_CALLCONV rm_resetbeadstatistics(ResultManager* rm, ErrorCluster* err)
+{
+	if (ValidRM(rm, err)) {
+		rm->ResetBeadStatistics();
+	}
+}
+
+// Drift correction against the reference beads, count=0 to turn it off. rawFile (can be empty) receives the uncorrected positions.
+CDLL_EXPORT void DLL_CALLCONV rm_setreferencebeads(ResultManager* rm, int* beads, int count, const char* rawFile, ErrorCluster* err)
+{
+	if (ValidRM(rm, err)) {
+		for (int i=0;i<count;i++) {
+			if (beads[i] < 0 || beads[i] >= rm->Config().numBeads) {
+				ArgumentErrorMsg(err,SPrintf( "Invalid bead index: %d. Accepted range: [0-%d]", beads[i], rm->Config().numBeads));
+				return;
+			}
+		}
+		rm->SetReferenceBeads(beads, count, rawFile);
+	}
+}
+
+// drift = [count], returns the number of frames written
+CDLL_EXPORT int DLL_CALLCONV rm_getdrift(ResultManager* rm, int startFrame, int count, vector3f* drift, ErrorCluster* err)
+{
+	if (ValidRM(rm, err)) {
+		return rm->GetDrift(startFrame, count, drift);
+	}
+	return 0;
+}
+
 CDLL_EXPORT void DLL_CALLCONV rm_removebead(ResultManager* rm, int bead, ErrorCluster* err)
 {
 	if (ValidRM(rm, err)) {
@@ -122,3 +169,11 @@ CDLL_EXPORT void DLL_CALLCONV rm_getconfig(ResultManager* rm, ResultManagerConfi
 		*cfg = rm->Config();
 	}
 }
+
+// Output file settings, see ResultManager::SetConfigValue
+CDLL_EXPORT void DLL_CALLCONV rm_set_config_value(ResultManager* rm, const char* name, const char* value, ErrorCluster* err)
+{
+	if (ValidRM(rm, err)) {
+		rm->SetConfigValue(name, value);
+	}
+}
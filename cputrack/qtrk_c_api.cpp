@@ -56,6 +56,38 @@ CDLL_EXPORT void DLL_CALLCONV QTrkFreeInstance(QueuedTracker* qtrk)
 	delete qtrk;
 }
 
+CDLL_EXPORT QueuedTracker* DLL_CALLCONV QTrkCreateInstanceFromState(const char* filename)
+{
+	try {
+		return CreateQueuedTrackerFromState(filename);
+	} catch (const std::runtime_error& e) {
+		dbgprintf("QTrkCreateInstanceFromState: %s\n", e.what());
+		return 0;
+	}
+}
+
+CDLL_EXPORT bool DLL_CALLCONV QTrkSaveState(QueuedTracker* qtrk, const char* filename)
+{
+	try {
+		qtrk->SaveState(filename);
+		return true;
+	} catch (const std::runtime_error& e) {
+		dbgprintf("QTrkSaveState: %s\n", e.what());
+		return false;
+	}
+}
+
+CDLL_EXPORT bool DLL_CALLCONV QTrkLoadState(QueuedTracker* qtrk, const char* filename)
+{
+	try {
+		qtrk->LoadState(filename);
+		return true;
+	} catch (const std::runtime_error& e) {
+		dbgprintf("QTrkLoadState: %s\n", e.what());
+		return false;
+	}
+}
+
 
 // C API, mainly intended to allow binding to .NET
 CDLL_EXPORT void DLL_CALLCONV QTrkSetLocalizationMode(QueuedTracker* qtrk, LocMode_t locType)
@@ -63,6 +95,22 @@ CDLL_EXPORT void DLL_CALLCONV QTrkSetLocalizationMode(QueuedTracker* qtrk, LocMo
 	qtrk->SetLocalizationMode(locType);
 }
 
+CDLL_EXPORT void DLL_CALLCONV QTrkSetLocalizationModeProfile(QueuedTracker* qtrk, int profile, LocMode_t locType)
+{
+	qtrk->SetLocalizationModeProfile(profile, locType);
+}
+
+CDLL_EXPORT bool DLL_CALLCONV QTrkSetPixelCalibrationMap(QueuedTracker* qtrk, float* offset, float* gain, int sensorWidth, int sensorHeight, ROIPosition* roiPositions, int numBeads)
+{
+	try {
+		qtrk->SetPixelCalibrationMap(offset, gain, sensorWidth, sensorHeight, roiPositions, numBeads);
+		return true;
+	} catch (const std::runtime_error& e) {
+		dbgprintf("QTrkSetPixelCalibrationMap: %s\n", e.what());
+		return false;
+	}
+}
+
 // Frame and timestamp are ignored by tracking code itself, but usable for the calling code
 // Pitch: Distance in bytes between two successive rows of pixels (e.g. address of (0,0) -  address of (0,1) )
 // ZlutIndex: Which ZLUT to use for ComputeZ/BuildZLUT
@@ -71,6 +119,11 @@ CDLL_EXPORT void DLL_CALLCONV QTrkScheduleLocalization(QueuedTracker* qtrk, void
 	qtrk->ScheduleLocalization(data,pitch,pdt,jobInfo);
 }
 
+CDLL_EXPORT void DLL_CALLCONV QTrkScheduleLocalizationProfile(QueuedTracker* qtrk, void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo, int modeProfile)
+{
+	qtrk->ScheduleLocalization(data,pitch,pdt,jobInfo,modeProfile);
+}
+
 CDLL_EXPORT void DLL_CALLCONV QTrkClearResults(QueuedTracker* qtrk)
 {
 	qtrk->ClearResults();
@@ -87,6 +140,11 @@ CDLL_EXPORT int DLL_CALLCONV QTrkScheduleFrame(QueuedTracker* qtrk, void *imgptr
 	return qtrk->ScheduleFrame(imgptr, pitch, width, height, positions, numROI, pdt, jobInfo);
 }
 
+CDLL_EXPORT int DLL_CALLCONV QTrkScheduleFrameProfiles(QueuedTracker* qtrk, void *imgptr, int pitch, int width, int height, ROIPosition *positions, int numROI, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo, const int* modeProfiles)
+{
+	return qtrk->ScheduleFrame(imgptr, pitch, width, height, positions, numROI, pdt, jobInfo, modeProfiles);
+}
+
 
 // data can be zero to allocate ZLUT data. zcmp has to have 'zlut_radialsteps' elements
 CDLL_EXPORT void DLL_CALLCONV QTrkSetRadialZLUT(QueuedTracker* qtrk, float* data, int count, int planes)
@@ -104,11 +162,38 @@ CDLL_EXPORT void DLL_CALLCONV QTrkGetRadialZLUTSize(QueuedTracker* qtrk, int* co
 	qtrk->GetRadialZLUTSize(*count, *planes, *radialsteps);
 }
 
+CDLL_EXPORT void DLL_CALLCONV QTrkSetBeadLUTMapping(QueuedTracker* qtrk, int* lutIndex, int numBeads)
+{
+	qtrk->SetBeadLUTMapping(lutIndex, numBeads);
+}
+
 CDLL_EXPORT void DLL_CALLCONV QTrkSetRadialWeights(QueuedTracker*qtrk, float* zcmp)
 {
 	qtrk->SetRadialWeights(zcmp);
 }
 
+CDLL_EXPORT bool DLL_CALLCONV QTrkSaveLUTLibrary(QueuedTracker* qtrk, const char* filename)
+{
+	try {
+		qtrk->SaveLUTLibrary(filename);
+		return true;
+	} catch (const std::runtime_error& e) {
+		dbgprintf("QTrkSaveLUTLibrary: %s\n", e.what());
+		return false;
+	}
+}
+
+CDLL_EXPORT bool DLL_CALLCONV QTrkLoadLUTLibrary(QueuedTracker* qtrk, const char* filename)
+{
+	try {
+		qtrk->LoadLUTLibrary(filename);
+		return true;
+	} catch (const std::runtime_error& e) {
+		dbgprintf("QTrkLoadLUTLibrary: %s\n", e.what());
+		return false;
+	}
+}
+
 
 CDLL_EXPORT void DLL_CALLCONV QTrkBeginLUT(QueuedTracker* qtrk, uint flags)
 {
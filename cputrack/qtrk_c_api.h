@@ -15,6 +15,9 @@ enum LocalizeModeEnum {
 	LT_ClearFirstFourPixels = 128,
 	LT_FourierLUT = 256,
 	LT_LocalizeZWeighted = 512,
+	LT_ZLUTPCA = 1024, // Compare radial profiles in a per-bead principal component basis of the ZLUT (see "zlut_pca_components" config value)
+	LT_ImageLUT = 2048, // Refine XYZ by fitting the image LUT and its z derivatives (CPU tracker, see "imagelut_iterations" config value)
+	LT_PixelBinnedProfile = 4096, // QI and Z profiles from pixels binned into rings, instead of interpolated samples (CPU tracker). Build the LUT with BUILDLUT_PIXELBINNED.
 
 	LT_Force32Bit = 0xffffffff
 };
@@ -143,24 +146,36 @@ class QueuedTracker;
 
 CDLL_EXPORT QueuedTracker* DLL_CALLCONV QTrkCreateInstance(QTrkSettings *cfg);
 CDLL_EXPORT void DLL_CALLCONV QTrkFreeInstance(QueuedTracker* qtrk);
+// State snapshots: LUTs, config values, mode profiles and pixel calibration. Return false or null on failure, the error is written to the debug log.
+CDLL_EXPORT QueuedTracker* DLL_CALLCONV QTrkCreateInstanceFromState(const char* filename);
+CDLL_EXPORT bool DLL_CALLCONV QTrkSaveState(QueuedTracker* qtrk, const char* filename);
+CDLL_EXPORT bool DLL_CALLCONV QTrkLoadState(QueuedTracker* qtrk, const char* filename);
 
 // C API, mainly intended to allow binding to .NET
 CDLL_EXPORT void DLL_CALLCONV QTrkSetLocalizationMode(QueuedTracker* qtrk, LocMode_t locType);
+// Profile 0 is the mode set by QTrkSetLocalizationMode. Profiles are selected per job with QTrkScheduleLocalizationProfile/QTrkScheduleFrameProfiles
+CDLL_EXPORT void DLL_CALLCONV QTrkSetLocalizationModeProfile(QueuedTracker* qtrk, int profile, LocMode_t locType);
 
 // These are per-bead! So both gain and offset are sized [width*height*numbeads], similar to ZLUT
 // result=gain*(pixel+offset)
 CDLL_EXPORT void DLL_CALLCONV QTrkSetPixelCalibrationImages(QueuedTracker* qtrk, float* offset, float* gain);
 CDLL_EXPORT void DLL_CALLCONV QTrkSetPixelCalibrationFactors(float offsetFactor, float gainFactor);
+// One sensor-sized offset and gain map shared by all beads. roiPositions = [numBeads], the top-left corner of every bead ROI.
+// Returns false if a ROI is outside the sensor
+CDLL_EXPORT bool DLL_CALLCONV QTrkSetPixelCalibrationMap(QueuedTracker* qtrk, float* offset, float* gain, int sensorWidth, int sensorHeight, ROIPosition* roiPositions, int numBeads);
 
 // Frame and timestamp are ignored by tracking code itself, but usable for the calling code
 // Pitch: Distance in bytes between two successive rows of pixels (e.g. address of (0,0) -  address of (0,1) )
 // ZlutIndex: Which ZLUT to use for ComputeZ/BuildZLUT
 CDLL_EXPORT void DLL_CALLCONV QTrkScheduleLocalization(QueuedTracker* qtrk, void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo);
+CDLL_EXPORT void DLL_CALLCONV QTrkScheduleLocalizationProfile(QueuedTracker* qtrk, void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo, int modeProfile);
 CDLL_EXPORT void DLL_CALLCONV QTrkClearResults(QueuedTracker* qtrk);
 CDLL_EXPORT void DLL_CALLCONV QTrkFlush(QueuedTracker* qtrk); // stop waiting for more jobs to do, and just process the current batch
 
 // Schedule an entire frame at once, allowing for further optimizations
 CDLL_EXPORT int DLL_CALLCONV QTrkScheduleFrame(QueuedTracker* qtrk, void *imgptr, int pitch, int width, int height, ROIPosition *positions, int numROI, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo);
+// modeProfiles = [numROI]
+CDLL_EXPORT int DLL_CALLCONV QTrkScheduleFrameProfiles(QueuedTracker* qtrk, void *imgptr, int pitch, int width, int height, ROIPosition *positions, int numROI, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo, const int* modeProfiles);
 
 CDLL_EXPORT void DLL_CALLCONV QTrkEnableRadialZLUTCompareProfile(bool enabled);
 CDLL_EXPORT void DLL_CALLCONV QTrkGetRadialZLUTCompareProfile(float* dst); // dst = [count * planes]
@@ -170,11 +185,20 @@ CDLL_EXPORT void DLL_CALLCONV QTrkSetRadialZLUT(QueuedTracker* qtrk, float* data
 CDLL_EXPORT void DLL_CALLCONV QTrkGetRadialZLUT(QueuedTracker* qtrk, float* dst);
 CDLL_EXPORT void DLL_CALLCONV QTrkGetRadialZLUTSize(QueuedTracker* qtrk, int* count, int* planes, int* radialsteps);
 
+// Beads with the same LUT index share one LUT. lutIndex = [numBeads], or null to use LUT i for bead i
+CDLL_EXPORT void DLL_CALLCONV QTrkSetBeadLUTMapping(QueuedTracker* qtrk, int* lutIndex, int numBeads);
+
 // Set radial weights used for comparing LUT profiles, zcmp has to have 'zlut_radialsteps' elements
 CDLL_EXPORT void DLL_CALLCONV QTrkSetRadialWeights(QueuedTracker*qtrk,  float* zcmp);
 
+// LUT library files hold all LUTs, radial weights and the bias correction table. The CPU tracker memory-maps a loaded library and uses it in place.
+// Both return false on failure, the error is written to the debug log.
+CDLL_EXPORT bool DLL_CALLCONV QTrkSaveLUTLibrary(QueuedTracker* qtrk, const char* filename);
+CDLL_EXPORT bool DLL_CALLCONV QTrkLoadLUTLibrary(QueuedTracker* qtrk, const char* filename);
+
 #define BUILDLUT_NORMALIZE 4
 #define BUILDLUT_BIASCORRECT 8
+#define BUILDLUT_PIXELBINNED 16
 CDLL_EXPORT void DLL_CALLCONV QTrkBeginLUT(QueuedTracker* qtrk, uint flags);
 CDLL_EXPORT void DLL_CALLCONV QTrkBuildLUT(QueuedTracker* qtrk, void* data, int pitch, QTRK_PixelDataType pdt, int plane, vector2f* known_pos=0);
 
@@ -1,5 +1,6 @@
 #pragma once
 #include <list>
+#include <functional>
 // Thread OS related code is abstracted into a simple "Threads" struct
 #ifdef USE_PTHREADS
 
@@ -90,6 +91,16 @@ struct Threads
 		}
 	};
 
+	// Manual reset event: wait() blocks until set() is called, and keeps returning immediately until reset()
+	struct Event {
+		HANDLE h;
+		Event() { h=CreateEvent(0,TRUE,FALSE,0); }
+		~Event() { CloseHandle(h); }
+		void set() { SetEvent(h); }
+		void reset() { ResetEvent(h); }
+		void wait() { WaitForSingleObject(h, INFINITE); }
+	};
+
 	static DWORD WINAPI ThreadCaller (void *param) {
 		Handle* hdl = (Handle*)param;
 		hdl->callback (hdl->param);
@@ -125,6 +136,27 @@ struct Threads
 			SetThreadPriority(h, bg ? THREAD_PRIORITY_BELOW_NORMAL : THREAD_PRIORITY_NORMAL);
 	}
 
+	// Restrict the thread to the index'th CPU the process is allowed to run on (wrapping around),
+	// or allow all CPUs of the process again if index < 0. Returns false if the affinity could not be set.
+	static bool SetAffinity(Handle* thread, int index)
+	{
+		DWORD_PTR processMask, systemMask;
+		if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask) || !processMask)
+			return false;
+
+		DWORD_PTR mask = processMask;
+		if (index >= 0) {
+			int ncpu = 0;
+			for (DWORD_PTR m=processMask; m; m &= m-1)
+				ncpu++;
+			index %= ncpu;
+			for (int i=0;i<index;i++)
+				mask &= mask-1; // clear the lowest set bit
+			mask &= ~(mask-1); // keep only the lowest remaining bit
+		}
+		return SetThreadAffinityMask(thread->winhdl, mask) != 0;
+	}
+
 	static void WaitAndClose(Handle* h) {
 		WaitForSingleObject(h->winhdl, INFINITE);
 		CloseHandle(h->winhdl);
@@ -258,3 +290,104 @@ void parallel_for(int count, TF f) {
 		threadPool.WaitUntilDone();
 	}
 }
+
+
+// Worker threads that stay alive between loops, so repeated data-parallel work doesn't pay for thread creation.
+// The loop body also gets the worker index, which can be used to index per-worker scratch buffers.
+class Executor {
+public:
+	Executor(int Nthreads=-1) {
+		if (Nthreads<0)
+			Nthreads = Threads::GetCPUCount();
+		quit=false;
+		next=count=inProgress=0;
+		workers.resize(Nthreads);
+		for (int i=0;i<Nthreads;i++) {
+			workers[i].executor=this;
+			workers[i].index=i;
+			workers[i].thread=Threads::Create(&ThreadEntryPoint, &workers[i]);
+		}
+	}
+	~Executor() {
+		workMutex.lock();
+		quit=true;
+		workReady.set();
+		workMutex.unlock();
+		for(uint i=0;i<workers.size();i++)
+			Threads::WaitAndClose(workers[i].thread);
+	}
+	int NumWorkers() { return workers.size(); }
+
+	// Calls f(item, workerIndex) for every item in [0,n), and returns when all items are done
+	void ForEach(int n, std::function<void(int,int)> f) {
+		loopMutex.lock();
+		workMutex.lock();
+		body=f;
+		next=0;
+		count=n;
+		if (n>0) {
+			loopDone.reset();
+			workReady.set();
+		}
+		workMutex.unlock();
+
+		if (n>0)
+			loopDone.wait();
+
+		workMutex.lock();
+		body=std::function<void(int,int)>();
+		count=0;
+		workMutex.unlock();
+		loopMutex.unlock();
+	}
+
+	// Shared instance. It is never deleted, as joining threads while a DLL unloads can deadlock.
+	static Executor& Shared() {
+		static Executor* e = new Executor();
+		return *e;
+	}
+protected:
+	struct Worker {
+		Executor* executor;
+		int index;
+		Threads::Handle* thread;
+	};
+	static void ThreadEntryPoint(void *param) {
+		Worker* w = (Worker*)param;
+		Executor* e = w->executor;
+		int item;
+		while (!e->quit) {
+			e->workReady.wait();
+			while (e->GetNewItem(item)) {
+				e->body(item, w->index);
+				e->ItemDone();
+			}
+		}
+	}
+	// Workers block on workReady again once the last item of the loop has been handed out
+	bool GetNewItem(int& item) {
+		workMutex.lock();
+		bool r = next < count;
+		if (r) {
+			item = next++;
+			inProgress++;
+		}
+		if (next == count && !quit)
+			workReady.reset();
+		workMutex.unlock();
+		return r;
+	}
+	void ItemDone() {
+		workMutex.lock();
+		inProgress--;
+		if (next == count && inProgress == 0)
+			loopDone.set();
+		workMutex.unlock();
+	}
+	std::vector<Worker> workers;
+	Threads::Mutex workMutex, loopMutex;
+	Threads::Event workReady, loopDone;
+	std::function<void(int,int)> body;
+	int next, count, inProgress;
+	Atomic<bool> quit;
+};
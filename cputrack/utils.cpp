@@ -13,6 +13,7 @@
 #include "QueuedTracker.h"
 #include "threads.h"
 #include "CubicBSpline.h"
+#include "../libs/math/jama_svd.h"
 
 static std::string logFilename;
 
@@ -229,18 +230,19 @@ float ComputeBgCorrectedCOM1D(float *data, int len, float cf)
 
 void NormalizeRadialProfile(scalar_t * prof, int rsteps)
 {
-	double sum=0.0f;
+	double sum=0.0;
 	for (int i=0;i<rsteps;i++)
 		sum += prof[i];
 
-	float mean =sum/rsteps;
+	float mean = sum/rsteps;
 	double rmssum2 = 0.0;
 
+	// rms of the mean-subtracted profile, so a large offset doesn't cancel out the variance
 	for (int i=0;i<rsteps;i++) {
 		prof[i] -= mean;
-		rmssum2 += prof[i]*prof[i];
+		rmssum2 += (double)prof[i]*prof[i];
 	}
-	double invTotalrms = 1.0f/sqrt(rmssum2/rsteps);
+	double invTotalrms = rmssum2 > 0.0 ? 1.0/sqrt(rmssum2/rsteps) : 1.0;
 	for (int i=0;i<rsteps;i++)
 		prof[i] *= invTotalrms;
 		
@@ -263,9 +265,53 @@ void NormalizeRadialProfile(scalar_t * prof, int rsteps)
 
 void NormalizeZLUT(float* zlut ,int numBeads, int planes, int radialsteps)
 {
-	for(int i=0;i<numBeads;i++)
-		for (int j=0;j<planes;j++)
-			NormalizeRadialProfile(&zlut[radialsteps*planes*i + radialsteps*j], radialsteps);
+	const int ProfilesPerItem = 64;
+	int count = numBeads*planes;
+	Executor::Shared().ForEach((count + ProfilesPerItem - 1) / ProfilesPerItem, [&](int item, int worker) {
+		int end = std::min(count, (item+1)*ProfilesPerItem);
+		for (int i=item*ProfilesPerItem;i<end;i++)
+			NormalizeRadialProfile(&zlut[radialsteps*i], radialsteps);
+	});
+}
+
+int ComputeZLUTPrincipalBasis(float* zlut, int planes, int res, float* weights, int k, float* mean, float* basis, float* coeffs)
+{
+	k = std::min(k, std::min(planes, res));
+
+	for (int r=0;r<res;r++) {
+		double sum = 0.0;
+		for (int p=0;p<planes;p++)
+			sum += zlut[p*res+r] * (weights ? weights[r] : 1.0f);
+		mean[r] = sum / planes;
+	}
+
+	// JAMA's SVD requires rows >= columns, so decompose the transpose if there are less planes than radial steps
+	bool transpose = planes < res;
+	TNT::Array2D<double> A(transpose ? res : planes, transpose ? planes : res);
+	for (int p=0;p<planes;p++) 
+		for (int r=0;r<res;r++) {
+			double v = zlut[p*res+r] * (weights ? weights[r] : 1.0f) - mean[r];
+			if (transpose) A[r][p] = v;
+			else A[p][r] = v;
+		}
+
+	JAMA::SVD<double> svd(A);
+	TNT::Array2D<double> V; // columns are the principal directions in radial-profile space, sorted by singular value
+	if (transpose) svd.getU(V);
+	else svd.getV(V);
+
+	for (int c=0;c<k;c++)
+		for (int r=0;r<res;r++)
+			basis[c*res+r] = V[r][c];
+
+	for (int p=0;p<planes;p++)
+		for (int c=0;c<k;c++) {
+			double sum = 0.0;
+			for (int r=0;r<res;r++)
+				sum += (zlut[p*res+r] * (weights ? weights[r] : 1.0f) - mean[r]) * basis[c*res+r];
+			coeffs[p*k+c] = sum;
+		}
+	return k;
 }
 
 void ComputeRadialProfile(float* dst, int radialSteps, int angularSteps, float minradius, float maxradius,
@@ -182,6 +182,9 @@ void ComputeCRP(float* dst, int radialSteps, int angularSteps, float minradius,
 CDLL_EXPORT void DLL_CALLCONV ComputeRadialProfile(float* dst, int radialSteps, int angularSteps, float minradius, float maxradius, vector2f center, ImageData* src, float mean, bool normalize);
 CDLL_EXPORT void DLL_CALLCONV NormalizeRadialProfile(float* prof, int rsteps);
 void NormalizeZLUT(float *zlut, int numLUTs, int planes, int radialsteps);
+// PCA of a single [planes x res] ZLUT, with profiles weighted by 'weights' (can be null). 
+// Output: mean=[res], basis=[k*res], coeffs=[planes*k]. Returns the number of components used.
+int ComputeZLUTPrincipalBasis(float* zlut, int planes, int res, float* weights, int k, float* mean, float* basis, float* coeffs);
 CDLL_EXPORT void DLL_CALLCONV GenerateImageFromLUT(ImageData* image, ImageData* zlut, float minradius, float maxradius, vector3f pos, bool useSplineInterp=true, int ovs=4);
 CDLL_EXPORT void DLL_CALLCONV ApplyPoissonNoise(ImageData& img, float poissonMax, float maxValue=255);
 CDLL_EXPORT void DLL_CALLCONV ApplyGaussianNoise(ImageData& img, float sigma);
@@ -62,7 +62,7 @@ __global__ void ZLUT_ProfilesToZLUT(int njobs, cudaImageListf images, ZLUTParams
 
 	if (idx < njobs) {
 		auto m = locParams[idx];
-		float* dst = params.GetRadialZLUT(m.zlutIndex, m.zlutPlane );
+		float* dst = params.GetRadialZLUT(m.lutIndex, m.zlutPlane );
 
 		for (int i=0;i<params.radialSteps();i++)
 			dst [i] += profiles [ params.radialSteps()*idx + i ];
@@ -121,7 +121,7 @@ __global__ void ZLUT_ComputeProfileMatchScores(int njobs, ZLUTParams params, flo
 	auto mapping = locParams[jobIdx];
 	float diffsum = 0.0f;
 	for (int r=0;r<params.radialSteps();r++) {
-		float d = prof[r] - params.img.pixel(r, zPlaneIdx, mapping.zlutIndex);
+		float d = prof[r] - params.img.pixel(r, zPlaneIdx, mapping.lutIndex);
 		if (params.zcmpwindow)
 			d *= params.zcmpwindow[r];
 		diffsum += d*d;
@@ -158,7 +158,7 @@ __global__ void ZLUT_NormalizeProfiles(int njobs, ZLUTParams params, float* prof
 }
 
 
-__global__ void ApplyOffsetGain (BaseKernelParams kp, cudaImageListf calib_gain, cudaImageListf calib_offset, float gainFactor, float offsetFactor)
+__global__ void ApplyOffsetGain (BaseKernelParams kp, PixelCalibParams calib, float gainFactor, float offsetFactor)
 {
 	int x = threadIdx.x + blockIdx.x * blockDim.x;
 	int y = threadIdx.y + blockIdx.y * blockDim.y;
@@ -166,10 +166,13 @@ __global__ void ApplyOffsetGain (BaseKernelParams kp, cudaImageListf calib_gain,
 
 	if (x < kp.images.w && y < kp.images.h && jobIdx < kp.njobs) {
 		int bead = kp.locParams[jobIdx].zlutIndex;
+		if (bead < 0 || bead >= calib.numBeads)
+			return;
 
+		int i = calib.beadStart[bead] + y * calib.pitch + x;
 		float value = kp.images.pixel(x,y,jobIdx);
-		float offset = calib_offset.isEmpty() ? 0 : calib_offset.pixel(x,y,bead);
-		float gain = calib_gain.isEmpty() ? 1 : calib_gain.pixel(x,y,bead);
+		float offset = calib.offset.IsSet() ? calib.offset.Value(i, calib.pitch) : 0.0f;
+		float gain = calib.gain.IsSet() ? calib.gain.Value(i, calib.pitch) : 1.0f;
 		kp.images.pixel(x,y,jobIdx) = (value + offset*offsetFactor) * gain*gainFactor;
 	}
 }
@@ -269,7 +272,7 @@ __global__ void ImageLUT_Sample(BaseKernelParams kp, float2 ilut_scale, float3*
 
 		float startx = positions[id].x - lut.imgw/2*ilut_scale.x;
 		float starty = positions[id].y - lut.imgh/2*ilut_scale.y;
-		int2 imgpos = lut.GetImagePos(kp.locParams[id].zlutPlane, kp.locParams[id].zlutIndex);
+		int2 imgpos = lut.GetImagePos(kp.locParams[id].zlutPlane, kp.locParams[id].lutIndex);
 
 		float px = startx + x*ilut_scale.x;
 		float py = starty + y*ilut_scale.y;
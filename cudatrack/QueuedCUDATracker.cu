@@ -206,7 +206,6 @@ QueuedCUDATracker::QueuedCUDATracker(const QTrkComputedConfig& cc, int batchSize
 	schedulingThread = Threads::Create(SchedulingThreadEntryPoint, this);
 
 	gc_offsetFactor = gc_gainFactor = 1.0f;
-	localizeMode = LT_OnlyCOM;
 
 	ForceCUDAKernelsToLoad<<< dim3(),dim3() >>> ();
 }
@@ -224,8 +223,6 @@ QueuedCUDATracker::Device::~Device()
 {
 	cudaSetDevice(index);
 	radial_zlut.free();
-	calib_gain.free();
-	calib_offset.free();
 }
 
 void QueuedCUDATracker::SchedulingThreadEntryPoint(void *param)
@@ -372,22 +369,30 @@ QueuedCUDATracker::Stream* QueuedCUDATracker::CreateStream(Device* device, int s
 
 
  // get a stream that is not currently executing, and still has room for images
-QueuedCUDATracker::Stream* QueuedCUDATracker::GetReadyStream()
+ // Streams that hold jobs of another localization mode are skipped, so every batch runs a single kernel pipeline
+QueuedCUDATracker::Stream* QueuedCUDATracker::GetReadyStream(uint localizeFlags)
 {
 	while (true) {
 		jobQueueMutex.lock();
 
-		Stream *best = 0;
+		Stream *best = 0, *otherMode = 0;
 		for (int i=0;i<streams.size();i++) 
 		{
 			Stream*s = streams[i];
 
 			if (s->state == Stream::StreamIdle) {
-				if (!best || (s->JobCount() > best->JobCount()))
-					best = s;
+				if (s->JobCount() == 0 || s->localizeFlags == localizeFlags) {
+					if (!best || (s->JobCount() > best->JobCount()))
+						best = s;
+				} else if (!otherMode || (s->JobCount() > otherMode->JobCount()))
+					otherMode = s;
 			}
 		}
 
+		// All idle streams are filling up with other modes, so launch the fullest one
+		if (!best && otherMode)
+			otherMode->state = Stream::StreamPendingExec;
+
 		jobQueueMutex.unlock();
 
 		if (best) 
@@ -421,20 +426,17 @@ int QueuedCUDATracker::GetQueueLength(int *maxQueueLen)
 }
 
 
+// Jobs that are already queued keep the mode they were scheduled with, so there is no need to wait for the queue to drain
 void QueuedCUDATracker::SetLocalizationMode(int mode)
 {
-	Flush();
-	while (!IsIdle());
-
-	jobQueueMutex.lock();
-	localizeMode = mode;
-	jobQueueMutex.unlock();
+	SetLocalizationModeProfile(0, mode);
 }
 
 
-void QueuedCUDATracker::ScheduleLocalization(void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob* jobInfo )
+void QueuedCUDATracker::ScheduleLocalization(void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob* jobInfo, int modeProfile)
 {
-	Stream* s = GetReadyStream();
+	LocMode_t localizeMode = GetLocalizationModeProfile(modeProfile);
+	Stream* s = GetReadyStream(localizeMode);
 
 	jobQueueMutex.lock();
 	int jobIndex = s->jobs.size();
@@ -442,6 +444,7 @@ void QueuedCUDATracker::ScheduleLocalization(void* data, int pitch, QTRK_PixelDa
 	s->jobs.push_back(job);
 	s->localizeFlags = localizeMode; // which kernels to run
 	s->locParams[jobIndex].zlutIndex = jobInfo->zlutIndex;
+	s->locParams[jobIndex].lutIndex = LUTIndex(jobInfo->zlutIndex);
 
 	if (s->jobs.size() == batchSize)
 		s->state = Stream::StreamPendingExec;
@@ -483,8 +486,11 @@ void QueuedCUDATracker::BuildLUT(void* data, int pitch, QTRK_PixelDataType pdt,
 	Device* d = streams[0]->device;
 	cudaSetDevice(d->index);
 
-	int nbeads = d->radial_zlut.count; // jobcount
+	int nbeads = GetBeadCount(); // jobcount
+	int nluts = d->radial_zlut.count;
 	std::vector<vector2f> positions(nbeads);
+	std::vector<int> beadLUT;
+	GetBeadLUTMapping(beadLUT);
 
 	float *profiles = new float [nbeads * cfg.zlut_radialsteps];
 	memset(profiles, 0, sizeof(float) * nbeads * cfg.zlut_radialsteps);
@@ -509,18 +515,28 @@ void QueuedCUDATracker::BuildLUT(void* data, int pitch, QTRK_PixelDataType pdt,
 			vector2f com = trk.ComputeMeanAndCOM();
 			bool bhit;
 			positions[i] = trk.ComputeQI(com, cfg.qi_iterations, cfg.qi_radialsteps, cfg.qi_angstepspq, cfg.qi_angstep_factor, cfg.qi_minradius, cfg.qi_maxradius, bhit);
-			trk.ComputeRadialProfile(&profiles[i * cfg.zlut_radialsteps], cfg.zlut_radialsteps, cfg.zlut_angularsteps, cfg.zlut_minradius, cfg.zlut_maxradius, positions[i], false, 0, true);
 		}
+		trk.ComputeRadialProfile(&profiles[i * cfg.zlut_radialsteps], cfg.zlut_radialsteps, cfg.zlut_angularsteps, cfg.zlut_minradius, cfg.zlut_maxradius, positions[i], false, 0, true);
 	});
 
-	// add to device 0 LUT
-	device_vec<float> d_profiles (nbeads * cfg.zlut_radialsteps);
-	d_profiles.copyToDevice(profiles, nbeads * cfg.zlut_radialsteps);
+	// Sum the profiles of beads that share a LUT
+	std::vector<float> lutProfiles(nluts * cfg.zlut_radialsteps, 0.0f);
+	for (int i=0;i<nbeads;i++) {
+		int lut = i < beadLUT.size() ? beadLUT[i] : i;
+		if (lut >= nluts)
+			continue;
+		for (int r=0;r<cfg.zlut_radialsteps;r++)
+			lutProfiles[lut * cfg.zlut_radialsteps + r] += profiles[i * cfg.zlut_radialsteps + r];
+	}
 	delete[] profiles;
 
+	// add to device 0 LUT
+	device_vec<float> d_profiles (nluts * cfg.zlut_radialsteps);
+	d_profiles.copyToDevice(&lutProfiles[0], nluts * cfg.zlut_radialsteps);
+
 	dim3 numThreads(4, 64);
-	dim3 numBlocks( (nbeads + numThreads.x - 1) / numThreads.x, (cfg.zlut_radialsteps + numThreads.y - 1) / numThreads.y);
-	AddProfilesToZLUT<<< numBlocks, numThreads, 0, streams[0]->stream >>> (d_profiles.data, nbeads, cfg.zlut_radialsteps, plane, d->radial_zlut);
+	dim3 numBlocks( (nluts + numThreads.x - 1) / numThreads.x, (cfg.zlut_radialsteps + numThreads.y - 1) / numThreads.y);
+	AddProfilesToZLUT<<< numBlocks, numThreads, 0, streams[0]->stream >>> (d_profiles.data, nluts, cfg.zlut_radialsteps, plane, d->radial_zlut);
 	cudaStreamSynchronize(streams[0]->stream);
 }
 
@@ -608,7 +624,7 @@ void QueuedCUDATracker::ExecuteBatch(Stream *s)
 		s->images.copyToDevice(s->hostImageBuf.data(), true, s->stream); 
 	}
 
-	if (!d->calib_gain.isEmpty() || !d->calib_offset.isEmpty()) {
+	if (d->calib.numBeads > 0) {
 		dim3 numThreads(16, 16, 2);
 		dim3 numBlocks((cfg.width + numThreads.x - 1 ) / numThreads.x,
 				(cfg.height + numThreads.y - 1) / numThreads.y,
@@ -619,7 +635,7 @@ void QueuedCUDATracker::ExecuteBatch(Stream *s)
 		gc_mutex.unlock();
 
 		ApplyOffsetGain <<< numBlocks, numThreads, 0, s->stream >>>	
-			(kp, s->device->calib_gain, s->device->calib_offset, gf, of);
+			(kp, s->device->calib, gf, of);
 	}
 
 	cudaEventRecord(s->imageCopyDone, s->stream);
@@ -698,19 +714,24 @@ void QueuedCUDATracker::ExecuteBatch(Stream *s)
 
 void QueuedCUDATracker::CopyStreamResults(Stream *s)
 {
-	resultMutex.lock();
+	std::vector<LocalizationResult> batch(s->JobCount());
 	for (int a=0;a<s->JobCount();a++) {
 		LocalizationJob& j = s->jobs[a];
-		LocalizationResult r;
+		LocalizationResult& r = batch[a];
 		r.job = j;
 		r.firstGuess =  vector2f( s->com[a].x, s->com[a].y );
 		r.pos = vector3f( s->results[a].x , s->results[a].y, s->results[a].z);
 		r.imageMean = s->imgMeans[a];
-		r.pos.z = ZLUTBiasCorrection(s->results[a].z, devices[0]->radial_zlut.h, j.zlutIndex);
-		results.push_back(r);
+		r.pos.z = ZLUTBiasCorrection(s->results[a].z, devices[0]->radial_zlut.h, s->locParams[a].lutIndex);
+	}
+
+	// The whole batch goes to the result sink at once, if there is one
+	if (!DeliverResults(batch.data(), batch.size())) {
+		resultMutex.lock();
+		results.insert(results.end(), batch.begin(), batch.end());
+		resultCount+=s->JobCount();
+		resultMutex.unlock();
 	}
-	resultCount+=s->JobCount();
-	resultMutex.unlock();
 
 	// Update times
 	float qi, com, imagecopy, zcomp, getResults;
@@ -743,37 +764,44 @@ int QueuedCUDATracker::FetchResults(LocalizationResult* dstResults, int maxResul
 
 void QueuedCUDATracker::SetPixelCalibrationImages(float* offset, float* gain)
 {
-	for (uint i=0;i<devices.size();i++) {
-		devices[i]->SetPixelCalibrationImages(offset, gain, cfg.width, cfg.height);
-	}
+	gc_calib = PixelCalibration::FromBeadImages(offset, gain, cfg.width, cfg.height, GetBeadCount());
+	for (uint i=0;i<devices.size();i++)
+		devices[i]->SetPixelCalibration(gc_calib.get());
+}
 
-	// Copy to CPU side buffers for BuildLUT
-	int nelem = devices[0]->radial_zlut.count * cfg.width * cfg.height;
-	if (offset && gc_offset.size()!=nelem) { 
-		gc_offset.resize(nelem);
-		gc_offset.assign(offset,offset+nelem);
-	}
-	if (!offset) gc_offset.clear();
+void QueuedCUDATracker::SetPixelCalibrationMap(float* offset, float* gain, int sensorWidth, int sensorHeight, ROIPosition* roiPositions, int numBeads)
+{
+	gc_calib = PixelCalibration::FromSensorMap(offset, gain, sensorWidth, sensorHeight, roiPositions, numBeads, cfg.width, cfg.height);
+	for (uint i=0;i<devices.size();i++)
+		devices[i]->SetPixelCalibration(gc_calib.get());
+}
 
-	if (gain && gc_gain.size()!=nelem) {
-		gc_gain.reserve(nelem);
-		gc_gain.assign(gain, gain+nelem);
-	}
-	if (!gain) gc_gain.clear();
+void QueuedCUDATracker::GetPixelCalibrationImages(std::vector<float>& offset, std::vector<float>& gain)
+{
+	PixelCalibration::GetImages(gc_calib.get(), offset, gain);
+}
+
+void QueuedCUDATracker::GetPixelCalibrationFactors(float& offsetFactor, float& gainFactor)
+{
+	gc_mutex.lock();
+	offsetFactor = gc_offsetFactor;
+	gainFactor = gc_gainFactor;
+	gc_mutex.unlock();
 }
 
 
 void QueuedCUDATracker::CPU_ApplyOffsetGain(CPUTracker* trk, int beadIndex)
 {
-	if (!gc_offset.empty() || !gc_gain.empty()) {
-		int index = cfg.width*cfg.height*beadIndex;
+	if (gc_calib && gc_calib->HasBead(beadIndex)) {
+		int n = cfg.width*cfg.height;
+		std::vector<float> offset(n), gain(n);
+		gc_calib->GetBeadImages(beadIndex, &offset[0], &gain[0]);
 
 		gc_mutex.lock();
 		float gf = gc_gainFactor, of = gc_offsetFactor;
 		gc_mutex.unlock();
 
-		trk->ApplyOffsetGain(gc_offset.empty() ? 0:  &gc_offset[index] , gc_gain.empty() ? 0: &gc_gain[index], of, gf);
-//		if (j->job.frame%100==0)
+		trk->ApplyOffsetGain(&offset[0], &gain[0], of, gf);
 	}
 }
 
@@ -785,28 +813,37 @@ void QueuedCUDATracker::SetPixelCalibrationFactors(float offsetFactor, float gai
 	gc_mutex.unlock();
 }
 
-void QueuedCUDATracker::Device::SetPixelCalibrationImages(float* offset, float* gain, int img_width, int img_height)
+void QueuedCUDATracker::Device::CalibMap::Set(const PixelCalibration::Map& m, PixelCalibMap& dst)
 {
-	cudaSetDevice(index);
-
-	if (offset == 0)
-		calib_offset.free();
-
-	if (gain == 0)
-		calib_gain.free();
-
-	if (radial_zlut.count > 0) {
+	q.free(); base.free(); scale.free(); f.free();
+	if (!m.q.empty()) {
+		q = m.q;
+		base = m.base;
+		scale = m.scale;
+	}
+	if (!m.f.empty())
+		f = m.f;
+	dst.q = q.data;
+	dst.base = base.data;
+	dst.scale = scale.data;
+	dst.f = f.data;
+}
 
-		if (gain)
-			calib_gain = cudaImageListf::alloc(img_width,img_height,radial_zlut.count);
+void QueuedCUDATracker::Device::SetPixelCalibration(const PixelCalibration* pc)
+{
+	cudaSetDevice(index);
 
-		if (offset)
-			calib_offset = cudaImageListf::alloc(img_width,img_height,radial_zlut.count);
+	PixelCalibration none;
+	calib_offset.Set(pc ? pc->offset : none.offset, calib.offset);
+	calib_gain.Set(pc ? pc->gain : none.gain, calib.gain);
+	calib_beadStart.free();
+	calib.numBeads = 0;
 
-		for (int j=0;j<radial_zlut.count;j++) {
-			if (gain) calib_gain.copyImageToDevice(j, &gain[img_width*img_height*j]);
-			if (offset) calib_offset.copyImageToDevice(j, &offset[img_width*img_height*j]);
-		}
+	if (pc) {
+		calib_beadStart = pc->beadStart;
+		calib.beadStart = calib_beadStart.data;
+		calib.pitch = pc->pitch;
+		calib.numBeads = pc->numBeads;
 	}
 }
 
@@ -829,6 +866,38 @@ void QueuedCUDATracker::SetRadialWeights(float *zcmp)
 	}
 }
 
+// Jobs that are already queued keep the LUT they were scheduled with
+void QueuedCUDATracker::SetBeadLUTMapping(const int* lutIndex, int numBeads)
+{
+	for (int i=0;lutIndex && i<numBeads;i++)
+		if (lutIndex[i] < 0)
+			throw std::runtime_error(SPrintf("SetBeadLUTMapping: bead %d has invalid LUT index %d", i, lutIndex[i]));
+
+	jobQueueMutex.lock();
+	if (lutIndex && numBeads > 0)
+		beadLUTMapping.assign(lutIndex, lutIndex+numBeads);
+	else
+		beadLUTMapping.clear();
+	jobQueueMutex.unlock();
+}
+
+void QueuedCUDATracker::GetBeadLUTMapping(std::vector<int>& lutIndex)
+{
+	jobQueueMutex.lock();
+	lutIndex = beadLUTMapping;
+	jobQueueMutex.unlock();
+}
+
+bool QueuedCUDATracker::GetRadialWeights(float* dst)
+{
+	Device* d = devices[0];
+	if (!d->zcompareWindow.data)
+		return false;
+	cudaSetDevice(d->index);
+	d->zcompareWindow.copyToHost(dst, false);
+	return true;
+}
+
 void QueuedCUDATracker::StreamUpdateZLUTSize(Stream* s)
 {		
 	cudaSetDevice(s->device->index);
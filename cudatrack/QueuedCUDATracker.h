@@ -25,6 +25,7 @@ typedef cudaImageList<float> cudaImageListf;
 
 struct LocalizationParams {
 	int zlutIndex, zlutPlane; // if <0 then, no zlut for this job
+	int lutIndex; // physical LUT used by bead zlutIndex, see QueuedTracker::SetBeadLUTMapping
 };
 
 
@@ -35,6 +36,21 @@ struct BaseKernelParams {
 	cudaImageListf images;
 };
 
+// Pixel calibration on the device, see PixelCalibration
+struct PixelCalibMap {
+	ushort* q; // null if not set or kept as float
+	float* base, *scale; // per row
+	float* f; // null if quantized
+	CUBOTH bool IsSet() { return q || f; }
+	CUBOTH float Value(int i, int pitch) { return f ? f[i] : base[i/pitch] + scale[i/pitch] * q[i]; }
+};
+
+struct PixelCalibParams {
+	PixelCalibMap offset, gain;
+	int* beadStart;
+	int pitch, numBeads;
+};
+
 #include "QI.h"
 
 struct ZLUTParams {
@@ -69,12 +85,15 @@ public:
 	void EnableTextureCache(bool useTextureCache) { this->useTextureCache=useTextureCache; }
 	
 	void SetLocalizationMode(LocMode_t locType) override;
-	void ScheduleLocalization(void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo) override;
+	void ScheduleLocalization(void* data, int pitch, QTRK_PixelDataType pdt, const LocalizationJob *jobInfo, int modeProfile=0) override;
 	void ClearResults() override;
 
 	// data can be zero to allocate ZLUT data.
 	void SetRadialZLUT(float* data,  int numLUTs, int planes) override; 
 	void SetRadialWeights(float *zcmp) override;
+	bool GetRadialWeights(float* dst) override;
+	void SetBeadLUTMapping(const int* lutIndex, int numBeads) override;
+	void GetBeadLUTMapping(std::vector<int>& lutIndex) override;
 	void GetRadialZLUT(float* data) override; // delete[] memory afterwards
 	void GetRadialZLUTSize(int& count, int& planes, int &radialSteps) override;
 	int FetchResults(LocalizationResult* results, int maxResults) override;
@@ -98,6 +117,9 @@ public:
 
 	void SetPixelCalibrationImages(float* offset,float* gain) override;
 	void SetPixelCalibrationFactors(float offsetFactor, float gainFactor) override;
+	void SetPixelCalibrationMap(float* offset, float* gain, int sensorWidth, int sensorHeight, ROIPosition* roiPositions, int numBeads) override;
+	void GetPixelCalibrationImages(std::vector<float>& offset, std::vector<float>& gain) override;
+	void GetPixelCalibrationFactors(float& offsetFactor, float& gainFactor) override;
 
 	ConfigValueMap GetConfigValues() override;
 	void SetConfigValue(std::string name, std::string value) override;
@@ -108,15 +130,23 @@ protected:
 	struct Device {
 		Device(int index) {
 			this->index=index; 
-			radial_zlut=calib_offset=calib_gain=cudaImageListf::emptyList(); 
+			radial_zlut=cudaImageListf::emptyList(); 
+			calib=PixelCalibParams();
 		}
 		~Device(); 
 		void SetRadialZLUT(float *data, int radialsteps, int planes, int numLUTs);
-		void SetPixelCalibrationImages(float* offset, float* gain, int img_width, int img_height);
+		void SetPixelCalibration(const PixelCalibration* pc);
 		void SetRadialWeights(float* zcmp);
 				
 		cudaImageListf radial_zlut;
-		cudaImageListf calib_offset, calib_gain;
+		struct CalibMap {
+			device_vec<ushort> q;
+			device_vec<float> base, scale, f;
+			void Set(const PixelCalibration::Map& m, PixelCalibMap& dst);
+		};
+		CalibMap calib_offset, calib_gain;
+		device_vec<int> calib_beadStart;
+		PixelCalibParams calib;
 		device_vec<float> zcompareWindow;
 		QI::DeviceInstance qi_instance;
 		QI::DeviceInstance qalign_instance;
@@ -162,7 +192,7 @@ protected:
 		device_vec<float> d_radialprofiles;// [ radialsteps * njobs ] for Z computation
 		device_vec<float> d_zlutcmpscores; // [ zlutplanes * njobs ]
 
-		uint localizeFlags; // Indicates whether kernels should be ran for building zlut, z computing, or QI
+		uint localizeFlags; // Indicates whether kernels should be ran for building zlut, z computing, or QI. All jobs in a batch share the same mode.
 		Device* device;
 
 		enum State {
@@ -183,13 +213,14 @@ protected:
 	std::vector<Stream*> streams;
 	std::list<LocalizationResult> results;
 	int resultCount;
-	LocMode_t localizeMode;
 	Threads::Mutex resultMutex, jobQueueMutex;
+	std::vector<int> beadLUTMapping; // guarded by jobQueueMutex
+	int LUTIndex(int bead) { return (bead >= 0 && bead < (int)beadLUTMapping.size()) ? beadLUTMapping[bead] : bead; }
 	std::vector<Device*> devices;
 	bool useTextureCache; // speed up using texture cache. 
 	float gc_offsetFactor, gc_gainFactor;
 	Threads::Mutex gc_mutex;
-	std::vector<float> gc_offset, gc_gain;///cpu size buffers are needed because BuildLUT uses CPU tracking
+	std::shared_ptr<PixelCalibration> gc_calib; // host copy, because BuildLUT uses CPU tracking
 	uint zlut_build_flags;
 
 	QI qi;
@@ -202,7 +233,7 @@ protected:
 	static void SchedulingThreadEntryPoint(void *param);
 
 	template<typename TImageSampler> void ExecuteBatch(Stream *s);
-	Stream* GetReadyStream(); // get a stream that not currently executing, and still has room for images
+	Stream* GetReadyStream(uint localizeFlags); // get a stream that not currently executing, and still has room for images with the given localization mode
 	void InitializeDeviceList();
 	Stream* CreateStream(Device* device, int streamIndex);
 	void CopyStreamResults(Stream* s);
@@ -73,6 +73,7 @@ public:
 		if (data) {
 			dbgCUDAErrorCheck(cudaFree(data));
 			data=0;
+			size=0;
 		}
 	}
 	operator std::vector<T>() const {